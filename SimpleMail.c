@@ -9,47 +9,24 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
-#include <netdb.h>
 
 #include "mime.h"
+#include "net.h"
+#include "resolver.h"
 #include "smtp.h"
 
-static int connect_server(const char *host, const char *strport) {
-	struct addrinfo hints, *result;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = IPPROTO_TCP;
-
-	int error = getaddrinfo(host, strport, &hints, &result);
-	if(error) {
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(error));
-		return -1;
-	}
-
-	int fd;
-	const struct addrinfo *ai;
-	for(ai = result; ai; ai = ai->ai_next) {
-		if((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
-			continue;
-
-		if(connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
-			close(fd);
-			continue;
-		}
-
-		freeaddrinfo(result);
-		return fd;
-	}
-
-	freeaddrinfo(result);
-	return -1;
-}
-
 static int data_cb(smtp *s, void *ctx) {
-	return mimemsg_write_line((mime_msg *)ctx, 76,
-			(mime_line_write_func)&smtp_write_line, s);
+	char buf[MIMECURSOR_CHUNK * 4];
+	int r;
+	mime_cursor *c = mimecursor_new((mime_msg *)ctx, 76,
+			MIMECURSOR_DOT_STUFF);
+	while((r = mimecursor_read(c, buf, sizeof(buf))) > 0)
+		if(smtp_write(s, buf, r) < 0) {
+			r = -1;
+			break;
+		}
+	mimecursor_free(c);
+	return r == 0 ? 1 : -1;
 }
 
 static int Error(const char *msg) {
@@ -78,7 +55,7 @@ static int Usage(int argc, char *argv[]) {
 }
 
 static const char *ReadLineToBuffer(buffer_ctx *b) {
-	buffer_shift(b, buffer_length(b));
+	buffer_reset(b);
 	char buffer[128];
 	while(1) {
 		if(fgets(buffer, sizeof(buffer), stdin) == NULL) return NULL;
@@ -116,6 +93,8 @@ static int HandleSmtpError(smtp *s) {
 	int code = smtp_get_code(s);
 
 	Prompt("Received %d error: %s", code, smtp_get_msg(s));
+	if(!smtp_is_permanent_failure(s))
+		Prompt("This is a temporary failure, it may work later.\n");
 
 	if(code == 421) // we must exit NOW!
 		return 0;
@@ -138,7 +117,7 @@ static int ReadAndSendMail(mime_msg *m, smtp *s,
 	// To
 	int i;
 	Prompt("Where should I send this message? Blank line to end.\n");
-	buffer_shift(strbuf, buffer_length(strbuf));
+	buffer_reset(strbuf);
 	i = 0;
 	while(1) {
 		Prompt("To [%d]: ", i+1);
@@ -159,7 +138,7 @@ static int ReadAndSendMail(mime_msg *m, smtp *s,
 
 	// Cc
 	Prompt("Should I CC this message? Blank line to end.\n");
-	buffer_shift(strbuf, buffer_length(strbuf));
+	buffer_reset(strbuf);
 	i = 0;
 	while(1) {
 		Prompt("Cc [%d]: ", i+1);
@@ -184,7 +163,7 @@ static int ReadAndSendMail(mime_msg *m, smtp *s,
 
 	// Read content
 	Prompt("Enter content, a single line with \"--end--\" to end.\n");
-	buffer_shift(strbuf, buffer_length(strbuf));
+	buffer_reset(strbuf);
 	int lines = 0;
 	Prompt("%3d: ", ++lines);
 	while(1) {
@@ -228,7 +207,12 @@ int main(int argc, char *argv[]) {
 		return -1;
 	}
 
-	int fd = connect_server(argv[1], argv[2]);
+	resolver *r = resolver_new();
+	resolver_result res;
+	int fd = -1;
+	if(resolver_wait(r, argv[1], atoi(argv[2]), 0, &res) == RESOLVER_OK)
+		fd = net_connect(&res, -1);
+	resolver_free(r);
 	if(fd < 0) {
 		fprintf(stderr, "Unable to connect to server.\n");
 		return -1;
@@ -1,4 +1,5 @@
 #include "base64.h"
+#include "probes.h"
 
 static const char *b64_en = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
 	"abcdefghijklmnopqrstuvwxyz0123456789+/";
@@ -42,13 +43,19 @@ int base64_encode(const unsigned char *data, int dlen, char *buf, int *blen) {
 int base64_encode_stream(read_func reader, write_func writer, void *ctx) {
 	unsigned char rbuf[BASE64_BLOCK_BASE*3];
 	char wbuf[BASE64_BLOCK_BASE*4];
-	int rlen, wlen;
-	while((rlen = reader(ctx, rbuf, sizeof(rbuf))) > 0) {
+	int rlen, wlen, ret = 1;
+	long out = 0;
+
+	PROBE_ENTER(base64, ctx, 0);
+	while(ret > 0 && (rlen = reader(ctx, rbuf, sizeof(rbuf))) > 0) {
 		wlen = sizeof(wbuf);
 		if(base64_encode(rbuf, rlen, wbuf, &wlen) < 0)
-			return -2;
-		if(writer(ctx, wbuf, wlen) < 0)
-			return -1;
+			ret = -2;
+		else if(writer(ctx, wbuf, wlen) < 0)
+			ret = -1;
+		else
+			out += wlen;
 	}
-	return 1;
+	PROBE_RETURN(base64, ctx, out);
+	return ret;
 }
@@ -0,0 +1,77 @@
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "budget.h"
+
+static long budget__limit, budget__used;
+static int budget__waiting;
+static pthread_mutex_t budget__lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t budget__freed = PTHREAD_COND_INITIALIZER;
+
+void budget_set_limit(long bytes) {
+	pthread_mutex_lock(&budget__lock);
+	budget__limit = bytes > 0 ? bytes : 0;
+	pthread_cond_broadcast(&budget__freed);
+	pthread_mutex_unlock(&budget__lock);
+}
+
+long budget_get_limit() {
+	return __atomic_load_n(&budget__limit, __ATOMIC_SEQ_CST);
+}
+
+long budget_used() {
+	return __atomic_load_n(&budget__used, __ATOMIC_SEQ_CST);
+}
+
+void budget_charge(long bytes) {
+	__atomic_add_fetch(&budget__used, bytes, __ATOMIC_SEQ_CST);
+}
+
+void budget_release(long bytes) {
+	__atomic_sub_fetch(&budget__used, bytes, __ATOMIC_SEQ_CST);
+	// buffers come and go all the time, only wake someone who waits
+	if(__atomic_load_n(&budget__waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&budget__lock);
+		pthread_cond_broadcast(&budget__freed);
+		pthread_mutex_unlock(&budget__lock);
+	}
+}
+
+int budget_room(long bytes) {
+	long limit = budget_get_limit();
+	return !limit || budget_used() + bytes <= limit;
+}
+
+int budget_wait(long bytes, int timeout_ms) {
+	struct timespec ts;
+	int ok;
+
+	if(budget_room(bytes) || !timeout_ms)
+		return budget_room(bytes);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	if(timeout_ms > 0) {
+		ts.tv_sec += timeout_ms / 1000;
+		ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		if(ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+	}
+
+	// counted before looking: budget_release() sees us, or we see it
+	pthread_mutex_lock(&budget__lock);
+	__atomic_add_fetch(&budget__waiting, 1, __ATOMIC_SEQ_CST);
+	while(!(ok = budget_room(bytes))) {
+		if(timeout_ms < 0)
+			pthread_cond_wait(&budget__freed, &budget__lock);
+		else if(pthread_cond_timedwait(&budget__freed, &budget__lock,
+				&ts) == ETIMEDOUT) {
+			ok = budget_room(bytes);
+			break;
+		}
+	}
+	__atomic_sub_fetch(&budget__waiting, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&budget__lock);
+	return ok;
+}
@@ -0,0 +1,23 @@
+#ifndef _BUDGET_H
+#	define _BUDGET_H
+
+// Process-wide memory budget. Buffers (see buffer.h) and queued
+// messages (see smtpclient.h) are counted against one limit. Memory
+// that is already needed is never refused, because a reply being read
+// has to be stored. Instead, producers ask for room before they take on
+// more work and wait while others release memory. That way use
+// settles near the limit instead of growing with the load.
+
+// Sets the limit in bytes. 0, the default, is unlimited.
+void budget_set_limit(long bytes);
+long budget_get_limit();
+long budget_used();
+
+void budget_charge(long bytes);
+void budget_release(long bytes);
+// 1 if bytes more stay within the limit.
+int budget_room(long bytes);
+// Waits up to timeout_ms (-1 forever) for budget_room(bytes).
+int budget_wait(long bytes, int timeout_ms);
+
+#endif
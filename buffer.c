@@ -1,33 +1,84 @@
 #include <stdlib.h>
 #include <string.h>
+#include "budget.h"
 #include "buffer.h"
 
+static __thread buffer_ctx *buffer__pool[BUFFER_POOL_SIZE];
+static __thread int buffer__pool_len;
+
+static void buffer__grow(buffer_ctx *ctx, int preferred) {
+    if(ctx->size >= preferred)
+	return;
+    int old = ctx->size;
+    while(ctx->size < preferred)
+	ctx->size <<= 1;
+    budget_charge(ctx->size - old);
+    ctx->buffer = (char *)realloc(ctx->buffer, ctx->size);
+}
+
 buffer_ctx *buffer_new(int size) {
-    buffer_ctx *ctx = (buffer_ctx *)malloc(sizeof(buffer_ctx));
-    ctx->size = size > 0 ? size : BUFFER_DEFAULT_SIZE;
-    ctx->curr = 0;
+    buffer_ctx *ctx;
+    if(size <= 0)
+	size = BUFFER_DEFAULT_SIZE;
+
+    if(buffer__pool_len > 0) {
+	ctx = buffer__pool[--buffer__pool_len];
+	buffer__grow(ctx, size);
+	ctx->start = ctx->curr = 0;
+	return ctx;
+    }
+
+    ctx = (buffer_ctx *)malloc(sizeof(buffer_ctx));
+    ctx->size = size;
+    ctx->start = ctx->curr = 0;
     ctx->buffer = (char *)malloc(ctx->size);
+    budget_charge(ctx->size);
     return ctx;
 }
 
 void buffer_free(buffer_ctx *ctx) {
+    if(buffer__pool_len < BUFFER_POOL_SIZE && ctx->buffer &&
+	    ctx->size <= BUFFER_POOL_MAX_SIZE) {
+	buffer__pool[buffer__pool_len++] = ctx;
+	return;
+    }
     if(ctx->buffer) free(ctx->buffer);
+    budget_release(ctx->size);
     free(ctx);
 }
 
-static void buffer__grow(buffer_ctx *ctx, int preferred) {
-    if(ctx->size >= preferred)
+void buffer_reset(buffer_ctx *ctx) {
+    ctx->start = ctx->curr = 0;
+}
+
+void buffer_pool_clear() {
+    while(buffer__pool_len > 0) {
+	buffer_ctx *ctx = buffer__pool[--buffer__pool_len];
+	budget_release(ctx->size);
+	free(ctx->buffer);
+	free(ctx);
+    }
+}
+
+// Makes room for size more bytes (plus a terminator) at the tail,
+// moving the data to the front only when that frees enough space.
+static void buffer__make_room(buffer_ctx *ctx, int size) {
+    int len = ctx->curr - ctx->start;
+    if(ctx->curr + size < ctx->size)
 	return;
-    while(ctx->size < preferred)
-	ctx->size <<= 1;
-    ctx->buffer = (char *)realloc(ctx->buffer, ctx->size);
+    if(ctx->start > 0) {
+	memmove(ctx->buffer, &ctx->buffer[ctx->start], len);
+	ctx->start = 0;
+	ctx->curr = len;
+    }
+    buffer__grow(ctx, len + size + 1);
 }
 
 int buffer_append(buffer_ctx *ctx, const char *data, int size) {
-    if(ctx->curr + size >= ctx->size)
-	buffer__grow(ctx, ctx->curr + size);
+    buffer__make_room(ctx, size);
     memcpy(&ctx->buffer[ctx->curr], data, size);
-    return ctx->curr += size;
+    ctx->curr += size;
+    return ctx->curr - ctx->start;
 }
 
 int buffer_append_string(buffer_ctx *ctx, const char *str) {
@@ -35,31 +86,46 @@ int buffer_append_string(buffer_ctx *ctx, const char *str) {
 }
 
 int buffer_shift(buffer_ctx *ctx, int length) {
-    int newlen = ctx->curr - length;
-    if(newlen > 0) {
-	memmove(ctx->buffer, &ctx->buffer[ctx->curr + length], newlen);
-	ctx->curr = newlen;
-    } else {
-	ctx->curr = 0;
-    }
-    return ctx->curr;
+    ctx->start += length;
+    if(ctx->start >= ctx->curr)
+	ctx->start = ctx->curr = 0;
+    return ctx->curr - ctx->start;
+}
+
+int buffer_truncate(buffer_ctx *ctx, int length) {
+    if(length < ctx->curr - ctx->start)
+	ctx->curr = ctx->start + length;
+    return ctx->curr - ctx->start;
 }
 
 int buffer_length(buffer_ctx *ctx) {
-    return ctx->curr;
+    return ctx->curr - ctx->start;
+}
+
+int buffer_capacity(buffer_ctx *ctx) {
+    return ctx->size;
+}
+
+char *buffer_reserve(buffer_ctx *ctx, int size) {
+    buffer__make_room(ctx, size);
+    return &ctx->buffer[ctx->curr];
+}
+
+int buffer_commit(buffer_ctx *ctx, int size) {
+    ctx->curr += size;
+    return ctx->curr - ctx->start;
 }
 
 const char *buffer_data(buffer_ctx *ctx) {
-    return ctx->buffer;
+    return &ctx->buffer[ctx->start];
 }
 
 const char *buffer_cstr(buffer_ctx *ctx) {
-    if(ctx->curr + 1 >= ctx->size)
-        buffer__grow(ctx, ctx->curr + 1);
+    buffer__make_room(ctx, 1);
 
     ctx->buffer[ctx->curr] = '\0';
 
-    return ctx->buffer;
+    return &ctx->buffer[ctx->start];
 }
 
 // vim: ts=8 sw=4
@@ -1,21 +1,41 @@
 #ifndef BUFFER_H
 #   define BUFFER_H
 
+// Data lives in buffer[start, curr); consumed bytes are only reclaimed
+// when the free space at the tail runs out.
 typedef struct {
     char *buffer;
-    int size, curr;
+    int size, start, curr;
 } buffer_ctx;
 
 #define BUFFER_DEFAULT_SIZE (1024)
 
+// Freed buffers are kept on a per-thread freelist for reuse, unless they
+// grew beyond BUFFER_POOL_MAX_SIZE. Capacity, pooled or not, counts
+// against the memory budget (budget.h).
+#define BUFFER_POOL_SIZE (16)
+#define BUFFER_POOL_MAX_SIZE (64 * 1024)
+
 buffer_ctx *buffer_new(int size);
 void	    buffer_free(buffer_ctx *ctx);
+// empties the buffer but keeps its capacity
+void	    buffer_reset(buffer_ctx *ctx);
+// releases the calling thread's freelist
+void	    buffer_pool_clear();
 
 // returns current buffer length
 int	    buffer_append(buffer_ctx *ctx, const char *data, int size);
 int	    buffer_append_string(buffer_ctx *ctx, const char *str);
 int	    buffer_shift(buffer_ctx *ctx, int length);
+// drops all but the first length bytes
+int	    buffer_truncate(buffer_ctx *ctx, int length);
 int         buffer_length(buffer_ctx *ctx);
+int         buffer_capacity(buffer_ctx *ctx);
+
+// Returns room for at least size bytes at the tail, e.g. for read(2);
+// buffer_commit() then appends the bytes actually written there.
+char       *buffer_reserve(buffer_ctx *ctx, int size);
+int         buffer_commit(buffer_ctx *ctx, int size);
 
 const char *buffer_data(buffer_ctx *ctx);
 const char *buffer_cstr(buffer_ctx *ctx);
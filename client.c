@@ -1,68 +1,133 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
 
+#include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
-#include <netdb.h>
 
+#include "budget.h"
+#include "dkim.h"
 #include "mime.h"
+#include "net.h"
+#include "planner.h"
+#include "probes.h"
+#include "ratelimit.h"
+#include "rawmsg.h"
+#include "resolver.h"
+#include "retry.h"
 #include "smtp.h"
+#include "spool.h"
+#include "template.h"
+#include "trace.h"
+
+#define LINE_WRAP (76)
+#define CONNECT_TIMEOUT (30)
+#define IO_TIMEOUT (300)
+#define MAX_CONNS (16)	// per destination, the AIMD window's ceiling
+#define MAX_BATCH (64)	// spooled messages delivered together
+
+// -E
+#define STARTTLS_NONE (0)
+#define STARTTLS_TRY (1)	// when offered
+#define STARTTLS_REQUIRE (2)
+
+// Mail merge data: tab separated, a line naming the columns, then one
+// line per recipient with the address first.
+typedef struct MergeData {
+	int n_cols, n_rows;
+	char **cols;
+	char **cells;	// n_rows * n_cols, NULL where a line is short
+} MergeData;
 
-#define MAX_ENT (512)
 typedef struct Config {
 	char *server;
 	short port;
+	char *hosts_fn;
+	int connect_timeout, io_timeout;	// seconds
+	int sndbuf, rcvbuf;	// socket buffers in bytes, 0 for the default
 	char *from;
-	char *to[MAX_ENT], *cc[MAX_ENT], *at[MAX_ENT];
+	char **to, **cc, **at;
 	int nto, ncc, nat;
 	char *subject;
 	char *content_fn;
 	char *content;
+	char *raw_fn;	// send this composed message as is
+	int raw_fd;
+	char *spool_dir;
+	int spool_wait;	// keep retrying until the spool is empty
+	double msg_rate, conn_rate;	// per destination and second
+	char *merge_fn;	// personalize the message for each recipient
+	MergeData merge;
+	dkim *dkim;	// sign with this key
+	int starttls;
+	char *ca_fn;	// verify the server against these CAs
+	char *socket_fn;	// local server instead of TCP
+	int lmtp;
+	trace *trace;	// record the sessions, see smtpreplay
 } Config;
 
-static int connect_server(const char *host, short port) {
-	char strport[8];
-	snprintf(strport, sizeof(strport), "%d", (int)port);
-
-	struct addrinfo hints, *result;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = IPPROTO_TCP;
-
-	int error = getaddrinfo(host, strport, &hints, &result);
-	if(error) {
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(error));
-		return -1;
-	}
+// Write buffer for cursor output: the ring's registered buffer when
+// there is one, otherwise stackbuf.
+static char *CursorBuffer(smtp *s, char *stackbuf, int *len) {
+	char *fixed = smtp_get_write_buffer(s, len);
+	return fixed ? fixed : stackbuf;
+}
 
+static int data_cb(smtp *s, void *ctx) {
+	char stackbuf[MIMECURSOR_CHUNK * 4];
+	int r, len = sizeof(stackbuf);
+	char *buf = CursorBuffer(s, stackbuf, &len);
 	int fd;
-	const struct addrinfo *ai;
-	for(ai = result; ai; ai = ai->ai_next) {
-		if((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
-			continue;
+	long off, flen;
 
-		if(connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
-			close(fd);
-			continue;
+	mime_cursor *c = mimecursor_new((mime_msg *)ctx, LINE_WRAP,
+			MIMECURSOR_DOT_STUFF | MIMECURSOR_FILES);
+	for(;;) {
+		while((r = mimecursor_read(c, buf, len)) > 0)
+			if(smtp_write(s, buf, r) < 0) {
+				r = -1;
+				break;
+			}
+		// cached base64 bodies are wire-ready, no line starts with '.'
+		if(r < 0 || !mimecursor_file(c, &fd, &off, &flen))
+			break;
+		if(smtp_sendfile(s, fd, off, flen) != flen) {
+			r = -1;
+			break;
 		}
-
-		freeaddrinfo(result);
-		return fd;
+		mimecursor_skip_file(c);
 	}
-
-	freeaddrinfo(result);
-	return -1;
+	mimecursor_free(c);
+	return r == 0 ? 1 : -1;
 }
 
-static int data_cb(smtp *s, void *ctx) {
-	return mimemsg_write_line((mime_msg *)ctx, 76,
-			(mime_line_write_func)&smtp_write_line, s);
+// Sends the message as BDAT chunks (RFC 3030), no dot-stuffing needed.
+static int SendChunked(smtp *s, mime_msg *m) {
+	char stackbuf[MIMECURSOR_CHUNK * 4];
+	int r, len = sizeof(stackbuf);
+	char *buf = CursorBuffer(s, stackbuf, &len);
+	int fd, ok = 1;
+	long off, flen;
+
+	mime_cursor *c = mimecursor_new(m, LINE_WRAP, MIMECURSOR_FILES);
+	for(;;) {
+		while(ok && (r = mimecursor_read(c, buf, len)) > 0)
+			ok = smtp_bdat(s, buf, r, 0);
+		if(!ok || r < 0 || !mimecursor_file(c, &fd, &off, &flen))
+			break;
+		ok = smtp_bdat_file(s, fd, off, flen, 0);
+		mimecursor_skip_file(c);
+	}
+	mimecursor_free(c);
+	return ok && r == 0 && smtp_bdat(s, NULL, 0, 1);
 }
 
 static int print_smtp_reply(smtp *s) {
@@ -70,6 +135,16 @@ static int print_smtp_reply(smtp *s) {
 	return 1;
 }
 
+static long NowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static int TimeoutMs(int seconds) {
+	return seconds > 0 ? seconds * 1000 : -1;
+}
+
 static int Error(const char *msg) {
 	fprintf(stderr, "%s", msg);
 	return 0;
@@ -88,26 +163,56 @@ static const char *NormalizeAddress(const char *addr) {
 	return buffer;
 }
 
+// Appends to a list that doubles its size as needed.
+static void AddEntry(char ***list, int *n, const char *value) {
+	if((*n & (*n - 1)) == 0)
+		*list = (char **)realloc(*list, (*n ? *n * 2 : 1) * sizeof(char *));
+	(*list)[(*n)++] = strdup(value);
+}
+
 static int Usage(int argc, char *argv[]) {
 	fprintf(stderr,
 			"Usage: %s\n"
-			"  -h host\n"
+			" [-h host]  (default: MX of each recipient's domain)\n"
 			" [-p port]\n"
+			" [-H hosts_file]  (resolve from this file only, no DNS)\n"
+			" [-T connect_timeout[,io_timeout]]  (seconds, default %d,%d)\n"
+			" [-B send_kb[,recv_kb]]  (socket buffer sizes)\n"
+			" [-m megabytes]  (memory budget for buffers and rendering)\n"
 			"  -f from_address\n"
 			"  -t to_addr1 [-t to_addr2] [...]\n"
 			" [-c cc_addr1] [-c cc_addr2] [...]\n"
 			" [-s subject]\n"
 			"  -d content | -D content_file\n"
-			" [-a attach_file1] [-a attach_file2] [...]\n",
-			argv[0]);
+			" [-a attach_file1] [-a attach_file2] [...]\n"
+			"  or -r message_file  (complete RFC 5322 message, - for stdin;\n"
+			"                       a pipe is sent on while it is read)\n"
+			" [-S spool_dir]  (spool the message before sending;\n"
+			"                  alone: deliver what is due in the spool)\n"
+			" [-W]  (with -S: wait for deferred recipients until done)\n"
+			" [-R msgs_per_sec[,conns_per_sec]]  (with -S: per destination)\n"
+			" [-M merge_file]  (instead of -t and -c: recipients and the\n"
+			"                   values for the {{column}} placeholders)\n"
+			" [-K domain:selector:key_file]  (DKIM sign, PEM RSA key)\n"
+			" [-E try|require]  (STARTTLS)\n"
+			" [-V ca_file]  (STARTTLS required, certificate checked for -h)\n"
+			" [-U socket_path]  (instead of -h and -p: a local server)\n"
+			" [-L]  (speak LMTP, results for each recipient)\n"
+			" [-X trace_file]  (record the sessions, for smtpreplay;\n"
+			"                   not with -E or -V)\n"
+			" [-Z rate]  (count every rate-th probe hit, see probes.h,\n"
+			"             and report them on exit)\n",
+			argv[0], CONNECT_TIMEOUT, IO_TIMEOUT);
 	return 0;
 }
 
 static int ParseArgs(int argc, char *argv[], Config *c) {
 	c->port = 25;
+	c->connect_timeout = CONNECT_TIMEOUT;
+	c->io_timeout = IO_TIMEOUT;
 
 	int ch;
-	while((ch = getopt(argc, argv, "h:p:f:t:c:s:d:D:a:")) != -1) {
+	while((ch = getopt(argc, argv, "h:p:H:T:B:m:f:t:c:s:d:D:a:r:S:WR:M:K:E:V:U:LX:Z:")) != -1) {
 		switch(ch) {
 			case 'h':
 				c->server = strdup(optarg);
@@ -115,20 +220,35 @@ static int ParseArgs(int argc, char *argv[], Config *c) {
 			case 'p':
 				c->port = atoi(optarg);
 				break;
+			case 'H':
+				c->hosts_fn = strdup(optarg);
+				break;
+			case 'T':
+				if(sscanf(optarg, "%d,%d", &c->connect_timeout,
+							&c->io_timeout) < 1)
+					return Error("Invalid -T argument.\n");
+				break;
+			case 'B':
+				if(sscanf(optarg, "%d,%d", &c->sndbuf, &c->rcvbuf) < 1)
+					return Error("Invalid -B argument.\n");
+				c->sndbuf *= 1024;
+				c->rcvbuf *= 1024;
+				break;
+			case 'm':
+				if(atol(optarg) <= 0)
+					return Error("Invalid -m argument.\n");
+				budget_set_limit(atol(optarg) * 1024 * 1024);
+				break;
 			case 'f':
 				if(c->from)
 					return Error("Only one -f argument can bge specified.\n");
 				c->from = strdup(NormalizeAddress(optarg));
 				break;
 			case 't':
-				if(c->nto >= MAX_ENT)
-					return Error("Too many receivers.\n");
-				c->to[c->nto++] = strdup(NormalizeAddress(optarg));
+				AddEntry(&c->to, &c->nto, NormalizeAddress(optarg));
 				break;
 			case 'c':
-				if(c->ncc >= MAX_ENT)
-					return Error("Too many CCs.\n");
-				c->cc[c->ncc++] = strdup(NormalizeAddress(optarg));
+				AddEntry(&c->cc, &c->ncc, NormalizeAddress(optarg));
 				break;
 			case 's':
 				if(c->subject)
@@ -150,9 +270,68 @@ static int ParseArgs(int argc, char *argv[], Config *c) {
 				c->content_fn = strdup(optarg);
 				break;
 			case 'a':
-				if(c->nat >= MAX_ENT)
-					return Error("Too many attachments.\n");
-				c->at[c->nat++] = strdup(optarg);
+				AddEntry(&c->at, &c->nat, optarg);
+				break;
+			case 'r':
+				if(c->raw_fn)
+					return Error("Only one -r argument can be specified.\n");
+				c->raw_fn = strdup(optarg);
+				break;
+			case 'S':
+				c->spool_dir = strdup(optarg);
+				break;
+			case 'W':
+				c->spool_wait = 1;
+				break;
+			case 'R':
+				if(sscanf(optarg, "%lf,%lf", &c->msg_rate, &c->conn_rate) < 1)
+					return Error("Invalid -R argument.\n");
+				break;
+			case 'M':
+				if(c->merge_fn)
+					return Error("Only one -M argument can be specified.\n");
+				c->merge_fn = strdup(optarg);
+				break;
+			case 'K': {
+				char domain[256], selector[64], key_fn[1024];
+				if(c->dkim)
+					return Error("Only one -K argument can be specified.\n");
+				if(sscanf(optarg, "%255[^:]:%63[^:]:%1023s", domain, selector,
+							key_fn) != 3)
+					return Error("Invalid -K argument.\n");
+				c->dkim = dkim_new(domain, selector, key_fn, DKIM_BODY_RELAXED);
+				if(!c->dkim)
+					return Error("Cannot load the DKIM key.\n");
+				break;
+			}
+			case 'E':
+				if(!strcmp(optarg, "try"))
+					c->starttls = STARTTLS_TRY;
+				else if(!strcmp(optarg, "require"))
+					c->starttls = STARTTLS_REQUIRE;
+				else
+					return Error("Invalid -E argument.\n");
+				break;
+			case 'V':
+				c->ca_fn = strdup(optarg);
+				c->starttls = STARTTLS_REQUIRE;
+				break;
+			case 'U':
+				c->socket_fn = strdup(optarg);
+				break;
+			case 'L':
+				c->lmtp = 1;
+				break;
+			case 'X':
+				if(c->trace)
+					return Error("Only one -X argument can be specified.\n");
+				if(!(c->trace = trace_create(optarg)))
+					return Error("Cannot create the trace file.\n");
+				break;
+			case 'Z':
+				if(atoi(optarg) <= 0)
+					return Error("Invalid -Z argument.\n");
+				probes_set_sampling(atoi(optarg));
 				break;
 			case '?':
 			default:
@@ -160,45 +339,148 @@ static int ParseArgs(int argc, char *argv[], Config *c) {
 				return 0;
 		}
 	}
+	// a trace holds plaintext, smtpreplay cannot play a TLS handshake
+	if(c->trace && c->starttls != STARTTLS_NONE)
+		return Error("-X cannot be combined with -E or -V.\n");
 	return 1;
 }
 
 static int ResetConfig(Config *c) {
 	int i;
-	for(i = 0; i < MAX_ENT; i++) {
-		if(c->to[i]) free(c->to[i]);
-		if(c->cc[i]) free(c->cc[i]);
-		if(c->at[i]) free(c->at[i]);
-	}
+	for(i = 0; i < c->nto; i++) free(c->to[i]);
+	for(i = 0; i < c->ncc; i++) free(c->cc[i]);
+	for(i = 0; i < c->nat; i++) free(c->at[i]);
+	if(c->to) free(c->to);
+	if(c->cc) free(c->cc);
+	if(c->at) free(c->at);
 	if(c->from) free(c->from);
 	if(c->server) free(c->server);
+	if(c->hosts_fn) free(c->hosts_fn);
 	if(c->subject) free(c->subject);
+	if(c->raw_fn) free(c->raw_fn);
+	if(c->raw_fd > 0) close(c->raw_fd);
+	if(c->spool_dir) free(c->spool_dir);
+	if(c->merge_fn) free(c->merge_fn);
+	for(i = 0; i < c->merge.n_cols; i++) free(c->merge.cols[i]);
+	for(i = 0; i < c->merge.n_cols * c->merge.n_rows; i++)
+		if(c->merge.cells[i]) free(c->merge.cells[i]);
+	if(c->merge.cols) free(c->merge.cols);
+	if(c->merge.cells) free(c->merge.cells);
+	if(c->dkim) dkim_free(c->dkim);
+	if(c->ca_fn) free(c->ca_fn);
+	if(c->socket_fn) free(c->socket_fn);
+	if(c->trace) trace_free(c->trace);
+	return 1;
+}
+
+// Reads the -M file; every row's address becomes a recipient.
+static int LoadMerge(Config *c) {
+	MergeData *md = &c->merge;
+	FILE *fp = fopen(c->merge_fn, "r");
+	char *line = NULL, *cell, *next;
+	size_t size = 0;
+	ssize_t len;
+	int i;
+
+	if(!fp)
+		return Error("Cannot open merge file.\n");
+	while((len = getline(&line, &size, fp)) >= 0) {
+		while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if(len == 0)
+			continue;
+
+		if(!md->cols) {
+			for(cell = line; cell; cell = next) {
+				if((next = strchr(cell, '\t'))) *next++ = '\0';
+				AddEntry(&md->cols, &md->n_cols, cell);
+			}
+			continue;
+		}
+		md->cells = (char **)realloc(md->cells,
+				(md->n_rows + 1) * md->n_cols * sizeof(char *));
+		char **row = &md->cells[md->n_rows++ * md->n_cols];
+		for(i = 0, cell = line; i < md->n_cols; i++) {
+			if(cell && (next = strchr(cell, '\t'))) *next++ = '\0';
+			else next = NULL;
+			row[i] = cell ? strdup(cell) : NULL;
+			cell = next;
+		}
+		if(!row[0] || !NormalizeAddress(row[0])) {
+			// nobody to send the row to
+			fprintf(stderr, "Skipping merge row %d without an address.\n",
+					md->n_rows);
+			for(i = 0; i < md->n_cols; i++)
+				if(row[i]) free(row[i]);
+			md->n_rows--;
+			continue;
+		}
+		AddEntry(&c->to, &c->nto, NormalizeAddress(row[0]));
+	}
+	free(line);
+	fclose(fp);
+	if(!md->n_rows || !md->cells[0])
+		return Error("No recipients in the merge file.\n");
 	return 1;
 }
 
+// An unlinked temporary file.
+static int TempFile() {
+	char tmpl[] = "/tmp/clientXXXXXX";
+	int tmp = mkstemp(tmpl);
+	if(tmp >= 0)
+		unlink(tmpl);
+	return tmp;
+}
+
 static int SetupMimeMsg(mime_msg *m, Config *c) {
 	if(!c->from)
 		return Error("No from address found.\n");
+	// mail exchangers are found by address, the name to check is unknown
+	if(c->ca_fn && !c->server)
+		return Error("-V needs -h.\n");
+	if(c->merge_fn) {
+		if(c->nto || c->ncc || c->raw_fn || c->spool_dir)
+			return Error("-M cannot be combined with -t, -c, -r or -S.\n");
+		if(!LoadMerge(c))
+			return 0;
+	}
 	if(!c->nto)
 		return Error("No recipients.\n");
 
+	if(c->raw_fn) {
+		if(c->subject || c->content || c->content_fn || c->nat || c->dkim)
+			return Error("-r cannot be combined with -s, -d, -D, -a or -K.\n");
+		c->raw_fd = strcmp(c->raw_fn, "-") ? open(c->raw_fn, O_RDONLY) :
+			STDIN_FILENO;
+		if(c->raw_fd < 0)
+			return Error("Cannot open message file.\n");
+		return 1;
+	}
+
 	int i;
 	buffer_ctx *buffer = buffer_new(0);
 
 	// From
 	mimemsg_set_header(m, "From", c->from);
 
-	// To
-	buffer_append_string(buffer, c->to[0]);
-	for(i = 1; i < c->nto; i++) {
-		buffer_append_string(buffer, ", ");
-		buffer_append_string(buffer, c->to[i]);
+	// To, each recipient's own with -M
+	if(c->merge_fn) {
+		buffer_append_string(buffer, "{{");
+		buffer_append_string(buffer, c->merge.cols[0]);
+		buffer_append_string(buffer, "}}");
+	} else {
+		buffer_append_string(buffer, c->to[0]);
+		for(i = 1; i < c->nto; i++) {
+			buffer_append_string(buffer, ", ");
+			buffer_append_string(buffer, c->to[i]);
+		}
 	}
 	mimemsg_set_header(m, "To", buffer_cstr(buffer));
 
 	// Cc
 	if(c->ncc) {
-		buffer_shift(buffer, buffer_length(buffer));
+		buffer_reset(buffer);
 		buffer_append_string(buffer, c->cc[0]);
 		for(i = 1; i < c->ncc; i++) {
 			buffer_append_string(buffer, ", ");
@@ -249,67 +531,1061 @@ static int SetupMimeMsg(mime_msg *m, Config *c) {
 		}
 	}
 
+	// with -M every recipient's header block is signed on its own
+	if(c->dkim && !c->merge_fn && !dkim_sign_msg(c->dkim, m, LINE_WRAP))
+		return Error("Cannot sign the message.\n");
 	return 1;
 }
 
-static int SendMail(Config *c, smtp *s, mime_msg *m) {
-	int i;
+// One resolver for the whole run, so its cache is shared.
+static resolver *theResolver;
+
+static resolver *Resolver(Config *c) {
+	if(theResolver)
+		return theResolver;
+	theResolver = resolver_new();
+	if(c->hosts_fn) {
+		resolver_set_nameserver(theResolver, NULL, 0);
+		if(!resolver_load_hosts(theResolver, c->hosts_fn))
+			fprintf(stderr, "Unable to load %s\n", c->hosts_fn);
+	}
+	return theResolver;
+}
+
+// Resolves -h, or the mail exchanger of rcpt's domain.
+static int ResolveServer(Config *c, const char *rcpt, resolver_result *res) {
+	int ret;
+
+	if(c->server) {
+		ret = resolver_wait(Resolver(c), c->server, c->port, 0, res);
+	} else {
+		// deliver directly to the recipient's mail exchanger
+		char domain[256];
+		planner_domain(rcpt, domain, sizeof(domain));
+		ret = resolver_wait(Resolver(c), domain, c->port, RESOLVER_MX, res);
+	}
+
+	if(ret != RESOLVER_OK)
+		return Error("Unable to resolve server.\n");
+	return 1;
+}
+
+// Grouping key: -h puts everybody in one group, otherwise domains
+// sharing their most preferred mail exchanger address share a group.
+static const char *GroupKey(const char *domain, void *ctx) {
+	static char key[INET6_ADDRSTRLEN + 8];
+	Config *c = (Config *)ctx;
+	resolver_result res;
+
+	if(c->socket_fn)
+		return c->socket_fn;
+	if(c->server)
+		return c->server;
+	if(resolver_wait(Resolver(c), domain, c->port, RESOLVER_MX, &res) !=
+			RESOLVER_OK || res.n_addrs == 0)
+		return NULL;
+
+	struct sockaddr_storage *sa = &res.addrs[0].addr;
+	const void *ip = sa->ss_family == AF_INET6 ?
+		(const void *)&((struct sockaddr_in6 *)sa)->sin6_addr :
+		(const void *)&((struct sockaddr_in *)sa)->sin_addr;
+	if(!inet_ntop(sa->ss_family, ip, key, sizeof(key)))
+		return NULL;
+	return key;
+}
+
+static smtp *OpenSession(Config *c, const char *rcpt, int *fd,
+		uring **ring) {
+	resolver_result res;
+	if(c->socket_fn)
+		*fd = net_connect_unix(c->socket_fn, TimeoutMs(c->connect_timeout));
+	else if(ResolveServer(c, rcpt, &res))
+		*fd = net_connect(&res, TimeoutMs(c->connect_timeout));
+	else
+		return NULL;
+
+	if(*fd < 0) {
+		fprintf(stderr, "Unable to connect\n");
+		return NULL;
+	}
+
+	smtp *s = smtp_new();
+#ifndef SMTP_NEWLINE_UNIX
+	smtp_set_fd(s, *fd, *fd);
+	smtp_set_buffers(s, c->sndbuf, c->rcvbuf);
+#endif
+	smtp_set_timeouts(s, TimeoutMs(c->io_timeout), TimeoutMs(c->io_timeout));
+	*ring = uring_new(URING_ENTRIES);
+	smtp_set_uring(s, *ring);
+	return s;
+}
+
+static void CloseSession(smtp *s, int fd, uring *ring) {
+	smtp_free(s);
+	if(ring) uring_free(ring);
+	close(fd);
+}
+
+// One TLS context for the whole run, so its sessions are reused.
+static tls_ctx *theTls;
+
+static tls_ctx *Tls(Config *c) {
+	if(!theTls)
+		theTls = tls_ctx_new(TLS_KTLS | (c->ca_fn ? TLS_VERIFY : 0),
+				c->ca_fn);
+	return theTls;
+}
+
+// TLS sessions are cached by the address and port connected to.
+static const char *PeerKey(int fd) {
+	static char key[INET6_ADDRSTRLEN + 16];
+	struct sockaddr_storage sa;
+	socklen_t len = sizeof(sa);
+	char host[INET6_ADDRSTRLEN];
 
-	if(!smtp_read_welcome(s) ||
-			!smtp_helo(s, "jizz.com") ||
-			!smtp_mail_from(s, c->from))
+	if(getpeername(fd, (struct sockaddr *)&sa, &len) < 0)
+		return NULL;
+	const void *ip = sa.ss_family == AF_INET6 ?
+		(const void *)&((struct sockaddr_in6 *)&sa)->sin6_addr :
+		(const void *)&((struct sockaddr_in *)&sa)->sin_addr;
+	int port = ntohs(sa.ss_family == AF_INET6 ?
+			((struct sockaddr_in6 *)&sa)->sin6_port :
+			((struct sockaddr_in *)&sa)->sin_port);
+	if(!inet_ntop(sa.ss_family, ip, host, sizeof(host)))
+		return NULL;
+	snprintf(key, sizeof(key), "[%s]:%d", host, port);
+	return key;
+}
+
+// Greeting and EHLO, going through STARTTLS first with -E. Returns 0
+// when the session cannot be used.
+static int Hello(Config *c, smtp *s) {
+	if(c->lmtp)
+		return smtp_lhlo(s, "jizz.com");
+	return smtp_ehlo(s, "jizz.com") || smtp_helo(s, "jizz.com");
+}
+
+static int Greet(Config *c, smtp *s, int fd) {
+	if(c->trace) {
+		const char *peer = c->socket_fn ? c->socket_fn : PeerKey(fd);
+		smtp_set_trace(s, c->trace, peer ? peer : "unknown");
+	}
+	if(!smtp_read_welcome(s) || !Hello(c, s))
 		return 0;
+	if(c->starttls == STARTTLS_NONE)
+		return 1;
+	if(!smtp_has_extension(s, SMTP_EXT_STARTTLS)) {
+		if(c->starttls == STARTTLS_TRY)
+			return 1;
+		fprintf(stderr, "No STARTTLS: ");
+		return 0;
+	}
+	tls_ctx *t = Tls(c);
+	if(!t)
+		return Error("Cannot set up TLS: ");
+	return smtp_starttls(s, t, c->server, PeerKey(fd)) && Hello(c, s);
+}
 
-	for(i = 0; i < c->nto; i++)
-		if(!smtp_rcpt_to(s, c->to[i]))
-			return 0;
+// -r - reading a pipe: the first transaction to get as far as the body
+// forwards it while it is read, through a buffer of fixed size, instead
+// of waiting for all of it. A copy goes to the body's file for
+// recipients that need it again.
+typedef struct Stream {
+	int in;
+} Stream;
+
+// What follows the envelope: a composed message, or a file in wire
+// format (raw message or spooled body).
+typedef struct Body {
+	mime_msg *m;
+	int fd;
+	long size;	// for SIZE=
+	Stream *st;	// fd is still being filled from a pipe
+} Body;
+
+// Body callback for smtp_send_pipelined().
+static int body_cb(smtp *s, void *ctx) {
+	if(smtp_has_extension(s, SMTP_EXT_CHUNKING))
+		return SendChunked(s, (mime_msg *)ctx);
+	return data_cb(s, ctx);
+}
 
+// Body callback for a Stream.
+static int stream_cb(smtp *s, void *ctx) {
+	Body *b = (Body *)ctx;
+	char in[MIMECURSOR_CHUNK * 4], out[RAWMSG_MAX_OUT(sizeof(in))];
+	int chunked = smtp_has_extension(s, SMTP_EXT_CHUNKING);
+	int r, len, ok = 1;
+	rawmsg_state st;
+
+	rawmsg_init(&st, chunked ? 0 : RAWMSG_DOT_STUFF);
+	while(ok && (r = read(b->st->in, in, sizeof(in))) != 0) {
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r < 0 || write(b->fd, in, r) != r)
+			return -1;
+		b->size += r;
+		len = rawmsg_encode(&st, in, r, out);
+		ok = chunked ? smtp_bdat(s, out, len, 0) :
+			smtp_write(s, out, len) >= 0;
+	}
+	if(!ok)
+		return -1;
+	len = rawmsg_finish(&st, out);
+	if(chunked)
+		return smtp_bdat(s, out, len, 1) ? 1 : -1;
+	return smtp_write(s, out, len) >= 0 ? 1 : -1;
+}
+
+// Reads what the stream has left into the body's file, which then
+// holds the whole message.
+static int FinishStream(Body *b) {
+	char buf[MIMECURSOR_CHUNK * 4];
+	int r;
+
+	while((r = read(b->st->in, buf, sizeof(buf))) != 0) {
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r < 0 || write(b->fd, buf, r) != r)
+			return Error("Cannot read the message.\n");
+		b->size += r;
+	}
+	b->st = NULL;
+	return 1;
+}
+
+#define RCPT_DEFERRED	(-1)
+#define RCPT_RETRY	(-2)	// 452, goes in the next transaction
+
+// The server dropped us, or the connection broke.
+static int SessionLost(smtp *s) {
+	return smtp_get_code(s) == 421 || smtp_get_code(s) < 0;
+}
+
+// One message's recipients in a group, sent as one transaction.
+typedef struct Share {
+	const char *from;
+	Body *b;
+	planner *p;
+	planner_group *g;
+	int *state;	// by planner index
+	int msg;	// DeliverSpooled()'s message
+	int order;
+} Share;
+
+// Outcome of a 2xx, 4xx or 5xx reply (0 or local 421: none came).
+static int ReplyState(int code) {
+	if(code >= 200 && code < 300)
+		return SPOOL_RCPT_DELIVERED;
+	if(code >= 500 && code < 600)
+		return SPOOL_RCPT_FAILED;
+	return RCPT_DEFERRED;
+}
+
+// Files the replies of a transaction with its recipients. With LMTP an
+// accepted recipient has its own reply to the end of data.
+static void ShareResult(Share *sh, smtp_txn *t, int *which) {
+	int k, accepted = 0, final;
+
+	for(k = 0; k < t->n_rcpts; k++)
+		if(ReplyState(t->rcpt_codes[k]) == SPOOL_RCPT_DELIVERED)
+			accepted++;
+	final = ReplyState(t->code);
+	if(ReplyState(t->mail_code) != SPOOL_RCPT_DELIVERED)
+		final = ReplyState(t->mail_code);
+
+	for(k = 0; k < t->n_rcpts; k++) {
+		int code = t->rcpt_codes[k], *st = &sh->state[which[k]];
+		if(ReplyState(t->mail_code) != SPOOL_RCPT_DELIVERED)
+			*st = final;
+		else if(ReplyState(code) == SPOOL_RCPT_DELIVERED)
+			*st = t->lmtp_codes && t->lmtp_codes[k] ?
+				ReplyState(t->lmtp_codes[k]) : final;
+		else if(code == 452 && accepted)
+			*st = RCPT_RETRY;
+		else
+			*st = ReplyState(code);
+	}
+}
+
+// The reply that tells most about the server's load: a refused MAIL,
+// else a transient RCPT failure other than too many recipients, else
+// the end of the body. 0 if nothing was answered.
+static int TxnCode(smtp_txn *t) {
+	int k;
+	if(t->mail_code && (t->mail_code < 200 || t->mail_code >= 300))
+		return t->mail_code;
+	for(k = 0; k < t->n_rcpts; k++)
+		if(t->rcpt_codes[k] >= 400 && t->rcpt_codes[k] < 500 &&
+				t->rcpt_codes[k] != 452)
+			return t->rcpt_codes[k];
+	return t->code;
+}
+
+// Sends each share's body once to its group of recipients, all in one
+// pipelined batch per round. A 452 reply to RCPT (too many recipients)
+// leaves the rest of a group for a transaction in the next round (RFC
+// 5321 4.5.3.1.10). state[] ends up SPOOL_RCPT_DELIVERED,
+// SPOOL_RCPT_FAILED or RCPT_DEFERRED. With rl, every transaction's reply
+// and its latency pace the destination rd. Returns 0 once the session
+// is unusable.
+static int SendShares(smtp *s, Share *sh, int n, ratelimit *rl,
+		ratelimit_dest *rd) {
+	smtp_txn *t = (smtp_txn *)malloc(n * sizeof(smtp_txn));
+	int **which = (int **)malloc(n * sizeof(int *));
+	int *owner = (int *)malloc(n * sizeof(int));
+	int i, k, nt, alive = 1;
+
+	for(i = 0; i < n; i++)
+		for(k = 0; k < sh[i].g->n_rcpts; k++)
+			sh[i].state[sh[i].g->rcpts[k]] = RCPT_RETRY;
+
+	do {
+		for(i = nt = 0; i < n; i++) {
+			planner_group *g = sh[i].g;
+			smtp_txn *tx = &t[nt];
+
+			tx->rcpts = (char **)malloc(g->n_rcpts * sizeof(char *));
+			tx->rcpt_codes = (int *)malloc(g->n_rcpts * sizeof(int));
+			tx->lmtp_codes = smtp_is_lmtp(s) ?
+				(int *)malloc(g->n_rcpts * sizeof(int)) : NULL;
+			which[nt] = (int *)malloc(g->n_rcpts * sizeof(int));
+			tx->n_rcpts = 0;
+			for(k = 0; k < g->n_rcpts; k++) {
+				int r = g->rcpts[k];
+				if(sh[i].state[r] != RCPT_RETRY)
+					continue;
+				which[nt][tx->n_rcpts] = r;
+				tx->rcpts[tx->n_rcpts++] = sh[i].p->rcpts[r];
+			}
+			if(!tx->n_rcpts) {
+				free(tx->rcpts);
+				free(tx->rcpt_codes);
+				free(tx->lmtp_codes);
+				free(which[nt]);
+				continue;
+			}
+			tx->from = sh[i].from;
+			tx->size = sh[i].b->size;
+			Body *b = sh[i].b;
+			tx->fd = b->st ? -1 : b->fd;
+			tx->cb = b->st ? &stream_cb : &body_cb;
+			tx->ctx = b->st ? (void *)b : (void *)b->m;
+			owner[nt++] = i;
+		}
+		if(nt == 0)
+			break;
+
+		alive = smtp_send_pipelined(s, t, nt);
+		for(i = 0; i < nt; i++) {
+			if(sh[owner[i]].b->st && !FinishStream(sh[owner[i]].b))
+				alive = 0;
+			ShareResult(&sh[owner[i]], &t[i], which[i]);
+			if(rl && TxnCode(&t[i]))
+				ratelimit_feedback(rl, rd, TxnCode(&t[i]), t[i].latency_us,
+						NowMs());
+			free(t[i].rcpts);
+			free(t[i].rcpt_codes);
+			free(t[i].lmtp_codes);
+			free(which[i]);
+		}
+	} while(alive);
+
+	for(i = 0; i < n; i++)
+		for(k = 0; k < sh[i].g->n_rcpts; k++)
+			if(sh[i].state[sh[i].g->rcpts[k]] == RCPT_RETRY)
+				sh[i].state[sh[i].g->rcpts[k]] = RCPT_DEFERRED;
+	free(t);
+	free(which);
+	free(owner);
+	return alive;
+}
+
+// Stores the message body in the spool: CRLF lines, no dot-stuffing.
+static int SpoolMessage(Config *c, spool *sp, mime_msg *m) {
+	char in[MIMECURSOR_CHUNK * 4], out[RAWMSG_MAX_OUT(sizeof(in))];
+	int i, r, ok = 1;
+	planner *p = planner_new();
+
+	for(i = 0; i < c->nto; i++)
+		planner_add(p, c->to[i]);
 	for(i = 0; i < c->ncc; i++)
-		if(!smtp_rcpt_to(s, c->cc[i]))
+		planner_add(p, c->cc[i]);
+	spool_msg *sm = spool_new_msg(sp, c->from, p->rcpts, p->n_rcpts);
+	planner_free(p);
+	if(!sm)
+		return Error("Cannot create spool file.\n");
+
+	if(c->raw_fn) {
+		rawmsg_state st;
+		rawmsg_init(&st, 0);
+		while(ok && (r = read(c->raw_fd, in, sizeof(in))) > 0) {
+			int len = rawmsg_encode(&st, in, r, out);
+			ok = write(sm->fd, out, len) == len;
+		}
+		r = rawmsg_finish(&st, out);
+		ok = ok && write(sm->fd, out, r) == r;
+	} else {
+		mime_cursor *mc = mimecursor_new(m, LINE_WRAP, 0);
+		while(ok && (r = mimecursor_read(mc, in, sizeof(in))) > 0)
+			ok = write(sm->fd, in, r) == r;
+		mimecursor_free(mc);
+	}
+
+	if(!ok) {
+		spool_remove(sp, sm);
+		return Error("Cannot write spool file.\n");
+	}
+	return spool_add(sp, sm) && spool_commit(sp);
+}
+
+// A spooled message in a delivery batch.
+typedef struct Spooled {
+	spool_msg *sm;
+	planner *p;	// its due recipients
+	int *map;	// planner -> spool index
+	int *state;	// by planner index
+	Body b;
+} Spooled;
+
+// Shares of the same destination go together, in message order.
+static int CompareShares(const void *a, const void *b) {
+	const Share *x = (const Share *)a, *y = (const Share *)b;
+	int r = strcmp(x->g->key, y->g->key);
+	return r ? r : x->order - y->order;
+}
+
+// Pacing held a share back: one entry brings its message back.
+static void Throttle(retry *rq, Spooled *m, Share *sh, long now, long wait) {
+	int k;
+	retry_schedule(rq, m->sm->id, m->map[sh->g->rcpts[0]],
+			now + (wait + 999) / 1000);
+	for(k = 0; k < sh->g->n_rcpts; k++)
+		sh->state[sh->g->rcpts[k]] = SPOOL_RCPT_PENDING;
+}
+
+// One delivery attempt for the due recipients of a batch of spooled
+// messages. All messages to a destination share one connection, their
+// transactions pipelined back to back. 5xx replies fail a recipient;
+// transient failures (4xx, no connection, timeouts) defer it with
+// backoff until RETRY_MAX_AGE. Returns -1 when pacing held back some.
+static int DeliverSpooled(Config *c, spool *sp, retry *rq, ratelimit *rl,
+		spool_msg **msgs, int n_msgs) {
+	Spooled *ms = (Spooled *)calloc(n_msgs, sizeof(Spooled));
+	long now = time(NULL);
+	int i, j, k, n_shares = 0, throttled = 0, fd;
+	struct stat sb;
+	uring *ring;
+
+	for(j = 0; j < n_msgs; j++) {
+		Spooled *m = &ms[j];
+		spool_msg *sm = m->sm = msgs[j];
+
+		m->p = planner_new();
+		m->map = (int *)malloc(sm->n_rcpts * sizeof(int));
+		m->state = (int *)malloc(sm->n_rcpts * sizeof(int));
+		for(i = 0; i < sm->n_rcpts; i++)
+			if(sm->state[i] == SPOOL_RCPT_PENDING && sm->next_try[i] <= now)
+				m->map[planner_add(m->p, sm->rcpts[i])] = i;
+		for(i = 0; i < m->p->n_rcpts; i++)
+			m->state[i] = RCPT_DEFERRED;
+
+		m->b.m = NULL;
+		m->b.st = NULL;
+		m->b.fd = spool_open_body(sp, sm);
+		if(m->b.fd >= 0 && fstat(m->b.fd, &sb) == 0)
+			m->b.size = sb.st_size;
+		if(m->b.fd >= 0) {
+			planner_plan(m->p, PLANNER_MAX_RCPTS, &GroupKey, c);
+			n_shares += m->p->n_groups;
+		}
+	}
+
+	Share *sh = (Share *)malloc((n_shares + 1) * sizeof(Share));
+	for(j = n_shares = 0; j < n_msgs; j++) {
+		Spooled *m = &ms[j];
+		for(i = 0; m->b.fd >= 0 && i < m->p->n_groups; i++) {
+			Share *x = &sh[n_shares];
+			x->from = m->sm->from;
+			x->b = &m->b;
+			x->p = m->p;
+			x->g = &m->p->groups[i];
+			x->state = m->state;
+			x->msg = j;
+			x->order = n_shares++;
+		}
+	}
+	qsort(sh, n_shares, sizeof(Share), &CompareShares);
+
+	for(i = 0; i < n_shares; i = j) {
+		const char *key = sh[i].g->key;
+		int n = 0;
+		for(j = i + 1; j < n_shares && !strcmp(sh[j].g->key, key); j++)
+			;
+
+		// paced per destination, the -h server or the mail exchanger:
+		// the connection brings one message, each further one a token
+		ratelimit_dest *rd = ratelimit_get(rl, key);
+		long wait = ratelimit_connect(rl, rd, NowMs());
+		if(!wait)
+			for(n = 1; i + n < j; n++)
+				if((wait = ratelimit_message(rl, rd, NowMs())))
+					break;
+		for(k = i + n; k < j; k++) {
+			Throttle(rq, &ms[sh[k].msg], &sh[k], now, wait);
+			throttled = 1;
+		}
+		if(n == 0)
+			continue;
+
+		smtp *s = OpenSession(c, sh[i].p->rcpts[sh[i].g->rcpts[0]], &fd, &ring);
+		if(!s) {
+			ratelimit_feedback(rl, rd, 421, 0, NowMs());
+			ratelimit_done(rd);
+			fprintf(stderr, "%s: no connection\n", key);
+			continue;
+		}
+		if(Greet(c, s, fd))
+			SendShares(s, &sh[i], n, rl, rd);
+		else
+			ratelimit_feedback(rl, rd, smtp_get_code(s), 0, NowMs());
+		fprintf(stderr, "%s, %d transactions: ", key, n);
+		print_smtp_reply(s);
+		if(!SessionLost(s))
+			smtp_quit(s);
+		CloseSession(s, fd, ring);
+		ratelimit_done(rd);
+	}
+	free(sh);
+
+	for(j = 0; j < n_msgs; j++) {
+		Spooled *m = &ms[j];
+		spool_msg *sm = m->sm;
+		int *state = (int *)malloc(sm->n_rcpts * sizeof(int));
+
+		for(i = 0; i < sm->n_rcpts; i++)
+			state[i] = SPOOL_RCPT_PENDING;
+		for(i = 0; i < m->p->n_rcpts; i++)
+			state[m->map[i]] = m->state[i];
+		if(m->b.fd >= 0)
+			close(m->b.fd);
+
+		// deferrals first, the last final state may remove sm
+		for(i = 0; i < sm->n_rcpts; i++) {
+			if(state[i] != RCPT_DEFERRED)
+				continue;
+			if(now - sm->created >= RETRY_MAX_AGE) {
+				state[i] = SPOOL_RCPT_FAILED;
+				continue;
+			}
+			long next_try = now + retry_backoff(sm->attempts[i] + 1);
+			spool_defer_rcpt(sp, sm, i, next_try);
+			retry_schedule(rq, sm->id, i, next_try);
+		}
+		for(i = 0; i < sm->n_rcpts; i++)
+			if(state[i] == SPOOL_RCPT_DELIVERED || state[i] == SPOOL_RCPT_FAILED)
+				spool_set_rcpt(sp, sm, i, state[i]);
+
+		planner_free(m->p);
+		free(m->map);
+		free(m->state);
+		free(state);
+	}
+	free(ms);
+	return throttled ? -1 : 1;
+}
+
+typedef struct {
+	Config *c;
+	spool *sp;
+	retry *rq;
+	ratelimit *rl;
+	long now;
+	spool_msg **due;
+	int n_due;
+} SpoolRun;
+
+// A recipient came due; its message goes out with all others due by now.
+static void SpoolDue(unsigned long msg_id, int rcpt, void *ctx) {
+	SpoolRun *run = (SpoolRun *)ctx;
+	spool_msg *sm = spool_find(run->sp, msg_id);
+
+	// stale entry: delivered, failed or rescheduled since
+	if(!sm || rcpt >= sm->n_rcpts ||
+			sm->state[rcpt] != SPOOL_RCPT_PENDING ||
+			sm->next_try[rcpt] > run->now)
+		return;
+	if((run->n_due & (run->n_due - 1)) == 0)
+		run->due = (spool_msg **)realloc(run->due,
+				(run->n_due ? run->n_due * 2 : 1) * sizeof(spool_msg *));
+	run->due[run->n_due++] = sm;
+}
+
+static int CompareIds(const void *a, const void *b) {
+	unsigned long x = (*(spool_msg **)a)->id, y = (*(spool_msg **)b)->id;
+	return x < y ? -1 : x > y;
+}
+
+// Delivers what came due, MAX_BATCH messages at a time. Returns -1 when
+// pacing held back some.
+static int DeliverDue(SpoolRun *run) {
+	int i, n = 0, ret = 1;
+
+	// a message is due once, however many recipients are
+	qsort(run->due, run->n_due, sizeof(spool_msg *), &CompareIds);
+	for(i = 0; i < run->n_due; i++)
+		if(n == 0 || run->due[i] != run->due[n - 1])
+			run->due[n++] = run->due[i];
+
+	for(i = 0; i < n; i += MAX_BATCH)
+		if(DeliverSpooled(run->c, run->sp, run->rq, run->rl, &run->due[i],
+				n - i < MAX_BATCH ? n - i : MAX_BATCH) < 0)
+			ret = -1;
+	run->n_due = 0;
+	return ret;
+}
+
+static int RunSpool(Config *c, mime_msg *m) {
+	spool *sp = spool_open(c->spool_dir);
+	spool_msg *sm;
+	int i;
+
+	if(!sp)
+		return Error("Cannot open spool.\n");
+	if(c->from || c->nto || c->raw_fn) {
+		if(!SetupMimeMsg(m, c) || !SpoolMessage(c, sp, m)) {
+			spool_close(sp);
 			return 0;
+		}
+		fprintf(stderr, "message spooled\n");
+	}
 
-	if(!smtp_data(s, &data_cb, m) ||
-			!smtp_quit(s))
-		return 0;
+	// one second behind, so what is due now fires on the first run
+	SpoolRun run = { c, sp, retry_new(time(NULL) - 1),
+		ratelimit_new(c->msg_rate, c->conn_rate, MAX_CONNS), 0, NULL, 0 };
+	for(sm = sp->head; sm; sm = sm->next)
+		for(i = 0; i < sm->n_rcpts; i++)
+			if(sm->state[i] == SPOOL_RCPT_PENDING)
+				retry_schedule(run.rq, sm->id, i, sm->next_try[i]);
 
+	for(;;) {
+		run.now = time(NULL);
+		retry_run(run.rq, run.now, &SpoolDue, &run);
+		int throttled = DeliverDue(&run) < 0;
+		spool_commit(sp);
+
+		// without -W, only what is due now but held back by pacing
+		long next = retry_next(run.rq);
+		if(next < 0 || (!c->spool_wait && !throttled))
+			break;
+		sleep(next);
+	}
+
+	if(sp->n_msgs)
+		fprintf(stderr, "%d messages left in the spool\n", sp->n_msgs);
+	free(run.due);
+	retry_free(run.rq);
+	ratelimit_free(run.rl);
+	spool_close(sp);
 	return 1;
 }
 
-int main(int argc, char *argv[]) {
-	Config cfg;
-	memset(&cfg, 0, sizeof(cfg));
+// Octets a raw message file takes on the wire after DATA: bare LF turns
+// into CRLF, leading dots are doubled, the last line gets its line end.
+// Under BDAT it is no more than that. -1 if the file cannot be read.
+static long WireSize(int fd) {
+	char buf[MIMECURSOR_CHUNK * 4], end[2];
+	rawmsg_state st;
+	long size = 0, off = 0;
+	int r;
 
-	mime_msg *m = mimemsg_new();
+	rawmsg_init(&st, RAWMSG_DOT_STUFF);
+	while((r = pread(fd, buf, sizeof(buf), off)) != 0) {
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r < 0)
+			return -1;
+		size += rawmsg_measure(&st, buf, r);
+		off += r;
+	}
+	return size + rawmsg_finish(&st, end);
+}
+
+// Sends the message to every recipient, one connection and one copy of
+// the body per recipient group. Returns 1 if all of them took it.
+static int SendMail(Config *c, mime_msg *m) {
+	planner *p = planner_new();
+	struct stat sb;
+	int i, fd, ok = 1;
+	uring *ring;
+
+	for(i = 0; i < c->nto; i++)
+		planner_add(p, c->to[i]);
+	for(i = 0; i < c->ncc; i++)
+		planner_add(p, c->cc[i]);
+	planner_plan(p, PLANNER_MAX_RCPTS, &GroupKey, c);
+
+	Body b = { m, -1, 0, NULL };
+	Stream st = { c->raw_fd };
+	if(c->raw_fn) {
+		b.fd = c->raw_fd;
+		if(fstat(b.fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+			b.size = WireSize(b.fd);
+			if(b.size < 0)
+				b.size = sb.st_size;
+		} else if((b.fd = TempFile()) >= 0) {
+			b.st = &st;
+		} else {
+			planner_free(p);
+			return Error("Cannot create a temporary file.\n");
+		}
+	} else {
+		b.size = mimemsg_get_size(m, LINE_WRAP);
+	}
+
+	int *state = (int *)malloc((p->n_rcpts + 1) * sizeof(int));
+	for(i = 0; i < p->n_rcpts; i++)
+		state[i] = RCPT_DEFERRED;
+
+	int gi;
+	for(gi = 0; gi < p->n_groups; gi++) {
+		planner_group *g = &p->groups[gi];
+		Share sh = { c->from, &b, p, g, state, 0, 0 };
+		smtp *s = OpenSession(c, p->rcpts[g->rcpts[0]], &fd, &ring);
+		if(!s)
+			continue;
+		if(Greet(c, s, fd))
+			SendShares(s, &sh, 1, NULL, NULL);
+		if(p->n_groups > 1)
+			fprintf(stderr, "%s: ", g->key);
+		print_smtp_reply(s);
+		if(!SessionLost(s))
+			smtp_quit(s);
+		CloseSession(s, fd, ring);
+	}
 
-	if(ParseArgs(argc, argv, &cfg) && SetupMimeMsg(m, &cfg)) {
-		if(!cfg.server)
-			return Error("No server specified.\n");
+	for(i = 0; i < p->n_rcpts; i++) {
+		if(state[i] == SPOOL_RCPT_DELIVERED)
+			continue;
+		fprintf(stderr, "%s: %s\n", p->rcpts[i],
+				state[i] == SPOOL_RCPT_FAILED ? "failed" : "not delivered, try later");
+		ok = 0;
+	}
+	if(c->raw_fn && b.fd != c->raw_fd)
+		close(b.fd);
+	free(state);
+	planner_free(p);
+	return ok;
+}
 
-		int fd = connect_server(cfg.server, cfg.port);
-		if(fd < 0) {
-			fprintf(stderr, "Unable to connect\n");
+// Writes rendered pieces: memory in writev batches, files with sendfile.
+static int WritePieces(smtp *s, template_output *o) {
+	struct iovec iov[SMTP_IOV_MAX];
+	int i, n = 0;
+
+	for(i = 0; i <= o->n_pieces; i++) {
+		template_piece *p = i < o->n_pieces ? &o->pieces[i] : NULL;
+		if(n && (!p || !p->data || n == SMTP_IOV_MAX)) {
+			if(smtp_writev(s, iov, n) < 0)
+				return -1;
+			n = 0;
+		}
+		if(!p)
+			break;
+		if(p->data) {
+			iov[n].iov_base = (void *)p->data;
+			iov[n++].iov_len = p->len;
+		} else if(smtp_sendfile(s, p->fd, p->offset, p->len) != p->len) {
 			return -1;
 		}
+	}
+	return 1;
+}
 
-		smtp *s = smtp_new();
-#ifndef SMTP_NEWLINE_UNIX
-		smtp_set_fd(s, fd, fd);
-#endif
+// One recipient's rendering of the template.
+typedef struct MergeTxn {
+	template *t;
+	const char **values;
+	template_output *out;	// shared, used by one body at a time
+	char *sig;	// DKIM-Signature header line, or NULL
+} MergeTxn;
 
-		if(SendMail(&cfg, s, m)) {
-			fprintf(stderr, "message sent\n");
-			print_smtp_reply(s);
-		} else {
-			fprintf(stderr, "[Error]\n");
-			print_smtp_reply(s);
+static int merge_cb(smtp *s, void *ctx) {
+	MergeTxn *mt = (MergeTxn *)ctx;
+	int siglen = mt->sig ? strlen(mt->sig) : 0;
+
+	// the signature lines start with a letter or a tab, never a dot
+	if(smtp_has_extension(s, SMTP_EXT_CHUNKING)) {
+		template_render(mt->t, mt->values, 0, mt->out);
+		return smtp_bdat_start(s, mt->out->len + siglen, 1) &&
+			(!siglen || smtp_write(s, mt->sig, siglen) >= 0) &&
+			WritePieces(s, mt->out) > 0 &&
+			smtp_bdat_end(s) ? 1 : -1;
+	}
+	template_render(mt->t, mt->values, TEMPLATE_DOT_STUFF, mt->out);
+	if(siglen && smtp_write(s, mt->sig, siglen) < 0)
+		return -1;
+	return WritePieces(s, mt->out);
+}
+
+static int BodyFields(template *t) {
+	int i;
+	for(i = 0; i < t->n_segs; i++)
+		if(t->segs[i].type == TEMPLATE_FIELD && !t->segs[i].header)
+			return 1;
+	return 0;
+}
+
+// Signs one recipient's rendering (without dot-stuffing). The body is
+// hashed only if bh is NULL, when placeholders make it differ. Returns
+// the DKIM-Signature header line to send in front, or NULL.
+static char *SignRendered(dkim *d, template_output *o, const char *bh) {
+	static const char blank[] = "\r\n\r\n";
+	buffer_ctx *hdr = buffer_new(0), *sig = buffer_new(0);
+	dkim_body *b = bh ? NULL : dkim_body_new(DKIM_BODY_RELAXED);
+	char buf[MIMECURSOR_CHUNK], hash[DKIM_HASH_SIZE];
+	int i, r, ok = 1, match = 0;
+
+	for(i = 0; i < o->n_pieces && (match < 4 || b); i++) {
+		template_piece *p = &o->pieces[i];
+		long k = 0;
+		if(p->data) {
+			for(; match < 4 && k < p->len; k++)
+				match = p->data[k] == blank[match] ? match + 1 :
+					p->data[k] == '\r' ? 1 : 0;
+			buffer_append(hdr, p->data, k);
+			if(b)
+				dkim_body_update(b, &p->data[k], p->len - k);
+			continue;
+		}
+		// cached bodies come after the header block
+		for(; b && k < p->len; k += r) {
+			r = pread(p->fd, buf, p->len - k < sizeof(buf) ?
+					p->len - k : sizeof(buf), p->offset + k);
+			if(r <= 0) {
+				ok = 0;
+				break;
+			}
+			dkim_body_update(b, buf, r);
+		}
+	}
+	if(b) {
+		dkim_body_final(b, hash);
+		bh = hash;
+	}
+
+	char *line = NULL;
+	if(ok && dkim_sign_header(d, buffer_data(hdr), buffer_length(hdr), bh,
+				sig)) {
+		line = (char *)malloc(buffer_length(sig) + sizeof(DKIM_HEADER) + 4);
+		sprintf(line, "%s: %s\r\n", DKIM_HEADER, buffer_cstr(sig));
+	}
+	buffer_free(hdr);
+	buffer_free(sig);
+	return line;
+}
+
+// The template keeps the rendered message in memory, encoded
+// attachments included. When that does not fit the memory budget, the
+// base64 parts are rendered into unlinked files first and the template
+// sends them from there. Returns their descriptors by part, -1 where
+// none, or NULL if nothing was spilled.
+static int *SpillParts(mime_msg *m) {
+	mime_part *p;
+	int i, *fds;
+
+	if(budget_room(mimemsg_get_size(m, LINE_WRAP)))
+		return NULL;
+	fds = (int *)malloc((m->n_parts + 1) * sizeof(int));
+	for(p = m->part_head, i = 0; p; p = p->next, i++) {
+		fds[i] = -1;
+		if(p->transfer_encoding != MIME_TRANSFER_ENCODING_BASE64 ||
+				p->cache_len || (fds[i] = TempFile()) < 0)
+			continue;
+		if(!mimepart_cache(p, LINE_WRAP, fds[i])) {
+			close(fds[i]);
+			fds[i] = -1;
 		}
+	}
+	return fds;
+}
 
-		smtp_free(s);
-		close(fd);
+static void UnspillParts(mime_msg *m, int *fds) {
+	mime_part *p;
+	int i;
+
+	if(!fds)
+		return;
+	for(p = m->part_head, i = 0; p; p = p->next, i++)
+		if(fds[i] >= 0) {
+			close(fds[i]);
+			p->cache_fd = -1;
+			p->cache_len = 0;
+		}
+	free(fds);
+}
+
+// Mail merge: every recipient gets the template rendered with its own
+// row, one transaction each, pipelined per recipient group. Returns 1
+// if all of them took it.
+static int SendMerged(Config *c, mime_msg *m) {
+	MergeData *md = &c->merge;
+	int *spilled = SpillParts(m);
+	template *t = template_compile(m, LINE_WRAP);
+	int i, k, fd, ok = 1;
+	uring *ring;
+
+	if(!t) {
+		UnspillParts(m, spilled);
+		return Error("Cannot compile the message.\n");
+	}
+	int *col = (int *)malloc((t->n_fields + 1) * sizeof(int));
+	for(i = 0; i < t->n_fields; i++) {
+		for(col[i] = 0; col[i] < md->n_cols; col[i]++)
+			if(!strcmp(md->cols[col[i]], t->fields[i]))
+				break;
+		if(col[i] == md->n_cols) {
+			fprintf(stderr, "No column for {{%s}}\n", t->fields[i]);
+			template_free(t);
+			UnspillParts(m, spilled);
+			free(col);
+			return 0;
+		}
+	}
+
+	// the body hash is the template's unless the body is personalized
+	const char *bh = NULL;
+	if(c->dkim && !BodyFields(t) &&
+			!(bh = dkim_msg_body_hash(c->dkim, m, LINE_WRAP))) {
+		template_free(t);
+		UnspillParts(m, spilled);
+		free(col);
+		return Error("Cannot sign the message.\n");
+	}
+
+	// the first row of an address wins
+	planner *p = planner_new();
+	int *row = (int *)malloc(md->n_rows * sizeof(int));
+	for(i = 0; i < md->n_rows; i++) {
+		int n = p->n_rcpts;
+		planner_add(p, NormalizeAddress(md->cells[i * md->n_cols]));
+		if(p->n_rcpts > n)
+			row[n] = i;
+	}
+	planner_plan(p, PLANNER_MAX_RCPTS, &GroupKey, c);
+
+	const char **values = (const char **)malloc(
+			(p->n_rcpts * t->n_fields + 1) * sizeof(char *));
+	int *state = (int *)malloc(p->n_rcpts * sizeof(int));
+	for(i = 0; i < p->n_rcpts; i++) {
+		state[i] = RCPT_DEFERRED;
+		for(k = 0; k < t->n_fields; k++)
+			values[i * t->n_fields + k] = md->cells[row[i] * md->n_cols + col[k]];
+	}
+
+	template_output *out = template_output_new();
+	smtp_txn *txn = (smtp_txn *)malloc(PLANNER_MAX_RCPTS * sizeof(smtp_txn));
+	MergeTxn *mt = (MergeTxn *)malloc(PLANNER_MAX_RCPTS * sizeof(MergeTxn));
+	int codes[PLANNER_MAX_RCPTS], lmtp_codes[PLANNER_MAX_RCPTS];
+	int which[PLANNER_MAX_RCPTS];
+	Share sh = { c->from, NULL, p, NULL, state, 0, 0 };
+
+	int gi;
+	for(gi = 0; gi < p->n_groups; gi++) {
+		planner_group *g = &p->groups[gi];
+		smtp *s = OpenSession(c, p->rcpts[g->rcpts[0]], &fd, &ring);
+		if(!s)
+			continue;
+		if(Greet(c, s, fd)) {
+			int n = 0;
+			for(k = 0; k < g->n_rcpts; k++) {
+				int r = g->rcpts[k];
+				mt[n].t = t;
+				mt[n].values = &values[r * t->n_fields];
+				mt[n].out = out;
+				mt[n].sig = NULL;
+				if(c->dkim) {
+					// signed up front, SIZE= counts the signature
+					template_render(t, mt[n].values, 0, out);
+					if(!(mt[n].sig = SignRendered(c->dkim, out, bh))) {
+						state[r] = SPOOL_RCPT_FAILED;
+						continue;
+					}
+				}
+				txn[n].from = c->from;
+				txn[n].rcpts = &p->rcpts[r];
+				txn[n].n_rcpts = 1;
+				txn[n].size = template_size(t, mt[n].values) +
+					(mt[n].sig ? strlen(mt[n].sig) : 0);
+				txn[n].fd = -1;
+				txn[n].cb = &merge_cb;
+				txn[n].ctx = &mt[n];
+				txn[n].rcpt_codes = &codes[n];
+				txn[n].lmtp_codes = smtp_is_lmtp(s) ? &lmtp_codes[n] : NULL;
+				which[n++] = r;
+			}
+			smtp_send_pipelined(s, txn, n);
+			for(k = 0; k < n; k++) {
+				ShareResult(&sh, &txn[k], &which[k]);
+				if(mt[k].sig)
+					free(mt[k].sig);
+			}
+		}
+		if(p->n_groups > 1)
+			fprintf(stderr, "%s: ", g->key);
+		print_smtp_reply(s);
+		if(!SessionLost(s))
+			smtp_quit(s);
+		CloseSession(s, fd, ring);
+	}
+
+	for(i = 0; i < p->n_rcpts; i++) {
+		if(state[i] == SPOOL_RCPT_DELIVERED)
+			continue;
+		fprintf(stderr, "%s: %s\n", p->rcpts[i],
+				state[i] == SPOOL_RCPT_FAILED ? "failed" : "not delivered, try later");
+		ok = 0;
+	}
+	template_output_free(out);
+	template_free(t);
+	UnspillParts(m, spilled);
+	planner_free(p);
+	free(txn);
+	free(mt);
+	free(values);
+	free(state);
+	free(row);
+	free(col);
+	return ok;
+}
+
+int main(int argc, char *argv[]) {
+	Config cfg;
+	memset(&cfg, 0, sizeof(cfg));
+
+	mime_msg *m = mimemsg_new();
+	// a pipelining server may hang up while we are still writing
+	signal(SIGPIPE, SIG_IGN);
+
+	if(!ParseArgs(argc, argv, &cfg)) {
+		Usage(argc, argv);
+	} else if(cfg.spool_dir) {
+		RunSpool(&cfg, m);
+	} else if(SetupMimeMsg(m, &cfg)) {
+		if(cfg.merge_fn ? SendMerged(&cfg, m) : SendMail(&cfg, m))
+			fprintf(stderr, "message sent\n");
+		else
+			fprintf(stderr, "[Error]\n");
 	} else {
 		Usage(argc, argv);
 	}
+	if(probes_rate)
+		probes_report(stderr);
 
+	if(theResolver)
+		resolver_free(theResolver);
+	if(theTls)
+		tls_ctx_free(theTls);
 	mimemsg_free(m);
 
 	ResetConfig(&cfg);
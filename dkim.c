@@ -0,0 +1,406 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+
+#include "base64.h"
+#include "dkim.h"
+
+// signed when present, bottom-most instance first
+static const char *dkim__headers[] = {
+	"From", "Sender", "Reply-To", "To", "Cc", "Subject", "Date",
+	"Message-ID", "In-Reply-To", "References", "Mime-Version",
+	"Content-Type", "Content-Transfer-Encoding", NULL
+};
+
+// folded lines stay short enough to pass the line wrapper unchanged
+#define DKIM__FOLD	(72)
+#define DKIM__OUT	(4096)
+
+struct dkim {
+	char *domain, *selector;
+	EVP_PKEY *key;
+	int body_canon;
+};
+
+struct dkim_body {
+	EVP_MD_CTX *md;
+	int canon;
+	int cr;		// a CR waiting for its LF
+	int wsp;	// relaxed: white space not known to be trailing yet
+	int started;	// the current line has content
+	int any;	// some line had content
+	long empty;	// empty lines held back, dropped at the end
+	char out[DKIM__OUT];
+	int n_out;
+};
+
+dkim *dkim_new(const char *domain, const char *selector,
+		const char *key_file, int body_canon) {
+	FILE *fp = fopen(key_file, "r");
+	if(!fp)
+		return NULL;
+	EVP_PKEY *key = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+	fclose(fp);
+	if(!key || EVP_PKEY_base_id(key) != EVP_PKEY_RSA) {
+		EVP_PKEY_free(key);
+		return NULL;
+	}
+
+	dkim *d = (dkim *)malloc(sizeof(dkim));
+	d->domain = strdup(domain);
+	d->selector = strdup(selector);
+	d->key = key;
+	d->body_canon = body_canon;
+	return d;
+}
+
+void dkim_free(dkim *d) {
+	EVP_PKEY_free(d->key);
+	free(d->domain);
+	free(d->selector);
+	free(d);
+}
+
+/*** Body hash ***/
+dkim_body *dkim_body_new(int body_canon) {
+	dkim_body *b = (dkim_body *)malloc(sizeof(dkim_body));
+	memset(b, 0, sizeof(dkim_body));
+	b->canon = body_canon;
+	b->md = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(b->md, EVP_sha256(), NULL);
+	return b;
+}
+
+static void dkim__put(dkim_body *b, const char *s, int len) {
+	while(len > 0) {
+		if(b->n_out == DKIM__OUT) {
+			EVP_DigestUpdate(b->md, b->out, b->n_out);
+			b->n_out = 0;
+		}
+		int n = DKIM__OUT - b->n_out;
+		if(n > len) n = len;
+		memcpy(&b->out[b->n_out], s, n);
+		b->n_out += n;
+		s += n;
+		len -= n;
+	}
+}
+
+// Content on the current line: the empty lines before it are not
+// trailing after all.
+static void dkim__char(dkim_body *b, char ch) {
+	if(b->canon == DKIM_BODY_RELAXED && (ch == ' ' || ch == '\t')) {
+		b->wsp = 1;
+		return;
+	}
+	if(!b->started) {
+		for(; b->empty > 0; b->empty--)
+			dkim__put(b, "\r\n", 2);
+		b->started = b->any = 1;
+	}
+	if(b->wsp)
+		dkim__put(b, " ", 1);
+	b->wsp = 0;
+	dkim__put(b, &ch, 1);
+}
+
+static void dkim__eol(dkim_body *b) {
+	if(b->started)
+		dkim__put(b, "\r\n", 2);
+	else
+		b->empty++;
+	b->started = b->wsp = 0;
+}
+
+void dkim_body_update(dkim_body *b, const void *buf, long len) {
+	const char *p = (const char *)buf;
+	long i;
+
+	for(i = 0; i < len; i++) {
+		char ch = p[i];
+		// the rest of a run of plain characters goes in at once
+		long run = i;
+		while(run < len && p[run] != '\r' && p[run] != '\n' &&
+				(b->canon == DKIM_BODY_SIMPLE ||
+				 (p[run] != ' ' && p[run] != '\t')))
+			run++;
+		if(run - i > 1 && !b->cr) {
+			dkim__char(b, ch);
+			dkim__put(b, &p[i + 1], run - i - 1);
+			i = run - 1;
+			continue;
+		}
+		if(b->cr) {
+			b->cr = 0;
+			if(ch == '\n') {
+				dkim__eol(b);
+				continue;
+			}
+			dkim__char(b, '\r');
+		}
+		if(ch == '\r')
+			b->cr = 1;
+		else if(ch == '\n')
+			dkim__eol(b);
+		else
+			dkim__char(b, ch);
+	}
+}
+
+void dkim_body_final(dkim_body *b, char *bh) {
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdlen;
+	int blen = DKIM_HASH_SIZE;
+
+	if(b->cr)
+		dkim__char(b, '\r');
+	if(b->started)
+		dkim__eol(b);
+	// an empty body is one CRLF for simple, nothing for relaxed
+	if(!b->any && b->canon == DKIM_BODY_SIMPLE)
+		dkim__put(b, "\r\n", 2);
+	EVP_DigestUpdate(b->md, b->out, b->n_out);
+	EVP_DigestFinal_ex(b->md, md, &mdlen);
+	base64_encode(md, mdlen, bh, &blen);
+	bh[blen] = '\0';
+
+	EVP_MD_CTX_free(b->md);
+	free(b);
+}
+
+/*** Header signature ***/
+typedef struct dkim__field {
+	const char *data;
+	long len;	// with its folding, without the last CRLF
+	int name_len;
+	int used;
+} dkim__field;
+
+// Relaxed value: unfolded, white space runs as one space, none at the
+// start or the end.
+static void dkim__relaxed_value(buffer_ctx *out, const char *v, long len) {
+	int wsp = 0, started = 0;
+	long i;
+
+	for(i = 0; i < len; i++) {
+		char ch = v[i];
+		if(ch == '\r' || ch == '\n')
+			continue;
+		if(ch == ' ' || ch == '\t') {
+			wsp = 1;
+			continue;
+		}
+		if(wsp && started)
+			buffer_append(out, " ", 1);
+		wsp = 0;
+		started = 1;
+		buffer_append(out, &ch, 1);
+	}
+}
+
+// Relaxed header canonicalization: lower case name, no white space
+// around the colon, relaxed value.
+static void dkim__relaxed(buffer_ctx *out, const char *f, long len) {
+	long i, colon;
+
+	for(colon = 0; colon < len && f[colon] != ':'; colon++);
+	long end = colon;
+	while(end > 0 && (f[end - 1] == ' ' || f[end - 1] == '\t'))
+		end--;
+	char *name = buffer_reserve(out, end + 1);
+	for(i = 0; i < end; i++)
+		name[i] = tolower((unsigned char)f[i]);
+	name[i] = ':';
+	buffer_commit(out, end + 1);
+	if(colon < len)
+		dkim__relaxed_value(out, &f[colon + 1], len - colon - 1);
+}
+
+// Splits the header block into fields, continuation lines included.
+static int dkim__fields(const char *hdr, long len, dkim__field **fields) {
+	int n = 0, size = 0;
+	long i = 0;
+
+	*fields = NULL;
+	while(i < len) {
+		long start = i;
+		do {
+			const char *eol = memchr(&hdr[i], '\n', len - i);
+			i = eol ? eol - hdr + 1 : len;
+		} while(i < len && (hdr[i] == ' ' || hdr[i] == '\t'));
+
+		if(n == size) {
+			size = size ? size * 2 : 32;
+			*fields = (dkim__field *)realloc(*fields,
+					size * sizeof(dkim__field));
+		}
+		dkim__field *f = &(*fields)[n++];
+		f->data = &hdr[start];
+		f->len = i - start;
+		while(f->len > 0 && (f->data[f->len - 1] == '\n' ||
+					f->data[f->len - 1] == '\r'))
+			f->len--;
+		const char *colon = memchr(f->data, ':', f->len);
+		f->name_len = colon ? colon - f->data : f->len;
+		while(f->name_len > 0 && (f->data[f->name_len - 1] == ' ' ||
+					f->data[f->name_len - 1] == '\t'))
+			f->name_len--;
+		f->used = 0;
+	}
+	return n;
+}
+
+// Appends a piece of the signature value, folding in front of it when
+// the line would get too long.
+static void dkim__fold(buffer_ctx *out, int *col, const char *s, int len,
+		int space) {
+	if(*col + space + len > DKIM__FOLD) {
+		buffer_append(out, "\r\n\t", 3);
+		*col = 1;
+	} else if(space) {
+		buffer_append(out, " ", 1);
+		(*col)++;
+	}
+	buffer_append(out, s, len);
+	*col += len;
+}
+
+int dkim_sign_header(dkim *d, const char *hdr, long len, const char *bh,
+		buffer_ctx *out) {
+	dkim__field *fields;
+	int n = dkim__fields(hdr, len, &fields);
+	int i, k, col = strlen(DKIM_HEADER ": ");
+	buffer_ctx *data = buffer_new(0);
+	char tag[512];
+
+	buffer_reset(out);
+	snprintf(tag, sizeof(tag), "v=1; a=rsa-sha256; c=relaxed/%s;",
+			d->body_canon == DKIM_BODY_RELAXED ? "relaxed" : "simple");
+	dkim__fold(out, &col, tag, strlen(tag), 0);
+	snprintf(tag, sizeof(tag), "d=%s;", d->domain);
+	dkim__fold(out, &col, tag, strlen(tag), 1);
+	snprintf(tag, sizeof(tag), "s=%s;", d->selector);
+	dkim__fold(out, &col, tag, strlen(tag), 1);
+	snprintf(tag, sizeof(tag), "t=%ld;", (long)time(NULL));
+	dkim__fold(out, &col, tag, strlen(tag), 1);
+
+	// h= and the canonical headers in the same order
+	int signed_from = 0, first = 1;
+	for(i = 0; dkim__headers[i]; i++) {
+		const char *name = dkim__headers[i];
+		int nlen = strlen(name);
+		for(k = n - 1; k >= 0; k--)
+			if(!fields[k].used && fields[k].name_len == nlen &&
+					!strncasecmp(fields[k].data, name, nlen))
+				break;
+		if(k < 0)
+			continue;
+		fields[k].used = 1;
+		signed_from |= i == 0;
+		dkim__relaxed(data, fields[k].data, fields[k].len);
+		buffer_append(data, "\r\n", 2);
+
+		snprintf(tag, sizeof(tag), "%s%s", first ? "h=" : ":", name);
+		dkim__fold(out, &col, tag, strlen(tag), first);
+		first = 0;
+	}
+	free(fields);
+	if(!signed_from) {
+		buffer_free(data);
+		return 0;
+	}
+	buffer_append(out, ";", 1);
+	col++;
+	snprintf(tag, sizeof(tag), "bh=%s;", bh);
+	dkim__fold(out, &col, tag, strlen(tag), 1);
+	dkim__fold(out, &col, "b=", 2, 1);
+
+	// the signature header itself, b= empty and no line break
+	buffer_append_string(data, "dkim-signature:");
+	dkim__relaxed_value(data, buffer_data(out), buffer_length(out));
+
+	unsigned char sig[1024];
+	size_t siglen = sizeof(sig);
+	EVP_MD_CTX *md = EVP_MD_CTX_new();
+	int ok = EVP_PKEY_get_size(d->key) <= (int)sizeof(sig) &&
+		EVP_DigestSignInit(md, NULL, EVP_sha256(), NULL, d->key) == 1 &&
+		EVP_DigestSign(md, sig, &siglen, (const unsigned char *)buffer_data(data),
+				buffer_length(data)) == 1;
+	EVP_MD_CTX_free(md);
+	buffer_free(data);
+	if(!ok)
+		return 0;
+
+	char b64[sizeof(sig) * 4 / 3 + 4];
+	int blen = sizeof(b64);
+	base64_encode(sig, siglen, b64, &blen);
+	for(i = 0; i < blen; i += DKIM__FOLD - 8)
+		dkim__fold(out, &col, &b64[i],
+				blen - i < DKIM__FOLD - 8 ? blen - i : DKIM__FOLD - 8, 0);
+	return 1;
+}
+
+/*** Messages ***/
+// Renders m; the header block with its blank line goes into hdr and the
+// body into b, either may be NULL. Stops after the header block when there is no b.
+static int dkim__render(mime_msg *m, int wrap, buffer_ctx *hdr,
+		dkim_body *b) {
+	static const char blank[] = "\r\n\r\n";
+	mime_cursor *c = mimecursor_new(m, wrap, 0);
+	char buf[MIMECURSOR_CHUNK];
+	int r, i = 0, match = 0;
+
+	while((r = mimecursor_read(c, buf, sizeof(buf))) > 0) {
+		for(i = 0; match < 4 && i < r; i++)
+			match = buf[i] == blank[match] ? match + 1 :
+				buf[i] == '\r' ? 1 : 0;
+		if(hdr)
+			buffer_append(hdr, buf, i);
+		if(match < 4)
+			continue;
+		if(!b)
+			break;
+		dkim_body_update(b, &buf[i], r - i);
+	}
+	mimecursor_free(c);
+	return r >= 0;
+}
+
+const char *dkim_msg_body_hash(dkim *d, mime_msg *m, int wrap) {
+	int key = wrap * 2 + d->body_canon;
+	char bh[DKIM_HASH_SIZE];
+
+	if(m->body_digest && m->body_digest_key == key)
+		return m->body_digest;
+
+	dkim_body *b = dkim_body_new(d->body_canon);
+	int ok = dkim__render(m, wrap, NULL, b);
+	dkim_body_final(b, bh);
+	if(!ok)
+		return NULL;
+	if(m->body_digest)
+		free(m->body_digest);
+	m->body_digest = strdup(bh);
+	m->body_digest_key = key;
+	return m->body_digest;
+}
+
+int dkim_sign_msg(dkim *d, mime_msg *m, int wrap) {
+	mimemsg_remove_header(m, DKIM_HEADER);
+
+	const char *bh = dkim_msg_body_hash(d, m, wrap);
+	if(!bh)
+		return 0;
+	buffer_ctx *hdr = buffer_new(0), *sig = buffer_new(0);
+	int ok = dkim__render(m, wrap, hdr, NULL) &&
+		dkim_sign_header(d, buffer_data(hdr), buffer_length(hdr), bh, sig) &&
+		mimemsg_set_header_first(m, DKIM_HEADER, buffer_cstr(sig));
+	buffer_free(hdr);
+	buffer_free(sig);
+	return ok;
+}
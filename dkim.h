@@ -0,0 +1,48 @@
+#ifndef _DKIM_H
+#	define _DKIM_H
+
+#include "buffer.h"
+#include "mime.h"
+
+// DKIM signing (RFC 6376), rsa-sha256 with relaxed header and relaxed or
+// simple body canonicalization. The body hash is computed while the body
+// streams by, so nothing is buffered but the header block. A message
+// sent out many times with different headers hashes its body once: the
+// hash stays in the mime_msg until its parts change, and every signature
+// after the first only hashes the headers.
+
+#define DKIM_BODY_SIMPLE	(0)
+#define DKIM_BODY_RELAXED	(1)
+
+#define DKIM_HEADER		"DKIM-Signature"
+// base64 SHA-256 with its terminating zero
+#define DKIM_HASH_SIZE		(48)
+
+typedef struct dkim dkim;
+typedef struct dkim_body dkim_body;
+
+// key_file is a PEM private key. Returns NULL if it cannot be loaded.
+dkim *dkim_new(const char *domain, const char *selector,
+		const char *key_file, int body_canon);
+void dkim_free(dkim *d);
+
+// Incremental body hash: feed the body as it goes on the wire (CRLF
+// lines, before dot-stuffing) in pieces of any size.
+dkim_body *dkim_body_new(int body_canon);
+void dkim_body_update(dkim_body *b, const void *buf, long len);
+// Writes the base64 hash into bh and frees b.
+void dkim_body_final(dkim_body *b, char *bh);
+
+// Signs the header block hdr (CRLF lines, the blank line after them may
+// be included) for the body hash bh. Puts the folded value of the
+// DKIM-Signature header into out. Returns 0 if there is no From header or signing fails.
+int dkim_sign_header(dkim *d, const char *hdr, long len, const char *bh,
+		buffer_ctx *out);
+
+// Body hash of m as rendered with wrap, kept in m for the next call.
+const char *dkim_msg_body_hash(dkim *d, mime_msg *m, int wrap);
+// Signs m as rendered with wrap and sets its DKIM-Signature header,
+// replacing the one of an earlier call.
+int dkim_sign_msg(dkim *d, mime_msg *m, int wrap);
+
+#endif
@@ -5,7 +5,11 @@
 #include <string.h>
 #include <strings.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "buffer.h"
 #include "mime.h"
+#include "probes.h"
 
 mime_msg *mimemsg_new() {
 	mime_msg *m = (mime_msg *)malloc(sizeof(mime_msg));
@@ -34,11 +38,16 @@ void mimemsg_free(mime_msg *m) {
 	}
 
 	if(m->boundary) free(m->boundary);
+	if(m->body_digest) free(m->body_digest);
 
 	free(m);
 }
 
 int mimemsg_add_part(mime_msg *m, mime_part *part) {
+	if(m->body_digest) {
+		free(m->body_digest);
+		m->body_digest = NULL;
+	}
 	part->next = NULL;
 	if(m->part_tail) {
 		m->part_tail->next = part;
@@ -75,6 +84,41 @@ int mimemsg_set_header(mime_msg *m, const char *key, const char *value) {
 	return ++m->n_heads;
 }
 
+int mimemsg_set_header_first(mime_msg *m, const char *key,
+		const char *value) {
+	mimemsg_remove_header(m, key);
+
+	mime_header *h = (mime_header *)malloc(sizeof(mime_header));
+	h->key = strdup(key);
+	h->value = strdup(value);
+	h->next = m->header_head;
+	m->header_head = h;
+	if(!m->header_tail)
+		m->header_tail = h;
+
+	return ++m->n_heads;
+}
+
+int mimemsg_remove_header(mime_msg *m, const char *key) {
+	mime_header *h, *prev = NULL;
+	for(h = m->header_head; h; prev = h, h = h->next) {
+		if(strcasecmp(h->key, key) != 0)
+			continue;
+		if(prev)
+			prev->next = h->next;
+		else
+			m->header_head = h->next;
+		if(m->header_tail == h)
+			m->header_tail = prev;
+		free(h->key);
+		free(h->value);
+		free(h);
+		m->n_heads--;
+		return 1;
+	}
+	return 0;
+}
+
 int mimemsg_set_boundary(mime_msg *m, const char *boundary) {
 	static int sranded = 0;
 	static const char *randchars = 
@@ -82,6 +126,10 @@ int mimemsg_set_boundary(mime_msg *m, const char *boundary) {
 	static const char *randprefix = "BOUNDARY-";
 
 	if(m->boundary) free(m->boundary);
+	if(m->body_digest) {
+		free(m->body_digest);
+		m->body_digest = NULL;
+	}
 
 	if(boundary) {
 		m->boundary = strdup(boundary);
@@ -125,7 +173,10 @@ static int mimemsg__write_boundary(mime_msg *m, int lastpart,
 	return 1;
 }
 
-static int mimemsg__real_write_stream(mime_msg *m,
+typedef int (* mimemsg__part_func)
+	(mime_part *p, mime_stream_write_func writer, void *ctx);
+
+static int mimemsg__real_write_stream(mime_msg *m, mimemsg__part_func part,
 		mime_stream_write_func writer, void *ctx) {
 	if(!m->boundary)
 		mimemsg_set_boundary(m, NULL);
@@ -138,7 +189,7 @@ static int mimemsg__real_write_stream(mime_msg *m,
 
 	mime_part *p = m->part_head;
 	if(m->n_parts == 1) {
-		mimepart_write_stream(p, writer, ctx);
+		part(p, writer, ctx);
 		mime__write_string(writer, ctx, "\r\n");
 	} else if(m->n_parts > 1) {
 		mime__write_strings(writer, ctx,
@@ -146,7 +197,7 @@ static int mimemsg__real_write_stream(mime_msg *m,
 			m->boundary, "\"\r\n\r\n", NULL);
 		for(; p; p = p->next) {
 			mimemsg__write_boundary(m, 0, writer, ctx);
-			mimepart_write_stream(p, writer, ctx);
+			part(p, writer, ctx);
 			mime__write_string(writer, ctx, "\r\n");
 		}
 		mimemsg__write_boundary(m, 1, writer, ctx);
@@ -165,6 +216,7 @@ typedef struct _mimemsg_wrapper {
 static int mimemsg__wrapper(void *ctx, const void *buf, int len) {
 	_mimemsg_wrapper *w = (_mimemsg_wrapper *)ctx;
 
+	PROBE(wrap, w, len);
 	while(w->len > 0 || len > 0) {
 		if(len > 0) {
 			// fill buffer to wrap length
@@ -226,7 +278,8 @@ int mimemsg_write_line(mime_msg *m, int wrap,
 	w.len = 0;
 	w.wrap = wrap;
 
-	int ret = mimemsg__real_write_stream(m, &mimemsg__wrapper, &w);
+	int ret = mimemsg__real_write_stream(m, &mimepart_write_stream,
+			&mimemsg__wrapper, &w);
 
 	// flush buffer
 	if(w.len)
@@ -235,3 +288,349 @@ int mimemsg_write_line(mime_msg *m, int wrap,
 	free(w.buffer);
 	return ret;
 }
+
+/*** Size calculation ***/
+static int mimemsg__count_line(void *ctx, const void *buf, int len) {
+	*(long *)ctx += len + 2;
+	return 1;
+}
+
+static int mimemsg__size_part(mime_part *p,
+		mime_stream_write_func writer, void *ctx) {
+	_mimemsg_wrapper *w = (_mimemsg_wrapper *)ctx;
+	long blen = mimepart_body_length(p);
+
+	if(blen < 0 || !p->header_writer)
+		return mimepart_write_stream(p, writer, ctx);
+
+	// The header ends with a blank line, so the body starts on a fresh
+	// line: every full run of wrap octets becomes one line, and the
+	// remainder is fed through the wrapper to keep its state exact.
+	p->header_writer(p, writer, ctx);
+	assert(w->len == 0);
+	*(long *)w->orig_ctx += (blen / w->wrap) * (w->wrap + 2);
+
+	static const char filler[64] =
+		"AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA";
+	int remain = blen % w->wrap;
+	while(remain > 0) {
+		int n = remain > sizeof(filler) ? sizeof(filler) : remain;
+		writer(ctx, filler, n);
+		remain -= n;
+	}
+	return 1;
+}
+
+long mimemsg_get_size(mime_msg *m, int wrap) {
+	long size = 0;
+	_mimemsg_wrapper w;
+	w.orig_writer = &mimemsg__count_line;
+	w.orig_ctx = &size;
+	w.buffer = (char *)malloc(wrap + 1);
+	w.len = 0;
+	w.wrap = wrap;
+
+	mimemsg__real_write_stream(m, &mimemsg__size_part,
+			&mimemsg__wrapper, &w);
+
+	if(w.len)
+		mimemsg__count_line(&size, w.buffer, w.len);
+
+	free(w.buffer);
+	return size;
+}
+
+/*** Cursor ***/
+enum {
+	MIMECURSOR_HEADERS,
+	MIMECURSOR_MULTIPART,
+	MIMECURSOR_BOUNDARY,
+	MIMECURSOR_PART_HEADER,
+	MIMECURSOR_PART_BODY,
+	MIMECURSOR_PART_CACHED,
+	MIMECURSOR_PART_FILE,
+	MIMECURSOR_PART_END,
+	MIMECURSOR_CLOSE,
+	MIMECURSOR_FLUSH,
+	MIMECURSOR_DONE
+};
+
+struct mime_cursor {
+	mime_msg *m;
+	int flags;
+	int state;
+	mime_header *header;
+	mime_part *part;
+	long offset;		// position in the encoded body of part
+	_mimemsg_wrapper w;	// keeps the partial line between calls
+	buffer_ctx *out;	// finished lines not yet handed out
+};
+
+static int mimecursor__line(void *ctx, const void *buf, int len) {
+	mime_cursor *c = (mime_cursor *)ctx;
+	if((c->flags & MIMECURSOR_DOT_STUFF) && len > 0 &&
+			((const char *)buf)[0] == '.')
+		buffer_append(c->out, ".", 1);
+	buffer_append(c->out, (const char *)buf, len);
+	buffer_append(c->out, "\r\n", 2);
+	return 1;
+}
+
+mime_cursor *mimecursor_new(mime_msg *m, int wrap, int flags) {
+	mime_cursor *c = (mime_cursor *)malloc(sizeof(mime_cursor));
+	memset(c, 0, sizeof(mime_cursor));
+
+	if(!m->boundary)
+		mimemsg_set_boundary(m, NULL);
+
+	c->m = m;
+	c->flags = flags;
+	c->state = MIMECURSOR_HEADERS;
+	c->header = m->header_head;
+	c->w.orig_writer = &mimecursor__line;
+	c->w.orig_ctx = c;
+	c->w.buffer = (char *)malloc(wrap + 1);
+	c->w.wrap = wrap;
+	c->out = buffer_new(MIMECURSOR_CHUNK * 2);
+	return c;
+}
+
+void mimecursor_free(mime_cursor *c) {
+	assert(c);
+	free(c->w.buffer);
+	buffer_free(c->out);
+	free(c);
+}
+
+int mimecursor_done(mime_cursor *c) {
+	return c->state == MIMECURSOR_DONE && buffer_length(c->out) == 0;
+}
+
+// Moves on after the line break closing a part.
+static void mimecursor__next_part(mime_cursor *c) {
+	c->part = c->part->next;
+	if(c->m->n_parts == 1)
+		c->state = MIMECURSOR_FLUSH;
+	else if(c->part)
+		c->state = MIMECURSOR_BOUNDARY;
+	else
+		c->state = MIMECURSOR_CLOSE;
+}
+
+// Renders the next piece of the message into c->out. Each step produces
+// at most about MIMECURSOR_CHUNK bytes, mirroring
+// mimemsg__real_write_stream().
+static int mimecursor__step(mime_cursor *c) {
+	mime_stream_write_func wr = &mimemsg__wrapper;
+	mime_msg *m = c->m;
+
+	switch(c->state) {
+		case MIMECURSOR_HEADERS:
+			if(c->header) {
+				mime__write_strings(wr, &c->w, c->header->key, ": ",
+						c->header->value, "\r\n", NULL);
+				c->header = c->header->next;
+				break;
+			}
+			c->part = m->part_head;
+			if(m->n_parts == 1)
+				c->state = MIMECURSOR_PART_HEADER;
+			else if(m->n_parts > 1)
+				c->state = MIMECURSOR_MULTIPART;
+			else
+				c->state = MIMECURSOR_FLUSH;
+			break;
+		case MIMECURSOR_MULTIPART:
+			mime__write_strings(wr, &c->w,
+				"Content-Type: multipart/mixed; boundary=\"",
+				m->boundary, "\"\r\n\r\n", NULL);
+			c->state = MIMECURSOR_BOUNDARY;
+			break;
+		case MIMECURSOR_BOUNDARY:
+			mimemsg__write_boundary(m, 0, wr, &c->w);
+			c->state = MIMECURSOR_PART_HEADER;
+			break;
+		case MIMECURSOR_PART_HEADER:
+			c->offset = 0;
+			if(c->part->header_writer && c->part->cache_len > 0 &&
+					c->part->cache_wrap == c->w.wrap) {
+				// the caller sends a file itself, there is nothing to time
+				if(!(c->flags & MIMECURSOR_FILES))
+					PROBE_ENTER(part, c->part, 0);
+				c->part->header_writer(c->part, wr, &c->w);
+				// the header ends with a line break, nothing is pending
+				assert(c->w.len == 0);
+				c->state = (c->flags & MIMECURSOR_FILES) ?
+					MIMECURSOR_PART_FILE : MIMECURSOR_PART_CACHED;
+			} else if(c->part->header_writer && c->part->reader) {
+				PROBE_ENTER(part, c->part, 0);
+				c->part->header_writer(c->part, wr, &c->w);
+				c->state = MIMECURSOR_PART_BODY;
+			} else {
+				// parts without pull access are rendered in one go
+				mimepart_write_stream(c->part, wr, &c->w);
+				c->state = MIMECURSOR_PART_END;
+			}
+			break;
+		case MIMECURSOR_PART_BODY: {
+			char buf[MIMECURSOR_CHUNK];
+			int r = mimepart_read(c->part, c->offset, buf, sizeof(buf));
+			if(r < 0)
+				return -1;
+			if(r == 0) {
+				PROBE_RETURN(part, c->part, c->offset);
+				c->state = MIMECURSOR_PART_END;
+				break;
+			}
+			mimemsg__wrapper(&c->w, buf, r);
+			c->offset += r;
+			break;
+		}
+		case MIMECURSOR_PART_CACHED: {
+			long remain = c->part->cache_len - c->offset;
+			if(remain <= 0) {
+				PROBE_RETURN(part, c->part, c->offset);
+				mimecursor__next_part(c);
+				break;
+			}
+			if(remain > MIMECURSOR_CHUNK) remain = MIMECURSOR_CHUNK;
+			char *buf = buffer_reserve(c->out, remain);
+			int r = pread(c->part->cache_fd, buf, remain, c->offset);
+			if(r <= 0)
+				return -1;
+			buffer_commit(c->out, r);
+			c->offset += r;
+			break;
+		}
+		case MIMECURSOR_PART_FILE:
+			// waits for mimecursor_skip_file()
+			return 0;
+		case MIMECURSOR_PART_END:
+			mime__write_string(wr, &c->w, "\r\n");
+			mimecursor__next_part(c);
+			break;
+		case MIMECURSOR_CLOSE:
+			mimemsg__write_boundary(m, 1, wr, &c->w);
+			c->state = MIMECURSOR_FLUSH;
+			break;
+		case MIMECURSOR_FLUSH:
+			if(c->w.len)
+				mimecursor__line(c, c->w.buffer, c->w.len);
+			c->w.len = 0;
+			c->state = MIMECURSOR_DONE;
+			break;
+	}
+	return 1;
+}
+
+int mimecursor_read(mime_cursor *c, void *buf, int len) {
+	int done = 0;
+	while(done < len) {
+		int avail = buffer_length(c->out);
+		if(avail > 0) {
+			if(avail > len - done) avail = len - done;
+			memcpy(&((char *)buf)[done], buffer_data(c->out), avail);
+			buffer_shift(c->out, avail);
+			done += avail;
+			continue;
+		}
+		if(c->state == MIMECURSOR_DONE)
+			break;
+		int r = mimecursor__step(c);
+		if(r < 0)
+			return done > 0 ? done : -1;
+		if(r == 0)
+			break;
+	}
+	return done;
+}
+
+int mimecursor_file(mime_cursor *c, int *fd, long *offset, long *len) {
+	if(c->state != MIMECURSOR_PART_FILE || buffer_length(c->out) > 0)
+		return 0;
+	*fd = c->part->cache_fd;
+	*offset = 0;
+	*len = c->part->cache_len;
+	return 1;
+}
+
+void mimecursor_skip_file(mime_cursor *c) {
+	if(c->state == MIMECURSOR_PART_FILE)
+		mimecursor__next_part(c);
+}
+
+/*** Body cache ***/
+typedef struct _mimepart_cache_writer {
+	int fd;
+	buffer_ctx *buf;
+	int error;
+} _mimepart_cache_writer;
+
+static int mimepart__cache_flush(_mimepart_cache_writer *cw) {
+	const char *data = buffer_data(cw->buf);
+	int len = buffer_length(cw->buf), done = 0;
+	while(done < len) {
+		int w = write(cw->fd, &data[done], len - done);
+		if(w <= 0) {
+			cw->error = 1;
+			break;
+		}
+		done += w;
+	}
+	buffer_reset(cw->buf);
+	return !cw->error;
+}
+
+static int mimepart__cache_line(void *ctx, const void *buf, int len) {
+	_mimepart_cache_writer *cw = (_mimepart_cache_writer *)ctx;
+	buffer_append(cw->buf, (const char *)buf, len);
+	buffer_append(cw->buf, "\r\n", 2);
+	if(buffer_length(cw->buf) >= MIMECURSOR_CHUNK * 16)
+		mimepart__cache_flush(cw);
+	return 1;
+}
+
+int mimepart_cache(mime_part *p, int wrap, int fd) {
+	struct stat st;
+
+	if(p->transfer_encoding != MIME_TRANSFER_ENCODING_BASE64 ||
+			!p->reader || fstat(fd, &st) < 0)
+		return 0;
+
+	if(st.st_size == 0) {
+		_mimepart_cache_writer cw;
+		_mimemsg_wrapper w;
+		char buf[MIMECURSOR_CHUNK];
+		long offset = 0;
+		int r;
+
+		cw.fd = fd;
+		cw.buf = buffer_new(MIMECURSOR_CHUNK * 16);
+		cw.error = 0;
+		w.orig_writer = &mimepart__cache_line;
+		w.orig_ctx = &cw;
+		w.buffer = (char *)malloc(wrap + 1);
+		w.len = 0;
+		w.wrap = wrap;
+
+		while((r = mimepart_read(p, offset, buf, sizeof(buf))) > 0) {
+			mimemsg__wrapper(&w, buf, r);
+			offset += r;
+		}
+		// the line break that closes the part in the message
+		mimemsg__wrapper(&w, "\r\n", 2);
+		if(w.len)
+			mimepart__cache_line(&cw, w.buffer, w.len);
+		mimepart__cache_flush(&cw);
+
+		free(w.buffer);
+		buffer_free(cw.buf);
+		if(r < 0 || cw.error || fstat(fd, &st) < 0)
+			return 0;
+	}
+
+	p->cache_fd = fd;
+	p->cache_wrap = wrap;
+	p->cache_len = st.st_size;
+	return 1;
+}
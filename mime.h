@@ -10,6 +10,8 @@ typedef int (* mime_stream_write_func) (void *ctx, const void *buf, int len);
 typedef int (* mime_line_write_func) (void *ctx, const void *buf, int len);
 typedef int (* mimepart_stream_write_func)
 	(struct mime_part *p, mime_stream_write_func writer, void *ctx);
+typedef int (* mimepart_read_func)
+	(struct mime_part *p, long offset, void *buf, int len);
 
 typedef struct mime_part {
 	struct mime_part *next;
@@ -19,6 +21,22 @@ typedef struct mime_part {
 	void *writer_ctx;
 	mimepart_stream_write_func writer;
 
+	// Writes only the part headers, including the blank line after them.
+	mimepart_stream_write_func header_writer;
+	// Length of the encoded body when it is one unbroken run (no line
+	// breaks, spaces or leading dots), or -1 if it has to be rendered to
+	// be measured. May be NULL.
+	long (*body_length) (struct mime_part *);
+	// Pull access to the encoded body: copies up to len bytes starting at
+	// offset, returns 0 at the end and < 0 on error. May be NULL.
+	mimepart_read_func reader;
+
+	// Body already rendered for wrap cache_wrap (lines ending in CRLF,
+	// including the line closing the part) in cache_fd, which stays owned
+	// by the caller. cache_len is 0 when there is no cache.
+	int cache_fd, cache_wrap;
+	long cache_len;
+
 	void (*free) (struct mime_part *);
 } mime_part;
 
@@ -34,6 +52,11 @@ typedef struct {
 	mime_header *header_head, *header_tail;
 	int n_heads;
 	char *boundary;
+
+	// Body hash kept by a signer (dkim.c) for the render its key names;
+	// adding a part or setting the boundary drops it.
+	char *body_digest;
+	int body_digest_key;
 } mime_msg;
 
 
@@ -42,16 +65,53 @@ void mimemsg_free(mime_msg *m);
 
 int mimemsg_add_part(mime_msg *m, mime_part *part);
 int mimemsg_set_header(mime_msg *m, const char *key, const char *value);
+// Like mimemsg_set_header(), but the header goes first.
+int mimemsg_set_header_first(mime_msg *m, const char *key, const char *value);
+int mimemsg_remove_header(mime_msg *m, const char *key);
 int mimemsg_set_boundary(mime_msg *m, const char *boundary);
 
 int mimemsg_write_line(mime_msg *m, int wrap,
 		mime_line_write_func writer, void *ctx);
 
+// Exact number of octets mimemsg_write_line() will produce with the given
+// wrap, counting CRLF after each line (RFC 1870 message size).
+long mimemsg_get_size(mime_msg *m, int wrap);
+
+
+// Freed parts are kept on a per-thread freelist for reuse.
+#define MIMEPART_POOL_SIZE	(16)
+
+// Resumable renderer: produces the same octets as mimemsg_write_line()
+// piece by piece, so a caller can stop whenever its socket is full.
+#define MIMECURSOR_DOT_STUFF	(1 << 0)	// double leading dots for DATA
+#define MIMECURSOR_FILES	(1 << 1)	// hand out cached bodies as files
+#define MIMECURSOR_CHUNK	(4096)
+
+typedef struct mime_cursor mime_cursor;
+
+mime_cursor *mimecursor_new(mime_msg *m, int wrap, int flags);
+void mimecursor_free(mime_cursor *c);
+// Fills buf with up to len bytes of CRLF terminated lines; returns the
+// number of bytes filled, 0 once the whole message has been produced.
+int mimecursor_read(mime_cursor *c, void *buf, int len);
+int mimecursor_done(mime_cursor *c);
+// With MIMECURSOR_FILES, mimecursor_read() stops in front of a cached
+// body; this returns 1 and its file region, which can be sent unchanged
+// (e.g. with sendfile). mimecursor_skip_file() then moves past it.
+int mimecursor_file(mime_cursor *c, int *fd, long *offset, long *len);
+void mimecursor_skip_file(mime_cursor *c);
 
 mime_part *mimepart_new_plain(const char *str);
 mime_part *mimepart_new_attachment(const char *path);
 void mimepart_free(mime_part *p);
+void mimepart_pool_clear();
 int mimepart_write_stream(mime_part *m,
 		mime_stream_write_func writer, void *ctx);
+long mimepart_body_length(mime_part *p);
+int mimepart_read(mime_part *p, long offset, void *buf, int len);
+// Renders the encoded body for the given wrap into fd, unless fd already
+// has content, and uses it from then on. Only base64 parts can be cached,
+// their lines never need dot-stuffing.
+int mimepart_cache(mime_part *p, int wrap, int fd);
 
 #endif
@@ -5,17 +5,38 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/uio.h>
 #include <unistd.h>
 #include "mime.h"
 #include "base64.h"
+#include "probes.h"
+
+static __thread mime_part *mimepart__pool[MIMEPART_POOL_SIZE];
+static __thread int mimepart__pool_len;
 
 static mime_part *mimepart__alloc() {
-	mime_part *p = (mime_part *)malloc(sizeof(mime_part));
+	mime_part *p;
+	if(mimepart__pool_len > 0)
+		p = mimepart__pool[--mimepart__pool_len];
+	else
+		p = (mime_part *)malloc(sizeof(mime_part));
 	memset(p, 0, sizeof(mime_part));
 	return p;
 }
 
+static void mimepart__release(mime_part *p) {
+	if(mimepart__pool_len < MIMEPART_POOL_SIZE)
+		mimepart__pool[mimepart__pool_len++] = p;
+	else
+		free(p);
+}
+
+void mimepart_pool_clear() {
+	while(mimepart__pool_len > 0)
+		free(mimepart__pool[--mimepart__pool_len]);
+}
+
 static int mimepart__write_string(mime_stream_write_func writer, void *ctx,
 		const char *s) {
 	return writer(ctx, s, strlen(s));
@@ -57,29 +78,62 @@ void mimepart_free(mime_part *p) {
 
 int mimepart_write_stream(mime_part *p, 
 		mime_stream_write_func writer, void *ctx) {
-	return p->writer(p, writer, ctx);
+	PROBE_ENTER(part, p, 0);
+	int ret = p->writer(p, writer, ctx);
+	PROBE_RETURN(part, p, mimepart_body_length(p));
+	return ret;
+}
+
+int mimepart_read(mime_part *p, long offset, void *buf, int len) {
+	if(!p->reader)
+		return -1;
+	return p->reader(p, offset, buf, len);
+}
+
+long mimepart_body_length(mime_part *p) {
+	if(p->body_length)
+		return p->body_length(p);
+	return -1;
 }
 
 /*** Plain text ***/
 typedef struct _mimepart_plain {
 	char *str;
+	long len;
 } _mimepart_plain;
 
+static int mimepart__plain_header_writer(mime_part *p,
+		mime_stream_write_func writer, void *ctx) {
+	mimepart__write_stream_header(p, writer, ctx);
+	mimepart__write_string(writer, ctx, "\r\n");
+	return 1;
+}
+
 static int mimepart__plain_writer(mime_part *p,
 		mime_stream_write_func writer, void *ctx) {
 	_mimepart_plain *c = (_mimepart_plain *)p->writer_ctx;
 
-	mimepart__write_stream_header(p, writer, ctx);
-	mimepart__write_string(writer, ctx, "\r\n");
+	mimepart__plain_header_writer(p, writer, ctx);
 
-	return writer(ctx, c->str, strlen(c->str));
+	return writer(ctx, c->str, c->len);
+}
+
+static int mimepart__plain_reader(mime_part *p, long offset,
+		void *buf, int len) {
+	_mimepart_plain *c = (_mimepart_plain *)p->writer_ctx;
+	if(offset >= c->len)
+		return 0;
+	if(len > c->len - offset)
+		len = c->len - offset;
+	memcpy(buf, &c->str[offset], len);
+	return len;
 }
 
 void mimepart__plain_free(mime_part *p) {
 	_mimepart_plain *c = (_mimepart_plain *)p->writer_ctx;
 	free(c->str);
 	free(c);
-	free(p);
+	mimepart__release(p);
 }
 
 mime_part *mimepart_new_plain(const char *str) {
@@ -90,9 +144,12 @@ mime_part *mimepart_new_plain(const char *str) {
 
 	_mimepart_plain *ctx = (_mimepart_plain *)malloc(sizeof(_mimepart_plain));
 	ctx->str = strdup(str);
+	ctx->len = strlen(str);
 
 	p->writer_ctx = ctx;
 	p->writer = &mimepart__plain_writer;
+	p->header_writer = &mimepart__plain_header_writer;
+	p->reader = &mimepart__plain_reader;
 	p->free = &mimepart__plain_free;
 
 	return p;
@@ -128,7 +185,7 @@ int mimepart__attach_file_writer(void *ctx, const void *buf, int len) {
 	return fc->writer(fc->ctx, buf, len);
 }
 
-int mimepart__attach_writer(mime_part *p, 
+int mimepart__attach_header_writer(mime_part *p,
 		mime_stream_write_func writer, void *ctx) {
 	_mimepart_attach *att = (_mimepart_attach *)p->writer_ctx;
 
@@ -136,6 +193,47 @@ int mimepart__attach_writer(mime_part *p,
 	mimepart__write_strings(writer, ctx,
 			"Content-Disposition: attachment; filename=\"",
 			att->fn, "\"\r\n\r\n", NULL);
+	return 1;
+}
+
+long mimepart__attach_body_length(mime_part *p) {
+	_mimepart_attach *att = (_mimepart_attach *)p->writer_ctx;
+	struct stat st;
+
+	if(fstat(att->fd, &st) < 0)
+		return -1;
+	return (st.st_size + 2) / 3 * 4;
+}
+
+// Encodes from the file with pread(), so offset may be anywhere.
+int mimepart__attach_reader(mime_part *p, long offset, void *buf, int len) {
+	_mimepart_attach *att = (_mimepart_attach *)p->writer_ctx;
+	unsigned char rbuf[BASE64_BLOCK_BASE*3];
+	char wbuf[BASE64_BLOCK_BASE*4];
+	int skip = offset % 4;
+
+	int n = (len + skip + 3) / 4 * 3;
+	if(n > sizeof(rbuf)) n = sizeof(rbuf);
+	int r = pread(att->fd, rbuf, n, offset / 4 * 3);
+	if(r <= 0)
+		return r;
+
+	int wlen = sizeof(wbuf);
+	if(base64_encode(rbuf, r, wbuf, &wlen) < 0)
+		return -1;
+	if(wlen <= skip)
+		return 0;
+	if(len > wlen - skip)
+		len = wlen - skip;
+	memcpy(buf, &wbuf[skip], len);
+	return len;
+}
+
+int mimepart__attach_writer(mime_part *p, 
+		mime_stream_write_func writer, void *ctx) {
+	_mimepart_attach *att = (_mimepart_attach *)p->writer_ctx;
+
+	mimepart__attach_header_writer(p, writer, ctx);
 
 	lseek(att->fd, SEEK_SET, 0);
 
@@ -154,7 +252,7 @@ void mimepart__attach_free(mime_part *p) {
 	_mimepart_attach *ctx = (_mimepart_attach *)p->writer_ctx;
 	close(ctx->fd);
 	free(ctx);
-	free(p);
+	mimepart__release(p);
 }
 
 mime_part *mimepart_new_attachment(const char *path) {
@@ -173,6 +271,9 @@ mime_part *mimepart_new_attachment(const char *path) {
 	p->transfer_encoding = MIME_TRANSFER_ENCODING_BASE64;
 
 	p->writer = &mimepart__attach_writer;
+	p->header_writer = &mimepart__attach_header_writer;
+	p->body_length = &mimepart__attach_body_length;
+	p->reader = &mimepart__attach_reader;
 	p->writer_ctx = ctx;
 	p->free = &mimepart__attach_free;
 
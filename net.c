@@ -0,0 +1,186 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "net.h"
+
+static long net__now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+// Keeps MX preference groups in order and alternates address families
+// inside each group, starting with the family listed first.
+static int net__order(const resolver_result *res, const resolver_addr **out) {
+	char used[RESOLVER_MAX_ADDRS];
+	int i = 0, n = 0;
+
+	memset(used, 0, sizeof(used));
+	while(i < res->n_addrs) {
+		int end = i, k;
+		while(end < res->n_addrs &&
+				res->addrs[end].preference == res->addrs[i].preference)
+			end++;
+
+		int family = res->addrs[i].addr.ss_family;
+		int left = end - i;
+		for(; left > 0; left--) {
+			int pick = -1;
+			for(k = i; k < end; k++) {
+				if(used[k]) continue;
+				if(pick < 0) pick = k;
+				if(res->addrs[k].addr.ss_family == family) {
+					pick = k;
+					break;
+				}
+			}
+			used[pick] = 1;
+			out[n++] = &res->addrs[pick];
+			family = res->addrs[pick].addr.ss_family == AF_INET6 ?
+				AF_INET : AF_INET6;
+		}
+		i = end;
+	}
+	return n;
+}
+
+static int net__start(const resolver_addr *a) {
+	int fd = socket(a->addr.ss_family,
+			SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if(fd < 0)
+		return -1;
+	if(connect(fd, (const struct sockaddr *)&a->addr, a->addrlen) < 0 &&
+			errno != EINPROGRESS) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// End of the MX preference level that starts at order[i].
+static int net__level_end(const resolver_addr **order, int n, int i) {
+	int end = i;
+	while(end < n && order[end]->preference == order[i]->preference)
+		end++;
+	return end;
+}
+
+int net_connect(const resolver_result *res, int timeout) {
+	const resolver_addr *order[RESOLVER_MAX_ADDRS];
+	struct pollfd pfds[RESOLVER_MAX_ADDRS];
+	int n = net__order(res, order);
+	int i, next = 0, active = 0, fd = -1;
+	long now = net__now();
+	long deadline = timeout >= 0 ? now + timeout : -1;
+	long next_start = now;
+	int level_end = net__level_end(order, n, 0);
+	long level_deadline = level_end < n ? now + NET_LEVEL_TIMEOUT : -1;
+
+	while(fd < 0) {
+		now = net__now();
+		if(deadline >= 0 && now >= deadline)
+			break;
+
+		// a lower preference only once this level failed or timed out
+		if((next == level_end && active == 0) ||
+				(level_deadline >= 0 && now >= level_deadline)) {
+			if(level_end == n)
+				break;
+			for(i = 0; i < active; i++)
+				close(pfds[i].fd);
+			active = 0;
+			next = level_end;
+			level_end = net__level_end(order, n, next);
+			level_deadline = level_end < n ? now + NET_LEVEL_TIMEOUT : -1;
+			next_start = now;
+		}
+
+		// start the next attempt when it is due or nothing is in flight
+		if(next < level_end && (now >= next_start || active == 0)) {
+			int s = net__start(order[next++]);
+			if(s >= 0) {
+				pfds[active].fd = s;
+				pfds[active].events = POLLOUT;
+				pfds[active].revents = 0;
+				active++;
+				next_start = now + NET_ATTEMPT_DELAY;
+			}
+			continue;
+		}
+		if(active == 0)
+			continue;
+
+		int wait = -1;
+		if(next < level_end)
+			wait = next_start - now;
+		if(level_deadline >= 0 && (wait < 0 || level_deadline - now < wait))
+			wait = level_deadline - now;
+		if(deadline >= 0 && (wait < 0 || deadline - now < wait))
+			wait = deadline - now;
+		if(poll(pfds, active, wait) < 0) {
+			if(errno == EINTR) continue;
+			break;
+		}
+
+		for(i = 0; i < active; ) {
+			if(!pfds[i].revents) {
+				i++;
+				continue;
+			}
+
+			int err = 0;
+			socklen_t len = sizeof(err);
+			if(getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+				err = errno;
+			if(!err && fd < 0) {
+				fd = pfds[i].fd;
+			} else {
+				close(pfds[i].fd);
+				// a failure lets the next address start right away
+				next_start = now;
+			}
+			pfds[i] = pfds[--active];
+		}
+	}
+
+	for(i = 0; i < active; i++)
+		close(pfds[i].fd);
+	return fd;
+}
+
+int net_connect_unix(const char *path, int timeout) {
+	struct sockaddr_un sun;
+	if(strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0)
+		return -1;
+	// a non-blocking connect(2) fails right away on a full backlog, a
+	// blocking one waits for the send timeout
+	if(timeout >= 0) {
+		struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	}
+	if(connect(fd, (const struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
@@ -0,0 +1,24 @@
+#ifndef _NET_H
+#	define _NET_H
+
+#include "resolver.h"
+
+// RFC 8305 "Connection Attempt Delay"
+#define NET_ATTEMPT_DELAY	(250)
+// ms an MX preference level gets before the next one is tried
+#define NET_LEVEL_TIMEOUT	(5000)
+
+// Races connections to the resolved addresses (Happy Eyeballs, RFC 8305),
+// one MX preference level at a time (RFC 5321 5.1): address families
+// are interleaved within the level, a new attempt starts every
+// NET_ATTEMPT_DELAY ms or as soon as one fails, and the first
+// established socket wins. The next level is only tried once every
+// attempt at this one failed, or NET_LEVEL_TIMEOUT ran out. timeout is
+// the overall limit in ms (-1 for none). Returns a non-blocking socket,
+// or -1.
+int net_connect(const resolver_result *res, int timeout);
+// Connects to a local stream socket at path, waiting at most timeout ms
+// for a busy listener. Returns a non-blocking socket, or -1.
+int net_connect_unix(const char *path, int timeout);
+
+#endif
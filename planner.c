@@ -0,0 +1,157 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "planner.h"
+
+typedef struct planner__entry {
+	struct planner__entry *next;
+	char *name;
+	int value;	// recipient index, or group index for keys
+} planner__entry;
+
+static unsigned int planner__hash(const char *s) {
+	unsigned int h = 5381;
+	for(; *s; s++)
+		h = h * 33 + (unsigned char)*s;
+	return h;
+}
+
+static planner__entry **planner__find(planner__entry **table,
+		const char *name) {
+	planner__entry **pe = &table[planner__hash(name) % PLANNER_BUCKETS];
+	while(*pe && strcmp((*pe)->name, name) != 0)
+		pe = &(*pe)->next;
+	return pe;
+}
+
+static void planner__clear(planner__entry **table) {
+	int i;
+	for(i = 0; i < PLANNER_BUCKETS; i++)
+		while(table[i]) {
+			planner__entry *e = table[i];
+			table[i] = e->next;
+			free(e->name);
+			free(e);
+		}
+}
+
+static planner__entry *planner__insert(planner__entry **pe, const char *name,
+		int value) {
+	planner__entry *e = (planner__entry *)malloc(sizeof(planner__entry));
+	e->next = NULL;
+	e->name = strdup(name);
+	e->value = value;
+	*pe = e;
+	return e;
+}
+
+planner *planner_new() {
+	planner *p = (planner *)malloc(sizeof(planner));
+	memset(p, 0, sizeof(planner));
+	p->seen = (planner__entry **)calloc(PLANNER_BUCKETS,
+			sizeof(planner__entry *));
+	return p;
+}
+
+static void planner__free_groups(planner *p) {
+	int i;
+	for(i = 0; i < p->n_groups; i++) {
+		free(p->groups[i].key);
+		free(p->groups[i].domain);
+		free(p->groups[i].rcpts);
+	}
+	free(p->groups);
+	p->groups = NULL;
+	p->n_groups = 0;
+}
+
+void planner_free(planner *p) {
+	int i;
+	planner__free_groups(p);
+	for(i = 0; i < p->n_rcpts; i++)
+		free(p->rcpts[i]);
+	free(p->rcpts);
+	planner__clear(p->seen);
+	free(p->seen);
+	free(p);
+}
+
+const char *planner_domain(const char *addr, char *buf, int size) {
+	const char *at = strrchr(addr, '@');
+	int i = 0;
+	if(at)
+		for(at++; *at && *at != '>' && i < size - 1; at++)
+			buf[i++] = tolower((unsigned char)*at);
+	buf[i] = '\0';
+	return buf;
+}
+
+int planner_add(planner *p, const char *addr) {
+	// the local part is case sensitive (RFC 5321 2.4), the domain is not
+	char *canon = strdup(addr);
+	char *at = strrchr(canon, '@');
+	if(at)
+		for(; *at; at++)
+			*at = tolower((unsigned char)*at);
+
+	planner__entry **pe = planner__find(p->seen, canon);
+	if(*pe) {
+		free(canon);
+		return (*pe)->value;
+	}
+
+	if(p->n_rcpts == p->size) {
+		p->size = p->size ? p->size * 2 : 16;
+		p->rcpts = (char **)realloc(p->rcpts, p->size * sizeof(char *));
+	}
+	planner__insert(pe, canon, p->n_rcpts);
+	p->rcpts[p->n_rcpts] = strdup(addr);
+	free(canon);
+	return p->n_rcpts++;
+}
+
+int planner_plan(planner *p, int max_rcpts, planner_key_func key,
+		void *ctx) {
+	planner__entry **keys = (planner__entry **)calloc(PLANNER_BUCKETS,
+			sizeof(planner__entry *));
+	char domain[256];
+	int i, size = 0;
+
+	if(max_rcpts < 1)
+		max_rcpts = PLANNER_MAX_RCPTS;
+	planner__free_groups(p);
+
+	for(i = 0; i < p->n_rcpts; i++) {
+		planner_domain(p->rcpts[i], domain, sizeof(domain));
+		const char *k = key ? key(domain, ctx) : NULL;
+		if(!k)
+			k = domain;
+
+		// the key maps to its newest group, a full one starts another
+		planner__entry **pe = planner__find(keys, k);
+		planner_group *g = *pe ? &p->groups[(*pe)->value] : NULL;
+		if(!g || g->n_rcpts >= max_rcpts) {
+			if(p->n_groups == size) {
+				size = size ? size * 2 : 8;
+				p->groups = (planner_group *)realloc(p->groups,
+						size * sizeof(planner_group));
+			}
+			g = &p->groups[p->n_groups];
+			memset(g, 0, sizeof(planner_group));
+			g->key = strdup(k);
+			g->domain = strdup(domain);
+			g->rcpts = (int *)malloc(max_rcpts * sizeof(int));
+			if(*pe)
+				(*pe)->value = p->n_groups;
+			else
+				planner__insert(pe, k, p->n_groups);
+			p->n_groups++;
+		}
+		g->rcpts[g->n_rcpts++] = i;
+	}
+
+	planner__clear(keys);
+	free(keys);
+	return p->n_groups;
+}
@@ -0,0 +1,47 @@
+#ifndef _PLANNER_H
+#	define _PLANNER_H
+
+// Plans the transactions for a recipient list: duplicates are dropped,
+// recipients sharing a domain (or a key derived from it, such as the
+// mail exchanger) form one group that gets one copy of the body, and
+// groups are split to stay within a server's recipient limit.
+
+// RFC 5321 4.5.3.1.8: servers accept at least 100 recipients
+#define PLANNER_MAX_RCPTS	(100)
+#define PLANNER_BUCKETS		(1024)
+
+typedef struct planner_group {
+	char *key;		// domain, or what the key function made of it
+	char *domain;		// domain of the first recipient, for routing
+	int n_rcpts;
+	int *rcpts;		// indexes into planner.rcpts
+} planner_group;
+
+struct planner__entry;
+
+typedef struct planner {
+	int n_rcpts, size;
+	char **rcpts;		// unique, in order of appearance
+	int n_groups;
+	planner_group *groups;
+	struct planner__entry **seen;
+} planner;
+
+// Maps a domain to its grouping key, e.g. its MX; NULL keeps the domain.
+typedef const char *(* planner_key_func) (const char *domain, void *ctx);
+
+planner *planner_new();
+void planner_free(planner *p);
+
+// Adds "<local@domain>" unless it is already there (the domain is
+// compared without case). Returns its index in p->rcpts.
+int planner_add(planner *p, const char *addr);
+// Groups the recipients added so far, groups keep the order in which
+// their keys first appear. key may be NULL. Returns the group count.
+int planner_plan(planner *p, int max_rcpts, planner_key_func key,
+		void *ctx);
+
+// Domain of "<local@domain>" into buf, lowercased.
+const char *planner_domain(const char *addr, char *buf, int size);
+
+#endif
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "probes.h"
+
+int probes_rate;
+
+#define PROBES__NAME(name) #name,
+static const char *probes__names[PROBES_COUNT] = { PROBES_LIST(PROBES__NAME) };
+#undef PROBES__NAME
+
+// Estimates are scaled by the rate when a sample is taken, so they stay
+// right across probes_set_sampling() calls.
+static struct probes__counter {
+	long hits, octets;	// estimated
+	long samples, ns;	// spans: timed samples, their time
+	long est_ns;
+} probes__counters[PROBES_COUNT];
+
+static __thread int probes__countdown[PROBES_COUNT];
+static __thread int probes__rate[PROBES_COUNT];
+static __thread long probes__start[PROBES_COUNT];	// 0: not sampled
+
+static long probes__now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// 1 if this hit is a sample, remembering the rate it stands for.
+static int probes__sample(int id) {
+	int rate = __atomic_load_n(&probes_rate, __ATOMIC_RELAXED);
+	if(rate <= 0 || --probes__countdown[id] > 0)
+		return 0;
+	probes__countdown[id] = rate;
+	probes__rate[id] = rate;
+	return 1;
+}
+
+static void probes__count(int id, long octets) {
+	struct probes__counter *c = &probes__counters[id];
+	int rate = probes__rate[id];
+	__atomic_add_fetch(&c->hits, rate, __ATOMIC_RELAXED);
+	if(octets > 0)
+		__atomic_add_fetch(&c->octets, octets * rate, __ATOMIC_RELAXED);
+}
+
+void probes__hit(int id, long octets) {
+	if(probes__sample(id))
+		probes__count(id, octets);
+}
+
+void probes__enter(int id) {
+	probes__start[id] = probes__sample(id) ? probes__now_ns() : 0;
+}
+
+void probes__return(int id, long octets) {
+	struct probes__counter *c = &probes__counters[id];
+	long ns;
+
+	if(!probes__start[id])
+		return;
+	ns = probes__now_ns() - probes__start[id];
+	probes__start[id] = 0;
+	probes__count(id, octets);
+	__atomic_add_fetch(&c->samples, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->ns, ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->est_ns, ns * probes__rate[id], __ATOMIC_RELAXED);
+}
+
+void probes_set_sampling(int rate) {
+	__atomic_store_n(&probes_rate, rate > 0 ? rate : 0, __ATOMIC_RELAXED);
+}
+
+void probes_reset() {
+	memset(probes__counters, 0, sizeof(probes__counters));
+}
+
+void probes_report(FILE *f) {
+	int i;
+
+	fprintf(f, "%-12s %12s %14s %10s %10s\n", "probe", "hits", "octets",
+			"avg us", "total ms");
+	for(i = 0; i < PROBES_COUNT; i++) {
+		struct probes__counter *c = &probes__counters[i];
+		if(!c->hits)
+			continue;
+		fprintf(f, "%-12s %12ld %14ld", probes__names[i], c->hits, c->octets);
+		if(c->samples)
+			fprintf(f, " %10.2f %10.1f", c->ns / 1000.0 / c->samples,
+					c->est_ns / 1000000.0);
+		fputc('\n', f);
+	}
+}
@@ -0,0 +1,91 @@
+#ifndef _PROBES_H
+#	define _PROBES_H
+
+// Static tracepoints in the hot paths. Where <sys/sdt.h> is installed
+// (systemtap-sdt-dev) every probe is a USDT probe of the provider
+// smtpclient: a single nop in the code and a note in the binary, which
+// bpftrace or perf can switch on in a running process, e.g.
+//   bpftrace -e 'usdt:./client:smtpclient:reply_return { @[arg0] = count(); }'
+//   perf probe -x ./client sdt_smtpclient:write_return
+// Without it, or built with -DPROBES_NO_SDT, they compile to nothing.
+//
+// Probes come as points, or as spans with _enter and _return. Each
+// takes two arguments:
+//   phase		fd, command		a command is written, "MAIL" etc.
+//   reply		fd, 0 / code, octets	smtp__read_response()
+//   poll		fd, events / fd, ready
+//   read		fd, size / fd, result	read(2), tls_read()
+//   write		fd, size / fd, result	write(2), tls_write()
+//   writev		fd, pieces / fd, result
+//   sendfile		fd, size / fd, result	sendfile(2), tls_sendfile()
+//   pread		fd, size / fd, result	the copy fallback of sendfile
+//   ring		fd, entries / fd, ok	io_uring submit and wait
+//   write_line		fd, octets		smtp_write_line()
+//   wrap		wrapper, octets		mimemsg__wrapper()
+//   base64		context, 0 / context, octets out
+//   part		part, 0 / part, body octets	render of one MIME part
+//
+// Independent of that, probes_set_sampling() turns on counters: each
+// thread counts every rate-th hit of each probe, and times the spans it
+// counts. Off, a probe costs a load and a branch.
+
+#if !defined(PROBES_NO_SDT) && defined(__has_include)
+#	if __has_include(<sys/sdt.h>)
+#		include <sys/sdt.h>
+#		define PROBES_SDT
+#	endif
+#endif
+
+#include <stdio.h>
+
+#define PROBES_LIST(X) \
+	X(phase) X(reply) X(poll) X(read) X(write) X(writev) X(sendfile) \
+	X(pread) X(ring) X(write_line) X(wrap) X(base64) X(part)
+
+#define PROBES__ID(name) probe_##name,
+enum { PROBES_LIST(PROBES__ID) PROBES_COUNT };
+#undef PROBES__ID
+
+#ifdef PROBES_SDT
+#	define PROBES__SDT(name, a, b) DTRACE_PROBE2(smtpclient, name, a, b)
+#else
+#	define PROBES__SDT(name, a, b) do {} while(0)
+#endif
+
+extern int probes_rate;
+
+// Counts a hit; for PROBE_PHASE the octets are 0.
+#define PROBE(name, a, octets) do { \
+	PROBES__SDT(name, a, octets); \
+	if(__atomic_load_n(&probes_rate, __ATOMIC_RELAXED)) \
+		probes__hit(probe_##name, (long)(octets)); \
+} while(0)
+#define PROBE_PHASE(fd, command) do { \
+	PROBES__SDT(phase, fd, command); \
+	if(__atomic_load_n(&probes_rate, __ATOMIC_RELAXED)) \
+		probes__hit(probe_phase, 0); \
+} while(0)
+#define PROBE_ENTER(name, a, b) do { \
+	PROBES__SDT(name##_enter, a, b); \
+	if(__atomic_load_n(&probes_rate, __ATOMIC_RELAXED)) \
+		probes__enter(probe_##name); \
+} while(0)
+// octets are counted for spans too, which is the result for I/O
+#define PROBE_RETURN(name, a, octets) do { \
+	PROBES__SDT(name##_return, a, octets); \
+	if(__atomic_load_n(&probes_rate, __ATOMIC_RELAXED)) \
+		probes__return(probe_##name, (long)(octets)); \
+} while(0)
+
+void probes__hit(int id, long octets);
+void probes__enter(int id);
+void probes__return(int id, long octets);
+
+// Counts every rate-th hit of each probe per thread, 0 (the default)
+// turns counting off. Counts so far are kept, probes_reset() drops them.
+void probes_set_sampling(int rate);
+void probes_reset();
+// Hits and octets estimated from the samples, the time spans took.
+void probes_report(FILE *f);
+
+#endif
@@ -0,0 +1,141 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "ratelimit.h"
+
+void ratelimit_bucket_init(ratelimit_bucket *b, double rate, double burst) {
+	b->rate = rate;
+	b->burst = burst < 1 ? 1 : burst;
+	b->tokens = b->burst;
+	b->last = 0;
+}
+
+static void ratelimit__refill(ratelimit_bucket *b, long now) {
+	if(b->last && now > b->last) {
+		b->tokens += (now - b->last) * b->rate / 1000.0;
+		if(b->tokens > b->burst)
+			b->tokens = b->burst;
+	}
+	b->last = now;
+}
+
+long ratelimit_bucket_wait(ratelimit_bucket *b, double n, long now) {
+	if(b->rate <= 0)
+		return 0;
+	ratelimit__refill(b, now);
+	if(b->tokens >= n)
+		return 0;
+	return (long)((n - b->tokens) * 1000.0 / b->rate) + 1;
+}
+
+long ratelimit_bucket_take(ratelimit_bucket *b, double n, long now) {
+	long wait = ratelimit_bucket_wait(b, n, now);
+	if(wait == 0 && b->rate > 0)
+		b->tokens -= n;
+	return wait;
+}
+
+ratelimit *ratelimit_new(double msg_rate, double conn_rate, int max_window) {
+	ratelimit *rl = (ratelimit *)malloc(sizeof(ratelimit));
+	memset(rl, 0, sizeof(ratelimit));
+	rl->msg_rate = msg_rate;
+	rl->conn_rate = conn_rate;
+	rl->max_window = max_window < 1 ? 1 : max_window;
+	return rl;
+}
+
+void ratelimit_free(ratelimit *rl) {
+	int i;
+	for(i = 0; i < RATELIMIT_BUCKETS; i++) {
+		while(rl->dests[i]) {
+			ratelimit_dest *d = rl->dests[i];
+			rl->dests[i] = d->next;
+			free(d->name);
+			free(d);
+		}
+	}
+	free(rl);
+}
+
+ratelimit_dest *ratelimit_get(ratelimit *rl, const char *name) {
+	unsigned int h = 5381;
+	const char *p;
+	for(p = name; *p; p++)
+		h = h * 33 + tolower((unsigned char)*p);
+
+	ratelimit_dest **pd = &rl->dests[h % RATELIMIT_BUCKETS];
+	for(; *pd; pd = &(*pd)->next)
+		if(strcasecmp((*pd)->name, name) == 0)
+			return *pd;
+
+	ratelimit_dest *d = (ratelimit_dest *)malloc(sizeof(ratelimit_dest));
+	memset(d, 0, sizeof(ratelimit_dest));
+	d->name = strdup(name);
+	// a second's worth of burst
+	ratelimit_bucket_init(&d->conns, rl->conn_rate, rl->conn_rate);
+	ratelimit_bucket_init(&d->msgs, rl->msg_rate, rl->msg_rate);
+	d->window = RATELIMIT_MIN_WINDOW;
+	*pd = d;
+	return d;
+}
+
+long ratelimit_connect(ratelimit *rl, ratelimit_dest *d, long now) {
+	long wait, w;
+
+	// a full window waits for a reply, about one latency
+	if(d->active >= (int)d->window)
+		return d->latency_us > 1000 ? (long)(d->latency_us / 1000) : 1;
+
+	wait = ratelimit_bucket_wait(&d->conns, 1, now);
+	w = ratelimit_bucket_wait(&d->msgs, 1, now);
+	if(w > wait)
+		wait = w;
+	if(wait)
+		return wait;
+
+	ratelimit_bucket_take(&d->conns, 1, now);
+	ratelimit_bucket_take(&d->msgs, 1, now);
+	d->active++;
+	return 0;
+}
+
+long ratelimit_message(ratelimit *rl, ratelimit_dest *d, long now) {
+	return ratelimit_bucket_take(&d->msgs, 1, now);
+}
+
+void ratelimit_done(ratelimit_dest *d) {
+	if(d->active > 0)
+		d->active--;
+}
+
+void ratelimit_feedback(ratelimit *rl, ratelimit_dest *d, int code,
+		long latency_us, long now) {
+	int slow = 0;
+
+	if(latency_us > 0) {
+		// EWMA with gain 1/8, as for TCP's smoothed RTT
+		if(d->latency_us == 0)
+			d->latency_us = latency_us;
+		else
+			d->latency_us += (latency_us - d->latency_us) / 8;
+		if(d->best_us == 0 || d->latency_us < d->best_us)
+			d->best_us = d->latency_us;
+		slow = d->latency_us > d->best_us * RATELIMIT_SLOW_FACTOR;
+	}
+
+	if((code >= 400 && code < 500) || slow) {
+		// one decrease per latency, a burst of 451s is one signal
+		if(now - d->last_decrease >= d->latency_us / 1000) {
+			d->window /= 2;
+			if(d->window < RATELIMIT_MIN_WINDOW)
+				d->window = RATELIMIT_MIN_WINDOW;
+			d->last_decrease = now;
+		}
+	} else if(code >= 200 && code < 300) {
+		d->window += 1.0 / d->window;
+		if(d->window > rl->max_window)
+			d->window = rl->max_window;
+	}
+}
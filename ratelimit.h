@@ -0,0 +1,67 @@
+#ifndef _RATELIMIT_H
+#	define _RATELIMIT_H
+
+// Per-destination pacing: token buckets for new connections and for
+// messages per second, and a concurrency window adjusted AIMD-style
+// from the replies. The window grows by about one connection per
+// window's worth of fast 2xx replies and is halved (at most once per
+// reply latency) on 421/4xx or when replies get much slower than the
+// fastest seen. Times are monotonic milliseconds given by the caller.
+// The window only limits callers that hold several connections to a
+// destination at once, like smtpclient's workers. The client's spool
+// runner opens one at a time, so there the buckets do the pacing.
+
+#define RATELIMIT_BUCKETS	(256)
+#define RATELIMIT_MIN_WINDOW	(1.0)
+// smoothed latency above this multiple of the best one counts as
+// congestion
+#define RATELIMIT_SLOW_FACTOR	(2.0)
+
+typedef struct ratelimit_bucket {
+	double rate;		// tokens per second, <= 0 for unlimited
+	double burst;
+	double tokens;
+	long last;
+} ratelimit_bucket;
+
+void ratelimit_bucket_init(ratelimit_bucket *b, double rate, double burst);
+// Takes n tokens. Returns 0, or the ms until they are there (nothing
+// is taken then).
+long ratelimit_bucket_take(ratelimit_bucket *b, double n, long now);
+long ratelimit_bucket_wait(ratelimit_bucket *b, double n, long now);
+
+typedef struct ratelimit_dest {
+	struct ratelimit_dest *next;
+	char *name;
+	ratelimit_bucket conns, msgs;
+	double window;		// allowed concurrent connections
+	int active;
+	double latency_us;	// smoothed reply latency
+	double best_us;		// lowest smoothed latency seen
+	long last_decrease;
+} ratelimit_dest;
+
+typedef struct ratelimit {
+	double msg_rate, conn_rate;	// per destination, <= 0 unlimited
+	int max_window;
+	ratelimit_dest *dests[RATELIMIT_BUCKETS];
+} ratelimit;
+
+ratelimit *ratelimit_new(double msg_rate, double conn_rate, int max_window);
+void ratelimit_free(ratelimit *rl);
+// Finds or creates the state for a destination (domain or host).
+ratelimit_dest *ratelimit_get(ratelimit *rl, const char *name);
+
+// A new connection carrying one message: needs a free slot in the
+// window and both tokens. Returns 0 when granted (release it with
+// ratelimit_done()), or the ms to wait.
+long ratelimit_connect(ratelimit *rl, ratelimit_dest *d, long now);
+// One more message on an open connection.
+long ratelimit_message(ratelimit *rl, ratelimit_dest *d, long now);
+void ratelimit_done(ratelimit_dest *d);
+
+// Reports a reply: its code and latency (latency_us <= 0: no sample).
+void ratelimit_feedback(ratelimit *rl, ratelimit_dest *d, int code,
+		long latency_us, long now);
+
+#endif
@@ -0,0 +1,121 @@
+#include <string.h>
+
+#ifdef __SSE2__
+#	include <emmintrin.h>
+#endif
+
+#include "rawmsg.h"
+
+// Line ends are the only places that need work, so the scan looks for
+// '\n' 16 bytes at a time and copies everything in between untouched.
+static const char *rawmsg__find_lf(const char *p, const char *e) {
+#ifdef __SSE2__
+	const __m128i lf = _mm_set1_epi8('\n');
+	while(e - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+		if(mask)
+			return p + __builtin_ctz(mask);
+		p += 16;
+	}
+#endif
+	const char *lf_pos = (const char *)memchr(p, '\n', e - p);
+	return lf_pos ? lf_pos : e;
+}
+
+void rawmsg_init(rawmsg_state *st, int flags) {
+	st->flags = flags;
+	st->bol = 1;
+	st->cr = 0;
+}
+
+int rawmsg_encode(rawmsg_state *st, const char *in, int len, char *out) {
+	const char *p = in, *e = in + len;
+	char *o = out;
+	int stuff = st->flags & RAWMSG_DOT_STUFF;
+
+	while(p < e) {
+		if(st->bol) {
+			if(stuff && *p == '.')
+				*o++ = '.';
+			st->bol = 0;
+		}
+
+		const char *lf = rawmsg__find_lf(p, e);
+		int n = lf - p;
+		memcpy(o, p, n);
+		o += n;
+		if(lf == e) {
+			st->cr = n > 0 ? p[n - 1] == '\r' : st->cr;
+			break;
+		}
+
+		// the CR may have been the last byte of the previous piece
+		if(!(n > 0 ? p[n - 1] == '\r' : st->cr))
+			*o++ = '\r';
+		*o++ = '\n';
+		st->cr = 0;
+		st->bol = 1;
+		p = lf + 1;
+	}
+	return o - out;
+}
+
+long rawmsg_measure(rawmsg_state *st, const char *in, long len) {
+	const char *p = in, *e = in + len;
+	long n = 0;
+	int stuff = st->flags & RAWMSG_DOT_STUFF;
+
+	while(p < e) {
+		if(st->bol) {
+			if(stuff && *p == '.')
+				n++;
+			st->bol = 0;
+		}
+
+		const char *lf = rawmsg__find_lf(p, e);
+		n += lf - p;
+		if(lf == e) {
+			st->cr = lf > p ? lf[-1] == '\r' : st->cr;
+			break;
+		}
+		if(!(lf > p ? lf[-1] == '\r' : st->cr))
+			n++;
+		n++;
+		st->cr = 0;
+		st->bol = 1;
+		p = lf + 1;
+	}
+	return n;
+}
+
+int rawmsg_finish(rawmsg_state *st, char *out) {
+	if(st->bol)
+		return 0;
+	st->bol = 1;
+	if(st->cr) {
+		st->cr = 0;
+		out[0] = '\n';
+		return 1;
+	}
+	out[0] = '\r';
+	out[1] = '\n';
+	return 2;
+}
+
+int rawmsg_is_clean(const char *buf, long len, int flags) {
+	const char *p = buf, *e = buf + len;
+	int stuff = flags & RAWMSG_DOT_STUFF;
+
+	if(len < 2 || e[-2] != '\r' || e[-1] != '\n')
+		return 0;
+	if(stuff && *p == '.')
+		return 0;
+	while((p = rawmsg__find_lf(p, e)) < e) {
+		if(p == buf || p[-1] != '\r')
+			return 0;
+		if(++p < e && stuff && *p == '.')
+			return 0;
+	}
+	return 1;
+}
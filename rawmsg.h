@@ -0,0 +1,34 @@
+#ifndef _RAWMSG_H
+#	define _RAWMSG_H
+
+// Turns an already composed RFC 5322 message into SMTP wire format:
+// bare LF becomes CRLF and, with RAWMSG_DOT_STUFF, lines starting with
+// '.' get a second one (RFC 5321 4.5.2). Input may arrive in pieces of
+// any size; line state is carried in rawmsg_state.
+
+#define RAWMSG_DOT_STUFF	(1 << 0)
+
+// output needed for len input bytes in the worst case ("\n.\n.\n...")
+#define RAWMSG_MAX_OUT(len)	(2 * (len) + 2)
+
+typedef struct {
+	int flags;
+	int bol;	// next byte starts a line
+	int cr;		// last byte was CR
+} rawmsg_state;
+
+void rawmsg_init(rawmsg_state *st, int flags);
+// Encodes len bytes from in into out, returns the bytes written.
+int rawmsg_encode(rawmsg_state *st, const char *in, int len, char *out);
+// Counts the bytes rawmsg_encode() would write for len bytes from in,
+// without writing them.
+long rawmsg_measure(rawmsg_state *st, const char *in, long len);
+// Terminates an unfinished last line with CRLF, returns the bytes
+// written to out (at most 2).
+int rawmsg_finish(rawmsg_state *st, char *out);
+
+// 1 if buf is wire-ready as is: every LF preceded by CR, ends in CRLF,
+// and with RAWMSG_DOT_STUFF no line starts with '.'.
+int rawmsg_is_clean(const char *buf, long len, int flags);
+
+#endif
@@ -0,0 +1,701 @@
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/random.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include "resolver.h"
+
+#define RESOLVER_BUCKETS	(256)
+
+typedef struct resolver__rr {
+	int pref;		// MX preference
+	char *host;		// MX exchange
+	int family;		// A / AAAA
+	unsigned char addr[16];
+} resolver__rr;
+
+typedef struct resolver__entry {
+	struct resolver__entry *next;
+	char *name;
+	int type;
+	long expires;		// monotonic ms, 0 for never
+	int status;		// RESOLVER_OK or RESOLVER_ERROR
+	int n_rrs;
+	resolver__rr *rrs;
+} resolver__entry;
+
+typedef struct resolver__query {
+	struct resolver__query *next;
+	unsigned short id;
+	char *name;
+	int type;
+	long deadline;
+	int tries;
+	int len;
+	unsigned char packet[NS_PACKETSZ];
+} resolver__query;
+
+static long resolver__now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static unsigned int resolver__hash(const char *name, int type) {
+	unsigned int h = 5381 + type;
+	for(; *name; name++)
+		h = h * 33 + tolower((unsigned char)*name);
+	return h;
+}
+
+static void resolver__entry_free(resolver__entry *e) {
+	int i;
+	for(i = 0; i < e->n_rrs; i++)
+		if(e->rrs[i].host) free(e->rrs[i].host);
+	free(e->rrs);
+	free(e->name);
+	free(e);
+}
+
+static resolver__entry *resolver__lookup(resolver *r, const char *name,
+		int type) {
+	resolver__entry **pe = &r->cache[resolver__hash(name, type) % r->n_buckets];
+	long now = resolver__now();
+
+	for(; *pe; pe = &(*pe)->next) {
+		resolver__entry *e = *pe;
+		if(e->type != type || strcasecmp(e->name, name) != 0)
+			continue;
+		if(e->expires && e->expires <= now) {
+			*pe = e->next;
+			resolver__entry_free(e);
+			return NULL;
+		}
+		return e;
+	}
+	return NULL;
+}
+
+// Returns the entry for name/type, creating an empty one if needed.
+static resolver__entry *resolver__entry_get(resolver *r, const char *name,
+		int type) {
+	resolver__entry *e = resolver__lookup(r, name, type);
+	if(e) return e;
+
+	unsigned int b = resolver__hash(name, type) % r->n_buckets;
+	e = (resolver__entry *)malloc(sizeof(resolver__entry));
+	memset(e, 0, sizeof(resolver__entry));
+	e->name = strdup(name);
+	e->type = type;
+	e->status = RESOLVER_OK;
+	e->next = r->cache[b];
+	r->cache[b] = e;
+	return e;
+}
+
+static void resolver__entry_reset(resolver__entry *e, int status, int ttl) {
+	int i;
+	for(i = 0; i < e->n_rrs; i++)
+		if(e->rrs[i].host) free(e->rrs[i].host);
+	free(e->rrs);
+	e->rrs = NULL;
+	e->n_rrs = 0;
+	e->status = status;
+	e->expires = ttl > 0 ? resolver__now() + ttl * 1000L : 0;
+}
+
+static void resolver__entry_add(resolver__entry *e, const resolver__rr *rr) {
+	e->rrs = (resolver__rr *)realloc(e->rrs,
+			(e->n_rrs + 1) * sizeof(resolver__rr));
+	e->rrs[e->n_rrs++] = *rr;
+}
+
+static int resolver__mx_cmp(const void *a, const void *b) {
+	return ((const resolver__rr *)a)->pref - ((const resolver__rr *)b)->pref;
+}
+
+// The last search or domain line wins, as with res_init().
+static void resolver__set_search(resolver *r, char *list) {
+	char *dom, *save;
+	while(r->n_search > 0)
+		free(r->search[--r->n_search]);
+	for(dom = strtok_r(list, " \t\r\n", &save); dom &&
+			r->n_search < RESOLVER_MAX_SEARCH;
+			dom = strtok_r(NULL, " \t\r\n", &save))
+		if(strcmp(dom, "."))
+			r->search[r->n_search++] = strdup(dom);
+}
+
+// address name [aliases...]: every name gets both an A and an AAAA
+// entry that never expires, empty if the file has no such address,
+// so that the name is not looked up in the DNS as well.
+static void resolver__load_etc_hosts(resolver *r, const char *path) {
+	static const int types[] = { ns_t_a, ns_t_aaaa };
+	char line[512], *name, *save;
+	FILE *fp = fopen(path, "r");
+	if(!fp)
+		return;
+
+	while(fgets(line, sizeof(line), fp)) {
+		resolver__rr rr;
+		char *hash = strchr(line, '#');
+		if(hash)
+			*hash = '\0';
+		char *addr = strtok_r(line, " \t\r\n", &save);
+		if(!addr)
+			continue;
+		memset(&rr, 0, sizeof(rr));
+		if(inet_pton(AF_INET, addr, rr.addr) == 1)
+			rr.family = AF_INET;
+		else if(inet_pton(AF_INET6, addr, rr.addr) == 1)
+			rr.family = AF_INET6;
+		else
+			continue;
+		while((name = strtok_r(NULL, " \t\r\n", &save))) {
+			int i;
+			for(i = 0; i < 2; i++) {
+				resolver__entry *e = resolver__entry_get(r, name, types[i]);
+				e->expires = 0;
+				if((types[i] == ns_t_a) == (rr.family == AF_INET))
+					resolver__entry_add(e, &rr);
+			}
+		}
+	}
+	fclose(fp);
+}
+
+resolver *resolver_new() {
+	resolver *r = (resolver *)malloc(sizeof(resolver));
+	memset(r, 0, sizeof(resolver));
+
+	r->fd = -1;
+	r->timeout = 1000;
+	r->tries = 3;
+	r->n_buckets = RESOLVER_BUCKETS;
+	r->cache = (resolver__entry **)calloc(r->n_buckets,
+			sizeof(resolver__entry *));
+
+	char line[512], ns[128] = "127.0.0.1";
+	int found = 0;
+	r->ndots = 1;
+	FILE *fp = fopen("/etc/resolv.conf", "r");
+	if(fp) {
+		while(fgets(line, sizeof(line), fp)) {
+			if(!found && sscanf(line, "nameserver %127s", ns) == 1)
+				found = 1;
+			else if(!strncmp(line, "search", 6) || !strncmp(line, "domain", 6))
+				resolver__set_search(r, &line[6]);
+			else if(!strncmp(line, "options", 7) && strstr(line, "ndots:"))
+				r->ndots = atoi(strstr(line, "ndots:") + 6);
+		}
+		fclose(fp);
+	}
+	resolver_set_nameserver(r, ns, NS_DEFAULTPORT);
+	resolver__load_etc_hosts(r, "/etc/hosts");
+
+	return r;
+}
+
+static void resolver__query_free(resolver__query *q) {
+	free(q->name);
+	free(q);
+}
+
+void resolver_free(resolver *r) {
+	assert(r);
+
+	int i;
+	for(i = 0; i < r->n_buckets; i++) {
+		resolver__entry *pe, *e = r->cache[i];
+		while(e) {
+			pe = e->next;
+			resolver__entry_free(e);
+			e = pe;
+		}
+	}
+	free(r->cache);
+
+	resolver__query *pq, *q = r->queries;
+	while(q) {
+		pq = q->next;
+		resolver__query_free(q);
+		q = pq;
+	}
+
+	while(r->n_search > 0)
+		free(r->search[--r->n_search]);
+	if(r->fd >= 0) close(r->fd);
+	free(r);
+}
+
+int resolver_set_nameserver(resolver *r, const char *host, int port) {
+	if(r->fd >= 0) {
+		close(r->fd);
+		r->fd = -1;
+	}
+	if(!host)
+		return 1;
+
+	struct sockaddr_in *sin = (struct sockaddr_in *)&r->ns;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&r->ns;
+	memset(&r->ns, 0, sizeof(r->ns));
+	if(inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		r->nslen = sizeof(struct sockaddr_in);
+	} else if(inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		r->nslen = sizeof(struct sockaddr_in6);
+	} else {
+		return 0;
+	}
+
+	if((r->fd = socket(r->ns.ss_family, SOCK_DGRAM, 0)) < 0)
+		return 0;
+	fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) | O_NONBLOCK);
+	fcntl(r->fd, F_SETFD, FD_CLOEXEC);
+	// connected, the kernel drops datagrams from any other source
+	if(connect(r->fd, (struct sockaddr *)&r->ns, r->nslen) < 0) {
+		close(r->fd);
+		r->fd = -1;
+		return 0;
+	}
+	return 1;
+}
+
+void resolver_set_search(resolver *r, const char *domains) {
+	char *list = strdup(domains);
+	resolver__set_search(r, list);
+	free(list);
+}
+
+int resolver_load_hosts(resolver *r, const char *path) {
+	FILE *fp = fopen(path, "r");
+	if(!fp) return 0;
+
+	char line[512], name[256], type[8], a1[256], a2[256];
+	int n = 0;
+	while(fgets(line, sizeof(line), fp)) {
+		if(line[0] == '#')
+			continue;
+
+		int f = sscanf(line, "%255s %7s %255s %255s", name, type, a1, a2);
+		if(f < 3)
+			continue;
+
+		resolver__rr rr;
+		int ttl = 0;
+		int rrtype;
+		memset(&rr, 0, sizeof(rr));
+		if(strcasecmp(type, "MX") == 0 && f == 4) {
+			rrtype = ns_t_mx;
+			rr.pref = atoi(a1);
+			rr.host = strdup(a2);
+			sscanf(line, "%*s %*s %*s %*s %d", &ttl);
+		} else if(strcasecmp(type, "A") == 0 &&
+				inet_pton(AF_INET, a1, rr.addr) == 1) {
+			rrtype = ns_t_a;
+			rr.family = AF_INET;
+			if(f == 4) ttl = atoi(a2);
+		} else if(strcasecmp(type, "AAAA") == 0 &&
+				inet_pton(AF_INET6, a1, rr.addr) == 1) {
+			rrtype = ns_t_aaaa;
+			rr.family = AF_INET6;
+			if(f == 4) ttl = atoi(a2);
+		} else {
+			continue;
+		}
+
+		resolver__entry *e = resolver__entry_get(r, name, rrtype);
+		e->expires = ttl > 0 ? resolver__now() + ttl * 1000L : 0;
+		resolver__entry_add(e, &rr);
+		if(rrtype == ns_t_mx)
+			qsort(e->rrs, e->n_rrs, sizeof(resolver__rr),
+					&resolver__mx_cmp);
+		n++;
+	}
+	fclose(fp);
+	return n;
+}
+
+static void resolver__fail(resolver *r, const char *name, int type) {
+	resolver__entry *e = resolver__entry_get(r, name, type);
+	resolver__entry_reset(e, RESOLVER_ERROR, RESOLVER_NEGATIVE_TTL);
+}
+
+static int resolver__send(resolver *r, resolver__query *q) {
+	q->deadline = resolver__now() + ((long)r->timeout << q->tries);
+	q->tries++;
+	return send(r->fd, q->packet, q->len, 0) == q->len;
+}
+
+// A random id, not one of a pending query. Returns 0 if none could be drawn.
+static int resolver__new_id(resolver *r, unsigned short *id) {
+	resolver__query *q;
+
+	do {
+		if(getrandom(id, sizeof(*id), 0) != sizeof(*id))
+			return 0;
+		for(q = r->queries; q && q->id != *id; q = q->next);
+	} while(q);
+	return 1;
+}
+
+static void resolver__start_query(resolver *r, const char *name, int type) {
+	resolver__query *q;
+
+	for(q = r->queries; q; q = q->next)
+		if(q->type == type && strcasecmp(q->name, name) == 0)
+			return;
+
+	// without a nameserver the fixture is authoritative: no data
+	if(r->fd < 0) {
+		resolver__entry *e = resolver__entry_get(r, name, type);
+		resolver__entry_reset(e, RESOLVER_OK, RESOLVER_NEGATIVE_TTL);
+		return;
+	}
+
+	q = (resolver__query *)malloc(sizeof(resolver__query));
+	memset(q, 0, sizeof(resolver__query));
+	q->len = res_mkquery(ns_o_query, name, ns_c_in, type,
+			NULL, 0, NULL, q->packet, sizeof(q->packet));
+	if(q->len < 0 || !resolver__new_id(r, &q->id)) {
+		free(q);
+		resolver__fail(r, name, type);
+		return;
+	}
+
+	q->packet[0] = q->id >> 8;
+	q->packet[1] = q->id & 0xff;
+	q->name = strdup(name);
+	q->type = type;
+
+	resolver__send(r, q);
+	q->next = r->queries;
+	r->queries = q;
+}
+
+// Stores the answer section of a reply in the cache.
+static void resolver__store_reply(resolver *r, resolver__query *q,
+		const unsigned char *buf, int len) {
+	ns_msg msg;
+	ns_rr rr;
+
+	// a truncated answer may miss records, never cache it as complete
+	if(ns_initparse(buf, len, &msg) < 0 || ns_msg_getflag(msg, ns_f_tc)) {
+		resolver__fail(r, q->name, q->type);
+		return;
+	}
+
+	resolver__entry *e = resolver__entry_get(r, q->name, q->type);
+	int rcode = ns_msg_getflag(msg, ns_f_rcode);
+	if(rcode != ns_r_noerror) {
+		resolver__entry_reset(e, RESOLVER_ERROR, RESOLVER_NEGATIVE_TTL);
+		return;
+	}
+
+	int i, n = ns_msg_count(msg, ns_s_an);
+	unsigned int ttl = 0;
+	resolver__entry_reset(e, RESOLVER_OK, 0);
+	for(i = 0; i < n; i++) {
+		if(ns_parserr(&msg, ns_s_an, i, &rr) < 0)
+			break;
+		if(ns_rr_type(rr) != q->type)
+			continue;
+
+		resolver__rr c;
+		char host[NS_MAXDNAME];
+		memset(&c, 0, sizeof(c));
+		if(q->type == ns_t_mx && ns_rr_rdlen(rr) > 2) {
+			c.pref = ns_get16(ns_rr_rdata(rr));
+			if(ns_name_uncompress(ns_msg_base(msg), ns_msg_end(msg),
+					ns_rr_rdata(rr) + 2, host, sizeof(host)) < 0)
+				continue;
+			c.host = strdup(host);
+		} else if(q->type == ns_t_a && ns_rr_rdlen(rr) == 4) {
+			c.family = AF_INET;
+			memcpy(c.addr, ns_rr_rdata(rr), 4);
+		} else if(q->type == ns_t_aaaa && ns_rr_rdlen(rr) == 16) {
+			c.family = AF_INET6;
+			memcpy(c.addr, ns_rr_rdata(rr), 16);
+		} else {
+			continue;
+		}
+
+		if(!ttl || ns_rr_ttl(rr) < ttl)
+			ttl = ns_rr_ttl(rr);
+		resolver__entry_add(e, &c);
+	}
+
+	if(e->n_rrs == 0 || ttl == 0)
+		ttl = RESOLVER_NEGATIVE_TTL;
+	e->expires = resolver__now() + ttl * 1000L;
+	if(q->type == ns_t_mx)
+		qsort(e->rrs, e->n_rrs, sizeof(resolver__rr), &resolver__mx_cmp);
+}
+
+// The reply has our id and echoes our question.
+static int resolver__matches(resolver__query *q, const unsigned char *buf,
+		int len) {
+	return len >= q->len && q->id == ((buf[0] << 8) | buf[1]) &&
+		memcmp(&buf[NS_HFIXEDSZ], &q->packet[NS_HFIXEDSZ],
+			q->len - NS_HFIXEDSZ) == 0;
+}
+
+static int resolver__read_full(int fd, unsigned char *buf, int len) {
+	int n, got = 0;
+	while(got < len) {
+		if((n = read(fd, buf + got, len - got)) <= 0)
+			return 0;
+		got += n;
+	}
+	return 1;
+}
+
+// Asks q again over TCP after a truncated reply, each step waiting at
+// most the first retransmit timeout. Returns the reply length, or -1.
+static int resolver__query_tcp(resolver *r, resolver__query *q,
+		unsigned char *buf, int size) {
+	struct timeval tv = { r->timeout / 1000, (r->timeout % 1000) * 1000 };
+	unsigned char hdr[2] = { q->len >> 8, q->len & 0xff };
+	struct iovec iov[2] = { { hdr, 2 }, { q->packet, q->len } };
+	int fd, len = -1;
+
+	if((fd = socket(r->ns.ss_family, SOCK_STREAM, 0)) < 0)
+		return -1;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if(connect(fd, (struct sockaddr *)&r->ns, r->nslen) == 0 &&
+			writev(fd, iov, 2) == q->len + 2 &&
+			resolver__read_full(fd, hdr, 2)) {
+		len = (hdr[0] << 8) | hdr[1];
+		if(len > size || !resolver__read_full(fd, buf, len) ||
+				!resolver__matches(q, buf, len))
+			len = -1;
+	}
+	close(fd);
+	return len;
+}
+
+int resolver_process(resolver *r) {
+	unsigned char buf[NS_PACKETSZ * 4];
+	resolver__query **pq, *q;
+	int len, handled = 0;
+
+	while(r->fd >= 0 && (len = recv(r->fd, buf, sizeof(buf), 0)) >= NS_HFIXEDSZ) {
+		for(pq = &r->queries; (q = *pq); pq = &q->next) {
+			// the question must echo ours, not just the id
+			if(resolver__matches(q, buf, len))
+				break;
+		}
+		if(!q)
+			continue;
+
+		if(buf[2] & 0x02) {
+			// TC: the whole answer only comes over TCP
+			unsigned char *tcp = (unsigned char *)malloc(NS_MAXMSG);
+			if((len = resolver__query_tcp(r, q, tcp, NS_MAXMSG)) >= NS_HFIXEDSZ)
+				resolver__store_reply(r, q, tcp, len);
+			else
+				resolver__fail(r, q->name, q->type);
+			free(tcp);
+		} else {
+			resolver__store_reply(r, q, buf, len);
+		}
+		*pq = q->next;
+		resolver__query_free(q);
+		handled++;
+	}
+
+	long now = resolver__now();
+	for(pq = &r->queries; (q = *pq); ) {
+		if(q->deadline > now) {
+			pq = &q->next;
+		} else if(q->tries < r->tries) {
+			resolver__send(r, q);
+			pq = &q->next;
+		} else {
+			resolver__fail(r, q->name, q->type);
+			*pq = q->next;
+			resolver__query_free(q);
+			handled++;
+		}
+	}
+	return handled;
+}
+
+int resolver_get_fd(resolver *r) {
+	return r->fd;
+}
+
+int resolver_next_timeout(resolver *r) {
+	resolver__query *q;
+	long now = resolver__now(), next = -1;
+	for(q = r->queries; q; q = q->next)
+		if(next < 0 || q->deadline - now < next)
+			next = q->deadline - now;
+	if(next < 0 && r->queries) next = 0;
+	return (int)next;
+}
+
+static void resolver__add_addr(resolver_result *res, int family,
+		const void *addr, int port, int pref) {
+	if(res->n_addrs >= RESOLVER_MAX_ADDRS)
+		return;
+
+	resolver_addr *a = &res->addrs[res->n_addrs++];
+	memset(a, 0, sizeof(resolver_addr));
+	a->preference = pref;
+	if(family == AF_INET) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&a->addr;
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		memcpy(&sin->sin_addr, addr, 4);
+		a->addrlen = sizeof(struct sockaddr_in);
+	} else {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&a->addr;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		memcpy(&sin6->sin6_addr, addr, 16);
+		a->addrlen = sizeof(struct sockaddr_in6);
+	}
+}
+
+// Collects A/AAAA records of host, returns 0 while still pending.
+static int resolver__resolve_host(resolver *r, const char *host, int port,
+		int pref, resolver_result *res) {
+	static const int types[] = { ns_t_aaaa, ns_t_a };
+	unsigned char addr[16];
+	int i, j, done = 1;
+
+	if(inet_pton(AF_INET6, host, addr) == 1) {
+		resolver__add_addr(res, AF_INET6, addr, port, pref);
+		return 1;
+	}
+	if(inet_pton(AF_INET, host, addr) == 1) {
+		resolver__add_addr(res, AF_INET, addr, port, pref);
+		return 1;
+	}
+
+	for(i = 0; i < 2; i++) {
+		resolver__entry *e = resolver__lookup(r, host, types[i]);
+		if(!e) {
+			resolver__start_query(r, host, types[i]);
+			done = 0;
+			continue;
+		}
+		if(e->status != RESOLVER_OK)
+			continue;
+		for(j = 0; j < e->n_rrs; j++)
+			resolver__add_addr(res, e->rrs[j].family, e->rrs[j].addr,
+					port, pref);
+	}
+	return done;
+}
+
+// A host name as given by the user: the candidates of the search list
+// in turn, like res_search(). Returns 0 while one is pending.
+static int resolver__search_host(resolver *r, const char *name, int port,
+		resolver_result *res) {
+	char fqdn[NS_MAXDNAME];
+	const char *p;
+	int i, k, dots = 0;
+
+	for(p = name; *p; p++)
+		dots += *p == '.';
+	// absolute names, addresses and names from /etc/hosts as they are
+	if(!r->n_search || (p > name && p[-1] == '.') || strchr(name, ':') ||
+			resolver__lookup(r, name, ns_t_a) ||
+			resolver__lookup(r, name, ns_t_aaaa))
+		return resolver__resolve_host(r, name, port, 0, res);
+
+	int first = dots >= r->ndots;
+	for(i = 0; i <= r->n_search; i++) {
+		const char *cand = name;
+		k = first ? i - 1 : i;
+		if(k >= 0 && k < r->n_search) {
+			snprintf(fqdn, sizeof(fqdn), "%s.%s", name, r->search[k]);
+			cand = fqdn;
+		}
+		if(!resolver__resolve_host(r, cand, port, 0, res))
+			return 0;
+		if(res->n_addrs)
+			break;
+	}
+	return 1;
+}
+
+int resolver_resolve(resolver *r, const char *name, int port, int flags,
+		resolver_result *res) {
+	int i, done = 1;
+
+	res->n_addrs = 0;
+
+	if(!(flags & RESOLVER_MX))
+		return resolver__search_host(r, name, port, res) ?
+			(res->n_addrs ? RESOLVER_OK : RESOLVER_ERROR) :
+			RESOLVER_PENDING;
+
+	resolver__entry *e = resolver__lookup(r, name, ns_t_mx);
+	if(!e) {
+		resolver__start_query(r, name, ns_t_mx);
+		// the implicit MX is the most likely answer, start it early
+		resolver__resolve_host(r, name, port, 0, res);
+		res->n_addrs = 0;
+		return RESOLVER_PENDING;
+	}
+	if(e->status != RESOLVER_OK)
+		return RESOLVER_ERROR;
+
+	if(e->n_rrs == 0) {
+		done = resolver__resolve_host(r, name, port, 0, res);
+	} else {
+		// null MX (RFC 7505): the domain accepts no mail
+		if(e->n_rrs == 1 && (!e->rrs[0].host[0] ||
+					strcmp(e->rrs[0].host, ".") == 0))
+			return RESOLVER_ERROR;
+		for(i = 0; i < e->n_rrs; i++)
+			if(!resolver__resolve_host(r, e->rrs[i].host, port,
+						e->rrs[i].pref, res))
+				done = 0;
+	}
+
+	if(!done)
+		return RESOLVER_PENDING;
+	return res->n_addrs ? RESOLVER_OK : RESOLVER_ERROR;
+}
+
+int resolver_wait(resolver *r, const char *name, int port, int flags,
+		resolver_result *res) {
+	int ret;
+	while((ret = resolver_resolve(r, name, port, flags, res))
+			== RESOLVER_PENDING) {
+		// lookups that could not be sent have already failed
+		if(!r->queries)
+			continue;
+
+		struct pollfd pfd;
+		pfd.fd = r->fd;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, resolver_next_timeout(r)) < 0 && errno != EINTR)
+			return RESOLVER_ERROR;
+		resolver_process(r);
+	}
+	return ret;
+}
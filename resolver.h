@@ -0,0 +1,89 @@
+#ifndef _RESOLVER_H
+#	define _RESOLVER_H
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define RESOLVER_MAX_ADDRS	(32)
+#define RESOLVER_MAX_SEARCH	(6)	// as res_init()
+
+// flags for resolver_resolve()
+#define RESOLVER_MX		(1 << 0)	// treat name as a mail domain
+
+// return values of resolver_resolve()
+#define RESOLVER_ERROR		(-1)
+#define RESOLVER_PENDING	(0)
+#define RESOLVER_OK		(1)
+
+// TTL used for negative answers and failed queries
+#define RESOLVER_NEGATIVE_TTL	(60)
+
+typedef struct resolver_addr {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int preference;		// MX preference of the host it belongs to
+} resolver_addr;
+
+typedef struct resolver_result {
+	int n_addrs;
+	resolver_addr addrs[RESOLVER_MAX_ADDRS];
+} resolver_result;
+
+struct resolver__entry;
+struct resolver__query;
+
+typedef struct resolver {
+	int fd;
+	struct sockaddr_storage ns;
+	socklen_t nslen;
+	int timeout;		// first retransmit timeout, in ms
+	int tries;
+	// host names with fewer than ndots dots are tried with these
+	// domains appended first, other names last
+	char *search[RESOLVER_MAX_SEARCH];
+	int n_search, ndots;
+
+	struct resolver__entry **cache;
+	int n_buckets;
+	struct resolver__query *queries;
+} resolver;
+
+// Uses the first nameserver and the search list of /etc/resolv.conf.
+// Names in /etc/hosts are answered from it, without the search list.
+// A resolver is used by one thread at a time.
+resolver *resolver_new();
+void resolver_free(resolver *r);
+
+// host == NULL disables network queries, only cached and fixture
+// records are answered.
+int resolver_set_nameserver(resolver *r, const char *host, int port);
+
+// Replaces the search list, domains separated by spaces.
+void resolver_set_search(resolver *r, const char *domains);
+
+// Loads a hosts-style fixture, one record per line:
+//   name MX preference exchange [ttl]
+//   name A|AAAA address [ttl]
+// A ttl of 0 (the default) never expires.
+int resolver_load_hosts(resolver *r, const char *path);
+
+// Never blocks. Starts any missing queries and returns RESOLVER_PENDING
+// until every record needed is cached. With RESOLVER_MX, addresses come
+// in MX preference order (the domain itself if it has no MX records).
+int resolver_resolve(resolver *r, const char *name, int port, int flags,
+		resolver_result *res);
+
+// Socket to poll for readability while lookups are pending.
+int resolver_get_fd(resolver *r);
+// Milliseconds until the next retransmit is due, -1 if nothing pending.
+int resolver_next_timeout(resolver *r);
+// Reads available replies and retransmits or fails expired queries.
+// Replies come from the nameserver only; a truncated one is asked again
+// over TCP, which blocks for up to the retransmit timeout per step.
+int resolver_process(resolver *r);
+
+// Blocking helper: drives resolver_process() until the name resolves.
+int resolver_wait(resolver *r, const char *name, int port, int flags,
+		resolver_result *res);
+
+#endif
@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "retry.h"
+
+typedef struct retry__item {
+	timer_node node;
+	unsigned long msg_id;
+	int rcpt;
+	struct retry__item *next_free;
+} retry__item;
+
+typedef struct {
+	retry *r;
+	retry_func cb;
+	void *ctx;
+} retry__run_ctx;
+
+long retry_backoff(int attempts) {
+	long delay = RETRY_BASE;
+	while(attempts-- > 1 && delay < RETRY_MAX_DELAY)
+		delay *= 2;
+	if(delay > RETRY_MAX_DELAY)
+		delay = RETRY_MAX_DELAY;
+	return delay - delay / 10 + random() % (delay / 5 + 1);
+}
+
+retry *retry_new(long now) {
+	retry *r = (retry *)malloc(sizeof(retry));
+	memset(r, 0, sizeof(retry));
+	timer_init(&r->wheel, now);
+	return r;
+}
+
+static void retry__drop(timer_node *t, void *ctx) {
+	free(t->data);
+}
+
+void retry_free(retry *r) {
+	timer_clear(&r->wheel, &retry__drop, NULL);
+	while(r->free_items) {
+		retry__item *it = r->free_items;
+		r->free_items = it->next_free;
+		free(it);
+	}
+	free(r);
+}
+
+void retry_schedule(retry *r, unsigned long msg_id, int rcpt, long when) {
+	retry__item *it = r->free_items;
+	if(it)
+		r->free_items = it->next_free;
+	else
+		it = (retry__item *)malloc(sizeof(retry__item));
+	memset(it, 0, sizeof(retry__item));
+	it->msg_id = msg_id;
+	it->rcpt = rcpt;
+	it->node.data = it;
+	timer_add(&r->wheel, &it->node, when);
+}
+
+static void retry__fire(timer_node *t, void *ctx) {
+	retry__run_ctx *rc = (retry__run_ctx *)ctx;
+	retry__item *it = (retry__item *)t->data;
+	unsigned long msg_id = it->msg_id;
+	int rcpt = it->rcpt;
+
+	it->next_free = rc->r->free_items;
+	rc->r->free_items = it;
+	rc->cb(msg_id, rcpt, rc->ctx);
+}
+
+int retry_run(retry *r, long now, retry_func cb, void *ctx) {
+	retry__run_ctx rc = { r, cb, ctx };
+	return timer_advance(&r->wheel, now, &retry__fire, &rc);
+}
+
+long retry_next(retry *r) {
+	return timer_next(&r->wheel);
+}
+
+int retry_count(retry *r) {
+	return r->wheel.count;
+}
@@ -0,0 +1,40 @@
+#ifndef _RETRY_H
+#	define _RETRY_H
+
+#include "timer.h"
+
+// Transient failures (4xx replies, failed connections, timeouts) are
+// retried after RETRY_BASE, doubling up to RETRY_MAX_DELAY, until the
+// recipient has waited RETRY_MAX_AGE; only then, or on a 5xx reply,
+// does it fail for good. All times are in seconds.
+#define RETRY_BASE		(60)
+#define RETRY_MAX_DELAY		(4 * 3600)
+#define RETRY_MAX_AGE		(5 * 24 * 3600)
+
+// Seconds to wait after the attempts-th failure, with +-10% jitter so
+// recipients deferred together do not come back together.
+long retry_backoff(int attempts);
+
+struct retry__item;
+
+// Due times of deferred recipients, kept on a timer wheel with one
+// second ticks.
+typedef struct retry {
+	timer_wheel wheel;
+	struct retry__item *free_items;
+} retry;
+
+typedef void (* retry_func) (unsigned long msg_id, int rcpt, void *ctx);
+
+retry *retry_new(long now);
+void retry_free(retry *r);
+// O(1); the same recipient may be scheduled more than once, callers
+// check on expiry whether it is still due.
+void retry_schedule(retry *r, unsigned long msg_id, int rcpt, long when);
+// Calls cb for each recipient due by now, returns how many.
+int retry_run(retry *r, long now, retry_func cb, void *ctx);
+// Seconds until the next recipient may be due, -1 when none is left.
+long retry_next(retry *r);
+int retry_count(retry *r);
+
+#endif
@@ -1,65 +1,444 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
 #include "smtp.h"
+#include "probes.h"
+#include "rawmsg.h"
+
+// a command whose reply is still to be read
+struct smtp__pending {
+	int cmd;	// SMTP__CMD_*
+	int txn, rcpt;
+};
+
+#define SMTP__CMD_MAIL	(0)
+#define SMTP__CMD_RCPT	(1)
+#define SMTP__CMD_DATA	(2)
+#define SMTP__CMD_BODY	(3)	// a BDAT chunk
+#define SMTP__CMD_RSET	(4)
+#define SMTP__CMD_END	(5)	// end of data, or BDAT LAST
+
+static __thread smtp *smtp__pool[SMTP_POOL_SIZE];
+static __thread int smtp__pool_len;
 
 smtp *smtp_new() {
-	smtp *s = (smtp *)malloc(sizeof(smtp));
-	memset(s, 0, sizeof(smtp));
+	smtp *s;
+	if(smtp__pool_len > 0) {
+		s = smtp__pool[--smtp__pool_len];
+	} else {
+		s = (smtp *)malloc(sizeof(smtp));
+		memset(s, 0, sizeof(smtp));
+		s->msg = buffer_new(0);
+		s->readbuf = buffer_new(0);
+		s->writebuf = buffer_new(0);
+		s->pending = (struct smtp__pending *)malloc(SMTP_MAX_PENDING *
+				sizeof(struct smtp__pending));
+	}
 
+	smtp_reset(s);
+	return s;
+}
+
+void smtp_reset(smtp *s) {
+	if(s->tls)
+		tls_close(s->tls);
+	s->tls = NULL;
 	s->rfd = 0;
 	s->wfd = 1;
 	s->code = -1;
 	s->multiline_reply = 0;
-	s->msg = buffer_new(0);
-	s->readbuf = buffer_new(0);
-
-	return s;
+	s->extensions = 0;
+	s->size_limit = 0;
+	s->latency_us = 0;
+	s->read_timeout = -1;
+	s->write_timeout = -1;
+	s->ring = NULL;
+	s->batch = NULL;
+	s->pending_head = s->n_pending = 0;
+	s->txn_open = 0;
+	s->lmtp = s->lmtp_rcpts = s->bdat_last = 0;
+	s->kept = s->ended = s->dropped = 0;
+	s->transport = SMTP_TRANSPORT_FILE;
+	s->corked = 0;
+	s->trace = NULL;
+	buffer_reset(s->msg);
+	buffer_reset(s->readbuf);
+	buffer_reset(s->writebuf);
 }
 
 void smtp_free(smtp *s) {
 	assert(s);
+	if(s->tls)
+		tls_close(s->tls);
+	s->tls = NULL;
+	if(smtp__pool_len < SMTP_POOL_SIZE &&
+			buffer_capacity(s->msg) <= BUFFER_POOL_MAX_SIZE &&
+			buffer_capacity(s->readbuf) <= BUFFER_POOL_MAX_SIZE &&
+			buffer_capacity(s->writebuf) <= BUFFER_POOL_MAX_SIZE) {
+		smtp__pool[smtp__pool_len++] = s;
+		return;
+	}
 	buffer_free(s->msg);
 	buffer_free(s->readbuf);
+	buffer_free(s->writebuf);
+	free(s->pending);
 	free(s);
 }
 
+void smtp_pool_clear() {
+	while(smtp__pool_len > 0) {
+		smtp *s = smtp__pool[--smtp__pool_len];
+		buffer_free(s->msg);
+		buffer_free(s->readbuf);
+		buffer_free(s->writebuf);
+		free(s->pending);
+		free(s);
+	}
+}
+
 void smtp_set_fd(smtp *s, int rfd, int wfd) {
+	int domain, on = 1;
+	socklen_t len = sizeof(domain);
+
 	s->rfd = rfd;
 	s->wfd = wfd;
+	s->transport = SMTP_TRANSPORT_FILE;
+	s->corked = 0;
+	if(getsockopt(wfd, SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0)
+		return;
+	if(domain == AF_UNIX) {
+		s->transport = SMTP_TRANSPORT_UNIX;
+	} else if(domain == AF_INET || domain == AF_INET6) {
+		s->transport = SMTP_TRANSPORT_TCP;
+		setsockopt(wfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+}
+
+int smtp_get_transport(smtp *s) {
+	return s->transport;
+}
+
+void smtp_set_buffers(smtp *s, int sndbuf, int rcvbuf) {
+	if(s->transport == SMTP_TRANSPORT_FILE)
+		return;
+	if(sndbuf > 0)
+		setsockopt(s->wfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	if(rcvbuf > 0)
+		setsockopt(s->rfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+}
+
+void smtp_set_timeouts(smtp *s, int read_ms, int write_ms) {
+	s->read_timeout = read_ms;
+	s->write_timeout = write_ms;
+}
+
+void smtp_set_uring(smtp *s, uring *u) {
+	s->ring = u;
+}
+
+void smtp_set_trace(smtp *s, trace *t, const char *peer) {
+	s->trace = t;
+	if(t)
+		trace_open(t, peer);
+}
+
+char *smtp_get_write_buffer(smtp *s, int *len) {
+	if(!s->ring)
+		return NULL;
+	return uring_buffer(s->ring, 0, len);
+}
+
+// Fails a command locally as if the server had replied with code.
+static int smtp__local_reply(smtp *s, int code, const char *text) {
+	char buf[16];
+	snprintf(buf, sizeof(buf), "%d ", code);
+	buffer_reset(s->msg);
+	buffer_append_string(s->msg, buf);
+	buffer_append_string(s->msg, text);
+	buffer_append_string(s->msg, SMTP_NEWLINE);
+	s->code = code;
+	s->multiline_reply = 0;
+	return 0;
+}
+
+// After smtp__drop() every read and write fails right away.
+static int smtp__dropped(smtp *s) {
+	if(s->dropped)
+		smtp__local_reply(s, 421, "Connection dropped");
+	return s->dropped;
+}
+
+// Waits until fd is ready, returns 0 on timeout or error. With TLS the
+// record layer may need the other direction, or have input buffered.
+static int smtp__wait(smtp *s, int fd, int events, int timeout) {
+	struct pollfd pfd;
+	int r;
+
+	if(s->tls) {
+		if((events & POLLIN) && tls_pending(s->tls))
+			return 1;
+		events = tls_events(s->tls, events);
+	}
+	pfd.fd = fd;
+	pfd.events = events;
+	PROBE_ENTER(poll, fd, events);
+	while((r = poll(&pfd, 1, timeout)) < 0 && errno == EINTR)
+		;
+	PROBE_RETURN(poll, fd, r);
+	if(r == 0)
+		smtp__local_reply(s, 421, "Connection timed out");
+	return r > 0;
+}
+
+static void smtp__trace(smtp *s, int type, const void *buf, long len) {
+	if(s->trace && len > 0)
+		trace_record(s->trace, type, buf, len);
+}
+
+static int smtp__ring_write(smtp *s, const char *buf, int len) {
+	int done = 0, res[2];
+	int timed = s->write_timeout >= 0;
+
+	while(done < len) {
+		uring_send(s->ring, s->wfd, &buf[done], len - done, timed);
+		if(timed)
+			uring_link_timeout(s->ring, s->write_timeout);
+		PROBE_ENTER(ring, s->wfd, 2);
+		int ok = uring_submit_wait(s->ring, res, 2);
+		PROBE_RETURN(ring, s->wfd, ok);
+		if(!ok)
+			return -1;
+
+		if(res[0] == -EAGAIN || res[0] == -EINTR) {
+			if(!smtp__wait(s, s->wfd, POLLOUT, s->write_timeout))
+				return -1;
+			continue;
+		}
+		if(timed && res[1] == -ETIME) {
+			smtp__local_reply(s, 421, "Connection timed out");
+			return -1;
+		}
+		if(res[0] < 0) {
+			smtp__local_reply(s, 421, "Connection lost");
+			return -1;
+		}
+		done += res[0];
+	}
+	smtp__trace(s, TRACE_OUT, buf, done);
+	return done;
+}
+
+// Writes the whole buffer, also on non-blocking descriptors.
+static int smtp__write_all(smtp *s, const char *buf, int len) {
+	if(smtp__dropped(s))
+		return -1;
+	if(s->ring && !s->tls)
+		return smtp__ring_write(s, buf, len);
+
+	int done = 0;
+	while(done < len) {
+		if(!smtp__wait(s, s->wfd, POLLOUT, s->write_timeout))
+			return -1;
+		PROBE_ENTER(write, s->wfd, len - done);
+		int w = s->tls ? tls_write(s->tls, &buf[done], len - done) :
+			write(s->wfd, &buf[done], len - done);
+		PROBE_RETURN(write, s->wfd, w);
+		if(w < 0) {
+			if(errno == EAGAIN || errno == EINTR) continue;
+			smtp__local_reply(s, 421, "Connection lost");
+			return -1;
+		}
+		done += w;
+	}
+	smtp__trace(s, TRACE_OUT, buf, done);
+	return done;
+}
+
+// Writes out the collected commands.
+static int smtp__flush(smtp *s) {
+	int len = buffer_length(s->writebuf);
+	if(len == 0)
+		return 1;
+	int w = smtp__write_all(s, buffer_data(s->writebuf), len);
+	buffer_reset(s->writebuf);
+	s->kept = 0;
+	return w == len;
+}
+
+// Holds back partial segments while a body is written piecewise. The
+// cork comes off before waiting for a reply, which sends the rest.
+static void smtp__cork(smtp *s, int on) {
+	if(s->transport != SMTP_TRANSPORT_TCP || s->corked == on)
+		return;
+	setsockopt(s->wfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+	s->corked = on;
+}
+
+// Writes out body lines collected in writebuf.
+static int smtp__flush_body(smtp *s) {
+	smtp__cork(s, 1);
+	return smtp__flush(s);
+}
+
+// Sends the collected commands and receives their reply in a single
+// submission. Sets errno to EAGAIN when it has to be called again.
+static int smtp__ring_recv(smtp *s, char *buf, int len) {
+	int res[3] = { 0, 0, 0 };
+	int timed = s->read_timeout >= 0;
+	int wlen = buffer_length(s->writebuf);
+	int sent = -1, recvd, timer = -1, ok;
+
+	if(wlen)
+		sent = uring_send(s->ring, s->wfd, buffer_data(s->writebuf), wlen, 1);
+	recvd = uring_recv(s->ring, s->rfd, buf, len, timed);
+	if(timed)
+		timer = uring_link_timeout(s->ring, s->read_timeout);
+	PROBE_ENTER(ring, s->rfd, 3);
+	ok = uring_submit_wait(s->ring, res, 3);
+	PROBE_RETURN(ring, s->rfd, ok);
+	if(!ok)
+		return -1;
+
+	if(sent >= 0) {
+		if(res[sent] < 0 && res[sent] != -EAGAIN && res[sent] != -EINTR) {
+			smtp__local_reply(s, 421, "Connection lost");
+			errno = -res[sent];
+			return -1;
+		}
+		if(res[sent] > 0) {
+			smtp__trace(s, TRACE_OUT, buffer_data(s->writebuf), res[sent]);
+			buffer_shift(s->writebuf, res[sent]);
+			s->kept = s->kept > res[sent] ? s->kept - res[sent] : 0;
+		}
+		// a short send does not break the link: the receive may still
+		// have run, and the rest goes out with the next call
+		if(buffer_length(s->writebuf) && res[recvd] <= 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+
+	if(res[recvd] > 0)
+		return res[recvd];
+	if(timer >= 0 && res[timer] == -ETIME) {
+		smtp__local_reply(s, 421, "Connection timed out");
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	if(res[recvd] < 0) {
+		errno = -res[recvd];
+		return -1;
+	}
+	return res[recvd];
 }
 
 static int smtp__read_line(smtp *s) {
-	char buf[4096];
-	char *line;
-	while(NULL == (line = strstr(buffer_cstr(s->readbuf), SMTP_NEWLINE))) {
-		int r = read(s->rfd, buf, sizeof(buf));
-		if(r < 0) return -1;
-		buffer_append(s->readbuf, buf, r);
+	const char *start, *line;
+	int len, scanned = 0;
+
+	while(1) {
+		start = buffer_data(s->readbuf);
+		len = buffer_length(s->readbuf);
+
+		// only scan new bytes, but catch a newline split across reads
+		int from = scanned - (SMTP_NEWLINE_LEN - 1);
+		if(from < 0) from = 0;
+		line = memmem(&start[from], len - from, SMTP_NEWLINE, SMTP_NEWLINE_LEN);
+		if(line)
+			break;
+		scanned = len;
+		if(len >= SMTP_REPLY_MAX) {
+			smtp__local_reply(s, 421, "Reply too long");
+			return -1;
+		}
+
+		// read straight into the buffer
+		char *buf = buffer_reserve(s->readbuf, SMTP_READ_SIZE);
+		int r;
+		if(s->ring && !s->tls) {
+			smtp__cork(s, 0);
+			r = smtp__ring_recv(s, buf, SMTP_READ_SIZE);
+			if(r < 0 && errno == EAGAIN && !buffer_length(s->writebuf) &&
+					!smtp__wait(s, s->rfd, POLLIN, s->read_timeout))
+				return -1;
+		} else {
+			if(!smtp__flush(s))
+				return -1;
+			smtp__cork(s, 0);
+			if(!smtp__wait(s, s->rfd, POLLIN, s->read_timeout))
+				return -1;
+			PROBE_ENTER(read, s->rfd, SMTP_READ_SIZE);
+			r = s->tls ? tls_read(s->tls, buf, SMTP_READ_SIZE) :
+				read(s->rfd, buf, SMTP_READ_SIZE);
+			PROBE_RETURN(read, s->rfd, r);
+		}
+		if(r < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+		// failed locally, the reply says why
+		if(r < 0 && s->code == 421) return -1;
+		if(r <= 0) {
+			smtp__local_reply(s, 421, "Connection closed");
+			return -1;
+		}
+		smtp__trace(s, TRACE_IN, buf, r);
+		buffer_commit(s->readbuf, r);
 	}
 
-	const char *start = buffer_data(s->readbuf);
-	int len = line - start + SMTP_NEWLINE_LEN;
+	len = line - start + SMTP_NEWLINE_LEN;
+	if(len < 4) {
+		buffer_shift(s->readbuf, len);
+		return -1;
+	}
 
-	if(len >= 4) {
-		buffer_append(s->msg, start, len);
-		s->code = atoi(start);
-		s->multiline_reply = (start[3] == '-') ? 1 : 0;
+	if(buffer_length(s->msg) + len > SMTP_REPLY_MAX) {
 		buffer_shift(s->readbuf, len);
-		return 1;
+		smtp__local_reply(s, 421, "Reply too long");
+		return -1;
 	}
-	return -1;
+	buffer_append(s->msg, start, len);
+	s->code = atoi(start);
+	s->multiline_reply = (start[3] == '-') ? 1 : 0;
+	buffer_shift(s->readbuf, len);
+	return 1;
+}
+
+static long smtp__now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
 }
 
 static int smtp__read_response(smtp *s) {
-	buffer_shift(s->msg, buffer_length(s->msg));
+	long start = smtp__now_us();
+	int ok = 1;
+
+	if(smtp__dropped(s))
+		return 0;
+	PROBE_ENTER(reply, s->rfd, 0);
+	buffer_reset(s->msg);
+	s->code = -1;
+	s->latency_us = 0;
 	do {
 		if(smtp__read_line(s) < 0)
-			return 0;
-	} while(s->multiline_reply);
-	return 1;
+			ok = 0;
+	} while(ok && s->multiline_reply);
+	if(ok)
+		s->latency_us = smtp__now_us() - start;
+	PROBE_RETURN(reply, s->code, buffer_length(s->msg));
+	return ok;
 }
 
 int smtp_is_positive_response(smtp *s) {
@@ -68,41 +447,297 @@ int smtp_is_positive_response(smtp *s) {
 	return 0;
 }
 
-static int smtp__write_end_data(smtp *s) {
-	return write(s->wfd, ".\r\n", 3);
+int smtp_is_permanent_failure(smtp *s) {
+	return s->code >= 500 && s->code < 600;
+}
+
+static int smtp__lost(smtp *s) {
+	return s->code == 421 || s->code < 0;
+}
+
+static int smtp__is_done(int code) {
+	return code >= 200 && code < 300;
+}
+
+// Files a reply with the transaction of the command it answers.
+static void smtp__dispatch(smtp *s, struct smtp__pending *p, int code) {
+	smtp_txn *t = &s->batch[p->txn];
+
+	switch(p->cmd) {
+	case SMTP__CMD_MAIL:
+		t->mail_code = code;
+		break;
+	case SMTP__CMD_RCPT:
+		t->rcpt_codes[p->rcpt] = code;
+		break;
+	case SMTP__CMD_END:
+		t->latency_us = s->latency_us;
+		// fall through
+	case SMTP__CMD_DATA:
+	case SMTP__CMD_BODY:
+		// the first failure sticks, BDAT may have more replies
+		if(t->code == 0 || t->code == 354 || smtp__is_done(t->code))
+			t->code = code;
+		break;
+	}
+}
+
+// LMTP end of data: a reply for each accepted recipient, in the order
+// of their RCPT commands (RFC 2033 4.2), or a single one if there were
+// none. The RCPT replies were all dispatched before.
+static int smtp__collect_lmtp(smtp *s, struct smtp__pending *p) {
+	smtp_txn *t = &s->batch[p->txn];
+	int k, n = 0, ok = 1, code = 0;
+
+	for(k = 0; k < t->n_rcpts; k++) {
+		if(!smtp__is_done(t->rcpt_codes[k]))
+			continue;
+		if(ok)
+			ok = smtp__read_response(s);
+		if(t->lmtp_codes)
+			t->lmtp_codes[k] = s->code;
+		if(code == 0 || smtp__is_done(code))
+			code = s->code;
+		n++;
+	}
+	if(n == 0) {
+		ok = smtp__read_response(s);
+		code = s->code;
+	}
+	smtp__dispatch(s, p, code);
+	return ok;
+}
+
+// Reads the reply to the oldest pending command. When the session is
+// gone all pending commands get the local failure and 0 is returned.
+static int smtp__collect(smtp *s) {
+	struct smtp__pending *p = &s->pending[s->pending_head];
+	int lmtp = s->lmtp && p->cmd == SMTP__CMD_END;
+	int ok = lmtp ? smtp__collect_lmtp(s, p) : smtp__read_response(s);
+
+	do {
+		p = &s->pending[s->pending_head];
+		s->pending_head = (s->pending_head + 1) % SMTP_MAX_PENDING;
+		s->n_pending--;
+		if(!lmtp)
+			smtp__dispatch(s, p, s->code);
+		lmtp = 0;
+	} while(!ok && s->n_pending);
+	return ok;
+}
+
+// Gives up on a session whose server is left inside a message body:
+// whatever came next would end up in it. The transactions before still
+// go out whole, and their replies are read.
+static int smtp__drop(smtp *s) {
+	buffer_truncate(s->writebuf, s->kept);
+	smtp__flush(s);
+	if(s->transport != SMTP_TRANSPORT_FILE)
+		shutdown(s->wfd, SHUT_WR);
+	while(s->batch && s->n_pending &&
+			s->pending[s->pending_head].txn < s->batch_txn &&
+			smtp__collect(s))
+		;
+	s->dropped = 1;
+	return smtp__local_reply(s, 421, "Message body broke off");
+}
+
+// The end of data outside smtp_send_pipelined() with LMTP.
+static int smtp__read_lmtp(smtp *s) {
+	int n = s->lmtp_rcpts > 0 ? s->lmtp_rcpts : 1;
+	int all = 1;
+
+	s->lmtp_rcpts = 0;
+	while(n-- > 0) {
+		if(!smtp__read_response(s))
+			return 0;
+		all = all && smtp_is_positive_response(s);
+	}
+	return all;
+}
+
+// A reply to the command just written is due. Outside a batch it is
+// read right away. In smtp_send_pipelined() it is only queued, unless
+// the server does not pipeline.
+static int smtp__expect(smtp *s, int cmd, int rcpt) {
+	if(cmd == SMTP__CMD_END)
+		s->ended = 1;
+	if(!s->batch && s->lmtp && cmd == SMTP__CMD_END)
+		return smtp__read_lmtp(s);
+	if(!s->batch)
+		return smtp__read_response(s) && smtp_is_positive_response(s);
+
+	if(s->n_pending == SMTP_MAX_PENDING && !smtp__collect(s))
+		return 0;
+	struct smtp__pending *p = &s->pending[(s->pending_head + s->n_pending) %
+		SMTP_MAX_PENDING];
+	p->cmd = cmd;
+	p->txn = s->batch_txn;
+	p->rcpt = rcpt;
+	s->n_pending++;
+
+	if(!(s->extensions & SMTP_EXT_PIPELINING))
+		return smtp__collect(s) && (cmd == SMTP__CMD_DATA ?
+			s->code == 354 : smtp_is_positive_response(s));
+	return !smtp__lost(s);
+}
+
+static int smtp__end_data(smtp *s) {
+	PROBE_PHASE(s->wfd, ".");
+	buffer_append(s->writebuf, ".\r\n", 3);
+	return smtp__expect(s, SMTP__CMD_END, 0);
 }
 
 int smtp_write(smtp *s, const char *buf, int len) {
-	return write(s->wfd, buf, len);
+	if(!smtp__flush_body(s))
+		return -1;
+	return smtp__write_all(s, buf, len);
 }
 
 int smtp_write_line(smtp *s, const char *buf, int len) {
-	/*write(s->wfd, "[", 1);
-	write(s->wfd, buf, len);
-	write(s->wfd, "]", 1);*/
-	if(len > 0 && buf[0] == '.' && write(s->wfd, ".", 1) < 0)
+	PROBE(write_line, s->wfd, len);
+	if(len > 0 && buf[0] == '.')
+		buffer_append(s->writebuf, ".", 1);
+	buffer_append(s->writebuf, buf, len);
+	buffer_append(s->writebuf, "\r\n", 2);
+	if(buffer_length(s->writebuf) >= SMTP_WRITE_FLUSH && !smtp__flush_body(s))
 		return -1;
-	if(write(s->wfd, buf, len) >= 0 && write(s->wfd, "\r\n", 2) >= 0)
-		return 1;
-	return -1;
+	return 1;
+}
+
+// Fallback for descriptors sendfile(2) does not support.
+static long smtp__copy_file(smtp *s, int fd, long offset, long len) {
+	char buf[SMTP_WRITE_FLUSH];
+	long done = 0;
+	while(done < len) {
+		int n = len - done > sizeof(buf) ? sizeof(buf) : len - done;
+		PROBE_ENTER(pread, fd, n);
+		int r = pread(fd, buf, n, offset + done);
+		PROBE_RETURN(pread, fd, r);
+		if(r <= 0 || smtp__write_all(s, buf, r) != r)
+			return -1;
+		done += r;
+	}
+	return done;
+}
+
+long smtp_writev(smtp *s, const struct iovec *iov, int n) {
+	struct iovec v[SMTP_IOV_MAX + 1], *p = v;
+	int head = buffer_length(s->writebuf), cnt = 0, i;
+	long total = head, done = 0;
+
+	if(n > SMTP_IOV_MAX || smtp__dropped(s))
+		return -1;
+	smtp__cork(s, 1);
+	if(s->tls) {
+		// one record per piece, SSL_write() does not gather
+		if(!smtp__flush(s))
+			return -1;
+		for(i = 0; i < n; i++) {
+			if(smtp__write_all(s, iov[i].iov_base, iov[i].iov_len) < 0)
+				return -1;
+			done += iov[i].iov_len;
+		}
+		return done;
+	}
+	if(head) {
+		v[cnt].iov_base = (void *)buffer_data(s->writebuf);
+		v[cnt++].iov_len = head;
+	}
+	for(i = 0; i < n; i++) {
+		v[cnt++] = iov[i];
+		total += iov[i].iov_len;
+	}
+
+	while(done < total) {
+		if(!smtp__wait(s, s->wfd, POLLOUT, s->write_timeout))
+			return -1;
+		PROBE_ENTER(writev, s->wfd, cnt);
+		ssize_t w = writev(s->wfd, p, cnt);
+		PROBE_RETURN(writev, s->wfd, w);
+		if(w < 0) {
+			if(errno == EAGAIN || errno == EINTR) continue;
+			smtp__local_reply(s, 421, "Connection lost");
+			return -1;
+		}
+		done += w;
+		// skip over what went out
+		while(cnt && w >= (ssize_t)p->iov_len) {
+			w -= p->iov_len;
+			p++;
+			cnt--;
+		}
+		if(cnt) {
+			p->iov_base = (char *)p->iov_base + w;
+			p->iov_len -= w;
+		}
+	}
+	smtp__trace(s, TRACE_OUT, buffer_data(s->writebuf), head);
+	for(i = 0; i < n; i++)
+		smtp__trace(s, TRACE_OUT, iov[i].iov_base, iov[i].iov_len);
+	buffer_reset(s->writebuf);
+	s->kept = 0;
+	return total - head;
+}
+
+long smtp_sendfile(smtp *s, int fd, long offset, long len) {
+	off_t off = offset;
+	long done = 0;
+
+	if(!smtp__flush_body(s) || smtp__dropped(s))
+		return -1;
+	// encrypting in userspace means reading the file there
+	if(s->tls && !tls_ktls_send(s->tls))
+		return smtp__copy_file(s, fd, offset, len);
+
+	while(done < len) {
+		if(!smtp__wait(s, s->wfd, POLLOUT, s->write_timeout))
+			return -1;
+		PROBE_ENTER(sendfile, s->wfd, len - done);
+		ssize_t w = s->tls ? tls_sendfile(s->tls, fd, off, len - done) :
+			sendfile(s->wfd, fd, &off, len - done);
+		PROBE_RETURN(sendfile, s->wfd, w);
+		if(s->tls && w > 0)
+			off += w;
+		if(w < 0) {
+			if(errno == EAGAIN || errno == EINTR) continue;
+			if(done == 0 && (errno == EINVAL || errno == ENOSYS))
+				return smtp__copy_file(s, fd, offset, len);
+			return -1;
+		}
+		if(w == 0)	// file shorter than promised
+			return -1;
+		done += w;
+	}
+	smtp__trace(s, TRACE_FILE, NULL, done);
+	return done;
 }
 
 int smtp_write_string(smtp *s, const char *str) {
 	return smtp_write(s, str, strlen(str));
 }
 
+// Commands are only collected here, they go out with the next read.
+// The first string names the command for the phase probe.
 static int smtp__write_strings(smtp *s, ...) {
 	int ret = 0;
 	char *str;
 	va_list va;
 	va_start(va, s);
-	while((str = va_arg(va, char *)) != NULL)
-		ret += smtp_write_string(s, str);
+	str = va_arg(va, char *);
+	PROBE_PHASE(s->wfd, str);
+	va_end(va);
+	va_start(va, s);
+	while((str = va_arg(va, char *)) != NULL) {
+		buffer_append_string(s->writebuf, str);
+		ret += strlen(str);
+	}
 	va_end(va);
 	return ret;
 }
 
 int smtp_read_welcome(smtp *s) {
+	PROBE_PHASE(s->rfd, "greeting");
 	if(smtp__read_response(s) &&
 			smtp_is_positive_response(s))
 		return 1;
@@ -117,8 +752,98 @@ int smtp_helo(smtp *s, const char *id) {
 	return 0;
 }
 
+static void smtp__parse_ehlo(smtp *s) {
+	const char *line = buffer_cstr(s->msg);
+	const char *next;
+
+	s->extensions = 0;
+	s->size_limit = 0;
+
+	// the first line is the greeting, keywords follow
+	if((line = strstr(line, SMTP_NEWLINE)) == NULL)
+		return;
+	for(line += SMTP_NEWLINE_LEN; *line; line = next) {
+		if((next = strstr(line, SMTP_NEWLINE)) == NULL)
+			break;
+		next += SMTP_NEWLINE_LEN;
+		if(next - line < 4 + SMTP_NEWLINE_LEN)
+			continue;
+		const char *kw = &line[4];
+
+		if(strncasecmp(kw, "CHUNKING", 8) == 0)
+			s->extensions |= SMTP_EXT_CHUNKING;
+		if(strncasecmp(kw, "PIPELINING", 10) == 0)
+			s->extensions |= SMTP_EXT_PIPELINING;
+		if(strncasecmp(kw, "STARTTLS", 8) == 0)
+			s->extensions |= SMTP_EXT_STARTTLS;
+		if(strncasecmp(kw, "SIZE", 4) == 0 &&
+				(kw[4] == ' ' || kw[4] == '\r' || kw[4] == '\n')) {
+			s->extensions |= SMTP_EXT_SIZE;
+			if(kw[4] == ' ')
+				s->size_limit = atol(&kw[5]);
+		}
+	}
+}
+
+int smtp_ehlo(smtp *s, const char *id) {
+	if(smtp__write_strings(s, "EHLO ", id, "\r\n", NULL) > 0 &&
+			smtp__read_response(s) &&
+			smtp_is_positive_response(s)) {
+		smtp__parse_ehlo(s);
+		return 1;
+	}
+	return 0;
+}
+
+int smtp_lhlo(smtp *s, const char *id) {
+	if(smtp__write_strings(s, "LHLO ", id, "\r\n", NULL) > 0 &&
+			smtp__read_response(s) &&
+			smtp_is_positive_response(s)) {
+		smtp__parse_ehlo(s);
+		s->lmtp = 1;
+		return 1;
+	}
+	return 0;
+}
+
+int smtp_starttls(smtp *s, tls_ctx *c, const char *host, const char *key) {
+	if(s->tls || smtp__write_strings(s, "STARTTLS\r\n", NULL) <= 0 ||
+			!smtp__read_response(s) || s->code != 220)
+		return 0;
+	// what came along with the reply was not protected (RFC 3207 6)
+	if(buffer_length(s->readbuf))
+		return smtp__local_reply(s, 421, "Data after STARTTLS");
+	if(!(s->tls = tls_connect(c, s->rfd, host, key, s->read_timeout)))
+		return smtp__local_reply(s, 421, "TLS handshake failed");
+	s->extensions = 0;
+	s->size_limit = 0;
+	return 1;
+}
+
+tls_conn *smtp_get_tls(smtp *s) {
+	return s->tls;
+}
+
 int smtp_mail_from(smtp *s, const char *addr) {
-	if(smtp__write_strings(s, "MAIL FROM:", addr, "\r\n", NULL) > 0 &&
+	return smtp_mail_from_size(s, addr, 0);
+}
+
+// Collects MAIL FROM, or fails with a local 552 if size is too large.
+static int smtp__write_mail(smtp *s, const char *addr, long size) {
+	char param[32] = "";
+
+	if(size > 0 && (s->extensions & SMTP_EXT_SIZE)) {
+		if(s->size_limit > 0 && size > s->size_limit)
+			return smtp__local_reply(s, 552,
+					"Message size exceeds server limit (not sent)");
+		snprintf(param, sizeof(param), " SIZE=%ld", size);
+	}
+	return smtp__write_strings(s, "MAIL FROM:", addr, param, "\r\n", NULL) > 0;
+}
+
+int smtp_mail_from_size(smtp *s, const char *addr, long size) {
+	s->lmtp_rcpts = 0;
+	if(smtp__write_mail(s, addr, size) &&
 			smtp__read_response(s) &&
 			smtp_is_positive_response(s))
 		return 1;
@@ -128,25 +853,262 @@ int smtp_mail_from(smtp *s, const char *addr) {
 int smtp_rcpt_to(smtp *s, const char *addr) {
 	if(smtp__write_strings(s, "RCPT TO:", addr, "\r\n", NULL) > 0 &&
 			smtp__read_response(s) &&
-			smtp_is_positive_response(s))
+			smtp_is_positive_response(s)) {
+		s->lmtp_rcpts++;
 		return 1;
+	}
 	return 0;
 }
 
-int smtp_data(smtp *s, smtp_data_callback cb, void *ctx) {
-	if(smtp_write_string(s, "DATA\r\n") > 0 &&
-			smtp__read_response(s) &&
-			smtp_get_code(s) == 354 &&
-			cb(s, ctx) > 0 &&
-			smtp__write_end_data(s) &&
+int smtp_rset(smtp *s) {
+	s->lmtp_rcpts = 0;
+	if(smtp__write_strings(s, "RSET\r\n", NULL) > 0 &&
 			smtp__read_response(s) &&
 			smtp_is_positive_response(s))
 		return 1;
 	return 0;
 }
 
+static int smtp__start_data(smtp *s) {
+	return smtp__write_strings(s, "DATA\r\n", NULL) > 0 &&
+		smtp__read_response(s) &&
+		smtp_get_code(s) == 354;
+}
+
+int smtp_data(smtp *s, smtp_data_callback cb, void *ctx) {
+	if(!smtp__start_data(s))
+		return 0;
+	if(cb(s, ctx) <= 0)
+		return smtp__drop(s);
+	return smtp__end_data(s);
+}
+
+int smtp_data_file(smtp *s, int fd, long offset, long len) {
+	if(!smtp__start_data(s))
+		return 0;
+	if(smtp_sendfile(s, fd, offset, len) != len)
+		return smtp__drop(s);
+	return smtp__end_data(s);
+}
+
+static int smtp__write_bdat(smtp *s, long len, int last) {
+	char cmd[48];
+	s->bdat_last = last;
+	snprintf(cmd, sizeof(cmd), "BDAT %ld%s\r\n", len, last ? " LAST" : "");
+	return smtp__write_strings(s, cmd, NULL);
+}
+
+int smtp_bdat(smtp *s, const char *buf, int len, int last) {
+	if(smtp__write_bdat(s, len, last) > 0) {
+		// small chunks travel with the command
+		if(len < SMTP_WRITE_FLUSH) {
+			if(len > 0)
+				buffer_append(s->writebuf, buf, len);
+		}
+		else if(smtp_write(s, buf, len) != len)
+			return 0;
+		return smtp__expect(s, last ? SMTP__CMD_END : SMTP__CMD_BODY, 0);
+	}
+	return 0;
+}
+
+int smtp_bdat_start(smtp *s, long len, int last) {
+	return smtp__write_bdat(s, len, last) > 0;
+}
+
+int smtp_bdat_end(smtp *s) {
+	return smtp__expect(s, s->bdat_last ? SMTP__CMD_END : SMTP__CMD_BODY, 0);
+}
+
+int smtp_bdat_file(smtp *s, int fd, long offset, long len, int last) {
+	if(smtp__write_bdat(s, len, last) <= 0)
+		return 0;
+	// what follows a short chunk would be taken for the rest of it
+	if(smtp_sendfile(s, fd, offset, len) != len)
+		return smtp__drop(s);
+	return smtp__expect(s, last ? SMTP__CMD_END : SMTP__CMD_BODY, 0);
+}
+
+// Streams the message through the wire encoder: into writebuf under
+// DATA, or as one BDAT chunk per input piece. map holds the message
+// (mapped or in memory), NULL to read a pipe.
+static int smtp__send_raw_encoded(smtp *s, int fd, const char *map,
+		long size, int chunked) {
+	char in[SMTP_RAW_CHUNK], out[RAWMSG_MAX_OUT(SMTP_RAW_CHUNK)];
+	rawmsg_state st;
+	long pos = 0;
+	int n, len;
+
+	rawmsg_init(&st, chunked ? 0 : RAWMSG_DOT_STUFF);
+	for(;;) {
+		const char *p = in;
+		if(map) {
+			n = size - pos > SMTP_RAW_CHUNK ? SMTP_RAW_CHUNK : size - pos;
+			p = map + pos;
+			pos += n;
+		} else if((n = read(fd, in, sizeof(in))) < 0) {
+			if(errno == EINTR) continue;
+			return 0;
+		}
+		if(n == 0)
+			break;
+
+		if(chunked) {
+			len = rawmsg_encode(&st, p, n, out);
+			if(!smtp_bdat(s, out, len, 0))
+				return 0;
+		} else {
+			char *o = buffer_reserve(s->writebuf, RAWMSG_MAX_OUT(n));
+			buffer_commit(s->writebuf, rawmsg_encode(&st, p, n, o));
+			if(buffer_length(s->writebuf) >= SMTP_WRITE_FLUSH &&
+					!smtp__flush_body(s))
+				return 0;
+		}
+	}
+
+	len = rawmsg_finish(&st, out);
+	if(chunked)
+		return smtp_bdat(s, out, len, 1);
+	buffer_append(s->writebuf, out, len);
+	return 1;
+}
+
+// The message of smtp_send_raw(), under DATA once the server said 354.
+static int smtp__send_raw_body(smtp *s, int fd, int chunked) {
+	struct stat sb;
+	char *map = NULL;
+	long size = 0;
+	int ok;
+
+	if(fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+		size = sb.st_size;
+		map = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(map == MAP_FAILED)
+			map = NULL;
+	}
+
+	// nothing to rewrite, let the kernel copy the file
+	if(map && rawmsg_is_clean(map, size, chunked ? 0 : RAWMSG_DOT_STUFF)) {
+		munmap(map, size);
+		if(chunked)
+			return smtp_bdat_file(s, fd, 0, size, 1);
+		return smtp_sendfile(s, fd, 0, size) == size && smtp__end_data(s);
+	}
+
+	ok = smtp__send_raw_encoded(s, fd, map, size, chunked) &&
+		(chunked || smtp__end_data(s));
+	if(map)
+		munmap(map, size);
+	return ok;
+}
+
+int smtp_send_raw(smtp *s, int fd) {
+	int chunked = smtp_has_extension(s, SMTP_EXT_CHUNKING);
+	int ok;
+
+	if(!chunked && !smtp__start_data(s))
+		return 0;
+	s->kept = buffer_length(s->writebuf);
+	s->ended = 0;
+	ok = smtp__send_raw_body(s, fd, chunked);
+	if(!s->ended)
+		return smtp__drop(s);
+	return ok;
+}
+
+int smtp_write_raw(smtp *s, const char *buf, long len) {
+	int chunked = smtp_has_extension(s, SMTP_EXT_CHUNKING);
+
+	if(len > 0 && len <= SMTP_RAW_MAX &&
+			rawmsg_is_clean(buf, len, chunked ? 0 : RAWMSG_DOT_STUFF)) {
+		if(chunked)
+			return smtp_bdat(s, buf, len, 1);
+		return smtp_write(s, buf, len) == len;
+	}
+	return smtp__send_raw_encoded(s, -1, buf, len, chunked);
+}
+
+// The commands of one transaction. Returns 1 once its end of data went
+// out, 0 if it stopped before the body.
+static int smtp__send_txn(smtp *s, smtp_txn *t, int chunked) {
+	int k, accepted = 0;
+	int pipelined = smtp_has_extension(s, SMTP_EXT_PIPELINING);
+
+	s->kept = buffer_length(s->writebuf);
+	if(!smtp__write_mail(s, t->from, t->size)) {
+		t->mail_code = s->code;
+		return 0;
+	}
+	if(!smtp__expect(s, SMTP__CMD_MAIL, 0) && !pipelined)
+		return 0;
+	for(k = 0; k < t->n_rcpts; k++) {
+		smtp__write_strings(s, "RCPT TO:", t->rcpts[k], "\r\n", NULL);
+		if(smtp__expect(s, SMTP__CMD_RCPT, k))
+			accepted++;
+		else if(smtp__lost(s))
+			return 0;
+	}
+	// without pipelining nothing was accepted for sure
+	if(!pipelined && !accepted)
+		return 0;
+
+	if(!chunked) {
+		// DATA has to wait for its 354, and so for all replies before
+		smtp__write_strings(s, "DATA\r\n", NULL);
+		smtp__expect(s, SMTP__CMD_DATA, 0);
+		while(s->n_pending)
+			if(!smtp__collect(s))
+				return 0;
+		if(t->code != 354)
+			return 0;
+	}
+	s->ended = 0;
+	if(t->fd >= 0)
+		smtp__send_raw_body(s, t->fd, chunked);
+	else if(t->cb(s, t->ctx) > 0 && !chunked)
+		smtp__end_data(s);
+	if(!s->ended) {
+		smtp__drop(s);
+		t->code = s->code;
+		return 0;
+	}
+	return 1;
+}
+
+int smtp_send_pipelined(smtp *s, smtp_txn *t, int n) {
+	int chunked = smtp_has_extension(s, SMTP_EXT_CHUNKING);
+	int open = s->txn_open, i, k;
+
+	for(i = 0; i < n; i++) {
+		t[i].mail_code = t[i].code = 0;
+		t[i].latency_us = 0;
+		for(k = 0; k < t[i].n_rcpts; k++) {
+			t[i].rcpt_codes[k] = 0;
+			if(t[i].lmtp_codes)
+				t[i].lmtp_codes[k] = 0;
+		}
+	}
+
+	s->batch = t;
+	for(i = 0; i < n && !smtp__lost(s); i++) {
+		s->batch_txn = i;
+		// the previous transaction may be left open on the server
+		if(open) {
+			smtp__write_strings(s, "RSET\r\n", NULL);
+			if(!smtp__expect(s, SMTP__CMD_RSET, 0) && smtp__lost(s))
+				break;
+		}
+		open = !smtp__send_txn(s, &t[i], chunked);
+	}
+	while(s->n_pending && smtp__collect(s))
+		;
+	s->batch = NULL;
+	s->txn_open = open;
+	return !smtp__lost(s);
+}
+
 int smtp_quit(smtp *s) {
-	if(smtp_write_string(s, "QUIT\r\n") > 0 &&
+	if(smtp__write_strings(s, "QUIT\r\n", NULL) > 0 &&
 			smtp__read_response(s))
 		return 1;
 	return 0;
@@ -159,3 +1121,19 @@ int smtp_get_code(smtp *s) {
 const char *smtp_get_msg(smtp *s) {
 	return buffer_cstr(s->msg);
 }
+
+int smtp_has_extension(smtp *s, int ext) {
+	return (s->extensions & ext) ? 1 : 0;
+}
+
+int smtp_is_lmtp(smtp *s) {
+	return s->lmtp;
+}
+
+long smtp_get_reply_latency(smtp *s) {
+	return s->latency_us;
+}
+
+long smtp_get_size_limit(smtp *s) {
+	return s->size_limit;
+}
@@ -2,8 +2,12 @@
 #	define	_SMTP_H
 
 #include <unistd.h>
+#include <sys/uio.h>
 
 #include "buffer.h"
+#include "tls.h"
+#include "trace.h"
+#include "uring.h"
 
 #ifdef SMTP_NEWLINE_UNIX
 #	define SMTP_NEWLINE		"\n"
@@ -13,39 +17,196 @@
 #	define SMTP_NEWLINE_LEN	(2)
 #endif
 
+// ESMTP extensions advertised in the EHLO reply
+#define SMTP_EXT_SIZE		(1 << 0)
+#define SMTP_EXT_CHUNKING	(1 << 1)	// BDAT, RFC 3030
+#define SMTP_EXT_PIPELINING	(1 << 2)	// RFC 2920
+#define SMTP_EXT_STARTTLS	(1 << 3)	// RFC 3207
+
+// bytes reserved in the read buffer for each read(2)
+#define SMTP_READ_SIZE		(4096)
+// longest reply, all its lines, that is kept; a server sending more
+// loses the session (local 421) instead of growing our buffers
+#define SMTP_REPLY_MAX		(64 * 1024)
+// commands and lines are collected up to this size before writing
+#define SMTP_WRITE_FLUSH	(16 * 1024)
+// input read per step by smtp_send_raw()
+#define SMTP_RAW_CHUNK		(16 * 1024)
+// largest message smtp_write_raw() sends in one write
+#define SMTP_RAW_MAX		(1 << 30)
+// replies smtp_send_pipelined() lets the server owe us; they must fit
+// in the socket buffers, or both sides could block writing
+#define SMTP_MAX_PENDING	(128)
+// most vectors smtp_writev() takes at once
+#define SMTP_IOV_MAX		(64)
+
+// what the descriptors of smtp_set_fd() are; TLS runs on top of a socket
+#define SMTP_TRANSPORT_FILE	(0)	// pipes and terminals
+#define SMTP_TRANSPORT_TCP	(1)
+#define SMTP_TRANSPORT_UNIX	(2)	// also socketpair(2)
+
 struct smtp;
+struct smtp__pending;
 
 // return > 0 means success, otherwise error
 typedef int (* smtp_data_callback) (struct smtp *s, void *ctx);
 
+// One mail transaction for smtp_send_pipelined().
+typedef struct smtp_txn {
+	const char *from;
+	char **rcpts;
+	int n_rcpts;
+	long size;		// for SIZE=, 0 if unknown
+	int fd;			// body as for smtp_send_raw(), or -1 for:
+	smtp_data_callback cb;	// writes the body: lines under DATA, or
+	void *ctx;		// smtp_bdat() chunks with SMTP_EXT_CHUNKING
+	// replies, 0 where the command was not sent
+	int mail_code;
+	int *rcpt_codes;	// n_rcpts entries
+	int code;		// DATA or the end of the body
+	// LMTP: the reply after the body for each recipient, 0 where none
+	// came (n_rcpts entries, or NULL). code is then the first failure.
+	int *lmtp_codes;
+	long latency_us;	// waiting for the reply to the end of the body
+} smtp_txn;
+
 typedef struct smtp {
 	int rfd, wfd;
 	int code;
 	int multiline_reply;
+	int extensions;
+	long size_limit;
+	int read_timeout, write_timeout;	// ms, -1 waits forever
+	long latency_us;	// time to the last complete reply
+	smtp_txn *batch;	// inside smtp_send_pipelined()
+	int batch_txn;
+	struct smtp__pending *pending;	// commands awaiting replies, a ring
+	int pending_head, n_pending;
+	int txn_open;		// the last batch may have left one open
+	int lmtp;		// after LHLO
+	int lmtp_rcpts;		// accepted by smtp_rcpt_to() since MAIL
+	int bdat_last;		// smtp_bdat_start() started the last chunk
+	int kept;		// octets of writebuf before the current message
+	int ended;		// the end of data of the message went out
+	int dropped;		// a body broke off, nothing more goes out
 	buffer_ctx *msg;
 	buffer_ctx *readbuf;
+	buffer_ctx *writebuf;
+	uring *ring;
+	tls_conn *tls;	// after STARTTLS, owned by the session
+	int transport;
+	int corked;	// TCP_CORK is on while a body goes out
+	trace *trace;	// records the session, or NULL
 } smtp;
 
+// Freed sessions keep their buffers on a per-thread freelist.
+#define SMTP_POOL_SIZE		(8)
+
 smtp *smtp_new();
 void smtp_free(smtp *s);
+// Forgets all session state but keeps the allocated buffers.
+void smtp_reset(smtp *s);
+void smtp_pool_clear();
 
+// On TCP, commands go out without Nagle delay (TCP_NODELAY). A body
+// written with smtp_write(), smtp_writev(), smtp_sendfile() or lines too
+// many for one write is corked (TCP_CORK) until its reply is awaited, so
+// it leaves in full-sized segments.
 void smtp_set_fd(smtp *s, int rfd, int wfd);
+int smtp_get_transport(smtp *s);
+// SO_SNDBUF and SO_RCVBUF of a socket, 0 keeps the system's default.
+void smtp_set_buffers(smtp *s, int sndbuf, int rcvbuf);
+// A timed out read or write fails the command with a local 421 reply.
+void smtp_set_timeouts(smtp *s, int read_ms, int write_ms);
+// Routes all socket I/O through u (may be NULL). Pending commands are
+// then submitted together with the read of their reply.
+void smtp_set_uring(smtp *s, uring *u);
+// Records everything written and read from here on into t (may be
+// NULL), as a new session with peer. With TLS the plaintext is
+// recorded, a replay cannot do the handshake.
+void smtp_set_trace(smtp *s, trace *t, const char *peer);
+// Registered I/O buffer to render DATA into, or NULL without io_uring.
+char *smtp_get_write_buffer(smtp *s, int *len);
 
 // return value: 0 error, 1 success
 int smtp_read_welcome(smtp *s);
 int smtp_helo(smtp *s, const char *id);
+int smtp_ehlo(smtp *s, const char *id);
+// LMTP (RFC 2033) instead of SMTP: the end of data is answered once for
+// each accepted recipient. smtp_send_pipelined() files those replies in
+// lmtp_codes; outside of it the end of data succeeds when all recipients
+// got the message, and the last reply is kept.
+int smtp_lhlo(smtp *s, const char *id);
+// STARTTLS and the handshake; host and key as for tls_connect(), key
+// usually the peer address. Everything from EHLO on has to be done
+// again. A failed handshake leaves the session unusable (local 421).
+// While TLS is on, io_uring is not used.
+int smtp_starttls(smtp *s, tls_ctx *c, const char *host, const char *key);
+// The session's TLS connection, NULL before STARTTLS.
+tls_conn *smtp_get_tls(smtp *s);
 int smtp_mail_from(smtp *s, const char *addr);
+// Sends SIZE=size if the server supports it, and fails without sending
+// anything if size exceeds the advertised limit (code 552).
+int smtp_mail_from_size(smtp *s, const char *addr, long size);
 int smtp_rcpt_to(smtp *s, const char *addr);
+// Aborts the current transaction.
+int smtp_rset(smtp *s);
 int smtp_data(smtp *s, smtp_data_callback cb, void *ctx);
+// DATA with a body that is already wire-ready on disk: CRLF line ends,
+// dot-stuffed, ending in CRLF. The body is sent with sendfile(2).
+int smtp_data_file(smtp *s, int fd, long offset, long len);
+// One BDAT chunk (needs SMTP_EXT_CHUNKING); no dot-stuffing applies.
+int smtp_bdat(smtp *s, const char *buf, int len, int last);
+int smtp_bdat_file(smtp *s, int fd, long offset, long len, int last);
+// A BDAT chunk the caller writes itself (smtp_write(), smtp_writev(),
+// smtp_sendfile()), exactly len octets; smtp_bdat_end() takes the reply.
+int smtp_bdat_start(smtp *s, long len, int last);
+int smtp_bdat_end(smtp *s);
+// Sends a complete RFC 5322 message read from fd (a whole regular file,
+// or a pipe up to EOF) as DATA, or as BDAT with SMTP_EXT_CHUNKING. Bare
+// LF is turned into CRLF and lines are dot-stuffed as needed; a file
+// that is already wire-ready goes out with sendfile(2).
+int smtp_send_raw(smtp *s, int fd);
+// The same for a message in memory, as the body in a smtp_txn callback:
+// lines under DATA (the final dot follows), or BDAT chunks up to LAST.
+int smtp_write_raw(smtp *s, const char *buf, long len);
+// Runs n transactions back to back. With SMTP_EXT_PIPELINING each
+// envelope (and BDAT body) goes out right behind the end of data of the
+// previous transaction, and the replies are matched to their commands
+// from a queue as they arrive: the only waits are for 354 after DATA
+// (RFC 2920 3.1). Without it every command waits for its reply. A
+// transaction starts with RSET when the previous one stopped before its
+// body, e.g. every RCPT was refused. A
+// body that breaks off (the callback fails, a file comes up short)
+// leaves the server inside the message, so the session is dropped with
+// a local 421; this holds for smtp_data() and smtp_send_raw() too.
+// Return value: 0 if the session was lost; replies that never came are
+// then 421 or -1.
+int smtp_send_pipelined(smtp *s, smtp_txn *t, int n);
 int smtp_quit(smtp *s);
 
 // return value: <0 error, >=0 success
 int smtp_write_string(smtp *s, const char *str);
 int smtp_write(smtp *s, const char *buf, int len);
 int smtp_write_line(smtp *s, const char *buf, int len);
+// Gathers up to SMTP_IOV_MAX pieces, and collected commands in front of
+// them, into as few writes as the socket takes. Returns the octets of iov
+// written, or -1.
+long smtp_writev(smtp *s, const struct iovec *iov, int n);
+// Copies a file region to the peer in the kernel where possible.
+long smtp_sendfile(smtp *s, int fd, long offset, long len);
 
 int smtp_is_positive_response(smtp *s);
+// 5xx: retrying will not help. Any other failure (4xx, the local 421
+// for timeouts and lost connections, I/O errors) is transient.
+int smtp_is_permanent_failure(smtp *s);
 int smtp_get_code(smtp *s);
+int smtp_has_extension(smtp *s, int ext);
+int smtp_is_lmtp(smtp *s);
+long smtp_get_size_limit(smtp *s);
+// Microseconds from sending the last command (or starting to wait, if
+// it went out earlier) until its complete reply; 0 without a reply.
+long smtp_get_reply_latency(smtp *s);
 const char *smtp_get_msg(smtp *s);
 
 #endif
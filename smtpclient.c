@@ -0,0 +1,575 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include "budget.h"
+#include "buffer.h"
+#include "net.h"
+#include "ratelimit.h"
+#include "rawmsg.h"
+#include "resolver.h"
+#include "smtp.h"
+#include "smtpclient.h"
+#include "tls.h"
+
+// A queued message. The result comes first, smtpclient_reap() hands it
+// out and smtpclient_result_free() gets the job back from it.
+typedef struct smtpclient__job {
+	smtpclient_result r;
+	char *from;
+	char *body;	// NULL with fd
+	long len;
+	long size;	// for SIZE=, with CRLF line ends
+	int fd;
+	smtpclient_callback cb;
+	int *rcpt_codes, *lmtp_codes;
+	struct smtpclient__job *next;
+} smtpclient__job;
+
+// A worker's connection, kept between batches.
+typedef struct smtpclient__conn {
+	smtp *s;
+	int fd;
+	resolver *res;
+} smtpclient__conn;
+
+struct smtpclient {
+	char *host;
+	int port;
+	char *socket_fn;
+	char *helo;
+	int connect_timeout, io_timeout;	// ms, -1 waits forever
+	int lmtp;
+	int tls_mode;
+	tls_ctx *tls;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_t *workers;
+	int n_workers, started, stopping;
+	smtpclient__job *head, *tail;	// to send
+	smtpclient__job *done_head, *done_tail;	// for smtpclient_reap()
+	int efd;
+	int in_flight;		// submitted, not completed yet
+	// AIMD window of workers sending at once, under lock
+	ratelimit *rl;
+	ratelimit_dest *rd;
+};
+
+static long smtpclient__now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// Waits for work with c->lock held, at most ms.
+static int smtpclient__wait(smtpclient *c, long ms) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000L;
+	if(ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	return pthread_cond_timedwait(&c->work, &c->lock, &ts);
+}
+
+smtpclient *smtpclient_new(int n_workers) {
+	smtpclient *c = (smtpclient *)malloc(sizeof(smtpclient));
+	memset(c, 0, sizeof(smtpclient));
+	c->port = 25;
+	c->helo = strdup("localhost");
+	c->connect_timeout = 30 * 1000;
+	c->io_timeout = 300 * 1000;
+	c->n_workers = n_workers > 0 ? n_workers : 1;
+	c->workers = (pthread_t *)malloc(c->n_workers * sizeof(pthread_t));
+	c->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->work, NULL);
+	// no pacing, only the window, which starts at one worker
+	c->rl = ratelimit_new(0, 0, c->n_workers);
+	c->rd = ratelimit_get(c->rl, "server");
+	return c;
+}
+
+void smtpclient_set_server(smtpclient *c, const char *host, int port) {
+	if(c->host) free(c->host);
+	c->host = strdup(host);
+	c->port = port;
+}
+
+void smtpclient_set_socket(smtpclient *c, const char *path) {
+	if(c->socket_fn) free(c->socket_fn);
+	c->socket_fn = strdup(path);
+}
+
+void smtpclient_set_timeouts(smtpclient *c, int connect_ms, int io_ms) {
+	c->connect_timeout = connect_ms;
+	c->io_timeout = io_ms;
+}
+
+void smtpclient_set_helo(smtpclient *c, const char *name) {
+	free(c->helo);
+	c->helo = strdup(name);
+}
+
+void smtpclient_set_lmtp(smtpclient *c, int on) {
+	c->lmtp = on;
+}
+
+int smtpclient_set_tls(smtpclient *c, int mode, const char *ca_file) {
+	if(c->tls)
+		tls_ctx_free(c->tls);
+	c->tls = NULL;
+	c->tls_mode = mode;
+	if(mode != SMTPCLIENT_TLS_NONE &&
+			!(c->tls = tls_ctx_new(TLS_KTLS | (ca_file ? TLS_VERIFY : 0),
+					ca_file)))
+		return 0;
+	return 1;
+}
+
+/*** Jobs ***/
+// A copied message counts against the memory budget until it is sent.
+static void smtpclient__drop_body(smtpclient__job *j) {
+	if(!j->body)
+		return;
+	free(j->body);
+	j->body = NULL;
+	budget_release(j->len);
+}
+
+// The message size SIZE= declares (RFC 1870): bare LFs are sent as
+// CRLF, doubled dots do not count. Reads fd when body is NULL.
+static long smtpclient__wire_size(const char *body, long len, int fd) {
+	char buf[SMTP_RAW_CHUNK], end[2];
+	rawmsg_state st;
+	long size = 0, off = 0;
+	int r;
+
+	rawmsg_init(&st, 0);
+	if(body)
+		return rawmsg_measure(&st, body, len) + rawmsg_finish(&st, end);
+	while((r = pread(fd, buf, sizeof(buf), off)) != 0) {
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r < 0)
+			return 0;	// unknown, SIZE= is left out
+		size += rawmsg_measure(&st, buf, r);
+		off += r;
+	}
+	return size + rawmsg_finish(&st, end);
+}
+
+static void smtpclient__job_free(smtpclient__job *j) {
+	int k;
+	for(k = 0; k < j->r.n_rcpts; k++)
+		free(j->r.rcpts[k]);
+	free(j->r.rcpts);
+	free(j->r.codes);
+	free(j->rcpt_codes);
+	free(j->lmtp_codes);
+	free(j->from);
+	smtpclient__drop_body(j);
+	free(j);
+}
+
+// Envelope addresses go in angle brackets.
+static char *smtpclient__address(const char *addr) {
+	char *a = (char *)malloc(strlen(addr) + 3);
+	if(addr[0] == '<')
+		strcpy(a, addr);
+	else
+		sprintf(a, "<%s>", addr);
+	return a;
+}
+
+static smtpclient__job *smtpclient__job_new(const char *from, char **rcpts,
+		int n_rcpts) {
+	smtpclient__job *j = (smtpclient__job *)malloc(sizeof(smtpclient__job));
+	int k;
+
+	memset(j, 0, sizeof(smtpclient__job));
+	j->from = smtpclient__address(from);
+	j->r.n_rcpts = n_rcpts;
+	j->r.rcpts = (char **)malloc(n_rcpts * sizeof(char *));
+	for(k = 0; k < n_rcpts; k++)
+		j->r.rcpts[k] = smtpclient__address(rcpts[k]);
+	j->r.codes = (int *)calloc(n_rcpts, sizeof(int));
+	j->rcpt_codes = (int *)calloc(n_rcpts, sizeof(int));
+	j->lmtp_codes = (int *)calloc(n_rcpts, sizeof(int));
+	j->fd = -1;
+	return j;
+}
+
+// Hands a finished job to its callback or the reap queue.
+static void smtpclient__complete(smtpclient *c, smtpclient__job *j) {
+	// not in flight any more before its memory wakes a waiting submitter
+	__atomic_sub_fetch(&c->in_flight, 1, __ATOMIC_SEQ_CST);
+	smtpclient__drop_body(j);
+	if(j->cb) {
+		j->cb(&j->r);
+		smtpclient__job_free(j);
+		return;
+	}
+	uint64_t one = 1;
+	pthread_mutex_lock(&c->lock);
+	j->next = NULL;
+	if(c->done_tail)
+		c->done_tail->next = j;
+	else
+		c->done_head = j;
+	c->done_tail = j;
+	pthread_mutex_unlock(&c->lock);
+	write(c->efd, &one, sizeof(one));
+}
+
+/*** Connections ***/
+static void smtpclient__close(smtpclient__conn *k, int quit) {
+	if(!k->s)
+		return;
+	if(quit)
+		smtp_quit(k->s);
+	smtp_free(k->s);
+	close(k->fd);
+	k->s = NULL;
+}
+
+static int smtpclient__hello(smtpclient *c, smtp *s) {
+	if(c->lmtp)
+		return smtp_lhlo(s, c->helo);
+	return smtp_ehlo(s, c->helo) || smtp_helo(s, c->helo);
+}
+
+static int smtpclient__open(smtpclient *c, smtpclient__conn *k) {
+	resolver_result res;
+
+	if(c->socket_fn) {
+		k->fd = net_connect_unix(c->socket_fn, c->connect_timeout);
+	} else {
+		if(!k->res)
+			k->res = resolver_new();
+		if(!c->host || resolver_wait(k->res, c->host, c->port, 0, &res) !=
+				RESOLVER_OK)
+			return 0;
+		k->fd = net_connect(&res, c->connect_timeout);
+	}
+	if(k->fd < 0)
+		return 0;
+
+	k->s = smtp_new();
+	smtp_set_fd(k->s, k->fd, k->fd);
+	smtp_set_timeouts(k->s, c->io_timeout, c->io_timeout);
+	if(smtp_read_welcome(k->s) && smtpclient__hello(c, k->s)) {
+		if(c->tls_mode == SMTPCLIENT_TLS_NONE ||
+				(c->tls_mode == SMTPCLIENT_TLS_TRY &&
+				!smtp_has_extension(k->s, SMTP_EXT_STARTTLS)))
+			return 1;
+		// sessions are resumed per server, whatever address it has
+		if(smtp_starttls(k->s, c->tls, c->host, c->socket_fn ?
+					c->socket_fn : c->host) &&
+				smtpclient__hello(c, k->s))
+			return 1;
+	}
+	smtpclient__close(k, 0);
+	return 0;
+}
+
+// Body callback for smtp_send_pipelined().
+static int smtpclient__body(smtp *s, void *ctx) {
+	smtpclient__job *j = (smtpclient__job *)ctx;
+	return smtp_write_raw(s, j->body, j->len);
+}
+
+// The reply that settled recipient k.
+static int smtpclient__code(smtp_txn *t, int k) {
+	if(t->mail_code < 200 || t->mail_code >= 300)
+		return t->mail_code;
+	if(t->rcpt_codes[k] < 200 || t->rcpt_codes[k] >= 300)
+		return t->rcpt_codes[k];
+	if(t->lmtp_codes && t->lmtp_codes[k])
+		return t->lmtp_codes[k];
+	return t->code;
+}
+
+// The reply that settled the transaction, for the window: a refused
+// MAIL, a temporary RCPT failure other than 452, or the end of data.
+static int smtpclient__txn_code(smtp_txn *t) {
+	int k;
+	if(t->mail_code && (t->mail_code < 200 || t->mail_code >= 300))
+		return t->mail_code;
+	for(k = 0; k < t->n_rcpts; k++)
+		if(t->rcpt_codes[k] >= 400 && t->rcpt_codes[k] < 500 &&
+				t->rcpt_codes[k] != 452)
+			return t->rcpt_codes[k];
+	return t->code;
+}
+
+// Reports a batch's replies to the window, t NULL for no connection.
+static void smtpclient__feedback(smtpclient *c, smtp_txn *t, int n) {
+	int i;
+
+	pthread_mutex_lock(&c->lock);
+	if(!t)
+		ratelimit_feedback(c->rl, c->rd, 421, 0, smtpclient__now());
+	for(i = 0; t && i < n; i++)
+		if(smtpclient__txn_code(&t[i]))
+			ratelimit_feedback(c->rl, c->rd, smtpclient__txn_code(&t[i]),
+					t[i].latency_us, smtpclient__now());
+	pthread_mutex_unlock(&c->lock);
+}
+
+// Sends a batch on the worker's connection. A kept connection the
+// server has closed in the meantime fails at once: the batch then gets
+// one more try on a new one.
+static void smtpclient__deliver(smtpclient *c, smtpclient__conn *k,
+		smtpclient__job **jobs, int n) {
+	smtp_txn t[SMTPCLIENT_BATCH];
+	int i, m, attempt;
+
+	for(attempt = 0; attempt < 2; attempt++) {
+		int reused = k->s != NULL;
+		if(!k->s && !smtpclient__open(c, k)) {
+			smtpclient__feedback(c, NULL, 0);
+			break;
+		}
+
+		memset(t, 0, n * sizeof(smtp_txn));
+		for(i = 0; i < n; i++) {
+			smtpclient__job *j = jobs[i];
+			t[i].from = j->from;
+			t[i].rcpts = j->r.rcpts;
+			t[i].n_rcpts = j->r.n_rcpts;
+			t[i].size = j->size;
+			t[i].fd = j->fd;
+			t[i].cb = &smtpclient__body;
+			t[i].ctx = j;
+			t[i].rcpt_codes = j->rcpt_codes;
+			t[i].lmtp_codes = smtp_is_lmtp(k->s) ? j->lmtp_codes : NULL;
+			// a file is sent from its start again on a retry
+			if(j->fd >= 0)
+				lseek(j->fd, 0, SEEK_SET);
+		}
+		int alive = smtp_send_pipelined(k->s, t, n);
+		if(!alive)
+			smtpclient__close(k, 0);
+		if(!alive && reused && t[0].mail_code == 421)
+			continue;
+
+		for(i = 0; i < n; i++)
+			for(m = 0; m < t[i].n_rcpts; m++)
+				jobs[i]->r.codes[m] = smtpclient__code(&t[i], m);
+		smtpclient__feedback(c, t, n);
+		break;
+	}
+}
+
+// set on worker threads, where callbacks run
+static __thread int smtpclient__on_worker;
+
+static void *smtpclient__worker(void *arg) {
+	smtpclient *c = (smtpclient *)arg;
+	smtpclient__conn k = { NULL, -1, NULL };
+	smtpclient__job *jobs[SMTPCLIENT_BATCH];
+	int i, n;
+	sigset_t set;
+
+	smtpclient__on_worker = 1;
+	// a closed connection is an error return, not a signal for the host
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_mutex_lock(&c->lock);
+	for(;;) {
+		while(!c->head && !c->stopping) {
+			if(!k.s) {
+				pthread_cond_wait(&c->work, &c->lock);
+				continue;
+			}
+			if(smtpclient__wait(c, SMTPCLIENT_IDLE) == ETIMEDOUT &&
+					!c->head) {
+				pthread_mutex_unlock(&c->lock);
+				smtpclient__close(&k, 1);
+				pthread_mutex_lock(&c->lock);
+			}
+		}
+		if(!c->head)
+			break;
+		// a full window waits for another worker's batch to finish
+		long wait = ratelimit_connect(c->rl, c->rd, smtpclient__now());
+		if(wait) {
+			smtpclient__wait(c, wait);
+			continue;
+		}
+
+		for(n = 0; c->head && n < SMTPCLIENT_BATCH; n++) {
+			jobs[n] = c->head;
+			c->head = c->head->next;
+		}
+		if(!c->head)
+			c->tail = NULL;
+		pthread_mutex_unlock(&c->lock);
+
+		smtpclient__deliver(c, &k, jobs, n);
+		pthread_mutex_lock(&c->lock);
+		ratelimit_done(c->rd);
+		pthread_cond_broadcast(&c->work);
+		pthread_mutex_unlock(&c->lock);
+		for(i = 0; i < n; i++)
+			smtpclient__complete(c, jobs[i]);
+		pthread_mutex_lock(&c->lock);
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	smtpclient__close(&k, 1);
+	if(k.res)
+		resolver_free(k.res);
+	// the freelists are per thread
+	smtp_pool_clear();
+	buffer_pool_clear();
+	return NULL;
+}
+
+/*** Submitting ***/
+// Backpressure: over the memory budget, a new message waits until
+// messages in flight have been sent. With none in flight, waiting
+// would not free anything. The timeout covers completions that release
+// no memory (smtpclient_submit_fd()). A callback submitting more never
+// waits: its worker is the one that would have to send something.
+static void smtpclient__throttle(smtpclient *c, long len) {
+	if(smtpclient__on_worker)
+		return;
+	while(!budget_room(len) &&
+			__atomic_load_n(&c->in_flight, __ATOMIC_SEQ_CST) > 0)
+		budget_wait(len, 100);
+}
+
+static int smtpclient__queue(smtpclient *c, smtpclient__job *j) {
+	int i, ok = 1;
+
+	pthread_mutex_lock(&c->lock);
+	if(c->stopping) {
+		ok = 0;
+	} else {
+		if(!c->started) {
+			for(i = 0; i < c->n_workers; i++)
+				pthread_create(&c->workers[i], NULL, &smtpclient__worker, c);
+			c->started = 1;
+		}
+		if(c->tail)
+			c->tail->next = j;
+		else
+			c->head = j;
+		c->tail = j;
+		__atomic_add_fetch(&c->in_flight, 1, __ATOMIC_SEQ_CST);
+		pthread_cond_signal(&c->work);
+	}
+	pthread_mutex_unlock(&c->lock);
+	if(!ok)
+		smtpclient__job_free(j);
+	return ok;
+}
+
+int smtpclient_submit(smtpclient *c, const char *from, char **rcpts,
+		int n_rcpts, const char *msg, long len, smtpclient_callback cb,
+		void *ctx) {
+	if(n_rcpts <= 0 || len <= 0)
+		return 0;
+	smtpclient__throttle(c, len);
+	smtpclient__job *j = smtpclient__job_new(from, rcpts, n_rcpts);
+	j->body = (char *)malloc(len);
+	memcpy(j->body, msg, len);
+	budget_charge(len);
+	j->len = len;
+	j->size = smtpclient__wire_size(msg, len, -1);
+	j->cb = cb;
+	j->r.ctx = ctx;
+	return smtpclient__queue(c, j);
+}
+
+int smtpclient_submit_fd(smtpclient *c, const char *from, char **rcpts,
+		int n_rcpts, int fd, smtpclient_callback cb, void *ctx) {
+	struct stat sb;
+	if(n_rcpts <= 0 || fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode))
+		return 0;
+	smtpclient__throttle(c, 0);
+	smtpclient__job *j = smtpclient__job_new(from, rcpts, n_rcpts);
+	j->fd = fd;
+	j->len = sb.st_size;
+	j->size = smtpclient__wire_size(NULL, 0, fd);
+	j->cb = cb;
+	j->r.ctx = ctx;
+	return smtpclient__queue(c, j);
+}
+
+/*** Results ***/
+int smtpclient_eventfd(smtpclient *c) {
+	return c->efd;
+}
+
+smtpclient_result *smtpclient_reap(smtpclient *c) {
+	uint64_t n;
+	pthread_mutex_lock(&c->lock);
+	smtpclient__job *j = c->done_head;
+	if(j) {
+		c->done_head = j->next;
+		if(!c->done_head)
+			c->done_tail = NULL;
+	} else {
+		// drained, poll(2) waits for the next one
+		read(c->efd, &n, sizeof(n));
+	}
+	pthread_mutex_unlock(&c->lock);
+	return j ? &j->r : NULL;
+}
+
+void smtpclient_result_free(smtpclient_result *r) {
+	smtpclient__job_free((smtpclient__job *)r);
+}
+
+int smtpclient_delivered(const smtpclient_result *r) {
+	int k, n = 0;
+	for(k = 0; k < r->n_rcpts; k++)
+		if(r->codes[k] >= 200 && r->codes[k] < 300)
+			n++;
+	return n;
+}
+
+void smtpclient_free(smtpclient *c) {
+	int i;
+
+	pthread_mutex_lock(&c->lock);
+	c->stopping = 1;
+	pthread_cond_broadcast(&c->work);
+	pthread_mutex_unlock(&c->lock);
+	if(c->started)
+		for(i = 0; i < c->n_workers; i++)
+			pthread_join(c->workers[i], NULL);
+
+	while(c->done_head) {
+		smtpclient__job *j = c->done_head;
+		c->done_head = j->next;
+		smtpclient__job_free(j);
+	}
+	if(c->tls)
+		tls_ctx_free(c->tls);
+	ratelimit_free(c->rl);
+	pthread_cond_destroy(&c->work);
+	pthread_mutex_destroy(&c->lock);
+	close(c->efd);
+	free(c->workers);
+	if(c->host) free(c->host);
+	if(c->socket_fn) free(c->socket_fn);
+	free(c->helo);
+	free(c);
+}
@@ -0,0 +1,74 @@
+#ifndef _SMTPCLIENT_H
+#	define _SMTPCLIENT_H
+
+// Asynchronous sending for programs that link the library instead of
+// running the client per message. smtpclient_submit() queues a message
+// and returns; worker threads take what is queued, batch it onto their
+// connections (pipelined, see smtp_send_pipelined()) and keep those
+// open for the next messages. Completion is reported to a callback, or
+// queued for smtpclient_reap() with an eventfd to poll.
+// The workers sending at once are held to an AIMD window (ratelimit.h):
+// it starts at one, grows with fast 2xx replies and halves on 4xx
+// replies, failed connections or replies that get much slower.
+
+// messages a worker takes off the queue for one batch
+#define SMTPCLIENT_BATCH	(32)
+// ms an unused connection is kept open
+#define SMTPCLIENT_IDLE		(5000)
+
+#define SMTPCLIENT_TLS_NONE	(0)
+#define SMTPCLIENT_TLS_TRY	(1)	// STARTTLS when offered
+#define SMTPCLIENT_TLS_REQUIRE	(2)
+
+typedef struct smtpclient smtpclient;
+
+typedef struct smtpclient_result {
+	void *ctx;		// as given to smtpclient_submit()
+	int n_rcpts;
+	char **rcpts;
+	// the reply that settled each recipient: to MAIL or RCPT if those
+	// failed, otherwise to the end of data (with LMTP its own one).
+	// 0 where none came, e.g. no connection.
+	int *codes;
+} smtpclient_result;
+
+// Runs on a worker thread, r is freed when it returns.
+typedef void (* smtpclient_callback) (smtpclient_result *r);
+
+// Nothing starts before the first message is submitted, so the setters
+// have to come first.
+smtpclient *smtpclient_new(int n_workers);
+// Delivers what is still queued, then stops the workers.
+void smtpclient_free(smtpclient *c);
+
+// Relay host (resolved as an address, no MX lookup) and port.
+void smtpclient_set_server(smtpclient *c, const char *host, int port);
+// Local server on a Unix domain socket, instead of a host.
+void smtpclient_set_socket(smtpclient *c, const char *path);
+void smtpclient_set_timeouts(smtpclient *c, int connect_ms, int io_ms);
+void smtpclient_set_helo(smtpclient *c, const char *name);
+void smtpclient_set_lmtp(smtpclient *c, int on);
+// ca_file checks the server's certificate against host, NULL does not.
+int smtpclient_set_tls(smtpclient *c, int mode, const char *ca_file);
+
+// Queues a complete RFC 5322 message (bare LF is fine), copied. With cb
+// NULL the result goes to smtpclient_reap(). Returns 0 if it cannot be
+// queued. Over the memory budget (budget.h) it first waits for messages
+// in flight to be sent, except in a callback, which queues right away.
+int smtpclient_submit(smtpclient *c, const char *from, char **rcpts,
+		int n_rcpts, const char *msg, long len, smtpclient_callback cb,
+		void *ctx);
+// The same for a message in the regular file fd, which has to stay open
+// until the message is completed.
+int smtpclient_submit_fd(smtpclient *c, const char *from, char **rcpts,
+		int n_rcpts, int fd, smtpclient_callback cb, void *ctx);
+
+// Readable while results are waiting for smtpclient_reap().
+int smtpclient_eventfd(smtpclient *c);
+// A completed message submitted without callback, NULL if none.
+smtpclient_result *smtpclient_reap(smtpclient *c);
+void smtpclient_result_free(smtpclient_result *r);
+// Recipients of r with a 2xx reply.
+int smtpclient_delivered(const smtpclient_result *r);
+
+#endif
@@ -0,0 +1,621 @@
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "buffer.h"
+#include "mime.h"
+#include "net.h"
+#include "planner.h"
+#include "probes.h"
+#include "resolver.h"
+#include "smtp.h"
+
+// Synthetic load for the sending pipeline: messages with sizes,
+// attachments and recipients drawn from the given distributions are
+// rendered and sent like the client does, to a built-in sink or a
+// server, and throughput and latency are reported. The workload only
+// depends on the seed, not on the number of connections.
+
+#define LINE_WRAP	(76)
+// attachments are picked from this many files, their sizes drawn once
+#define ATTACH_POOL	(32)
+#define MAX_ATTACH	(16)
+#define MAX_RCPTS	(1000)
+
+typedef struct Config {
+	int n_msgs, n_conns;
+	double size_kb, size_spread;	// text body: median and sigma
+	int max_attach;
+	double attach_kb;
+	int max_rcpts, n_domains;
+	double personalized;	// share of messages with a copy per recipient
+	int line_writer;	// mimemsg_write_line() instead of the cursor
+	int chunking;		// the sink offers CHUNKING
+	char *host;
+	int port;
+	char *socket_fn;
+	unsigned seed;
+} Config;
+
+// One message of the workload.
+typedef struct Load {
+	long text_len;
+	int n_attach;
+	int attach[MAX_ATTACH];	// into the pool
+	int n_rcpts;
+	int first_rcpt;		// recipients are consecutive user numbers
+	int personalized;
+} Load;
+
+typedef struct Run {
+	Config *c;
+	Load *loads;
+	char *text;		// longest body text, messages take a prefix
+	char *attach_fn[ATTACH_POOL];
+	int next;		// next message to send
+	pthread_mutex_t lock;
+	double *latency_ms;	// by message, < 0 if it failed
+	long octets, txns, rcpts;
+} Run;
+
+static int Error(const char *msg) {
+	fprintf(stderr, "%s", msg);
+	return 0;
+}
+
+static int Usage(char *argv[]) {
+	fprintf(stderr,
+			"Usage: %s\n"
+			" [-n messages]  (default 1000)\n"
+			" [-j connections]  (default 1, a thread each)\n"
+			" [-s size_kb[,spread]]  (text body, log-normal: median and\n"
+			"                         sigma, default 4,1)\n"
+			" [-a max_attachments[,size_kb]]  (0 to max per message,\n"
+			"                                  median size, default 0,64)\n"
+			" [-r max_rcpts[,domains]]  (1 to max per message, spread over\n"
+			"                            domains, default 1,1)\n"
+			" [-P ratio]  (share of personalized messages, default 0)\n"
+			" [-L]  (render with mimemsg_write_line(), not the cursor)\n"
+			" [-C]  (the built-in sink offers CHUNKING)\n"
+			" [-h host -p port | -U socket_path]  (default: built-in sink)\n"
+			" [-S seed]\n"
+			" [-Z rate]  (count every rate-th probe hit and report them,\n"
+			"             see probes.h)\n",
+			argv[0]);
+	return 0;
+}
+
+static int ParseArgs(int argc, char *argv[], Config *c) {
+	int ch;
+
+	c->n_msgs = 1000;
+	c->n_conns = 1;
+	c->size_kb = 4;
+	c->size_spread = 1;
+	c->attach_kb = 64;
+	c->max_rcpts = c->n_domains = 1;
+	c->port = 25;
+	c->seed = 1;
+	while((ch = getopt(argc, argv, "n:j:s:a:r:P:LCh:p:U:S:Z:")) != -1) {
+		switch(ch) {
+			case 'n':
+				c->n_msgs = atoi(optarg);
+				break;
+			case 'j':
+				c->n_conns = atoi(optarg);
+				break;
+			case 's':
+				if(sscanf(optarg, "%lf,%lf", &c->size_kb, &c->size_spread) < 1)
+					return Error("Invalid -s argument.\n");
+				break;
+			case 'a':
+				if(sscanf(optarg, "%d,%lf", &c->max_attach, &c->attach_kb) < 1 ||
+						c->max_attach > MAX_ATTACH)
+					return Error("Invalid -a argument.\n");
+				break;
+			case 'r':
+				if(sscanf(optarg, "%d,%d", &c->max_rcpts, &c->n_domains) < 1 ||
+						c->max_rcpts > MAX_RCPTS)
+					return Error("Invalid -r argument.\n");
+				break;
+			case 'P':
+				c->personalized = atof(optarg);
+				break;
+			case 'L':
+				c->line_writer = 1;
+				break;
+			case 'C':
+				c->chunking = 1;
+				break;
+			case 'h':
+				c->host = optarg;
+				break;
+			case 'p':
+				c->port = atoi(optarg);
+				break;
+			case 'U':
+				c->socket_fn = optarg;
+				break;
+			case 'S':
+				c->seed = atoi(optarg);
+				break;
+			case 'Z':
+				if(atoi(optarg) <= 0)
+					return Error("Invalid -Z argument.\n");
+				probes_set_sampling(atoi(optarg));
+				break;
+			default:
+				return 0;
+		}
+	}
+	if(c->n_msgs <= 0 || c->n_conns <= 0 || c->size_kb <= 0 ||
+			c->max_rcpts <= 0 || c->n_domains <= 0)
+		return Error("Counts and sizes have to be positive.\n");
+	return 1;
+}
+
+/*** Workload ***/
+static double Uniform(unsigned *seed) {
+	return (rand_r(seed) + 0.5) / (RAND_MAX + 1.0);
+}
+
+// Log-normal with the given median, Box-Muller.
+static double LogNormal(unsigned *seed, double median, double sigma) {
+	double z = sqrt(-2 * log(Uniform(seed))) * cos(2 * M_PI * Uniform(seed));
+	return median * exp(sigma * z);
+}
+
+static void MakeText(char *buf, long len) {
+	static const char *words[] = { "lorem", "ipsum", "dolor", "sit", "amet",
+		"consectetur", "adipiscing", "elit", "sed", "do", "eiusmod", "tempor" };
+	long i = 0;
+	int w = 0, col = 0;
+
+	while(i < len) {
+		const char *word = words[w++ % 12];
+		int n = strlen(word);
+		if(col + n + 1 > 72) {
+			buf[i++] = '\n';
+			col = 0;
+			continue;
+		}
+		if(i + n + 1 > len)
+			break;
+		memcpy(&buf[i], word, n);
+		buf[i + n] = ' ';
+		i += n + 1;
+		col += n + 1;
+	}
+	memset(&buf[i], '.', len - i);
+	buf[len] = '\0';
+}
+
+// The whole workload up front, from the seed alone.
+static int MakeLoad(Run *run, const char *dir) {
+	Config *c = run->c;
+	unsigned seed = c->seed;
+	long longest = 0;
+	int i, k;
+
+	run->loads = (Load *)malloc(c->n_msgs * sizeof(Load));
+	for(i = 0; i < c->n_msgs; i++) {
+		Load *l = &run->loads[i];
+		l->text_len = LogNormal(&seed, c->size_kb * 1024, c->size_spread);
+		if(l->text_len < 16)
+			l->text_len = 16;
+		if(l->text_len > longest)
+			longest = l->text_len;
+		l->n_attach = c->max_attach ? rand_r(&seed) % (c->max_attach + 1) : 0;
+		for(k = 0; k < l->n_attach; k++)
+			l->attach[k] = rand_r(&seed) % ATTACH_POOL;
+		l->n_rcpts = 1 + rand_r(&seed) % c->max_rcpts;
+		l->first_rcpt = rand_r(&seed) % 1000000000;
+		l->personalized = Uniform(&seed) < c->personalized;
+	}
+	run->text = (char *)malloc(longest + 1);
+	MakeText(run->text, longest);
+
+	for(i = 0; c->max_attach && i < ATTACH_POOL; i++) {
+		char fn[256];
+		long len = LogNormal(&seed, c->attach_kb * 1024, 1), done;
+		snprintf(fn, sizeof(fn), "%s/attach%02d.bin", dir, i);
+		FILE *f = fopen(fn, "w");
+		if(!f)
+			return Error("Cannot create the attachments.\n");
+		for(done = 0; done < len; done++)
+			fputc(rand_r(&seed) & 0xff, f);
+		fclose(f);
+		run->attach_fn[i] = strdup(fn);
+	}
+	return 1;
+}
+
+static void Address(char *buf, int size, Config *c, int user) {
+	snprintf(buf, size, "<user%u@d%u.example>", (unsigned)user,
+			(unsigned)user % c->n_domains);
+}
+
+// The message for one recipient, or for all with recipient < 0.
+static mime_msg *MakeMessage(Run *run, Load *l, int recipient) {
+	mime_msg *m = mimemsg_new();
+	char *text = (char *)malloc(l->text_len + 64);
+	int k, off = 0;
+
+	mimemsg_set_header(m, "From", "<load@test.example>");
+	mimemsg_set_header(m, "Subject", "Load test");
+	if(recipient >= 0)
+		off = sprintf(text, "Dear user%u,\n\n", (unsigned)recipient);
+	memcpy(&text[off], run->text, l->text_len);
+	text[off + l->text_len] = '\0';
+	mimemsg_add_part(m, mimepart_new_plain(text));
+	free(text);
+	for(k = 0; k < l->n_attach; k++)
+		mimemsg_add_part(m, mimepart_new_attachment(run->attach_fn[l->attach[k]]));
+	return m;
+}
+
+/*** Sending ***/
+static int line_cb(void *ctx, const void *buf, int len) {
+	return smtp_write_line((smtp *)ctx, (const char *)buf, len);
+}
+
+// The cursor renders for DATA, or in BDAT chunks.
+static int body_cb(smtp *s, void *ctx) {
+	mime_msg *m = (mime_msg *)ctx;
+	char buf[MIMECURSOR_CHUNK * 4];
+	int chunked = smtp_has_extension(s, SMTP_EXT_CHUNKING);
+	int r, ok = 1;
+
+	mime_cursor *c = mimecursor_new(m, LINE_WRAP,
+			chunked ? 0 : MIMECURSOR_DOT_STUFF);
+	while(ok && (r = mimecursor_read(c, buf, sizeof(buf))) > 0)
+		ok = chunked ? smtp_bdat(s, buf, r, 0) : smtp_write(s, buf, r) >= 0;
+	mimecursor_free(c);
+	if(!ok || r < 0)
+		return -1;
+	return chunked ? (smtp_bdat(s, "", 0, 1) ? 1 : -1) : 1;
+}
+
+// Line by line, under DATA only. A failed write leaves a local 421.
+static int line_body_cb(smtp *s, void *ctx) {
+	mimemsg_write_line((mime_msg *)ctx, LINE_WRAP, &line_cb, s);
+	return smtp_get_code(s) == 421 ? -1 : 1;
+}
+
+static double NowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int Connect(Config *c) {
+	resolver_result res;
+	int fd = -1;
+
+	if(c->socket_fn)
+		return net_connect_unix(c->socket_fn, 10000);
+	resolver *r = resolver_new();
+	if(resolver_wait(r, c->host, c->port, 0, &res) == RESOLVER_OK)
+		fd = net_connect(&res, 10000);
+	resolver_free(r);
+	return fd;
+}
+
+// Sends one message: a transaction per recipient domain, or per
+// recipient when personalized. Returns its latency in ms, < 0 if not
+// every recipient took it.
+static double SendLoad(Run *run, smtp *s, Load *l) {
+	Config *c = run->c;
+	smtp_txn t[MAX_RCPTS];
+	mime_msg *msgs[MAX_RCPTS];
+	char addr[64];
+	int i, k, n = 0, ok = 1;
+	long octets = 0;
+	planner *p = planner_new();
+
+	for(i = 0; i < l->n_rcpts; i++) {
+		Address(addr, sizeof(addr), c, l->first_rcpt + i);
+		planner_add(p, addr);
+	}
+	planner_plan(p, PLANNER_MAX_RCPTS, NULL, NULL);
+
+	double start = NowMs();
+	if(!l->personalized)
+		msgs[0] = MakeMessage(run, l, -1);
+	for(i = 0; i < (l->personalized ? p->n_rcpts : p->n_groups); i++) {
+		planner_group *g = l->personalized ? NULL : &p->groups[i];
+		mime_msg *m = l->personalized ? MakeMessage(run, l, l->first_rcpt + i) :
+			msgs[0];
+		memset(&t[n], 0, sizeof(smtp_txn));
+		t[n].from = "<load@test.example>";
+		t[n].n_rcpts = g ? g->n_rcpts : 1;
+		t[n].rcpts = (char **)malloc(t[n].n_rcpts * sizeof(char *));
+		for(k = 0; k < t[n].n_rcpts; k++)
+			t[n].rcpts[k] = p->rcpts[g ? g->rcpts[k] : i];
+		t[n].size = mimemsg_get_size(m, LINE_WRAP);
+		t[n].fd = -1;
+		t[n].cb = c->line_writer ? &line_body_cb : &body_cb;
+		t[n].ctx = m;
+		t[n].rcpt_codes = (int *)malloc(t[n].n_rcpts * sizeof(int));
+		msgs[n] = m;
+		octets += t[n].size;
+		n++;
+	}
+	if(!smtp_send_pipelined(s, t, n))
+		ok = 0;
+	double took = NowMs() - start;
+
+	for(i = 0; i < n; i++) {
+		if(t[i].code < 200 || t[i].code >= 300)
+			ok = 0;
+		for(k = 0; k < t[i].n_rcpts; k++)
+			if(t[i].rcpt_codes[k] < 200 || t[i].rcpt_codes[k] >= 300)
+				ok = 0;
+		free(t[i].rcpts);
+		free(t[i].rcpt_codes);
+		if(l->personalized || i == 0)
+			mimemsg_free(msgs[i]);
+	}
+	pthread_mutex_lock(&run->lock);
+	run->octets += octets;
+	run->txns += n;
+	run->rcpts += p->n_rcpts;
+	pthread_mutex_unlock(&run->lock);
+	planner_free(p);
+	return ok ? took : -1;
+}
+
+static void *Worker(void *arg) {
+	Run *run = (Run *)arg;
+	Config *c = run->c;
+	int fd = Connect(c);
+	smtp *s = smtp_new();
+	int i;
+
+	smtp_set_fd(s, fd, fd);
+	smtp_set_timeouts(s, 30000, 30000);
+	if(fd < 0 || !smtp_read_welcome(s) ||
+			(!smtp_ehlo(s, "load.test.example") &&
+			 !smtp_helo(s, "load.test.example"))) {
+		fprintf(stderr, "No session: %s", fd < 0 ? "no connection\n" :
+				smtp_get_msg(s));
+		smtp_free(s);
+		if(fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	// the line writer dot-stuffs, BDAT must not be
+	if(c->line_writer)
+		s->extensions &= ~SMTP_EXT_CHUNKING;
+
+	for(;;) {
+		pthread_mutex_lock(&run->lock);
+		i = run->next < c->n_msgs ? run->next++ : -1;
+		pthread_mutex_unlock(&run->lock);
+		if(i < 0)
+			break;
+		run->latency_ms[i] = SendLoad(run, s, &run->loads[i]);
+	}
+	smtp_quit(s);
+	smtp_free(s);
+	close(fd);
+	smtp_pool_clear();
+	mimepart_pool_clear();
+	buffer_pool_clear();
+	return NULL;
+}
+
+/*** Sink ***/
+// Takes everything and says yes, a thread per connection.
+typedef struct Sink {
+	int fd;
+	char buf[64 * 1024];
+	int start, len;
+} Sink;
+
+static int SinkFill(Sink *k) {
+	if(k->start) {
+		memmove(k->buf, &k->buf[k->start], k->len);
+		k->start = 0;
+	}
+	int r = read(k->fd, &k->buf[k->len], sizeof(k->buf) - k->len);
+	if(r <= 0)
+		return 0;
+	k->len += r;
+	return 1;
+}
+
+// The next line, NUL terminated in place without its CRLF.
+static char *SinkLine(Sink *k) {
+	char *eol;
+	while(!(eol = memchr(&k->buf[k->start], '\n', k->len))) {
+		if(k->len == sizeof(k->buf))
+			k->len = 0;	// longer than any line we care about
+		if(!SinkFill(k))
+			return NULL;
+	}
+	char *line = &k->buf[k->start];
+	int n = eol - line + 1;
+	*eol = '\0';
+	if(eol > line && eol[-1] == '\r')
+		eol[-1] = '\0';
+	k->start += n;
+	k->len -= n;
+	return line;
+}
+
+// Drops n octets of BDAT data.
+static int SinkSkip(Sink *k, long n) {
+	while(n > 0) {
+		if(!k->len && !SinkFill(k))
+			return 0;
+		int take = k->len < n ? k->len : n;
+		k->start += take;
+		k->len -= take;
+		n -= take;
+	}
+	return 1;
+}
+
+static void SinkWrite(Sink *k, const char *str) {
+	write(k->fd, str, strlen(str));
+}
+
+static void *SinkSession(void *arg) {
+	Sink *k = (Sink *)calloc(1, sizeof(Sink));
+	int chunking = ((long)arg) & 1;
+	char *line;
+
+	k->fd = (long)arg >> 1;
+	SinkWrite(k, "220 sink\r\n");
+	while((line = SinkLine(k))) {
+		if(!strncasecmp(line, "EHLO", 4)) {
+			SinkWrite(k, chunking ? "250-sink\r\n250-PIPELINING\r\n"
+					"250-8BITMIME\r\n250 CHUNKING\r\n" :
+					"250-sink\r\n250-PIPELINING\r\n250 8BITMIME\r\n");
+		} else if(!strncasecmp(line, "DATA", 4)) {
+			SinkWrite(k, "354 go ahead\r\n");
+			while((line = SinkLine(k)) && strcmp(line, "."))
+				;
+			SinkWrite(k, "250 queued\r\n");
+		} else if(!strncasecmp(line, "BDAT", 4)) {
+			int last = strstr(line, "LAST") != NULL;
+			if(!SinkSkip(k, atol(&line[5])))
+				break;
+			SinkWrite(k, last ? "250 queued\r\n" : "250 chunk\r\n");
+		} else if(!strncasecmp(line, "QUIT", 4)) {
+			SinkWrite(k, "221 bye\r\n");
+			break;
+		} else {
+			SinkWrite(k, "250 ok\r\n");
+		}
+	}
+	close(k->fd);
+	free(k);
+	return NULL;
+}
+
+static void *SinkListener(void *arg) {
+	int lfd = (long)arg >> 1, chunking = (long)arg & 1, fd;
+	while((fd = accept(lfd, NULL, NULL)) >= 0) {
+		pthread_t t;
+		pthread_create(&t, NULL, &SinkSession, (void *)((long)fd << 1 | chunking));
+		pthread_detach(t);
+	}
+	return NULL;
+}
+
+static int StartSink(const char *path, int chunking) {
+	struct sockaddr_un sun;
+	pthread_t t;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+	int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(lfd < 0 || bind(lfd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+			listen(lfd, 64) < 0)
+		return -1;
+	pthread_create(&t, NULL, &SinkListener, (void *)((long)lfd << 1 | chunking));
+	pthread_detach(t);
+	return lfd;
+}
+
+/*** Report ***/
+static int CompareMs(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void Report(Run *run, double ms) {
+	Config *c = run->c;
+	double *sorted = (double *)malloc(c->n_msgs * sizeof(double));
+	int i, n = 0;
+
+	for(i = 0; i < c->n_msgs; i++)
+		if(run->latency_ms[i] >= 0)
+			sorted[n++] = run->latency_ms[i];
+	qsort(sorted, n, sizeof(double), &CompareMs);
+
+	printf("%d messages (%d failed), %ld transactions, %ld recipients, "
+			"%.1f MB in %.3f s\n", c->n_msgs, c->n_msgs - n, run->txns,
+			run->rcpts, run->octets / 1048576.0, ms / 1000);
+	printf("throughput: %.1f messages/s, %.1f transactions/s, %.1f MB/s\n",
+			n / ms * 1000, run->txns / ms * 1000,
+			run->octets / 1048576.0 / ms * 1000);
+	if(n)
+		printf("latency ms: p50 %.2f, p90 %.2f, p99 %.2f, max %.2f\n",
+				sorted[n / 2], sorted[n * 9 / 10], sorted[n * 99 / 100],
+				sorted[n - 1]);
+	free(sorted);
+}
+
+int main(int argc, char *argv[]) {
+	char dir[] = "/tmp/smtpload.XXXXXX", sink_fn[64];
+	Config cfg;
+	Run run;
+	int i, lfd = -1;
+
+	memset(&cfg, 0, sizeof(cfg));
+	memset(&run, 0, sizeof(run));
+	if(!ParseArgs(argc, argv, &cfg))
+		return Usage(argv) + 1;
+	if(!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	// a server may hang up while we are still writing
+	signal(SIGPIPE, SIG_IGN);
+
+	run.c = &cfg;
+	pthread_mutex_init(&run.lock, NULL);
+	run.latency_ms = (double *)malloc(cfg.n_msgs * sizeof(double));
+	for(i = 0; i < cfg.n_msgs; i++)
+		run.latency_ms[i] = -1;
+	if(!cfg.host && !cfg.socket_fn) {
+		snprintf(sink_fn, sizeof(sink_fn), "%s/sink", dir);
+		if((lfd = StartSink(sink_fn, cfg.chunking)) >= 0)
+			cfg.socket_fn = sink_fn;
+		else
+			Error("Cannot start the sink.\n");
+	}
+
+	if(cfg.host || cfg.socket_fn) {
+		if(MakeLoad(&run, dir)) {
+			pthread_t *workers = (pthread_t *)malloc(cfg.n_conns * sizeof(pthread_t));
+			double start = NowMs();
+			for(i = 0; i < cfg.n_conns; i++)
+				pthread_create(&workers[i], NULL, &Worker, &run);
+			for(i = 0; i < cfg.n_conns; i++)
+				pthread_join(workers[i], NULL);
+			Report(&run, NowMs() - start);
+			if(probes_rate)
+				probes_report(stdout);
+			free(workers);
+		}
+	}
+
+	if(lfd >= 0) {
+		shutdown(lfd, SHUT_RDWR);
+		close(lfd);
+		unlink(sink_fn);
+	}
+	for(i = 0; i < ATTACH_POOL; i++)
+		if(run.attach_fn[i]) {
+			unlink(run.attach_fn[i]);
+			free(run.attach_fn[i]);
+		}
+	rmdir(dir);
+	free(run.loads);
+	free(run.text);
+	free(run.latency_ms);
+	pthread_mutex_destroy(&run.lock);
+	return 0;
+}
@@ -0,0 +1,112 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "trace.h"
+
+// Plays the server side of sessions recorded with client -X, one
+// connection per recorded session, in order. Point the client under
+// test at it (-h 127.0.0.1 -p port, or -U socket_path) with the same
+// message and recipients.
+
+static int Usage(char *argv[]) {
+	fprintf(stderr,
+			"Usage: %s\n"
+			" [-p port]  (on 127.0.0.1, default 2525)\n"
+			" [-U socket_path]  (instead of -p)\n"
+			" [-s scale]  (server delays times scale, default 1, 0 for none)\n"
+			"  trace_file\n",
+			argv[0]);
+	return 1;
+}
+
+static int Listen(int port, const char *path) {
+	int fd, on = 1;
+
+	if(path) {
+		struct sockaddr_un sun;
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+		unlink(path);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(fd < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+			return -1;
+	} else {
+		struct sockaddr_in sin;
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(port);
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if(fd < 0)
+			return -1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if(bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+			return -1;
+	}
+	return listen(fd, 8) < 0 ? -1 : fd;
+}
+
+int main(int argc, char *argv[]) {
+	char *path = NULL;
+	double scale = 1.0;
+	int ch, port = 2525, n = 0, r;
+	trace_stats st;
+
+	while((ch = getopt(argc, argv, "p:U:s:")) != -1) {
+		switch(ch) {
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'U':
+				path = optarg;
+				break;
+			case 's':
+				scale = atof(optarg);
+				break;
+			default:
+				return Usage(argv);
+		}
+	}
+	if(optind != argc - 1 || scale < 0)
+		return Usage(argv);
+
+	trace_reader *tr = trace_reader_open(argv[optind]);
+	if(!tr) {
+		fprintf(stderr, "%s is not a trace\n", argv[optind]);
+		return 1;
+	}
+	int lfd = Listen(port, path);
+	if(lfd < 0) {
+		perror("listen");
+		trace_reader_free(tr);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	while(trace_has_session(tr)) {
+		int fd = accept(lfd, NULL, NULL);
+		if(fd < 0)
+			break;
+		r = trace_replay(tr, fd, scale, &st);
+		close(fd);
+		printf("%d %s: %s, recorded %.1f ms, replayed %.1f ms, "
+				"%ld octets sent, %ld received\n", ++n, st.peer,
+				r > 0 ? "played" : "OUT OF STEP", st.recorded_us / 1000.0,
+				st.replayed_us / 1000.0, st.in, st.out);
+		fflush(stdout);
+	}
+
+	close(lfd);
+	if(path)
+		unlink(path);
+	trace_reader_free(tr);
+	return 0;
+}
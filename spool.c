@@ -0,0 +1,583 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "spool.h"
+
+// journal record: u32 length, u32 crc32 of the payload, payload
+//   ADD	u8 type, u64 id, i64 created, str from, u32 n,
+//		n * (u8 state, u16 attempts, i64 next_try, str rcpt)
+//   RCPT	u8 type, u64 id, u32 rcpt, u8 state
+//   DEFER	u8 type, u64 id, u32 rcpt, u16 attempts, i64 next_try
+//   REMOVE	u8 type, u64 id
+// str is u16 length + bytes, integers are in host byte order.
+enum {
+	SPOOL__ADD = 1,
+	SPOOL__RCPT,
+	SPOOL__REMOVE,
+	SPOOL__DEFER
+};
+
+#define SPOOL__HEADER	(8)
+
+static uint32_t spool__crc_table[256];
+
+static void spool__crc_init() {
+	uint32_t i, k, c;
+	if(spool__crc_table[1])
+		return;
+	for(i = 0; i < 256; i++) {
+		for(c = i, k = 0; k < 8; k++)
+			c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		spool__crc_table[i] = c;
+	}
+}
+
+static uint32_t spool__crc(const char *buf, int len) {
+	uint32_t c = 0xFFFFFFFF;
+	while(len-- > 0)
+		c = spool__crc_table[(c ^ (unsigned char)*buf++) & 0xFF] ^ (c >> 8);
+	return c ^ 0xFFFFFFFF;
+}
+
+static long spool__now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static char *spool__path(spool *sp, const char *name, unsigned long id) {
+	static __thread char path[4096];
+	if(name)
+		snprintf(path, sizeof(path), "%s/%s", sp->dir, name);
+	else
+		snprintf(path, sizeof(path), "%s/msg/%016lx", sp->dir, id);
+	return path;
+}
+
+// fsync on a directory makes the entries created or renamed in it durable.
+static int spool__sync_dir(const char *dir) {
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if(fd < 0)
+		return 0;
+	int r = fsync(fd);
+	close(fd);
+	return r == 0;
+}
+
+/*** Records ***/
+static void spool__put(buffer_ctx *b, const void *v, int len) {
+	buffer_append(b, (const char *)v, len);
+}
+
+static void spool__put_str(buffer_ctx *b, const char *str) {
+	uint16_t len = strlen(str);
+	spool__put(b, &len, sizeof(len));
+	spool__put(b, str, len);
+}
+
+// Starts a record, spool__end() fills in its header.
+static int spool__begin(buffer_ctx *b, int type, unsigned long id) {
+	int at = buffer_length(b);
+	uint8_t t = type;
+	uint64_t i = id;
+	buffer_reserve(b, SPOOL__HEADER);
+	buffer_commit(b, SPOOL__HEADER);
+	spool__put(b, &t, sizeof(t));
+	spool__put(b, &i, sizeof(i));
+	return at;
+}
+
+static void spool__end(buffer_ctx *b, int at) {
+	char *rec = (char *)buffer_data(b) + at;
+	uint32_t len = buffer_length(b) - at - SPOOL__HEADER;
+	uint32_t crc = spool__crc(rec + SPOOL__HEADER, len);
+	memcpy(rec, &len, sizeof(len));
+	memcpy(rec + 4, &crc, sizeof(crc));
+}
+
+static void spool__put_add(buffer_ctx *b, spool_msg *m) {
+	int at = spool__begin(b, SPOOL__ADD, m->id);
+	int64_t created = m->created;
+	uint32_t n = m->n_rcpts, i;
+	spool__put(b, &created, sizeof(created));
+	spool__put_str(b, m->from);
+	spool__put(b, &n, sizeof(n));
+	for(i = 0; i < n; i++) {
+		int64_t next_try = m->next_try[i];
+		spool__put(b, &m->state[i], 1);
+		spool__put(b, &m->attempts[i], sizeof(uint16_t));
+		spool__put(b, &next_try, sizeof(next_try));
+		spool__put_str(b, m->rcpts[i]);
+	}
+	spool__end(b, at);
+}
+
+typedef struct {
+	const char *p, *e;
+	int ok;
+} spool__reader;
+
+static void spool__get(spool__reader *r, void *v, int len) {
+	if(r->e - r->p < len) {
+		r->ok = 0;
+		memset(v, 0, len);
+		return;
+	}
+	memcpy(v, r->p, len);
+	r->p += len;
+}
+
+static char *spool__get_str(spool__reader *r) {
+	uint16_t len;
+	spool__get(r, &len, sizeof(len));
+	if(!r->ok || r->e - r->p < len) {
+		r->ok = 0;
+		return NULL;
+	}
+	char *str = strndup(r->p, len);
+	r->p += len;
+	return str;
+}
+
+/*** Messages ***/
+static spool_msg **spool__slot(spool *sp, unsigned long id) {
+	spool_msg **pm = &sp->ids[id % SPOOL_BUCKETS];
+	while(*pm && (*pm)->id != id)
+		pm = &(*pm)->hnext;
+	return pm;
+}
+
+spool_msg *spool_find(spool *sp, unsigned long id) {
+	return *spool__slot(sp, id);
+}
+
+static spool_msg *spool__msg_new(unsigned long id, const char *from, int n) {
+	spool_msg *m = (spool_msg *)malloc(sizeof(spool_msg));
+	memset(m, 0, sizeof(spool_msg));
+	m->id = id;
+	m->from = strdup(from ? from : "");
+	m->n_rcpts = n;
+	m->rcpts = (char **)calloc(n > 0 ? n : 1, sizeof(char *));
+	m->state = (unsigned char *)calloc(n > 0 ? n : 1, 1);
+	m->attempts = (unsigned short *)calloc(n > 0 ? n : 1,
+			sizeof(unsigned short));
+	m->next_try = (long *)calloc(n > 0 ? n : 1, sizeof(long));
+	m->fd = -1;
+	return m;
+}
+
+static void spool__msg_free(spool_msg *m) {
+	int i;
+	for(i = 0; i < m->n_rcpts; i++)
+		if(m->rcpts[i]) free(m->rcpts[i]);
+	free(m->rcpts);
+	free(m->state);
+	free(m->attempts);
+	free(m->next_try);
+	free(m->from);
+	if(m->fd >= 0) close(m->fd);
+	free(m);
+}
+
+static void spool__link(spool *sp, spool_msg *m) {
+	m->prev = sp->tail;
+	m->next = NULL;
+	if(sp->tail) sp->tail->next = m;
+	else sp->head = m;
+	sp->tail = m;
+
+	spool_msg **pm = spool__slot(sp, m->id);
+	m->hnext = NULL;
+	*pm = m;
+	m->journaled = 1;
+	sp->n_msgs++;
+	if(m->id >= sp->next_id)
+		sp->next_id = m->id + 1;
+}
+
+static void spool__unlink(spool *sp, spool_msg *m) {
+	if(m->prev) m->prev->next = m->next;
+	else sp->head = m->next;
+	if(m->next) m->next->prev = m->prev;
+	else sp->tail = m->prev;
+
+	spool_msg **pm = spool__slot(sp, m->id);
+	if(*pm == m)
+		*pm = m->hnext;
+	sp->n_msgs--;
+}
+
+static void spool__count_pending(spool_msg *m) {
+	int i;
+	m->n_pending = 0;
+	for(i = 0; i < m->n_rcpts; i++)
+		if(m->state[i] == SPOOL_RCPT_PENDING)
+			m->n_pending++;
+}
+
+/*** Replay ***/
+// Applies one record, returns 0 if it is malformed.
+static int spool__apply(spool *sp, const char *rec, int len, int *dead) {
+	spool__reader r = { rec, rec + len, 1 };
+	uint8_t type, state;
+	uint16_t attempts;
+	uint64_t id;
+	uint32_t n, i;
+	int64_t created, next_try;
+	spool_msg *m;
+
+	spool__get(&r, &type, sizeof(type));
+	spool__get(&r, &id, sizeof(id));
+	if(!r.ok)
+		return 0;
+
+	switch(type) {
+		case SPOOL__ADD:
+			spool__get(&r, &created, sizeof(created));
+			char *from = spool__get_str(&r);
+			spool__get(&r, &n, sizeof(n));
+			if(!r.ok || n > (uint32_t)len) {
+				if(from) free(from);
+				return 0;
+			}
+			m = spool__msg_new(id, from, n);
+			free(from);
+			m->created = created;
+			for(i = 0; i < n; i++) {
+				spool__get(&r, &m->state[i], 1);
+				spool__get(&r, &attempts, sizeof(attempts));
+				spool__get(&r, &next_try, sizeof(next_try));
+				m->attempts[i] = attempts;
+				m->next_try[i] = next_try;
+				m->rcpts[i] = spool__get_str(&r);
+			}
+			if(!r.ok || spool_find(sp, id)) {
+				spool__msg_free(m);
+				return r.ok;
+			}
+			spool__count_pending(m);
+			spool__link(sp, m);
+			return 1;
+		case SPOOL__RCPT:
+			spool__get(&r, &n, sizeof(n));
+			spool__get(&r, &state, sizeof(state));
+			if(!r.ok)
+				return 0;
+			if((m = spool_find(sp, id)) && n < m->n_rcpts) {
+				m->state[n] = state;
+				spool__count_pending(m);
+			}
+			(*dead)++;
+			return 1;
+		case SPOOL__DEFER:
+			spool__get(&r, &n, sizeof(n));
+			spool__get(&r, &attempts, sizeof(attempts));
+			spool__get(&r, &next_try, sizeof(next_try));
+			if(!r.ok)
+				return 0;
+			if((m = spool_find(sp, id)) && n < m->n_rcpts) {
+				m->attempts[n] = attempts;
+				m->next_try[n] = next_try;
+			}
+			(*dead)++;
+			return 1;
+		case SPOOL__REMOVE:
+			if((m = spool_find(sp, id))) {
+				spool__unlink(sp, m);
+				spool__msg_free(m);
+			}
+			if(id >= sp->next_id)
+				sp->next_id = id + 1;
+			(*dead)++;
+			return 1;
+	}
+	return 0;
+}
+
+// Reads the journal and truncates it after the last intact record.
+static int spool__replay(spool *sp) {
+	buffer_ctx *b = buffer_new(0);
+	int r, dead = 0;
+
+	while((r = read(sp->journal_fd, buffer_reserve(b, 65536), 65536)) > 0)
+		buffer_commit(b, r);
+	if(r < 0) {
+		buffer_free(b);
+		return 0;
+	}
+
+	const char *data = buffer_data(b);
+	long pos = 0, size = buffer_length(b);
+	while(size - pos >= SPOOL__HEADER) {
+		uint32_t len, crc;
+		memcpy(&len, data + pos, sizeof(len));
+		memcpy(&crc, data + pos + 4, sizeof(crc));
+		if(len > size - pos - SPOOL__HEADER ||
+				spool__crc(data + pos + SPOOL__HEADER, len) != crc ||
+				!spool__apply(sp, data + pos + SPOOL__HEADER, len, &dead))
+			break;
+		pos += SPOOL__HEADER + len;
+	}
+	buffer_free(b);
+
+	if(pos < size) {
+		fprintf(stderr, "spool: dropping %ld bytes of torn journal\n",
+				size - pos);
+		if(ftruncate(sp->journal_fd, pos) < 0)
+			return 0;
+	}
+	lseek(sp->journal_fd, pos, SEEK_SET);
+
+	// a message whose body is gone cannot be delivered
+	spool_msg *m, *next;
+	for(m = sp->head; m; m = next) {
+		next = m->next;
+		if(access(spool__path(sp, NULL, m->id), R_OK) < 0) {
+			spool__unlink(sp, m);
+			spool__msg_free(m);
+			dead++;
+		}
+	}
+
+	// bodies whose ADD record never made it to the journal
+	DIR *d = opendir(spool__path(sp, "msg", 0));
+	struct dirent *de;
+	while(d && (de = readdir(d))) {
+		char *end;
+		unsigned long id = strtoul(de->d_name, &end, 16);
+		if(de->d_name[0] == '.' || *end || spool_find(sp, id))
+			continue;
+		unlinkat(dirfd(d), de->d_name, 0);
+		if(id >= sp->next_id)
+			sp->next_id = id + 1;
+	}
+	if(d) closedir(d);
+
+	// replay leaves the journal at its smallest
+	return dead ? spool_compact(sp) : 1;
+}
+
+/*** Spool ***/
+spool *spool_open(const char *dir) {
+	spool *sp = (spool *)malloc(sizeof(spool));
+	memset(sp, 0, sizeof(spool));
+	sp->dir = strdup(dir);
+	sp->ids = (spool_msg **)calloc(SPOOL_BUCKETS, sizeof(spool_msg *));
+	sp->pending = buffer_new(0);
+	sp->next_id = 1;
+	sp->journal_fd = -1;
+	spool__crc_init();
+
+	mkdir(dir, 0700);
+	mkdir(spool__path(sp, "msg", 0), 0700);
+	// replay compacts the journal and deletes bodies without an ADD
+	// record, which would pull the rug from under a running owner. The
+	// lock file stays put, unlike the journal, which compaction replaces.
+	sp->lock_fd = open(spool__path(sp, "lock", 0),
+			O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(sp->lock_fd < 0 || flock(sp->lock_fd, LOCK_EX | LOCK_NB) < 0) {
+		if(sp->lock_fd >= 0)
+			fprintf(stderr, "spool: %s is in use by another process\n", dir);
+		spool_close(sp);
+		return NULL;
+	}
+	sp->journal_fd = open(spool__path(sp, "journal", 0),
+			O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if(sp->journal_fd < 0 || !spool__replay(sp)) {
+		spool_close(sp);
+		return NULL;
+	}
+	return sp;
+}
+
+void spool_close(spool *sp) {
+	spool_msg *m, *next;
+	assert(sp);
+
+	if(sp->journal_fd >= 0) {
+		spool_commit(sp);
+		close(sp->journal_fd);
+	}
+	if(sp->lock_fd >= 0)
+		close(sp->lock_fd);
+	for(m = sp->head; m; m = next) {
+		next = m->next;
+		spool__msg_free(m);
+	}
+	buffer_free(sp->pending);
+	free(sp->ids);
+	free(sp->dir);
+	free(sp);
+}
+
+// Commits when the batch is full or its oldest record waited long enough.
+static int spool__queued(spool *sp) {
+	long now = spool__now();
+	if(!sp->pending_since)
+		sp->pending_since = now;
+	if(sp->n_sync >= SPOOL_COMMIT_BATCH ||
+			now - sp->pending_since >= SPOOL_COMMIT_DELAY)
+		return spool_commit(sp);
+	return 1;
+}
+
+spool_msg *spool_new_msg(spool *sp, const char *from, char **rcpts,
+		int n_rcpts) {
+	int i;
+	spool_msg *m = spool__msg_new(sp->next_id++, from, n_rcpts);
+	for(i = 0; i < n_rcpts; i++)
+		m->rcpts[i] = strdup(rcpts[i]);
+	m->n_pending = n_rcpts;
+	m->created = time(NULL);
+	m->fd = open(spool__path(sp, NULL, m->id),
+			O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if(m->fd < 0) {
+		spool__msg_free(m);
+		return NULL;
+	}
+	return m;
+}
+
+int spool_add(spool *sp, spool_msg *m) {
+	// the body is synced with the batch, before the journal
+	if(sp->n_sync >= SPOOL_COMMIT_BATCH && !spool_commit(sp))
+		return 0;
+	close(m->fd);
+	m->fd = -1;
+	sp->n_sync++;
+
+	spool__put_add(sp->pending, m);
+	spool__link(sp, m);
+	return spool__queued(sp);
+}
+
+int spool_set_rcpt(spool *sp, spool_msg *m, int rcpt, int state) {
+	if(rcpt < 0 || rcpt >= m->n_rcpts || m->state[rcpt] == state)
+		return 1;
+	m->state[rcpt] = state;
+	spool__count_pending(m);
+	if(m->n_pending == 0)
+		return spool_remove(sp, m);
+
+	int at = spool__begin(sp->pending, SPOOL__RCPT, m->id);
+	uint32_t i = rcpt;
+	uint8_t s = state;
+	spool__put(sp->pending, &i, sizeof(i));
+	spool__put(sp->pending, &s, sizeof(s));
+	spool__end(sp->pending, at);
+	return spool__queued(sp);
+}
+
+int spool_defer_rcpt(spool *sp, spool_msg *m, int rcpt, long next_try) {
+	if(rcpt < 0 || rcpt >= m->n_rcpts)
+		return 1;
+	if(m->attempts[rcpt] < 0xFFFF)
+		m->attempts[rcpt]++;
+	m->next_try[rcpt] = next_try;
+
+	int at = spool__begin(sp->pending, SPOOL__DEFER, m->id);
+	uint32_t i = rcpt;
+	uint16_t attempts = m->attempts[rcpt];
+	int64_t when = next_try;
+	spool__put(sp->pending, &i, sizeof(i));
+	spool__put(sp->pending, &attempts, sizeof(attempts));
+	spool__put(sp->pending, &when, sizeof(when));
+	spool__end(sp->pending, at);
+	return spool__queued(sp);
+}
+
+int spool_remove(spool *sp, spool_msg *m) {
+	int journaled = m->journaled;
+	if(journaled) {
+		spool__end(sp->pending, spool__begin(sp->pending, SPOOL__REMOVE, m->id));
+		spool__unlink(sp, m);
+	}
+	// a body without an ADD record is ignored on replay, and an ADD
+	// record without a body is dropped there
+	unlink(spool__path(sp, NULL, m->id));
+	spool__msg_free(m);
+	return journaled ? spool__queued(sp) : 1;
+}
+
+int spool_commit(spool *sp) {
+	int len = buffer_length(sp->pending);
+
+	// the bodies, and their directory entries, before the records that
+	// name them: one sync of the whole filesystem for all of them. On
+	// failure they count for the next try.
+	if(sp->n_sync > 0 && syncfs(sp->lock_fd) < 0)
+		return 0;
+	sp->n_sync = 0;
+
+	if(len > 0) {
+		const char *data = buffer_data(sp->pending);
+		off_t start = lseek(sp->journal_fd, 0, SEEK_END);
+		int done = 0;
+		while(done < len) {
+			int w = write(sp->journal_fd, data + done, len - done);
+			if(w < 0 && errno == EINTR)
+				continue;
+			if(w <= 0)
+				break;
+			done += w;
+		}
+		if(done < len || fdatasync(sp->journal_fd) < 0) {
+			// a torn record would end the journal on replay, and
+			// every later commit with it
+			if(start >= 0)
+				ftruncate(sp->journal_fd, start);
+			return 0;
+		}
+	}
+
+	buffer_reset(sp->pending);
+	sp->pending_since = 0;
+	return 1;
+}
+
+int spool_compact(spool *sp) {
+	char tmp[4096];
+	buffer_ctx *b = buffer_new(0);
+	spool_msg *m;
+	int fd, ok = 0;
+
+	if(!spool_commit(sp))
+		goto out;
+	for(m = sp->head; m; m = m->next)
+		spool__put_add(b, m);
+
+	snprintf(tmp, sizeof(tmp), "%s", spool__path(sp, "journal.tmp", 0));
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+	if(fd < 0)
+		goto out;
+	if(write(fd, buffer_data(b), buffer_length(b)) != buffer_length(b) ||
+			fdatasync(fd) < 0 ||
+			rename(tmp, spool__path(sp, "journal", 0)) < 0) {
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	close(sp->journal_fd);
+	sp->journal_fd = fd;
+	ok = spool__sync_dir(sp->dir);
+out:
+	buffer_free(b);
+	return ok;
+}
+
+int spool_open_body(spool *sp, spool_msg *m) {
+	return open(spool__path(sp, NULL, m->id), O_RDONLY | O_CLOEXEC);
+}
@@ -0,0 +1,87 @@
+#ifndef _SPOOL_H
+#	define _SPOOL_H
+
+#include "buffer.h"
+
+// Outbound spool directory:
+//   dir/journal	append-only log of envelopes and recipient state
+//   dir/lock		held (flock) by the process that has the spool open
+//   dir/msg/<id>	message body (CRLF lines, not dot-stuffed), stored
+//			once however many recipients it has
+// Journal records are collected in memory and reach the disk in groups:
+// spool_commit() makes the bodies written since the last commit durable
+// with one syncfs() of the spool's filesystem, then writes and syncs the
+// journal: two syncs for a burst of messages, however many there are. A torn record at the end of the
+// journal (crash during a write) is dropped on the next spool_open().
+// A failed commit keeps its records pending and the journal as it was,
+// the next commit tries again.
+
+#define SPOOL_COMMIT_BATCH	(256)	// messages waiting force a commit
+#define SPOOL_COMMIT_DELAY	(10)	// ms a record may wait for a commit
+#define SPOOL_BUCKETS		(1024)
+
+// recipient states
+#define SPOOL_RCPT_PENDING	(0)
+#define SPOOL_RCPT_DELIVERED	(1)
+#define SPOOL_RCPT_FAILED	(2)
+
+typedef struct spool_msg {
+	struct spool_msg *next, *prev;	// spool order
+	struct spool_msg *hnext;	// id hash chain
+	unsigned long id;
+	long created;			// unix time
+	char *from;
+	int n_rcpts;
+	char **rcpts;
+	unsigned char *state;		// SPOOL_RCPT_* per recipient
+	unsigned short *attempts;	// failed attempts per recipient
+	long *next_try;			// unix time of the next attempt
+	int n_pending;
+	int fd;				// body while it is written, else -1
+	int journaled;
+} spool_msg;
+
+typedef struct spool {
+	char *dir;
+	int journal_fd;
+	int lock_fd;
+	unsigned long next_id;
+	int n_msgs;
+	spool_msg *head, *tail;
+	spool_msg **ids;
+	buffer_ctx *pending;		// records not written yet
+	int n_sync;			// bodies written since the last commit
+	long pending_since;		// monotonic ms, 0 if nothing pending
+} spool;
+
+// Creates the directory if needed and replays the journal. Fails if
+// another process has the spool open.
+spool *spool_open(const char *dir);
+// Commits pending records.
+void spool_close(spool *sp);
+
+// Starts a message; write its body to m->fd, then spool_add() it.
+spool_msg *spool_new_msg(spool *sp, const char *from, char **rcpts,
+		int n_rcpts);
+// Queues the message for the next commit. Return value: 0 error, 1 ok.
+int spool_add(spool *sp, spool_msg *m);
+// Records a delivery outcome; the message is removed once no recipient
+// is pending.
+int spool_set_rcpt(spool *sp, spool_msg *m, int rcpt, int state);
+// Counts a transient failure and sets when to try the recipient again.
+int spool_defer_rcpt(spool *sp, spool_msg *m, int rcpt, long next_try);
+// Drops a message, also one that was never added.
+int spool_remove(spool *sp, spool_msg *m);
+
+// Makes everything queued so far durable. Adding and updating commits
+// by itself when SPOOL_COMMIT_BATCH or SPOOL_COMMIT_DELAY is reached;
+// an idle caller commits explicitly. Return value: 0 error, 1 ok.
+int spool_commit(spool *sp);
+// Rewrites the journal with only the live messages.
+int spool_compact(spool *sp);
+
+// Opens the body for reading, returns -1 on error.
+int spool_open_body(spool *sp, spool_msg *m);
+spool_msg *spool_find(spool *sp, unsigned long id);
+
+#endif
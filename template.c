@@ -0,0 +1,277 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "template.h"
+
+static void template__add(template *t, int type, long offset, long len,
+		int fd, int field, int header) {
+	if(type == TEMPLATE_TEXT && len == 0)
+		return;
+	if(t->n_segs == t->size) {
+		t->size = t->size ? t->size * 2 : 64;
+		t->segs = (template_seg *)realloc(t->segs,
+				t->size * sizeof(template_seg));
+	}
+	template_seg *s = &t->segs[t->n_segs++];
+	s->type = type;
+	s->offset = offset;
+	s->len = len;
+	s->fd = fd;
+	s->field = field;
+	s->header = header;
+	if(type == TEMPLATE_TEXT || type == TEMPLATE_FILE)
+		t->static_len += len;
+}
+
+static int template__name_char(char c) {
+	return isalnum((unsigned char)c) || c == '_' || c == '-' || c == '.';
+}
+
+static int template__field_add(template *t, const char *name, int len) {
+	int i;
+	for(i = 0; i < t->n_fields; i++)
+		if(strlen(t->fields[i]) == len && !memcmp(t->fields[i], name, len))
+			return i;
+	if(t->n_fields == TEMPLATE_MAX_FIELDS)
+		return -1;
+	t->fields[t->n_fields] = strndup(name, len);
+	return t->n_fields++;
+}
+
+// Cuts the static text [start, end) at placeholders and at the points
+// where DATA may need a dot: line starts beginning with '.', and text
+// right after a field, which may have been empty at a line start.
+static int template__scan(template *t, long start, long end, long header_end) {
+	const char *p = buffer_data(t->text);
+	long run = start, i = start;
+
+	while(i < end) {
+		if(p[i] == '.' && (i == 0 || p[i - 1] == '\n' ||
+				(i == run && t->n_segs &&
+				 t->segs[t->n_segs - 1].type == TEMPLATE_FIELD))) {
+			template__add(t, TEMPLATE_TEXT, run, i - run, -1, -1, 0);
+			template__add(t, TEMPLATE_DOT, 0, 0, -1, -1, 0);
+			run = i++;
+			continue;
+		}
+		if(p[i] != '{' || i + 1 >= end || p[i + 1] != '{') {
+			i++;
+			continue;
+		}
+
+		long j = i + 2;
+		while(j < end && template__name_char(p[j]))
+			j++;
+		if(j == i + 2 || j + 1 >= end || p[j] != '}' || p[j + 1] != '}') {
+			i++;
+			continue;
+		}
+		int field = template__field_add(t, &p[i + 2], j - i - 2);
+		if(field < 0)
+			return 0;
+		template__add(t, TEMPLATE_TEXT, run, i - run, -1, -1, 0);
+		template__add(t, TEMPLATE_FIELD, 0, 0, -1, field, i < header_end);
+		i = run = j + 2;
+	}
+	template__add(t, TEMPLATE_TEXT, run, end - run, -1, -1, 0);
+	return 1;
+}
+
+template *template_compile(mime_msg *m, int wrap) {
+	template *t = (template *)malloc(sizeof(template));
+	memset(t, 0, sizeof(template));
+	t->text = buffer_new(0);
+
+	// render once, cached bodies stay in their files
+	mime_cursor *c = mimecursor_new(m, wrap, MIMECURSOR_FILES);
+	long start = 0, header_end = -1;
+	int r, fd, ok = 1;
+	long off, flen;
+
+	for(;;) {
+		do {
+			char *buf = buffer_reserve(t->text, MIMECURSOR_CHUNK);
+			r = mimecursor_read(c, buf, MIMECURSOR_CHUNK);
+			if(r > 0)
+				buffer_commit(t->text, r);
+		} while(r > 0);
+
+		long end = buffer_length(t->text);
+		if(header_end < 0) {
+			const char *hdr = memmem(buffer_data(t->text), end, "\r\n\r\n", 4);
+			header_end = hdr ? hdr - buffer_data(t->text) : end;
+		}
+		if(r < 0 || !(ok = template__scan(t, start, end, header_end)))
+			break;
+		start = end;
+
+		if(!mimecursor_file(c, &fd, &off, &flen))
+			break;
+		template__add(t, TEMPLATE_FILE, off, flen, fd, -1, 0);
+		mimecursor_skip_file(c);
+	}
+	mimecursor_free(c);
+
+	if(r < 0 || !ok) {
+		template_free(t);
+		return NULL;
+	}
+	return t;
+}
+
+void template_free(template *t) {
+	int i;
+	for(i = 0; i < t->n_fields; i++)
+		free(t->fields[i]);
+	buffer_free(t->text);
+	free(t->segs);
+	free(t);
+}
+
+int template_field(template *t, const char *name) {
+	int i;
+	for(i = 0; i < t->n_fields; i++)
+		if(!strcmp(t->fields[i], name))
+			return i;
+	return -1;
+}
+
+template_output *template_output_new() {
+	template_output *o = (template_output *)malloc(sizeof(template_output));
+	memset(o, 0, sizeof(template_output));
+	o->values = buffer_new(0);
+	return o;
+}
+
+void template_output_free(template_output *o) {
+	buffer_free(o->values);
+	free(o->pieces);
+	free(o);
+}
+
+static template_piece *template__piece(template_output *o) {
+	if(o->n_pieces == o->size) {
+		o->size = o->size ? o->size * 2 : 64;
+		o->pieces = (template_piece *)realloc(o->pieces,
+				o->size * sizeof(template_piece));
+	}
+	return &o->pieces[o->n_pieces++];
+}
+
+// Length of a value as rendered: without its trailing line break, and
+// with CRLF for bare LF in the body.
+static long template__value_len(const char *v, int header) {
+	long len = strlen(v), i, n;
+	while(len > 0 && (v[len - 1] == '\n' || v[len - 1] == '\r'))
+		len--;
+	if(header)
+		return len;
+	for(i = 0, n = len; i < len; i++)
+		if(v[i] == '\n' && (i == 0 || v[i - 1] != '\r'))
+			n++;
+	return n;
+}
+
+// Formats a value into o->values.
+static void template__format(template_output *o, const char *v, int header,
+		int flags, int bol) {
+	long len = strlen(v), i;
+	while(len > 0 && (v[len - 1] == '\n' || v[len - 1] == '\r'))
+		len--;
+
+	// at most a dot or a CR more for each character
+	char *out = buffer_reserve(o->values, 2 * len), *q = out;
+	for(i = 0; i < len; i++) {
+		char ch = v[i];
+		if(header) {
+			// a line break would start a header of its own
+			*q++ = ch == '\r' || ch == '\n' ? ' ' : ch;
+			continue;
+		}
+		if((flags & TEMPLATE_DOT_STUFF) && bol && ch == '.')
+			*q++ = '.';
+		if(ch == '\n' && (i == 0 || v[i - 1] != '\r'))
+			*q++ = '\r';
+		*q++ = ch;
+		bol = ch == '\n';
+	}
+	buffer_commit(o->values, q - out);
+}
+
+int template_render(template *t, const char **values, int flags,
+		template_output *o) {
+	const char *text = buffer_data(t->text);
+	int i, bol = 1;
+
+	o->n_pieces = 0;
+	o->len = 0;
+	buffer_reset(o->values);
+
+	for(i = 0; i < t->n_segs; i++) {
+		template_seg *s = &t->segs[i];
+		template_piece *p;
+
+		switch(s->type) {
+		case TEMPLATE_TEXT:
+			p = template__piece(o);
+			p->data = &text[s->offset];
+			p->fd = -1;
+			p->len = s->len;
+			bol = text[s->offset + s->len - 1] == '\n';
+			break;
+		case TEMPLATE_FILE:
+			p = template__piece(o);
+			p->data = NULL;
+			p->fd = s->fd;
+			p->offset = s->offset;
+			p->len = s->len;
+			bol = 1;	// cached bodies end with their line break
+			break;
+		case TEMPLATE_DOT:
+			if(!(flags & TEMPLATE_DOT_STUFF) || !bol)
+				break;
+			p = template__piece(o);
+			p->data = ".";
+			p->fd = -1;
+			p->len = 1;
+			bol = 0;
+			break;
+		case TEMPLATE_FIELD: {
+			const char *v = values[s->field] ? values[s->field] : "";
+			long before = buffer_length(o->values);
+			template__format(o, v, s->header, flags, bol);
+			long len = buffer_length(o->values) - before;
+			if(len == 0)
+				break;
+			// data is set below, values may still move
+			p = template__piece(o);
+			p->data = NULL;
+			p->fd = -1;
+			p->offset = before;
+			p->len = len;
+			bol = 0;
+			break;
+		}
+		}
+	}
+
+	for(i = 0; i < o->n_pieces; i++) {
+		template_piece *p = &o->pieces[i];
+		if(!p->data && p->fd < 0)
+			p->data = &buffer_data(o->values)[p->offset];
+		o->len += p->len;
+	}
+	return 1;
+}
+
+long template_size(template *t, const char **values) {
+	long size = t->static_len;
+	int i;
+	for(i = 0; i < t->n_segs; i++)
+		if(t->segs[i].type == TEMPLATE_FIELD && values[t->segs[i].field])
+			size += template__value_len(values[t->segs[i].field],
+					t->segs[i].header);
+	return size;
+}
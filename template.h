@@ -0,0 +1,74 @@
+#ifndef _TEMPLATE_H
+#	define _TEMPLATE_H
+
+#include "buffer.h"
+#include "mime.h"
+
+// Mail merge. A message with {{name}} placeholders in its headers and
+// plain text parts is rendered once and cut into segments: static runs
+// (attachments already base64 encoded), cached bodies as file regions,
+// and the placeholders. Rendering for a recipient only formats the
+// field values, everything else is handed out by reference, so the cost
+// per recipient follows the personalized bytes, not the message size.
+//
+// Values go in as they are, lines are wrapped around the placeholder.
+// In the message header line breaks in a value become spaces, in the
+// body bare LF becomes CRLF; a trailing line break is dropped.
+
+#define TEMPLATE_DOT_STUFF	(1 << 0)	// render for DATA
+#define TEMPLATE_MAX_FIELDS	(64)
+
+// segment types
+#define TEMPLATE_TEXT		(0)
+#define TEMPLATE_FILE		(1)
+#define TEMPLATE_FIELD		(2)
+#define TEMPLATE_DOT		(3)	// '.' if dot-stuffing at a line start
+
+typedef struct template_seg {
+	int type;
+	long offset, len;	// in text, or in fd
+	int fd;
+	int field;
+	int header;		// field in the message header
+} template_seg;
+
+typedef struct template {
+	buffer_ctx *text;	// all static runs
+	template_seg *segs;
+	int n_segs, size;
+	char *fields[TEMPLATE_MAX_FIELDS];
+	int n_fields;
+	long static_len;	// octets not coming from values
+} template;
+
+// A piece of rendered output: memory, or a region of fd if data is NULL.
+typedef struct template_piece {
+	const char *data;
+	int fd;
+	long offset, len;
+} template_piece;
+
+typedef struct template_output {
+	template_piece *pieces;
+	int n_pieces, size;
+	buffer_ctx *values;	// the formatted values the pieces point into
+	long len;
+} template_output;
+
+// Returns NULL if the message cannot be rendered or has too many fields.
+template *template_compile(mime_msg *m, int wrap);
+void template_free(template *t);
+// Index of the field with that name, or -1.
+int template_field(template *t, const char *name);
+
+template_output *template_output_new();
+void template_output_free(template_output *o);
+
+// Renders for one recipient; values[i] is the value of field i, NULL
+// for empty. o is reused: its pieces stay valid until the next call.
+int template_render(template *t, const char **values, int flags,
+		template_output *o);
+// Message size (without dot-stuffing) for the same values, for SIZE=.
+long template_size(template *t, const char **values);
+
+#endif
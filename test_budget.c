@@ -0,0 +1,93 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "budget.h"
+#include "buffer.h"
+#include "smtp.h"
+
+static void *release_later(void *arg) {
+	usleep(50 * 1000);
+	budget_release((long)arg);
+	return NULL;
+}
+
+// Sends a reply of n octets: lines of line_len (a divisor of n), the last
+// one without continuation, or no line break at all with line_len 0.
+static void reply(int fd, int n, int line_len) {
+	char *buf = (char *)malloc(n);
+	int i;
+
+	memset(buf, 'x', n);
+	for(i = 0; line_len && i < n; i += line_len) {
+		memcpy(&buf[i], i + line_len < n ? "250-" : "250 ", 4);
+		buf[i + line_len - 2] = '\r';
+		buf[i + line_len - 1] = '\n';
+	}
+	for(i = 0; i < n; ) {
+		int r = write(fd, &buf[i], n - i);
+		if(r <= 0)
+			break;
+		i += r;
+	}
+	free(buf);
+}
+
+static void session(const char *what, int n, int line_len) {
+	int fds[2];
+	smtp *s = smtp_new();
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	smtp_set_fd(s, fds[0], fds[0]);
+	smtp_set_timeouts(s, 1000, 1000);
+	reply(fds[1], n, line_len);
+	if(smtp_read_welcome(s))
+		printf("%s: accepted, %d octets\n", what, (int)strlen(smtp_get_msg(s)));
+	else
+		printf("%s: %s", what, smtp_get_msg(s));
+	smtp_free(s);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+int main() {
+	pthread_t t;
+	long base = budget_used();
+
+	// capacity is what counts, a buffer in the freelist included
+	buffer_ctx *b = buffer_new(4096);
+	printf("buffer: %ld\n", budget_used() - base);
+	char *p = buffer_reserve(b, 10000);
+	memset(p, 'x', 10000);
+	buffer_commit(b, 10000);
+	printf("grown: %ld\n", budget_used() - base);
+	buffer_free(b);
+	printf("pooled: %ld\n", budget_used() - base);
+	buffer_pool_clear();
+	printf("cleared: %ld\n", budget_used() - base);
+
+	budget_set_limit(base + 1000);
+	printf("room for 1000: %d, for 1001: %d\n", budget_room(1000),
+			budget_room(1001));
+	budget_charge(900);
+	printf("charged 900, room for 200: %d\n", budget_room(200));
+	printf("wait, nothing released: %d\n", budget_wait(200, 20));
+	pthread_create(&t, NULL, &release_later, (void *)500L);
+	printf("wait, 500 released: %d\n", budget_wait(200, 1000));
+	pthread_join(t, NULL);
+	budget_release(400);
+	printf("used: %ld\n", budget_used() - base);
+	budget_set_limit(0);
+	printf("unlimited: %d\n", budget_room(1L << 40));
+
+	// a server cannot make a session buffer more than SMTP_REPLY_MAX
+	signal(SIGPIPE, SIG_IGN);
+	session("short lines", 2000, 100);
+	session("no line break", SMTP_REPLY_MAX + 4000, 0);
+	session("too many lines", SMTP_REPLY_MAX + 4000, 100);
+	return 0;
+}
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+
+#include "buffer.h"
+#include "dkim.h"
+#include "mime.h"
+
+static void hash(int canon, const char *body, int step, char *bh) {
+	dkim_body *b = dkim_body_new(canon);
+	int len = strlen(body), i;
+	for(i = 0; i < len; i += step)
+		dkim_body_update(b, &body[i], len - i < step ? len - i : step);
+	dkim_body_final(b, bh);
+}
+
+// Known answers: SHA-256 of the canonical form, worked out by hand.
+static void expect(int canon, const char *body, const char *want,
+		const char *what) {
+	char bh[DKIM_HASH_SIZE], bh1[DKIM_HASH_SIZE];
+	hash(canon, body, strlen(body) + 1, bh);
+	hash(canon, body, 1, bh1);
+	printf("%s: %s%s\n", what, strcmp(bh, want) ? "WRONG " : "ok",
+			strcmp(bh, bh1) ? ", DIFFERS by the byte" : "");
+}
+
+static int write_key(char *fn) {
+	EVP_PKEY *key = EVP_RSA_gen(2048);
+	int fd = mkstemp(fn);
+	FILE *fp = fdopen(fd, "w");
+	int ok = key && fp && PEM_write_PrivateKey(fp, key, NULL, NULL, 0,
+			NULL, NULL);
+	if(fp) fclose(fp);
+	EVP_PKEY_free(key);
+	return ok;
+}
+
+static int print_line(void *ctx, const void *buf, int len) {
+	fwrite(buf, 1, len, (FILE *)ctx);
+	fwrite("\r\n", 1, 2, (FILE *)ctx);
+	return 1;
+}
+
+static int append_line(void *ctx, const void *buf, int len) {
+	buffer_append((buffer_ctx *)ctx, (const char *)buf, len);
+	buffer_append((buffer_ctx *)ctx, "\r\n", 2);
+	return 1;
+}
+
+int main(int argc, char *argv[]) {
+	char key_fn[] = "/tmp/test_dkim.XXXXXX";
+
+	// "\r\n"
+	expect(DKIM_BODY_SIMPLE, "",
+			"frcCV1k9oG9oKj3dpUqdJg1PxRT2RSN/XKdLCPjaYaY=", "simple empty");
+	// ""
+	expect(DKIM_BODY_RELAXED, "\r\n\r\n",
+			"47DEQpj8HBSa+/TImW+5JCeuQeRkm5NMpJWZG3hSuFU=", "relaxed empty");
+	// " C\r\nD E\r\n"
+	expect(DKIM_BODY_RELAXED, " C \r\nD \t E\r\n\r\n\r\n",
+			"unak6JHq0wL+Q1HP7dW1tjBx9FLA6DffoZ0qrLwbbpo=",
+			"relaxed RFC 6376 3.4.5");
+	// " C \r\nD \t E\r\n"
+	expect(DKIM_BODY_SIMPLE, " C \r\nD \t E\r\n\r\n\r\n",
+			"NOeivbQlDH9TmNKJUw7D53wZfsk8YMZ/hTuVVwTgi8s=",
+			"simple RFC 6376 3.4.5");
+
+	if(argc > 1)
+		strcpy(key_fn, argv[1]);
+	else if(!write_key(key_fn))
+		return 1;
+	dkim *d = dkim_new("qbey.tw", "mail", key_fn, DKIM_BODY_RELAXED);
+	if(argc <= 1)
+		unlink(key_fn);
+	if(!d) {
+		printf("cannot load key\n");
+		return 1;
+	}
+
+	mime_msg *m = mimemsg_new();
+	mimemsg_set_header(m, "From", "<test@qbey.tw>");
+	mimemsg_set_header(m, "To", "<madoka@qbey.tw>");
+	mimemsg_set_header(m, "Subject", "a rather long subject line that the "
+			"wrapper will have to fold somewhere in the middle");
+	mimemsg_add_part(m, mimepart_new_plain("Hello  there \r\n\r\nbye\r\n\r\n"));
+	mimemsg_add_part(m, mimepart_new_attachment("buffer.c"));
+
+	// the body as a whole, through the line writer
+	char bh[DKIM_HASH_SIZE];
+	dkim_body *b = dkim_body_new(DKIM_BODY_RELAXED);
+	buffer_ctx *all = buffer_new(0);
+	mimemsg_set_boundary(m, "BOUNDARY-test");
+	mimemsg_write_line(m, 76, append_line, all);
+	const char *body = strstr(buffer_cstr(all), "\r\n\r\n") + 4;
+	dkim_body_update(b, body, strlen(body));
+	dkim_body_final(b, bh);
+
+	int ok = dkim_sign_msg(d, m, 76);
+	const char *digest = m->body_digest;
+	printf("signed: %s, body hash %s\n", ok ? "ok" : "FAILED",
+			strcmp(digest, bh) ? "WRONG" : "ok");
+	printf("first header: %s\n", m->header_head->key);
+
+	// another recipient: only the header block is signed again
+	mimemsg_set_header(m, "To", "<homura@qbey.tw>");
+	char *sig1 = strdup(m->header_head->value);
+	ok = dkim_sign_msg(d, m, 76);
+	printf("re-signed: %s, body hash %s, signature %s, %d signature\n",
+			ok ? "ok" : "FAILED",
+			m->body_digest == digest ? "reused" : "HASHED AGAIN",
+			strcmp(sig1, m->header_head->value) ? "new" : "SAME",
+			m->n_heads - 4);
+	free(sig1);
+
+	// a new part drops the hash
+	mimemsg_add_part(m, mimepart_new_plain("P.S."));
+	printf("after add_part: %s\n", m->body_digest ? "STALE" : "dropped");
+	dkim_sign_msg(d, m, 76);
+	printf("signed again: body hash %s\n",
+			strcmp(m->body_digest, bh) ? "new" : "STALE");
+
+	if(argc > 1)
+		mimemsg_write_line(m, 76, print_line, stderr);
+
+	buffer_free(all);
+	mimemsg_free(m);
+	dkim_free(d);
+	return 0;
+}
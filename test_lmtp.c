@@ -0,0 +1,227 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "net.h"
+#include "smtp.h"
+#include "test_server.h"
+
+/*** An LMTP stand-in on a Unix domain socket ***/
+// RCPT refuses "nobody", the mailstore of "full" is over quota.
+typedef struct server {
+	test_server io;
+	char rcpts[16][64];
+	int n_rcpts;
+} server;
+
+// One reply for each accepted recipient.
+static void server_deliver(server *sv) {
+	char reply[128];
+	int i;
+
+	if(!sv->n_rcpts)
+		test_server_write(&sv->io, "554 no valid recipients\r\n");
+	for(i = 0; i < sv->n_rcpts; i++) {
+		snprintf(reply, sizeof(reply), strstr(sv->rcpts[i], "full") ?
+				"452 %s over quota\r\n" : "250 %s delivered\r\n", sv->rcpts[i]);
+		test_server_write(&sv->io, reply);
+	}
+	sv->n_rcpts = 0;
+}
+
+static void serve(int fd) {
+	server sv;
+	char line[4096];
+	int n;
+
+	memset(&sv, 0, sizeof(sv));
+	test_server_init(&sv.io, fd, 4096);
+	test_server_write(&sv.io, "220 stand-in LMTP\r\n");
+	while(test_server_line(&sv.io, line, sizeof(line))) {
+		if(!strncmp(line, "LHLO", 4)) {
+			test_server_write(&sv.io, "250-stand-in\r\n250-PIPELINING\r\n"
+					"250-CHUNKING\r\n250 ENHANCEDSTATUSCODES\r\n");
+		} else if(!strncmp(line, "MAIL", 4) || !strncmp(line, "RSET", 4)) {
+			sv.n_rcpts = 0;
+			test_server_write(&sv.io, "250 ok\r\n");
+		} else if(!strncmp(line, "RCPT", 4)) {
+			if(strstr(line, "nobody")) {
+				test_server_write(&sv.io, "550 no such user\r\n");
+				continue;
+			}
+			sscanf(line, "RCPT TO:%63s", sv.rcpts[sv.n_rcpts++]);
+			test_server_write(&sv.io, "250 ok\r\n");
+		} else if(!strncmp(line, "DATA", 4)) {
+			test_server_write(&sv.io, "354 go ahead\r\n");
+			while((n = test_server_line(&sv.io, line, sizeof(line))) &&
+					strcmp(line, ".\r\n"))
+				;
+			if(!n)
+				break;	// the client broke off, nothing is delivered
+			server_deliver(&sv);
+		} else if(!strncmp(line, "BDAT", 4)) {
+			long len = atol(&line[5]);
+			if(test_server_skip(&sv.io, len) < len)
+				break;
+			if(strstr(line, "LAST"))
+				server_deliver(&sv);
+			else
+				test_server_write(&sv.io, "250 chunk\r\n");
+		} else if(!strncmp(line, "QUIT", 4)) {
+			test_server_write(&sv.io, "221 bye\r\n");
+			break;
+		} else {
+			test_server_write(&sv.io, "500 what\r\n");
+		}
+	}
+	test_server_free(&sv.io);
+	close(fd);
+}
+
+/*** Client ***/
+static int data_cb(smtp *s, void *ctx) {
+	smtp_write_string(s, "Subject: test\r\n\r\nhello\r\n");
+	return 1;
+}
+
+static int bdat_cb(smtp *s, void *ctx) {
+	return smtp_bdat(s, "Subject: test\r\n", 15, 0) &&
+		smtp_bdat(s, "\r\nhello\r\n", 9, 1);
+}
+
+// Breaks off in the middle of the body.
+static int broken_cb(smtp *s, void *ctx) {
+	if(smtp_has_extension(s, SMTP_EXT_CHUNKING))
+		smtp_bdat(s, "Subject: test\r\n", 15, 0);
+	else
+		smtp_write_string(s, "Subject: test\r\n");
+	return 0;
+}
+
+static void print_txn(const char *what, smtp_txn *t) {
+	int k;
+	printf("%s: mail %d, end %d\n", what, t->mail_code, t->code);
+	for(k = 0; k < t->n_rcpts; k++)
+		printf("  %s: rcpt %d, lmtp %d\n", t->rcpts[k], t->rcpt_codes[k],
+				t->lmtp_codes[k]);
+}
+
+static void session(const char *path, int chunking) {
+	char *rcpts[] = { "<madoka@qbey.tw>", "<nobody@qbey.tw>",
+		"<full@qbey.tw>", "<homura@qbey.tw>" };
+	char *none[] = { "<nobody@qbey.tw>" };
+	int codes[3][4], lmtp[3][4];
+	int fd = net_connect_unix(path, 1000);
+	smtp *s = smtp_new();
+
+	smtp_set_fd(s, fd, fd);
+	smtp_set_timeouts(s, 5000, 5000);
+	if(!smtp_read_welcome(s) || !smtp_lhlo(s, "test")) {
+		printf("no LHLO: %s", smtp_get_msg(s));
+		smtp_free(s);
+		close(fd);
+		return;
+	}
+	if(!chunking)
+		s->extensions &= ~SMTP_EXT_CHUNKING;
+
+	smtp_data_callback cb = chunking ? &bdat_cb : &data_cb;
+	smtp_txn t[3] = {
+		{ "<a@b.c>", rcpts, 4, 0, -1, cb, NULL, 0, codes[0], 0, lmtp[0] },
+		{ "<a@b.c>", none, 1, 0, -1, cb, NULL, 0, codes[1], 0, lmtp[1] },
+		{ "<a@b.c>", &rcpts[3], 1, 0, -1, cb, NULL, 0, codes[2], 0, lmtp[2] },
+	};
+	printf("pipelined %s: %s\n", chunking ? "BDAT" : "DATA",
+			smtp_send_pipelined(s, t, 3) ? "ok" : "LOST");
+	print_txn("  first", &t[0]);
+	print_txn("  nobody", &t[1]);
+	print_txn("  last", &t[2]);
+
+	// one command at a time, all replies are read
+	int ok = smtp_mail_from(s, "<a@b.c>") &&
+		smtp_rcpt_to(s, "<madoka@qbey.tw>") &&
+		smtp_rcpt_to(s, "<full@qbey.tw>") &&
+		(chunking ? bdat_cb(s, NULL) : smtp_data(s, &data_cb, NULL));
+	printf("single: %s, last %s", ok ? "all delivered" : "not all delivered",
+			smtp_get_msg(s));
+	printf("quit: %s", smtp_quit(s) ? smtp_get_msg(s) : "FAILED\n");
+	smtp_free(s);
+	close(fd);
+}
+
+// The second of three transactions fails its body: the first is
+// delivered, the session is dropped before anything else goes out.
+static void broken(const char *path, int chunking) {
+	char *rcpts[] = { "<madoka@qbey.tw>" };
+	int codes[3][1], lmtp[3][1];
+	int fd = net_connect_unix(path, 1000);
+	smtp *s = smtp_new();
+
+	smtp_set_fd(s, fd, fd);
+	smtp_set_timeouts(s, 5000, 5000);
+	smtp_read_welcome(s);
+	smtp_lhlo(s, "test");
+	if(!chunking)
+		s->extensions &= ~SMTP_EXT_CHUNKING;
+
+	smtp_data_callback cb = chunking ? &bdat_cb : &data_cb;
+	smtp_txn t[3] = {
+		{ "<a@b.c>", rcpts, 1, 0, -1, cb, NULL, 0, codes[0], 0, lmtp[0] },
+		{ "<a@b.c>", rcpts, 1, 0, -1, &broken_cb, NULL, 0, codes[1], 0,
+			lmtp[1] },
+		{ "<a@b.c>", rcpts, 1, 0, -1, cb, NULL, 0, codes[2], 0, lmtp[2] },
+	};
+	printf("broken %s: %s\n", chunking ? "BDAT" : "DATA",
+			smtp_send_pipelined(s, t, 3) ? "ok" : "LOST");
+	print_txn("  first", &t[0]);
+	print_txn("  broken", &t[1]);
+	print_txn("  after", &t[2]);
+	printf("quit: %s", smtp_quit(s) ? smtp_get_msg(s) : "FAILED\n");
+	smtp_free(s);
+	close(fd);
+}
+
+int main() {
+	char dir[] = "/tmp/test_lmtp.XXXXXX";
+	char path[64];
+	struct sockaddr_un sun;
+	int i;
+
+	mkdtemp(dir);
+	snprintf(path, sizeof(path), "%s/lmtp", dir);
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	bind(lfd, (struct sockaddr *)&sun, sizeof(sun));
+	listen(lfd, 8);
+
+	pid_t pid = fork();
+	if(pid == 0) {
+		for(i = 0; i < 4; i++) {
+			int fd = accept(lfd, NULL, NULL);
+			if(fd >= 0)
+				serve(fd);
+		}
+		_exit(0);
+	}
+	close(lfd);
+	signal(SIGPIPE, SIG_IGN);
+
+	session(path, 0);
+	session(path, 1);
+	broken(path, 0);
+	broken(path, 1);
+	printf("no listener: %s\n",
+			net_connect_unix("/tmp/test_lmtp.none", 1000) < 0 ? "refused" : "CONNECTED");
+
+	waitpid(pid, NULL, 0);
+	unlink(path);
+	rmdir(dir);
+	return 0;
+}
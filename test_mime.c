@@ -1,10 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include "buffer.h"
 #include "mime.h"
 
-int write_to_stdout(void *ctx, const void *buf, int len) {
-	return write(STDOUT_FILENO, buf, len);
+int write_line_to_buffer(void *ctx, const void *buf, int len) {
+	buffer_append((buffer_ctx *)ctx, buf, len);
+	buffer_append((buffer_ctx *)ctx, "\r\n", 2);
+	return 1;
 }
 
 int main() {
@@ -24,8 +28,58 @@ int main() {
 	mimemsg_set_header(m, "To", to);
 	mimemsg_set_header(m, "Subject", subject);
 
-	mimemsg_write_stream(m, 76, &write_to_stdout, NULL);
+	buffer_ctx *lines = buffer_new(0);
+	long size = mimemsg_get_size(m, 76);
+	mimemsg_write_line(m, 76, &write_line_to_buffer, lines);
+	fprintf(stderr, "size: computed %ld, written %d\n",
+			size, buffer_length(lines));
 
+	// the cursor must produce the same octets in arbitrary slices
+	char buf[97];
+	int r;
+	buffer_ctx *pulled = buffer_new(0);
+	mime_cursor *c = mimecursor_new(m, 76, 0);
+	while((r = mimecursor_read(c, buf, sizeof(buf))) > 0)
+		buffer_append(pulled, buf, r);
+	mimecursor_free(c);
+	fprintf(stderr, "cursor: %s\n",
+			buffer_length(pulled) == buffer_length(lines) &&
+			memcmp(buffer_data(pulled), buffer_data(lines),
+				buffer_length(lines)) == 0 ? "match" : "MISMATCH");
+
+	// cached attachment bodies, read through and handed out as files
+	char cache_fn[] = "/tmp/test_mime.XXXXXX";
+	int fd = mkstemp(cache_fn);
+	unlink(cache_fn);
+	mimepart_cache(p2, 76, fd);
+
+	int pass;
+	for(pass = 0; pass < 2; pass++) {
+		int ffd;
+		long off, flen;
+		buffer_reset(pulled);
+		c = mimecursor_new(m, 76, pass ? MIMECURSOR_FILES : 0);
+		while(!mimecursor_done(c)) {
+			while((r = mimecursor_read(c, buf, sizeof(buf))) > 0)
+				buffer_append(pulled, buf, r);
+			if(mimecursor_file(c, &ffd, &off, &flen)) {
+				char *dst = buffer_reserve(pulled, flen);
+				buffer_commit(pulled, pread(ffd, dst, flen, off));
+				mimecursor_skip_file(c);
+			}
+		}
+		mimecursor_free(c);
+		fprintf(stderr, "cached%s: %s\n", pass ? " (files)" : "",
+				buffer_length(pulled) == buffer_length(lines) &&
+				memcmp(buffer_data(pulled), buffer_data(lines),
+					buffer_length(lines)) == 0 ? "match" : "MISMATCH");
+	}
+	close(fd);
+
+	write(STDOUT_FILENO, buffer_data(lines), buffer_length(lines));
+
+	buffer_free(pulled);
+	buffer_free(lines);
 	mimemsg_free(m);
 	return 0;
 }
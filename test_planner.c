@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "planner.h"
+
+static void dump(planner *p) {
+	int i, k;
+	for(i = 0; i < p->n_groups; i++) {
+		planner_group *g = &p->groups[i];
+		printf("  %s (%s):", g->key, g->domain);
+		for(k = 0; k < g->n_rcpts; k++)
+			printf(" %s", p->rcpts[g->rcpts[k]]);
+		printf("\n");
+	}
+}
+
+// pretend both domains are served by the same exchanger
+static const char *mx_key(const char *domain, void *ctx) {
+	if(strcmp(domain, "y.org") == 0 || strcmp(domain, "z.org") == 0)
+		return "mx.example.net";
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	const char *addrs[] = {
+		"<a@x.org>", "<b@y.org>", "<c@X.ORG>", "<a@X.org>",
+		"<A@x.org>", "<d@z.org>", "<e@y.org>", "<b@y.org>"
+	};
+	int i, n = sizeof(addrs) / sizeof(addrs[0]);
+	planner *p = planner_new();
+
+	for(i = 0; i < n; i++)
+		printf("%s -> %d\n", addrs[i], planner_add(p, addrs[i]));
+
+	printf("by domain: %d groups\n", planner_plan(p, 0, NULL, NULL));
+	dump(p);
+	printf("by mx: %d groups\n", planner_plan(p, 0, &mx_key, NULL));
+	dump(p);
+	printf("at most 2: %d groups\n", planner_plan(p, 2, NULL, NULL));
+	dump(p);
+	planner_free(p);
+
+	// a newsletter: 100000 recipients in 50 domains
+	char addr[64];
+	p = planner_new();
+	for(i = 0; i < 100000; i++) {
+		snprintf(addr, sizeof(addr), "<user%d@domain%d.com>", i, i % 50);
+		planner_add(p, addr);
+	}
+	printf("newsletter: %d recipients, %d groups\n", p->n_rcpts,
+			planner_plan(p, PLANNER_MAX_RCPTS, NULL, NULL));
+	planner_free(p);
+	return 0;
+}
@@ -0,0 +1,42 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#include "probes.h"
+
+// One render with a write per line, like the hot paths do.
+static void render(int lines) {
+	int i;
+	PROBE_ENTER(part, NULL, 0);
+	for(i = 0; i < lines; i++)
+		PROBE(write_line, 1, 76);
+	usleep(1000);
+	PROBE_RETURN(part, NULL, lines * 78);
+}
+
+int main() {
+	int i;
+
+	// off: nothing is counted
+	for(i = 0; i < 10; i++)
+		render(100);
+	printf("off:\n");
+	probes_report(stdout);
+
+	// every hit
+	probes_set_sampling(1);
+	for(i = 0; i < 10; i++)
+		render(100);
+	printf("rate 1:\n");
+	probes_report(stdout);
+
+	// one in 10: the same estimates, the times vary with the machine
+	probes_reset();
+	probes_set_sampling(10);
+	for(i = 0; i < 100; i++)
+		render(10);
+	probes_set_sampling(0);
+	render(10);
+	printf("rate 10:\n");
+	probes_report(stdout);
+	return 0;
+}
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ratelimit.h"
+
+int main(int argc, char *argv[]) {
+	ratelimit_bucket b;
+	long now = 1000;
+	int i, taken = 0;
+
+	// 10 per second with a burst of 10
+	ratelimit_bucket_init(&b, 10, 10);
+	for(i = 0; i < 20; i++)
+		if(ratelimit_bucket_take(&b, 1, now) == 0)
+			taken++;
+	printf("burst: %d taken, wait %ld ms\n", taken,
+			ratelimit_bucket_wait(&b, 1, now));
+	printf("after 100 ms: %s\n",
+			ratelimit_bucket_take(&b, 1, now + 100) == 0 ? "taken" : "wait");
+
+	ratelimit *rl = ratelimit_new(0, 0, 16);
+	ratelimit_dest *d = ratelimit_get(rl, "Example.COM");
+	printf("same dest: %s\n", ratelimit_get(rl, "example.com") == d ?
+			"yes" : "no");
+
+	// additive increase on fast 2xx replies
+	for(i = 0; i < 40; i++, now += 10)
+		ratelimit_feedback(rl, d, 250, 20000, now);
+	printf("after 40 fast 250s: window %.0f\n", d->window);
+
+	// 451 halves the window once per latency
+	ratelimit_feedback(rl, d, 451, 20000, now);
+	printf("after 451: window %.0f\n", d->window);
+	ratelimit_feedback(rl, d, 451, 20000, now + 1);
+	printf("another 451 right away: window %.0f\n", d->window);
+	ratelimit_feedback(rl, d, 421, 20000, now + 100);
+	printf("421 later: window %.0f\n", d->window);
+
+	// rising latency with 2xx replies is congestion as well
+	for(i = 0; i < 40; i++, now += 10)
+		ratelimit_feedback(rl, d, 250, 20000, now);
+	double before = d->window;
+	for(i = 0; i < 20; i++, now += 1000)
+		ratelimit_feedback(rl, d, 250, 200000, now);
+	printf("slow replies: window %s\n", d->window < before ?
+			"decreased" : "NOT decreased");
+
+	// the window caps concurrent connections
+	d->window = 2;
+	for(i = 0; i < 3; i++)
+		printf("connect %d: %s\n", i + 1,
+				ratelimit_connect(rl, d, now) ? "wait" : "granted");
+	ratelimit_done(d);
+	printf("after done: %s\n", ratelimit_connect(rl, d, now) ? "wait" :
+			"granted");
+
+	ratelimit_free(rl);
+	return 0;
+}
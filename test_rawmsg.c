@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rawmsg.h"
+
+// Encodes in in pieces of step bytes, so CR, LF and '.' get split across
+// calls at every possible position.
+static int encode(const char *in, int len, int step, int flags, char *out) {
+	rawmsg_state st;
+	int i, n = 0;
+
+	rawmsg_init(&st, flags);
+	for(i = 0; i < len; i += step)
+		n += rawmsg_encode(&st, &in[i], len - i < step ? len - i : step,
+				&out[n]);
+	n += rawmsg_finish(&st, &out[n]);
+	return n;
+}
+
+// The same pieces, only counted.
+static long measure(const char *in, int len, int step, int flags) {
+	rawmsg_state st;
+	char end[2];
+	long n = 0;
+	int i;
+
+	rawmsg_init(&st, flags);
+	for(i = 0; i < len; i += step)
+		n += rawmsg_measure(&st, &in[i], len - i < step ? len - i : step);
+	return n + rawmsg_finish(&st, end);
+}
+
+static void check(const char *name, const char *in, const char *expect,
+		int flags) {
+	int len = strlen(in), step, ok = 1;
+	char *out = (char *)malloc(RAWMSG_MAX_OUT(len));
+
+	for(step = 1; step <= len + 1; step++) {
+		int n = encode(in, len, step, flags, out);
+		if(n != strlen(expect) || memcmp(out, expect, n) ||
+				measure(in, len, step, flags) != n) {
+			ok = 0;
+			break;
+		}
+	}
+	printf("%s: %s", name, ok ? "match" : "MISMATCH");
+	if(!ok)
+		printf(" (step %d)", step);
+	printf(", clean %d\n", rawmsg_is_clean(expect, strlen(expect), flags));
+	free(out);
+}
+
+int main(int argc, char *argv[]) {
+	check("lf", "a\nb\n", "a\r\nb\r\n", RAWMSG_DOT_STUFF);
+	check("crlf", "a\r\nb\r\n", "a\r\nb\r\n", RAWMSG_DOT_STUFF);
+	check("mixed", "a\r\nb\nc", "a\r\nb\r\nc\r\n", RAWMSG_DOT_STUFF);
+	check("dots", ".a\n..b\nc.\n.\n", "..a\r\n...b\r\nc.\r\n..\r\n",
+			RAWMSG_DOT_STUFF);
+	check("dots (bdat)", ".a\n..b\n", ".a\r\n..b\r\n", 0);
+	check("long", "0123456789abcdef0123456789abcdef\n.0123456789abcdef\n",
+			"0123456789abcdef0123456789abcdef\r\n..0123456789abcdef\r\n",
+			RAWMSG_DOT_STUFF);
+	check("bare cr", "a\rb\n", "a\rb\r\n", RAWMSG_DOT_STUFF);
+	check("trailing cr", "a\r", "a\r\n", RAWMSG_DOT_STUFF);
+	check("empty lines", "\n\n.\n", "\r\n\r\n..\r\n", RAWMSG_DOT_STUFF);
+	return 0;
+}
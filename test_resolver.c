@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "resolver.h"
+
+int main(int argc, char *argv[]) {
+	resolver *r = resolver_new();
+	int ch, flags = 0;
+
+	while((ch = getopt(argc, argv, "f:s:p:d:m")) != -1) {
+		switch(ch) {
+			case 'f':
+				// fixture only, never touch the network
+				resolver_set_nameserver(r, NULL, 0);
+				resolver_load_hosts(r, optarg);
+				break;
+			case 's':
+				resolver_set_nameserver(r, optarg, 53);
+				break;
+			case 'p':
+				resolver_set_nameserver(r, "127.0.0.1", atoi(optarg));
+				break;
+			case 'd':
+				resolver_set_search(r, optarg);
+				break;
+			case 'm':
+				flags |= RESOLVER_MX;
+				break;
+		}
+	}
+	if(optind >= argc) {
+		fprintf(stderr, "Usage: %s [-f hosts] [-s ns | -p port] [-d domains] [-m] name\n",
+				argv[0]);
+		return -1;
+	}
+
+	resolver_result res;
+	int ret = resolver_wait(r, argv[optind], 25, flags, &res);
+	printf("%s: %s\n", argv[optind], ret == RESOLVER_OK ? "ok" : "error");
+
+	int i;
+	for(i = 0; ret == RESOLVER_OK && i < res.n_addrs; i++) {
+		char buf[INET6_ADDRSTRLEN];
+		const void *a = res.addrs[i].addr.ss_family == AF_INET ?
+			(const void *)&((struct sockaddr_in *)&res.addrs[i].addr)->sin_addr :
+			(const void *)&((struct sockaddr_in6 *)&res.addrs[i].addr)->sin6_addr;
+		inet_ntop(res.addrs[i].addr.ss_family, a, buf, sizeof(buf));
+		printf("  %d %s\n", res.addrs[i].preference, buf);
+	}
+
+	// a second lookup must be answered from the cache
+	if(ret == RESOLVER_OK &&
+			resolver_resolve(r, argv[optind], 25, flags, &res) != RESOLVER_OK)
+		printf("cache miss!\n");
+
+	resolver_free(r);
+	return ret == RESOLVER_OK ? 0 : 1;
+}
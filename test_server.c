@@ -0,0 +1,93 @@
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test_server.h"
+
+void test_server_init(test_server *sv, int fd, int size) {
+	memset(sv, 0, sizeof(test_server));
+	sv->fd = fd;
+	sv->idle_ms = -1;
+	sv->buf = (char *)malloc(size);
+	sv->size = size;
+}
+
+void test_server_free(test_server *sv) {
+	free(sv->buf);
+	sv->buf = NULL;
+}
+
+static int test_server__read(test_server *sv, char *buf, int len) {
+	return sv->ssl ? SSL_read(sv->ssl, buf, len) : read(sv->fd, buf, len);
+}
+
+void test_server_write(test_server *sv, const char *str) {
+	if(sv->ssl)
+		SSL_write(sv->ssl, str, strlen(str));
+	else
+		write(sv->fd, str, strlen(str));
+}
+
+// Removes n octets from the front of the buffer.
+static void test_server__shift(test_server *sv, int n) {
+	memmove(sv->buf, &sv->buf[n], sv->len - n);
+	sv->len -= n;
+}
+
+int test_server_line(test_server *sv, char *out, int size) {
+	for(;;) {
+		char *eol = memchr(sv->buf, '\n', sv->len);
+		if(eol) {
+			int take = eol - sv->buf + 1;
+			int copy = take < size ? take : size - 1;
+			memcpy(out, sv->buf, copy);
+			out[copy] = '\0';
+			test_server__shift(sv, take);
+			return take;
+		}
+		// TLS may hold decrypted input the descriptor does not show
+		if(sv->idle_ms >= 0 && !(sv->ssl && SSL_pending(sv->ssl))) {
+			struct pollfd pfd = { sv->fd, POLLIN, 0 };
+			if(poll(&pfd, 1, sv->idle_ms) <= 0)
+				return 0;
+		}
+		if(sv->len == sv->size)
+			return 0;	// longer than any line of the tests
+		int r = test_server__read(sv, &sv->buf[sv->len], sv->size - sv->len);
+		if(r <= 0)
+			return 0;
+		sv->len += r;
+	}
+}
+
+int test_server_fill(test_server *sv, int n) {
+	if(n > sv->size)
+		return 0;
+	while(sv->len < n) {
+		int r = test_server__read(sv, &sv->buf[sv->len], sv->size - sv->len);
+		if(r <= 0)
+			return 0;
+		sv->len += r;
+	}
+	return 1;
+}
+
+void test_server_take(test_server *sv, char *out, int n) {
+	memcpy(out, sv->buf, n);
+	test_server__shift(sv, n);
+}
+
+long test_server_skip(test_server *sv, long n) {
+	long done = sv->len < n ? sv->len : n;
+	test_server__shift(sv, done);
+	while(done < n) {
+		char buf[4096];
+		int r = test_server__read(sv, buf, n - done < sizeof(buf) ?
+				n - done : sizeof(buf));
+		if(r <= 0)
+			break;
+		done += r;
+	}
+	return done;
+}
@@ -0,0 +1,33 @@
+#ifndef _TEST_SERVER_H
+#	define _TEST_SERVER_H
+
+#include <openssl/ssl.h>
+
+// The I/O half of the stand-in servers of the socket tests: buffered
+// lines, counted octets for BDAT, and replies, in the clear or over TLS
+// once ssl is set. Each test keeps its protocol in its own serve().
+typedef struct test_server {
+	int fd;
+	SSL *ssl;		// NULL until STARTTLS
+	int idle_ms;		// a line has to come within this, -1 waits
+	char *buf;
+	int size, len;
+} test_server;
+
+// Buffers up to size octets: a line or a BDAT chunk must fit.
+void test_server_init(test_server *sv, int fd, int size);
+// Frees the buffer, the descriptor stays open.
+void test_server_free(test_server *sv);
+
+void test_server_write(test_server *sv, const char *str);
+// Reads a line, with its line break, into out (truncated to size - 1).
+// Returns its length, 0 when the client hung up or idle_ms passed.
+int test_server_line(test_server *sv, char *out, int size);
+// Reads until n octets are buffered, 0 if the client hung up first.
+int test_server_fill(test_server *sv, int n);
+// Moves n buffered octets to out.
+void test_server_take(test_server *sv, char *out, int n);
+// Reads and drops n octets, returns how many came.
+long test_server_skip(test_server *sv, long n);
+
+#endif
@@ -10,12 +10,26 @@ int data_cb(smtp *s, void *ctx) {
 
 int main() {
 	smtp *s = smtp_new();
+	char *rcpts[] = { "<jizz@qbey.tw>", "<qbey@jizz.com>" };
+	int codes[2][2], i;
 
 	smtp_read_welcome(s);
 	smtp_helo(s, "jizz.com");
 	smtp_mail_from(s, "<user@example.com>");
 	smtp_rcpt_to(s, "<jizz@qbey.tw>");
 	smtp_data(s, &data_cb, NULL);
+
+	// EHLO starts over with extensions; then back to back, all at once
+	// if its reply had PIPELINING
+	smtp_ehlo(s, "jizz.com");
+	smtp_txn t[2] = {
+		{ "<user@example.com>", rcpts, 2, 0, -1, &data_cb, NULL, 0, codes[0] },
+		{ "<user@example.com>", rcpts, 1, 0, -1, &data_cb, NULL, 0, codes[1] },
+	};
+	smtp_send_pipelined(s, t, 2);
+	for(i = 0; i < 2; i++)
+		fprintf(stderr, "txn %d: mail %d, rcpt %d, data %d\n", i,
+				t[i].mail_code, t[i].rcpt_codes[0], t[i].code);
 	smtp_quit(s);
 
 	smtp_free(s);
@@ -0,0 +1,315 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "budget.h"
+#include "smtpclient.h"
+#include "test_server.h"
+
+// the message as submitted, and as it has to arrive
+#define MESSAGE	"Subject: test\n\n.a line with a dot\nlast line\n"
+#define WIRE	"Subject: test\r\n\r\n.a line with a dot\r\nlast line\r\n"
+// size of the messages submitted under a memory budget
+#define BIG	(16 * 1024)
+
+/*** An SMTP stand-in, a thread per connection ***/
+// RCPT refuses "nobody". A connection idle for IDLE_MS is dropped.
+#define IDLE_MS	(200)
+
+static int chunking, sizes, busy;
+static int connections, messages, damaged, missized;
+// connections inside a transaction now, and the most at once
+static int sending, most;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// A transaction starts (d 1) or ends (d -1) on a connection with open
+// ones, pipelined transactions count once.
+static void server_txn(int *open, int d) {
+	pthread_mutex_lock(&lock);
+	if(d > 0 && (*open)++ == 0) {
+		if(++sending > most)
+			most = sending;
+	} else if(d < 0 && --*open == 0) {
+		sending--;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+// declared is the SIZE= of the transaction, -1 without one
+static void server_got(const char *body, long declared) {
+	pthread_mutex_lock(&lock);
+	messages++;
+	if(strcmp(body, WIRE) && strlen(body) != BIG)
+		damaged++;
+	if(sizes && declared != (long)strlen(body))
+		missized++;
+	pthread_mutex_unlock(&lock);
+}
+
+static void *serve(void *arg) {
+	test_server sv;
+	char line[8192], body[BIG + 8192];
+	int got = 0, open = 0;
+	long declared = -1;
+
+	test_server_init(&sv, (int)(long)arg, BIG + 8192);
+	sv.idle_ms = IDLE_MS;
+	test_server_write(&sv, "220 stand-in\r\n");
+	while(test_server_line(&sv, line, sizeof(line))) {
+		if(!strncmp(line, "EHLO", 4)) {
+			test_server_write(&sv, "250-stand-in\r\n");
+			if(sizes)
+				test_server_write(&sv, "250-SIZE 100000\r\n");
+			test_server_write(&sv, chunking ? "250-PIPELINING\r\n"
+					"250 CHUNKING\r\n" : "250 PIPELINING\r\n");
+		} else if(!strncmp(line, "MAIL", 4)) {
+			char *p = strstr(line, "SIZE=");
+			declared = p ? atol(p + 5) : -1;
+			server_txn(&open, 1);
+			test_server_write(&sv, "250 ok\r\n");
+		} else if(!strncmp(line, "RCPT", 4) && strstr(line, "nobody")) {
+			test_server_write(&sv, "550 no such user\r\n");
+		} else if(!strncmp(line, "DATA", 4)) {
+			test_server_write(&sv, "354 go ahead\r\n");
+			body[0] = '\0';
+			while(test_server_line(&sv, line, sizeof(line)) &&
+					strcmp(line, ".\r\n"))
+				strcat(body, line[0] == '.' ? &line[1] : line);
+			server_got(body, declared);
+			server_txn(&open, -1);
+			test_server_write(&sv, busy ? "451 busy\r\n" : "250 queued\r\n");
+		} else if(!strncmp(line, "BDAT", 4)) {
+			int n = atoi(&line[5]);
+			// the stand-in's messages are small
+			if(!test_server_fill(&sv, n))
+				break;
+			test_server_take(&sv, &body[got], n);
+			got += n;
+			body[got] = '\0';
+			if(!strstr(line, "LAST")) {
+				test_server_write(&sv, "250 chunk\r\n");
+				continue;
+			}
+			server_got(body, declared);
+			server_txn(&open, -1);
+			got = 0;
+			test_server_write(&sv, busy ? "451 busy\r\n" : "250 queued\r\n");
+		} else if(!strncmp(line, "QUIT", 4)) {
+			test_server_write(&sv, "221 bye\r\n");
+			break;
+		} else {
+			test_server_write(&sv, "250 ok\r\n");
+		}
+	}
+	test_server_free(&sv);
+	close(sv.fd);
+	return NULL;
+}
+
+static void *listener(void *arg) {
+	int lfd = (int)(long)arg, fd;
+	while((fd = accept(lfd, NULL, NULL)) >= 0) {
+		pthread_t t;
+		pthread_mutex_lock(&lock);
+		connections++;
+		pthread_mutex_unlock(&lock);
+		pthread_create(&t, NULL, &serve, (void *)(long)fd);
+		pthread_detach(t);
+	}
+	return NULL;
+}
+
+/*** Client ***/
+static int completed, delivered, refused;
+
+static void done(smtpclient_result *r) {
+	pthread_mutex_lock(&lock);
+	completed++;
+	delivered += smtpclient_delivered(r);
+	refused += r->n_rcpts - smtpclient_delivered(r);
+	pthread_mutex_unlock(&lock);
+}
+
+// Waits for n callbacks in total.
+static void wait_for(int n) {
+	for(;;) {
+		pthread_mutex_lock(&lock);
+		int k = completed;
+		pthread_mutex_unlock(&lock);
+		if(k >= n)
+			return;
+		usleep(10000);
+	}
+}
+
+// Submits the same message again from the callback, again_left times.
+static smtpclient *again_c;
+static int again_left;
+
+static void again(smtpclient_result *r) {
+	done(r);
+	pthread_mutex_lock(&lock);
+	int more = again_left-- > 0;
+	pthread_mutex_unlock(&lock);
+	if(more)
+		smtpclient_submit(again_c, "test@qbey.tw", r->rcpts, r->n_rcpts,
+				MESSAGE, strlen(MESSAGE), &again, NULL);
+}
+
+static void report(const char *what, int max_connections) {
+	pthread_mutex_lock(&lock);
+	printf("%s: %d completed, %d delivered, %d refused, %d received, "
+			"%d damaged, connections %s\n", what, completed, delivered,
+			refused, messages, damaged,
+			connections <= max_connections ? "ok" : "TOO MANY");
+	completed = delivered = refused = messages = damaged = connections = 0;
+	pthread_mutex_unlock(&lock);
+}
+
+int main() {
+	char dir[] = "/tmp/test_smtpclient.XXXXXX";
+	char path[64];
+	char *rcpts[] = { "madoka@qbey.tw", "homura@qbey.tw" };
+	char *nobody[] = { "nobody@qbey.tw", "sayaka@qbey.tw" };
+	struct sockaddr_un sun;
+	pthread_t lt;
+	int i;
+
+	mkdtemp(dir);
+	snprintf(path, sizeof(path), "%s/smtp", dir);
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	bind(lfd, (struct sockaddr *)&sun, sizeof(sun));
+	listen(lfd, 8);
+	pthread_create(&lt, NULL, &listener, (void *)(long)lfd);
+
+	// one worker, its connection carries every batch
+	smtpclient *c = smtpclient_new(1);
+	smtpclient_set_socket(c, path);
+	for(i = 0; i < 50; i++)
+		smtpclient_submit(c, "test@qbey.tw", i % 10 ? rcpts : nobody, 2,
+				MESSAGE, strlen(MESSAGE), &done, NULL);
+	wait_for(50);
+	report("callbacks", 1);
+
+	// the server drops the kept connection, the next batch reconnects
+	usleep(IDLE_MS * 2 * 1000);
+	for(i = 0; i < 5; i++)
+		smtpclient_submit(c, "test@qbey.tw", rcpts, 2, MESSAGE,
+				strlen(MESSAGE), &done, NULL);
+	wait_for(5);
+	report("after idle", 1);
+	smtpclient_free(c);
+
+	// four workers, results through the eventfd
+	chunking = 1;
+	c = smtpclient_new(4);
+	smtpclient_set_socket(c, path);
+	for(i = 0; i < 100; i++)
+		smtpclient_submit(c, "test@qbey.tw", rcpts, 2, MESSAGE,
+				strlen(MESSAGE), NULL, (void *)(long)i);
+	int n = 0, sum = 0;
+	while(n < 100) {
+		struct pollfd pfd = { smtpclient_eventfd(c), POLLIN, 0 };
+		if(poll(&pfd, 1, 5000) <= 0)
+			break;
+		smtpclient_result *r;
+		while((r = smtpclient_reap(c)) != NULL) {
+			done(r);
+			sum += (int)(long)r->ctx;
+			n++;
+			smtpclient_result_free(r);
+		}
+	}
+	smtpclient_free(c);
+	printf("eventfd: contexts %s\n", sum == 99 * 100 / 2 ? "ok" : "WRONG");
+	report("BDAT", 4);
+
+	// submitting waits for room, instead of copying all of them at once
+	char *big = (char *)malloc(BIG);
+	long limit = budget_used() + 256 * 1024, peak = 0;
+	memset(big, 'x', BIG);
+	memcpy(&big[BIG - 2], "\r\n", 2);
+	budget_set_limit(limit);
+	c = smtpclient_new(2);
+	smtpclient_set_socket(c, path);
+	for(i = 0; i < 200; i++) {
+		smtpclient_submit(c, "test@qbey.tw", rcpts, 2, big, BIG, &done, NULL);
+		if(budget_used() > peak)
+			peak = budget_used();
+	}
+	wait_for(200);
+	smtpclient_free(c);
+	budget_set_limit(0);
+	free(big);
+	// the last message in, and the buffers of the sessions
+	printf("budget: peak %s\n", peak <= limit + BIG + 64 * 1024 ?
+			"within the limit" : "OVER THE LIMIT");
+	report("under budget", 2);
+
+	// over budget with messages in flight, a callback queues more
+	// without waiting for its own worker to send them
+	again_c = c = smtpclient_new(1);
+	again_left = 10;
+	smtpclient_set_socket(c, path);
+	for(i = 0; i < 3; i++)
+		smtpclient_submit(c, "test@qbey.tw", rcpts, 2, MESSAGE,
+				strlen(MESSAGE), &again, NULL);
+	budget_set_limit(1);
+	wait_for(13);
+	smtpclient_free(c);
+	budget_set_limit(0);
+	report("submitted by callbacks", 1);
+
+	// SIZE= counts the bare LFs of the message as CRLF, from memory and
+	// from a file, with DATA and with BDAT
+	char fn[64];
+	snprintf(fn, sizeof(fn), "%s/message", dir);
+	int fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	write(fd, MESSAGE, strlen(MESSAGE));
+	sizes = 1;
+	for(chunking = 0; chunking < 2; chunking++) {
+		c = smtpclient_new(1);
+		smtpclient_set_socket(c, path);
+		for(i = 0; i < 3; i++)
+			smtpclient_submit(c, "test@qbey.tw", rcpts, 2, MESSAGE,
+					strlen(MESSAGE), &done, NULL);
+		smtpclient_submit_fd(c, "test@qbey.tw", rcpts, 2, fd, &done, NULL);
+		wait_for(4 * (chunking + 1));
+		smtpclient_free(c);
+	}
+	close(fd);
+	unlink(fn);
+	printf("SIZE=: %s\n", missized ? "WRONG" : "ok");
+	report("bare LF", 2);
+
+	// a busy server keeps the window at one worker sending at a time
+	busy = 1;
+	pthread_mutex_lock(&lock);
+	sending = most = 0;
+	pthread_mutex_unlock(&lock);
+	c = smtpclient_new(4);
+	smtpclient_set_socket(c, path);
+	for(i = 0; i < 4 * SMTPCLIENT_BATCH; i++)
+		smtpclient_submit(c, "test@qbey.tw", rcpts, 2, MESSAGE,
+				strlen(MESSAGE), &done, NULL);
+	wait_for(4 * SMTPCLIENT_BATCH);
+	smtpclient_free(c);
+	printf("window: %s\n", most == 1 ? "one at a time" : "TOO WIDE");
+	report("busy", 4);
+
+	shutdown(lfd, SHUT_RDWR);
+	close(lfd);
+	pthread_join(lt, NULL);
+	unlink(path);
+	rmdir(dir);
+	return 0;
+}
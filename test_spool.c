@@ -0,0 +1,88 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spool.h"
+
+static void dump(spool *sp) {
+	spool_msg *m;
+	int i;
+	printf("%d messages\n", sp->n_msgs);
+	for(m = sp->head; m; m = m->next) {
+		printf("  %lu %s ->", m->id, m->from);
+		for(i = 0; i < m->n_rcpts; i++)
+			printf(" %s:%d", m->rcpts[i], m->state[i]);
+		printf("\n");
+	}
+}
+
+static long now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+int main(int argc, char *argv[]) {
+	char dir[] = "/tmp/test_spool.XXXXXX";
+	char *rcpts[] = { "<a@x.org>", "<b@y.org>", "<c@y.org>" };
+	char path[256];
+	int i, n = argc > 1 ? atoi(argv[1]) : 10000;
+
+	if(!mkdtemp(dir))
+		return -1;
+
+	spool *sp = spool_open(dir);
+	for(i = 0; i < 3; i++) {
+		spool_msg *m = spool_new_msg(sp, "<me@here.org>", rcpts, 3 - i);
+		write(m->fd, "Subject: hi\r\n\r\nbody\r\n", 21);
+		spool_add(sp, m);
+	}
+	spool_set_rcpt(sp, spool_find(sp, 1), 1, SPOOL_RCPT_DELIVERED);
+	spool_set_rcpt(sp, spool_find(sp, 1), 2, SPOOL_RCPT_FAILED);
+	spool_set_rcpt(sp, spool_find(sp, 3), 0, SPOOL_RCPT_DELIVERED);
+	spool_close(sp);
+
+	printf("reopened: ");
+	sp = spool_open(dir);
+	dump(sp);
+	// one process at a time
+	printf("while open: %s\n", spool_open(dir) ? "OPENED AGAIN" : "refused");
+	spool_close(sp);
+
+	// a crash in the middle of a journal write
+	snprintf(path, sizeof(path), "%s/journal", dir);
+	int fd = open(path, O_WRONLY | O_APPEND);
+	write(fd, "\x40\0\0\0garbage", 11);
+	close(fd);
+	printf("torn: ");
+	sp = spool_open(dir);
+	dump(sp);
+
+	// group commit: many messages, few syncs
+	long start = now_ms();
+	for(i = 0; i < n; i++) {
+		spool_msg *m = spool_new_msg(sp, "<me@here.org>", rcpts, 1);
+		write(m->fd, "Subject: hi\r\n\r\nbody\r\n", 21);
+		spool_add(sp, m);
+	}
+	spool_commit(sp);
+	fprintf(stderr, "%d messages in %ld ms\n", n, now_ms() - start);
+	spool_close(sp);
+
+	sp = spool_open(dir);
+	printf("bulk: %d messages\n", sp->n_msgs);
+	while(sp->head)
+		spool_remove(sp, sp->head);
+	spool_close(sp);
+
+	sp = spool_open(dir);
+	printf("removed: %d messages\n", sp->n_msgs);
+	spool_close(sp);
+
+	snprintf(path, sizeof(path), "rm -rf %s", dir);
+	system(path);
+	return 0;
+}
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "mime.h"
+#include "template.h"
+
+static mime_msg *make_msg(const char *to, const char *name, const char *note,
+		int cache_fd) {
+	char text[512];
+	mime_msg *m = mimemsg_new();
+
+	snprintf(text, sizeof(text), "Dear %s,\r\n.a line with a dot\r\n%s\r\nbye",
+			name, note);
+	mimemsg_add_part(m, mimepart_new_plain(text));
+	mime_part *p = mimepart_new_attachment("buffer.c");
+	if(cache_fd >= 0)
+		mimepart_cache(p, 76, cache_fd);
+	mimemsg_add_part(m, p);
+
+	mimemsg_set_header(m, "From", "<test@cnmail.csie.org>");
+	mimemsg_set_header(m, "To", to);
+	snprintf(text, sizeof(text), "Hello %s", name);
+	mimemsg_set_header(m, "Subject", text);
+	mimemsg_set_boundary(m, "BOUNDARY-test");
+	return m;
+}
+
+static void flatten(template_output *o, buffer_ctx *out) {
+	int i;
+	buffer_reset(out);
+	for(i = 0; i < o->n_pieces; i++) {
+		template_piece *p = &o->pieces[i];
+		if(p->data) {
+			buffer_append(out, p->data, p->len);
+			continue;
+		}
+		char *buf = buffer_reserve(out, p->len);
+		buffer_commit(out, pread(p->fd, buf, p->len, p->offset));
+	}
+}
+
+static void expect(template *t, const char **values, int flags,
+		mime_msg *m, const char *what) {
+	template_output *o = template_output_new();
+	buffer_ctx *got = buffer_new(0), *want = buffer_new(0);
+	char buf[4096];
+	int r;
+
+	template_render(t, values, flags, o);
+	flatten(o, got);
+	mime_cursor *c = mimecursor_new(m, 76,
+			flags & TEMPLATE_DOT_STUFF ? MIMECURSOR_DOT_STUFF : 0);
+	while((r = mimecursor_read(c, buf, sizeof(buf))) > 0)
+		buffer_append(want, buf, r);
+	mimecursor_free(c);
+
+	printf("%s: %d pieces, %ld octets, %s", what, o->n_pieces, o->len,
+			buffer_length(got) == buffer_length(want) &&
+			!memcmp(buffer_data(got), buffer_data(want), buffer_length(got)) ?
+			"match" : "MISMATCH");
+	if(!(flags & TEMPLATE_DOT_STUFF))
+		printf(", size %s", template_size(t, values) == o->len ?
+				"exact" : "WRONG");
+	printf("\n");
+
+	template_output_free(o);
+	buffer_free(got);
+	buffer_free(want);
+}
+
+static long now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+int main(int argc, char *argv[]) {
+	int i, n = argc > 1 ? atoi(argv[1]) : 100000;
+	char cache_fn[] = "/tmp/test_template.XXXXXX";
+	int cache_fd = mkstemp(cache_fn);
+	unlink(cache_fn);
+
+	mime_msg *tm = make_msg("{{email}}", "{{name}}", "{{note}}", -1);
+	template *t = template_compile(tm, 76);
+	printf("fields:");
+	for(i = 0; i < t->n_fields; i++)
+		printf(" %s", t->fields[i]);
+	printf(", %d segments, %ld static octets\n", t->n_segs, t->static_len);
+
+	const char *v1[] = { "<madoka@qbey.tw>", "Madoka", "P.S. see you" };
+	mime_msg *m1 = make_msg(v1[0], v1[1], v1[2], -1);
+	expect(t, v1, 0, m1, "plain");
+	expect(t, v1, TEMPLATE_DOT_STUFF, m1, "stuffed");
+	mimemsg_free(m1);
+
+	// a value starting a line with a dot, and one spanning lines
+	const char *v2[] = { "<homura@qbey.tw>", "Homura", ".hidden\n.\nend" };
+	m1 = make_msg(v2[0], v2[1], ".hidden\r\n.\r\nend", -1);
+	expect(t, v2, TEMPLATE_DOT_STUFF, m1, "dotted value");
+	mimemsg_free(m1);
+
+	// line breaks cannot add headers
+	const char *v3[] = { "<x@qbey.tw>\r\nBcc: <all@qbey.tw>", "X", "" };
+	template_output *o = template_output_new();
+	buffer_ctx *out = buffer_new(0);
+	template_render(t, v3, 0, o);
+	flatten(o, out);
+	printf("header injection: %s\n", strstr(buffer_cstr(out), "\r\nBcc:") ?
+			"INJECTED" : "blocked");
+
+	// the cached attachment is handed out as a file region
+	template_free(t);
+	mimemsg_free(tm);
+	tm = make_msg("{{email}}", "{{name}}", "{{note}}", cache_fd);
+	t = template_compile(tm, 76);
+	m1 = make_msg(v1[0], v1[1], v1[2], cache_fd);
+	expect(t, v1, TEMPLATE_DOT_STUFF, m1, "cached");
+	mimemsg_free(m1);
+
+	// per recipient work is the values, not the message
+	char email[64], name[32];
+	const char *vn[] = { email, name, "" };
+	long values = 0, total = 0, start = now_us();
+	for(i = 0; i < n; i++) {
+		snprintf(email, sizeof(email), "<user%d@qbey.tw>", i);
+		snprintf(name, sizeof(name), "User %d", i);
+		template_render(t, vn, TEMPLATE_DOT_STUFF, o);
+		values += buffer_length(o->values);
+		total += o->len;
+	}
+	fprintf(stderr, "%d renders in %ld us\n", n, now_us() - start);
+	printf("%d recipients: %ld of %ld octets formatted\n", n, values, total);
+
+	buffer_free(out);
+	template_output_free(o);
+	template_free(t);
+	mimemsg_free(tm);
+	close(cache_fd);
+	return 0;
+}
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "retry.h"
+#include "timer.h"
+
+typedef struct {
+	timer_node node;
+	unsigned long due;
+} item;
+
+static unsigned long late, early, fired, bad_next;
+
+// The wheel's clock is at the tick being processed.
+static void check(timer_node *t, void *ctx) {
+	timer_wheel *w = (timer_wheel *)ctx;
+	item *it = (item *)t->data;
+	if(w->now < it->due) early++;
+	if(w->now > it->due) late++;
+	fired++;
+}
+
+int main(int argc, char *argv[]) {
+	int i, n = argc > 1 ? atoi(argv[1]) : 1000000;
+	item *items = (item *)calloc(n, sizeof(item));
+	timer_wheel w;
+
+	srandom(1);
+	timer_init(&w, 1000);
+	for(i = 0; i < n; i++) {
+		// a spread over all levels, dense near the front
+		unsigned long delta = 1 + random() % (1UL << (6 * (1 + i % 4)));
+		items[i].node.data = &items[i];
+		items[i].due = 1000 + delta;
+		timer_add(&w, &items[i].node, items[i].due);
+	}
+	// removing is O(1) as well
+	for(i = 0; i < n; i += 10)
+		timer_del(&w, &items[i].node);
+	printf("pending: %d\n", w.count);
+
+	while(w.count) {
+		// nothing may fire before the time timer_next() reports
+		long next = timer_next(&w);
+		if(next > 1) {
+			unsigned long before = fired;
+			timer_advance(&w, w.now + next - 1, &check, &w);
+			if(fired != before) bad_next++;
+		}
+		timer_advance(&w, w.now + 1 + random() % 500, &check, &w);
+	}
+	printf("fired: %lu, early: %lu, late: %lu, bad next: %lu\n",
+			fired, early, late, bad_next);
+
+	printf("backoff:");
+	for(i = 1; i <= 10; i++) {
+		long b = retry_backoff(i);
+		long nominal = RETRY_BASE << (i - 1);
+		if(nominal > RETRY_MAX_DELAY) nominal = RETRY_MAX_DELAY;
+		printf(" %s", b >= nominal - nominal / 10 &&
+				b <= nominal + nominal / 10 ? "ok" : "BAD");
+	}
+	printf("\n");
+
+	free(items);
+	return 0;
+}
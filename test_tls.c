@@ -0,0 +1,192 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include "smtp.h"
+#include "tls.h"
+#include "test_server.h"
+
+// server behaviour per connection
+#define SERVE_PLAIN	(0)
+#define SERVE_INJECT	(1)	// a reply right behind 220 to STARTTLS
+
+/*** A STARTTLS stand-in with a self-signed certificate ***/
+static void serve(SSL_CTX *ctx, int fd, int mode) {
+	test_server sv;
+	char line[4096];
+	long body = 0;
+
+	test_server_init(&sv, fd, 4096);
+	test_server_write(&sv, "220 stand-in\r\n");
+	while(test_server_line(&sv, line, sizeof(line))) {
+		if(!strncmp(line, "EHLO", 4)) {
+			test_server_write(&sv, sv.ssl ? "250-stand-in\r\n250-PIPELINING\r\n"
+					"250 CHUNKING\r\n" : "250-stand-in\r\n250 STARTTLS\r\n");
+		} else if(!strncmp(line, "STARTTLS", 8)) {
+			test_server_write(&sv, mode == SERVE_INJECT ?
+					"220 go ahead\r\n250 injected\r\n" : "220 go ahead\r\n");
+			sv.ssl = SSL_new(ctx);
+			SSL_set_fd(sv.ssl, fd);
+			if(SSL_accept(sv.ssl) != 1)
+				break;
+		} else if(!strncmp(line, "BDAT", 4)) {
+			body += test_server_skip(&sv, atol(&line[5]));
+			snprintf(line, sizeof(line), "250 %ld octets\r\n", body);
+			test_server_write(&sv, line);
+		} else if(!strncmp(line, "QUIT", 4)) {
+			test_server_write(&sv, "221 bye\r\n");
+			break;
+		} else {
+			test_server_write(&sv, "250 ok\r\n");
+		}
+	}
+	if(sv.ssl) {
+		SSL_shutdown(sv.ssl);
+		SSL_free(sv.ssl);
+	}
+	test_server_free(&sv);
+	close(fd);
+}
+
+static SSL_CTX *server_ctx(const char *cert_fn) {
+	EVP_PKEY *key = EVP_EC_gen("P-256");
+	X509 *x = X509_new();
+	X509_set_version(x, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+	X509_gmtime_adj(X509_getm_notBefore(x), 0);
+	X509_gmtime_adj(X509_getm_notAfter(x), 3600);
+	X509_NAME *name = X509_get_subject_name(x);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+			(const unsigned char *)"localhost", -1, -1, 0);
+	X509_set_issuer_name(x, name);
+	X509_set_pubkey(x, key);
+	X509_sign(x, key, EVP_sha256());
+
+	FILE *fp = fopen(cert_fn, "w");
+	PEM_write_X509(fp, x);
+	fclose(fp);
+
+	SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+	SSL_CTX_use_certificate(ctx, x);
+	SSL_CTX_use_PrivateKey(ctx, key);
+	X509_free(x);
+	EVP_PKEY_free(key);
+	return ctx;
+}
+
+/*** Client ***/
+static int connect_to(int port) {
+	struct sockaddr_in sin;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// One session: STARTTLS, then a message with its body from a file.
+static void session(tls_ctx *c, int port, const char *host, int body_fd,
+		long body_len, const char *what) {
+	int fd = connect_to(port);
+	smtp *s = smtp_new();
+	smtp_set_fd(s, fd, fd);
+	smtp_set_timeouts(s, 5000, 5000);
+
+	printf("%s: ", what);
+	if(!smtp_read_welcome(s) || !smtp_ehlo(s, "test") ||
+			!smtp_has_extension(s, SMTP_EXT_STARTTLS)) {
+		printf("no STARTTLS\n");
+	} else if(!smtp_starttls(s, c, host, "127.0.0.1:25")) {
+		printf("refused, %s", smtp_get_msg(s));
+	} else {
+		tls_conn *t = smtp_get_tls(s);
+		printf("%s, %s handshake, ", tls_version(t),
+				tls_resumed(t) ? "resumed" : "full");
+		fprintf(stderr, "%s: kTLS %s\n", what, tls_ktls_send(t) ? "on" : "off");
+		if(smtp_ehlo(s, "test") && smtp_mail_from(s, "<a@b.c>") &&
+				smtp_rcpt_to(s, "<d@e.f>") &&
+				smtp_bdat_file(s, body_fd, 0, body_len, 1))
+			printf("%s", smtp_get_msg(s));
+		else
+			printf("FAILED %s", smtp_get_msg(s));
+		smtp_quit(s);
+	}
+	smtp_free(s);
+	close(fd);
+}
+
+int main() {
+	char cert_fn[] = "/tmp/test_tls_cert.XXXXXX";
+	char body_fn[] = "/tmp/test_tls_body.XXXXXX";
+	int modes[] = { SERVE_PLAIN, SERVE_PLAIN, SERVE_PLAIN, SERVE_PLAIN,
+		SERVE_INJECT };
+	int n = sizeof(modes) / sizeof(modes[0]), i;
+
+	close(mkstemp(cert_fn));
+	SSL_CTX *sctx = server_ctx(cert_fn);
+
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	int lfd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bind(lfd, (struct sockaddr *)&sin, sizeof(sin));
+	listen(lfd, 8);
+	getsockname(lfd, (struct sockaddr *)&sin, &slen);
+	int port = ntohs(sin.sin_port);
+
+	pid_t pid = fork();
+	if(pid == 0) {
+		// one context, so its session tickets stay valid
+		for(i = 0; i < n; i++) {
+			int fd = accept(lfd, NULL, NULL);
+			if(fd >= 0)
+				serve(sctx, fd, modes[i]);
+		}
+		_exit(0);
+	}
+	close(lfd);
+	signal(SIGPIPE, SIG_IGN);
+
+	// a body large enough for several records
+	int body_fd = mkstemp(body_fn);
+	unlink(body_fn);
+	long body_len = 0;
+	for(i = 0; i < 4000; i++) {
+		char line[64];
+		int len = snprintf(line, sizeof(line), "line %d of the body\r\n", i);
+		body_len += write(body_fd, line, len);
+	}
+
+	tls_ctx *c = tls_ctx_new(TLS_KTLS, NULL);
+	session(c, port, "localhost", body_fd, body_len, "first");
+	session(c, port, "localhost", body_fd, body_len, "again");
+
+	tls_ctx *v = tls_ctx_new(TLS_VERIFY, cert_fn);
+	session(v, port, "localhost", body_fd, body_len, "verified");
+	session(v, port, "mx.example.org", body_fd, body_len, "wrong name");
+	session(c, port, "localhost", body_fd, body_len, "injected");
+
+	waitpid(pid, NULL, 0);
+	tls_ctx_free(c);
+	tls_ctx_free(v);
+	SSL_CTX_free(sctx);
+	close(body_fd);
+	unlink(cert_fn);
+	return 0;
+}
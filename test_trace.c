@@ -0,0 +1,151 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "smtp.h"
+#include "trace.h"
+#include "test_server.h"
+
+// the server takes this long to accept a message
+#define QUEUE_MS	(100)
+
+/*** An SMTP stand-in ***/
+static void serve(int fd) {
+	test_server sv;
+	char line[1024];
+
+	test_server_init(&sv, fd, 1024);
+	test_server_write(&sv, "220 stand-in\r\n");
+	while(test_server_line(&sv, line, sizeof(line))) {
+		if(!strncmp(line, "EHLO", 4)) {
+			test_server_write(&sv, "250-stand-in\r\n250-PIPELINING\r\n"
+					"250 SIZE 1000000\r\n");
+		} else if(!strncmp(line, "DATA", 4)) {
+			test_server_write(&sv, "354 go ahead\r\n");
+			while(test_server_line(&sv, line, sizeof(line)) &&
+					strcmp(line, ".\r\n"))
+				;
+			usleep(QUEUE_MS * 1000);
+			test_server_write(&sv, "250 queued as 42\r\n");
+		} else if(!strncmp(line, "QUIT", 4)) {
+			test_server_write(&sv, "221 bye\r\n");
+			break;
+		} else {
+			test_server_write(&sv, "250 ok\r\n");
+		}
+	}
+	test_server_free(&sv);
+	close(fd);
+}
+
+/*** Client ***/
+static long now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+// The same session every time: the body comes from a file, so that it
+// is recorded by length only. Returns the replies, one line each.
+static void session(int fd, trace *t, int body_fd, long body_len,
+		char *replies) {
+	smtp *s = smtp_new();
+
+	smtp_set_fd(s, fd, fd);
+	smtp_set_timeouts(s, 5000, 5000);
+	smtp_set_trace(s, t, "stand-in");
+	replies[0] = '\0';
+	smtp_read_welcome(s);
+	strcat(replies, smtp_get_msg(s));
+	smtp_ehlo(s, "test");
+	strcat(replies, smtp_get_msg(s));
+	smtp_mail_from(s, "<a@b.c>");
+	strcat(replies, smtp_get_msg(s));
+	smtp_rcpt_to(s, "<d@e.f>");
+	strcat(replies, smtp_get_msg(s));
+	smtp_data_file(s, body_fd, 0, body_len);
+	strcat(replies, smtp_get_msg(s));
+	smtp_quit(s);
+	strcat(replies, smtp_get_msg(s));
+	smtp_free(s);
+}
+
+static void replay(const char *path, double scale, int body_fd,
+		long body_len, const char *recorded) {
+	char replies[4096];
+	int fds[2];
+	trace_stats st;
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	pid_t pid = fork();
+	if(pid == 0) {
+		trace_reader *r = trace_reader_open(path);
+		close(fds[0]);
+		int ok = r && trace_replay(r, fds[1], scale, &st) == 1 &&
+			!trace_has_session(r);
+		_exit(ok ? 0 : 1);
+	}
+	close(fds[1]);
+	long start = now_ms();
+	session(fds[0], NULL, body_fd, body_len, replies);
+	long took = now_ms() - start;
+	close(fds[0]);
+	int status;
+	waitpid(pid, &status, 0);
+
+	printf("replay x%g: %s, replies %s, %s\n", scale,
+			WIFEXITED(status) && WEXITSTATUS(status) == 0 ? "played" : "FAILED",
+			strcmp(replies, recorded) ? "DIFFERENT" : "the same",
+			scale ? (took >= QUEUE_MS * scale ? "delay kept" : "DELAY LOST") :
+			(took < QUEUE_MS ? "no delay" : "DELAYED"));
+}
+
+int main() {
+	char path[] = "/tmp/test_trace.XXXXXX", body[] = "/tmp/test_trace_body.XXXXXX";
+	char recorded[4096];
+	trace_event e;
+	int fds[2], counts[4] = { 0, 0, 0, 0 }, n;
+
+	signal(SIGPIPE, SIG_IGN);
+	close(mkstemp(path));
+	int body_fd = mkstemp(body);
+	unlink(body);
+	for(n = 0; n < 1000; n++)
+		write(body_fd, "a line of the message body\r\n", 28);
+
+	// record a session with the stand-in
+	socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	pid_t pid = fork();
+	if(pid == 0) {
+		close(fds[0]);
+		serve(fds[1]);
+		_exit(0);
+	}
+	close(fds[1]);
+	trace *t = trace_create(path);
+	session(fds[0], t, body_fd, 28000, recorded);
+	trace_free(t);
+	close(fds[0]);
+	waitpid(pid, NULL, 0);
+	printf("recorded:\n%s", recorded);
+
+	trace_reader *r = trace_reader_open(path);
+	while((n = trace_next(r, &e)) > 0)
+		counts[e.type]++;
+	trace_reader_free(r);
+	printf("records: %d open, %d out, %d in, %d file, %s\n", counts[TRACE_OPEN],
+			counts[TRACE_OUT], counts[TRACE_IN], counts[TRACE_FILE],
+			n == 0 ? "complete" : "DAMAGED");
+
+	replay(path, 1, body_fd, 28000, recorded);
+	replay(path, 0, body_fd, 28000, recorded);
+
+	close(body_fd);
+	unlink(path);
+	return 0;
+}
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "smtp.h"
+
+static const char *names[] = { "file", "TCP", "Unix" };
+
+static int option(int fd, int level, int name) {
+	int v = 0;
+	socklen_t len = sizeof(v);
+	getsockopt(fd, level, name, &v, &len);
+	return v;
+}
+
+// A connected pair of loopback TCP sockets.
+static int tcp_pair(int fds[2]) {
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int lfd = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(lfd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+			listen(lfd, 1) < 0 ||
+			getsockname(lfd, (struct sockaddr *)&sin, &len) < 0)
+		return 0;
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+	if(connect(fds[0], (struct sockaddr *)&sin, sizeof(sin)) < 0)
+		return 0;
+	fds[1] = accept(lfd, NULL, NULL);
+	close(lfd);
+	return fds[1] >= 0;
+}
+
+int main() {
+	char body[20000];
+	int fds[2];
+	smtp *s = smtp_new();
+
+	if(pipe(fds) == 0) {
+		smtp_set_fd(s, fds[0], fds[1]);
+		printf("pipe: %s\n", names[smtp_get_transport(s)]);
+		close(fds[0]);
+		close(fds[1]);
+	}
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0) {
+		smtp_set_fd(s, fds[0], fds[0]);
+		printf("socketpair: %s\n", names[smtp_get_transport(s)]);
+		close(fds[0]);
+		close(fds[1]);
+	}
+	if(!tcp_pair(fds)) {
+		printf("no loopback TCP\n");
+		return 1;
+	}
+
+	smtp_set_fd(s, fds[0], fds[0]);
+	smtp_set_buffers(s, 256 * 1024, 128 * 1024);
+	printf("tcp: %s, nodelay %d, buffers %s\n", names[smtp_get_transport(s)],
+			option(fds[0], IPPROTO_TCP, TCP_NODELAY),
+			// the kernel doubles what is asked for
+			option(fds[0], SOL_SOCKET, SO_SNDBUF) >= 256 * 1024 &&
+			option(fds[0], SOL_SOCKET, SO_RCVBUF) >= 128 * 1024 ?
+			"set" : "NOT SET");
+
+	// commands wait in the buffer, a body goes out corked
+	memset(body, 'x', sizeof(body));
+	smtp_bdat_start(s, sizeof(body), 1);
+	printf("command: cork %d\n", option(fds[0], IPPROTO_TCP, TCP_CORK));
+	smtp_write(s, body, sizeof(body));
+	printf("body: cork %d\n", option(fds[0], IPPROTO_TCP, TCP_CORK));
+
+	// the reply is already there, waiting for it uncorks
+	write(fds[1], "250 ok\r\n", 8);
+	int ok = smtp_bdat_end(s);
+	printf("reply: %s, cork %d\n", ok ? "ok" : "FAILED",
+			option(fds[0], IPPROTO_TCP, TCP_CORK));
+
+	char buf[4096];
+	long got = 0;
+	int r;
+	shutdown(fds[0], SHUT_WR);
+	while((r = read(fds[1], buf, sizeof(buf))) > 0)
+		got += r;
+	printf("received: %ld octets\n", got);
+
+	smtp_free(s);
+	close(fds[0]);
+	close(fds[1]);
+
+	// a command and its reply in one submission, where io_uring is built
+	// in (make WITH_URING=1) and the kernel has it
+	uring *ring = uring_new(URING_ENTRIES);
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		return 1;
+	s = smtp_new();
+	smtp_set_fd(s, fds[0], fds[0]);
+	smtp_set_uring(s, ring);
+	write(fds[1], "250 reset\r\n", 11);
+	ok = smtp_rset(s);
+	got = read(fds[1], buf, sizeof(buf));
+	printf("rset through %s: %s\n", ring ? "io_uring" : "poll",
+			ok && got == 6 && !memcmp(buf, "RSET\r\n", 6) ? "ok" : "FAILED");
+	smtp_free(s);
+	if(ring)
+		uring_free(ring);
+	close(fds[0]);
+	close(fds[1]);
+	return 0;
+}
@@ -0,0 +1,144 @@
+#include <string.h>
+
+#include "timer.h"
+
+#define TIMER__MASK	(TIMER_SLOTS - 1)
+
+static void timer__list_init(timer_node *head) {
+	head->next = head->prev = head;
+}
+
+static void timer__list_add(timer_node *head, timer_node *t) {
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+static void timer__list_del(timer_node *t) {
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+}
+
+// Picks the level by distance and the slot by the expiry's digit there.
+static void timer__place(timer_wheel *w, timer_node *t) {
+	unsigned long delta = t->expires - w->now;
+	int level = 0;
+
+	while(level < TIMER_LEVELS - 1 &&
+			delta >> (TIMER_SLOT_BITS * (level + 1)))
+		level++;
+	int slot = (t->expires >> (TIMER_SLOT_BITS * level)) & TIMER__MASK;
+	timer__list_add(&w->slots[level][slot], t);
+}
+
+void timer_init(timer_wheel *w, unsigned long now) {
+	int l, i;
+	memset(w, 0, sizeof(timer_wheel));
+	w->now = now;
+	for(l = 0; l < TIMER_LEVELS; l++)
+		for(i = 0; i < TIMER_SLOTS; i++)
+			timer__list_init(&w->slots[l][i]);
+}
+
+void timer_add(timer_wheel *w, timer_node *t, unsigned long expires) {
+	if(expires <= w->now)
+		expires = w->now + 1;
+	if(expires - w->now > TIMER_MAX_DELTA)
+		expires = w->now + TIMER_MAX_DELTA;
+	t->expires = expires;
+	timer__place(w, t);
+	w->count++;
+}
+
+void timer_del(timer_wheel *w, timer_node *t) {
+	if(!timer_pending(t))
+		return;
+	timer__list_del(t);
+	w->count--;
+}
+
+int timer_pending(timer_node *t) {
+	return t->next != NULL;
+}
+
+// Re-places the timers of one slot, all of them are now closer.
+static void timer__cascade(timer_wheel *w, int level, int slot) {
+	timer_node list, *t;
+	timer_node *head = &w->slots[level][slot];
+
+	if(head->next == head)
+		return;
+	list.next = head->next;
+	list.prev = head->prev;
+	list.next->prev = list.prev->next = &list;
+	timer__list_init(head);
+
+	while((t = list.next) != &list) {
+		timer__list_del(t);
+		timer__place(w, t);
+	}
+}
+
+int timer_advance(timer_wheel *w, unsigned long now, timer_func cb,
+		void *ctx) {
+	int fired = 0;
+
+	while(w->now < now) {
+		w->now++;
+
+		int level;
+		for(level = 1; level < TIMER_LEVELS; level++) {
+			int bits = TIMER_SLOT_BITS * level;
+			if(w->now & ((1UL << bits) - 1))
+				break;
+			timer__cascade(w, level, (w->now >> bits) & TIMER__MASK);
+		}
+
+		timer_node *head = &w->slots[0][w->now & TIMER__MASK], *t;
+		while((t = head->next) != head) {
+			timer__list_del(t);
+			w->count--;
+			fired++;
+			cb(t, ctx);
+		}
+	}
+	return fired;
+}
+
+void timer_clear(timer_wheel *w, timer_func cb, void *ctx) {
+	int l, i;
+	for(l = 0; l < TIMER_LEVELS; l++)
+		for(i = 0; i < TIMER_SLOTS; i++) {
+			timer_node *head = &w->slots[l][i], *t;
+			while((t = head->next) != head) {
+				timer__list_del(t);
+				w->count--;
+				cb(t, ctx);
+			}
+		}
+}
+
+long timer_next(timer_wheel *w) {
+	long best = -1;
+	int level, i;
+
+	if(w->count == 0)
+		return -1;
+	for(level = 0; level < TIMER_LEVELS; level++) {
+		int bits = TIMER_SLOT_BITS * level;
+		unsigned long base = w->now >> bits;
+		for(i = 1; i <= TIMER_SLOTS; i++) {
+			timer_node *head = &w->slots[level][(base + i) & TIMER__MASK];
+			if(head->next == head)
+				continue;
+			// lower levels are exact, higher ones give the slot start
+			long at = level ? (long)(((base + i) << bits) - w->now) : i;
+			if(best < 0 || at < best)
+				best = at;
+			break;
+		}
+	}
+	return best;
+}
@@ -0,0 +1,48 @@
+#ifndef _TIMER_H
+#	define _TIMER_H
+
+// Hierarchical timer wheel (Varghese & Lauck): TIMER_LEVELS wheels of
+// TIMER_SLOTS slots, each level 64 times coarser than the one below.
+// Adding and removing a timer is O(1); a timer is moved down a level at
+// most TIMER_LEVELS - 1 times before it expires. Time is counted in
+// ticks of whatever unit the caller picks.
+
+#define TIMER_SLOT_BITS		(6)
+#define TIMER_SLOTS		(1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS		(4)
+// later timers are clamped to this many ticks from now
+#define TIMER_MAX_DELTA		((1UL << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1)
+
+// Embed in the timed object; data is for the owner.
+typedef struct timer_node {
+	struct timer_node *next, *prev;
+	unsigned long expires;
+	void *data;
+} timer_node;
+
+typedef struct timer_wheel {
+	unsigned long now;
+	int count;
+	timer_node slots[TIMER_LEVELS][TIMER_SLOTS];	// list heads
+} timer_wheel;
+
+// Called for each expired timer, which is already removed and may be
+// freed or added again.
+typedef void (* timer_func) (timer_node *t, void *ctx);
+
+void timer_init(timer_wheel *w, unsigned long now);
+// expires in the past fires on the next timer_advance().
+void timer_add(timer_wheel *w, timer_node *t, unsigned long expires);
+void timer_del(timer_wheel *w, timer_node *t);
+int timer_pending(timer_node *t);
+
+// Moves the wheel to now and fires everything due, in expiry order.
+// Returns the number of timers fired.
+int timer_advance(timer_wheel *w, unsigned long now, timer_func cb,
+		void *ctx);
+// Removes every timer, calling cb for each.
+void timer_clear(timer_wheel *w, timer_func cb, void *ctx);
+// Ticks until the next timer may fire (a lower bound), -1 when empty.
+long timer_next(timer_wheel *w);
+
+#endif
@@ -0,0 +1,277 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "tls.h"
+
+typedef struct tls__entry {
+	char key[TLS_KEY_SIZE];
+	SSL_SESSION *sess;
+	unsigned long used;	// clock of the last store
+} tls__entry;
+
+struct tls_ctx {
+	SSL_CTX *ssl;
+	int flags;
+	pthread_mutex_t lock;	// sessions arrive on any thread
+	tls__entry cache[TLS_CACHE_SIZE];
+	unsigned long clock;
+};
+
+struct tls_conn {
+	tls_ctx *c;
+	SSL *ssl;
+	char key[TLS_KEY_SIZE];
+	int want;	// poll(2) events the last call waits for
+};
+
+/*** Session cache ***/
+static void tls__store(tls_ctx *c, const char *key, SSL_SESSION *sess) {
+	tls__entry *e = NULL;
+	int i;
+
+	pthread_mutex_lock(&c->lock);
+	for(i = 0; i < TLS_CACHE_SIZE; i++) {
+		tls__entry *x = &c->cache[i];
+		if(x->sess && !strcmp(x->key, key)) {
+			e = x;
+			break;
+		}
+		if(!e || (e->sess && (!x->sess || x->used < e->used)))
+			e = x;
+	}
+	if(e->sess)
+		SSL_SESSION_free(e->sess);
+	strcpy(e->key, key);
+	e->sess = sess;
+	e->used = ++c->clock;
+	pthread_mutex_unlock(&c->lock);
+}
+
+// Offers the destination's session if it is still good.
+static void tls__offer(tls_ctx *c, const char *key, SSL *ssl) {
+	int i;
+
+	pthread_mutex_lock(&c->lock);
+	for(i = 0; i < TLS_CACHE_SIZE; i++) {
+		tls__entry *e = &c->cache[i];
+		if(!e->sess || strcmp(e->key, key))
+			continue;
+		if(SSL_SESSION_is_resumable(e->sess) &&
+				SSL_SESSION_get_time(e->sess) +
+				SSL_SESSION_get_timeout(e->sess) > time(NULL)) {
+			SSL_set_session(ssl, e->sess);
+		} else {
+			SSL_SESSION_free(e->sess);
+			e->sess = NULL;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+// Keeps the session (a TLS 1.3 ticket may come any time after the
+// handshake); returning 1 takes over the reference.
+static int tls__new_session(SSL *ssl, SSL_SESSION *sess) {
+	tls_conn *t = (tls_conn *)SSL_get_app_data(ssl);
+	if(!t || !t->key[0])
+		return 0;
+	tls__store(t->c, t->key, sess);
+	return 1;
+}
+
+tls_ctx *tls_ctx_new(int flags, const char *ca_file) {
+	SSL_CTX *ssl = SSL_CTX_new(TLS_client_method());
+	if(!ssl)
+		return NULL;
+
+	SSL_CTX_set_session_cache_mode(ssl,
+			SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ssl, &tls__new_session);
+	// behave like write(2): partial writes, retries from anywhere
+	SSL_CTX_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE |
+			SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	// servers hang up after QUIT without close_notify; SMTP replies
+	// delimit themselves, so a cut can be told anyway
+	SSL_CTX_set_options(ssl, SSL_OP_IGNORE_UNEXPECTED_EOF);
+	if(flags & TLS_KTLS)
+		SSL_CTX_set_options(ssl, SSL_OP_ENABLE_KTLS);
+	if(flags & TLS_VERIFY) {
+		SSL_CTX_set_verify(ssl, SSL_VERIFY_PEER, NULL);
+		if(!(ca_file ? SSL_CTX_load_verify_locations(ssl, ca_file, NULL) :
+					SSL_CTX_set_default_verify_paths(ssl))) {
+			SSL_CTX_free(ssl);
+			return NULL;
+		}
+	}
+
+	tls_ctx *c = (tls_ctx *)malloc(sizeof(tls_ctx));
+	memset(c, 0, sizeof(tls_ctx));
+	c->ssl = ssl;
+	c->flags = flags;
+	pthread_mutex_init(&c->lock, NULL);
+	return c;
+}
+
+void tls_ctx_free(tls_ctx *c) {
+	int i;
+	for(i = 0; i < TLS_CACHE_SIZE; i++)
+		if(c->cache[i].sess)
+			SSL_SESSION_free(c->cache[i].sess);
+	pthread_mutex_destroy(&c->lock);
+	SSL_CTX_free(c->ssl);
+	free(c);
+}
+
+/*** Connections ***/
+// Maps a failed call to read(2) semantics.
+static int tls__error(tls_conn *t, int r) {
+	switch(SSL_get_error(t->ssl, r)) {
+	case SSL_ERROR_WANT_READ:
+		t->want = POLLIN;
+		errno = EAGAIN;
+		return -1;
+	case SSL_ERROR_WANT_WRITE:
+		t->want = POLLOUT;
+		errno = EAGAIN;
+		return -1;
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+	case SSL_ERROR_SYSCALL:
+		if(errno == 0)
+			return 0;	// closed without close_notify
+		return -1;
+	default:
+		errno = EIO;
+		return -1;
+	}
+}
+
+static long tls__now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static int tls__is_address(const char *host) {
+	unsigned char buf[sizeof(struct in6_addr)];
+	return inet_pton(AF_INET, host, buf) == 1 ||
+		inet_pton(AF_INET6, host, buf) == 1;
+}
+
+tls_conn *tls_connect(tls_ctx *c, int fd, const char *host, const char *key,
+		int timeout) {
+	tls_conn *t = (tls_conn *)malloc(sizeof(tls_conn));
+	memset(t, 0, sizeof(tls_conn));
+	t->c = c;
+	t->ssl = SSL_new(c->ssl);
+	// a resumed session skips the certificate, so it stays with the name
+	// it was checked for
+	if(key)
+		snprintf(t->key, sizeof(t->key), "%s %s", key, host ? host : "");
+	SSL_set_app_data(t->ssl, t);
+	SSL_set_fd(t->ssl, fd);
+
+	if(host && !tls__is_address(host))
+		SSL_set_tlsext_host_name(t->ssl, host);
+	if(host && (c->flags & TLS_VERIFY))
+		SSL_set1_host(t->ssl, host);
+	if(t->key[0])
+		tls__offer(c, t->key, t->ssl);
+
+	long deadline = timeout >= 0 ? tls__now() + timeout : -1;
+	for(;;) {
+		ERR_clear_error();
+		errno = 0;
+		int r = SSL_connect(t->ssl);
+		if(r == 1)
+			break;
+		if(tls__error(t, r) >= 0 || errno != EAGAIN)
+			goto fail;
+
+		struct pollfd pfd = { fd, t->want, 0 };
+		int wait = deadline < 0 ? -1 : (int)(deadline - tls__now());
+		if(deadline >= 0 && wait <= 0)
+			goto fail;
+		if(poll(&pfd, 1, wait) < 0 && errno != EINTR)
+			goto fail;
+	}
+	t->want = 0;
+	return t;
+
+fail:
+	SSL_free(t->ssl);
+	free(t);
+	return NULL;
+}
+
+void tls_close(tls_conn *t) {
+	ERR_clear_error();
+	errno = 0;
+	SSL_shutdown(t->ssl);
+	SSL_free(t->ssl);
+	free(t);
+}
+
+int tls_resumed(tls_conn *t) {
+	return SSL_session_reused(t->ssl);
+}
+
+int tls_ktls_send(tls_conn *t) {
+	return BIO_get_ktls_send(SSL_get_wbio(t->ssl)) ? 1 : 0;
+}
+
+const char *tls_version(tls_conn *t) {
+	return SSL_get_version(t->ssl);
+}
+
+int tls_read(tls_conn *t, void *buf, int len) {
+	ERR_clear_error();
+	errno = 0;
+	int r = SSL_read(t->ssl, buf, len);
+	if(r > 0) {
+		t->want = 0;
+		return r;
+	}
+	return tls__error(t, r);
+}
+
+int tls_write(tls_conn *t, const void *buf, int len) {
+	ERR_clear_error();
+	errno = 0;
+	int r = SSL_write(t->ssl, buf, len);
+	if(r > 0) {
+		t->want = 0;
+		return r;
+	}
+	r = tls__error(t, r);
+	return r == 0 ? -1 : r;
+}
+
+long tls_sendfile(tls_conn *t, int fd, long offset, long len) {
+	ERR_clear_error();
+	errno = 0;
+	ossl_ssize_t r = SSL_sendfile(t->ssl, fd, offset, len, 0);
+	if(r > 0) {
+		t->want = 0;
+		return r;
+	}
+	r = tls__error(t, r);
+	return r == 0 ? -1 : r;
+}
+
+int tls_pending(tls_conn *t) {
+	return SSL_pending(t->ssl);
+}
+
+int tls_events(tls_conn *t, int events) {
+	return t->want ? t->want : events;
+}
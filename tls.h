@@ -0,0 +1,49 @@
+#ifndef _TLS_H
+#	define _TLS_H
+
+// Client side TLS for STARTTLS (RFC 3207), on OpenSSL. Sessions are
+// cached per destination, so reconnecting to the same server resumes
+// instead of running a full handshake. With TLS_KTLS the record layer
+// is handed to the kernel where it supports that, and file bodies can
+// then still go out with sendfile(2).
+
+#define TLS_VERIFY	(1 << 0)	// check the certificate and host name
+#define TLS_KTLS	(1 << 1)	// kernel TLS offload when available
+
+// destinations with a cached session, the oldest one makes room
+#define TLS_CACHE_SIZE	(64)
+#define TLS_KEY_SIZE	(320)	// key and host name
+
+typedef struct tls_ctx tls_ctx;
+typedef struct tls_conn tls_conn;
+
+// ca_file is used with TLS_VERIFY, NULL for the system's default CAs.
+tls_ctx *tls_ctx_new(int flags, const char *ca_file);
+void tls_ctx_free(tls_ctx *c);
+
+// Runs the handshake on the connected socket fd within timeout ms (-1
+// for none). host is for SNI and TLS_VERIFY (may be NULL). key names
+// the destination: its cached session for the same host is offered,
+// and sessions the server issues are stored under it (may be NULL).
+// Returns NULL if the handshake fails.
+tls_conn *tls_connect(tls_ctx *c, int fd, const char *host, const char *key,
+		int timeout);
+// Sends close_notify if the socket takes it; fd stays open.
+void tls_close(tls_conn *t);
+
+int tls_resumed(tls_conn *t);
+// The kernel encrypts what is written, so tls_sendfile() works.
+int tls_ktls_send(tls_conn *t);
+const char *tls_version(tls_conn *t);
+
+// Like read(2) and write(2) on a non-blocking socket: -1 with EAGAIN
+// when TLS has to wait, then tls_events() tells for what.
+int tls_read(tls_conn *t, void *buf, int len);
+int tls_write(tls_conn *t, const void *buf, int len);
+long tls_sendfile(tls_conn *t, int fd, long offset, long len);
+// Decrypted bytes buffered in userspace, poll(2) does not see them.
+int tls_pending(tls_conn *t);
+// poll(2) events to wait for instead of events.
+int tls_events(tls_conn *t, int events);
+
+#endif
@@ -0,0 +1,213 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+struct trace {
+	FILE *f;
+	long last_us;
+};
+
+struct trace_reader {
+	FILE *f;
+	char *data;
+	long size;
+	trace_event pending;	// read ahead: the OPEN of the next session
+	int has_pending;
+};
+
+static long trace__now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+/*** Recording ***/
+static void trace__put_varint(FILE *f, unsigned long v) {
+	while(v >= 0x80) {
+		fputc((v & 0x7f) | 0x80, f);
+		v >>= 7;
+	}
+	fputc(v, f);
+}
+
+trace *trace_create(const char *path) {
+	FILE *f = fopen(path, "w");
+	if(!f)
+		return NULL;
+	fputs(TRACE_MAGIC, f);
+	trace *t = (trace *)malloc(sizeof(trace));
+	t->f = f;
+	t->last_us = trace__now_us();
+	return t;
+}
+
+void trace_free(trace *t) {
+	fclose(t->f);
+	free(t);
+}
+
+void trace_record(trace *t, int type, const void *buf, long len) {
+	long now = trace__now_us();
+	fputc(type, t->f);
+	trace__put_varint(t->f, now - t->last_us);
+	trace__put_varint(t->f, len);
+	if(type != TRACE_FILE)
+		fwrite(buf, 1, len, t->f);
+	t->last_us = now;
+}
+
+void trace_open(trace *t, const char *peer) {
+	trace_record(t, TRACE_OPEN, peer, strlen(peer));
+}
+
+/*** Reading ***/
+static int trace__get_varint(FILE *f, long *v) {
+	int c, shift = 0;
+	*v = 0;
+	do {
+		if((c = fgetc(f)) == EOF || shift > 56)
+			return 0;
+		*v |= (long)(c & 0x7f) << shift;
+		shift += 7;
+	} while(c & 0x80);
+	return 1;
+}
+
+trace_reader *trace_reader_open(const char *path) {
+	char magic[sizeof(TRACE_MAGIC) - 1];
+	FILE *f = fopen(path, "r");
+
+	if(!f)
+		return NULL;
+	if(fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+			memcmp(magic, TRACE_MAGIC, sizeof(magic))) {
+		fclose(f);
+		return NULL;
+	}
+	trace_reader *r = (trace_reader *)malloc(sizeof(trace_reader));
+	memset(r, 0, sizeof(trace_reader));
+	r->f = f;
+	return r;
+}
+
+void trace_reader_free(trace_reader *r) {
+	fclose(r->f);
+	free(r->data);
+	free(r);
+}
+
+int trace_next(trace_reader *r, trace_event *e) {
+	int type = fgetc(r->f);
+
+	if(type == EOF)
+		return 0;
+	e->type = type;
+	if(type > TRACE_FILE || !trace__get_varint(r->f, &e->delta_us) ||
+			!trace__get_varint(r->f, &e->len) || e->len < 0)
+		return -1;
+	if(type == TRACE_FILE) {
+		e->data = NULL;
+		return 1;
+	}
+	if(e->len + 1 > r->size) {
+		r->size = e->len + 1;
+		r->data = (char *)realloc(r->data, r->size);
+	}
+	if(fread(r->data, 1, e->len, r->f) != e->len)
+		return -1;
+	r->data[e->len] = '\0';
+	e->data = r->data;
+	return 1;
+}
+
+/*** Replay ***/
+// Reads from the client until it has written want octets in total.
+static int trace__await(int fd, long want, trace_stats *st) {
+	char buf[16 * 1024];
+
+	while(st->out < want) {
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		int r = poll(&pfd, 1, TRACE_STALL_MS);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			return 0;
+		if((r = read(fd, buf, sizeof(buf))) < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			return 0;
+		st->out += r;
+	}
+	return 1;
+}
+
+static int trace__send(int fd, const char *buf, long len) {
+	long done = 0;
+	while(done < len) {
+		ssize_t w = write(fd, &buf[done], len - done);
+		if(w < 0 && errno == EINTR)
+			continue;
+		if(w <= 0)
+			return 0;
+		done += w;
+	}
+	return 1;
+}
+
+static void trace__sleep_until(long us) {
+	long now = trace__now_us();
+	if(us <= now)
+		return;
+	struct timespec ts = { (us - now) / 1000000L, (us - now) % 1000000L * 1000L };
+	while(nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+int trace_has_session(trace_reader *r) {
+	while(!r->has_pending && trace_next(r, &r->pending) > 0)
+		r->has_pending = r->pending.type == TRACE_OPEN;
+	return r->has_pending;
+}
+
+int trace_replay(trace_reader *r, int fd, double scale, trace_stats *st) {
+	trace_event e;
+	long start = trace__now_us(), expect = 0, delay = 0;
+	int n, ok = 1;
+
+	memset(st, 0, sizeof(trace_stats));
+	if(!trace_has_session(r))
+		return 0;
+	r->has_pending = 0;
+	snprintf(st->peer, sizeof(st->peer), "%s", r->pending.data);
+
+	while(ok && (n = trace_next(r, &e)) > 0 && e.type != TRACE_OPEN) {
+		st->recorded_us += e.delta_us;
+		delay += e.delta_us;
+		if(e.type == TRACE_OUT || e.type == TRACE_FILE) {
+			expect += e.len;
+			delay = 0;
+			continue;
+		}
+		// TRACE_IN: the server answers what the client wrote so far,
+		// as long after it as it did then
+		if((ok = trace__await(fd, expect, st))) {
+			trace__sleep_until(trace__now_us() + (long)(delay * scale));
+			ok = trace__send(fd, e.data, e.len);
+			st->in += e.len;
+		}
+		delay = 0;
+	}
+	if(n > 0 && e.type == TRACE_OPEN) {
+		r->pending = e;
+		r->has_pending = 1;
+	}
+	ok = ok && trace__await(fd, expect, st);
+	st->replayed_us = trace__now_us() - start;
+	return ok ? 1 : -1;
+}
@@ -0,0 +1,75 @@
+#ifndef _TRACE_H
+#	define _TRACE_H
+
+// Session transcripts for benchmarking without a live server. A session
+// with a trace (smtp_set_trace()) records every piece it writes and
+// reads, with the time since the previous record. trace_replay() then
+// plays the server's side of a recorded session to a client under
+// test. Before each reply it waits until the client has written as many
+// octets as it did when recorded, then sleeps the recorded server
+// delay, scaled.
+//
+// The file starts with TRACE_MAGIC, then records follow:
+//   type		1 octet, TRACE_*
+//   delta		microseconds since the previous record, varint
+//   len		varint
+//   data		len octets; none for TRACE_FILE
+// Varints are 7 bits per octet, least significant first, the high bit
+// set on all but the last octet.
+
+#define TRACE_MAGIC	"SMTPTRC1"
+
+// record types
+#define TRACE_OPEN	(0)	// a session starts, data names the peer
+#define TRACE_OUT	(1)	// written by the client
+#define TRACE_IN	(2)	// read from the server
+#define TRACE_FILE	(3)	// written by the client from a file, length only
+
+// a client that writes nothing for this long is out of step with the
+// trace; trace_replay() gives up on the session
+#define TRACE_STALL_MS	(5000)
+
+// Sessions recorded into one trace follow each other, a trace is not
+// shared by concurrent sessions.
+// Only plaintext sessions can be replayed: after STARTTLS a trace holds
+// the decrypted traffic, which smtpreplay cannot play to a client that
+// expects a TLS handshake. The client refuses -X with -E or -V.
+typedef struct trace trace;
+
+// Creates (or truncates) path.
+trace *trace_create(const char *path);
+void trace_free(trace *t);
+void trace_open(trace *t, const char *peer);
+void trace_record(trace *t, int type, const void *buf, long len);
+
+typedef struct trace_event {
+	int type;
+	long delta_us;
+	long len;
+	char *data;	// valid until the next trace_next()
+} trace_event;
+
+typedef struct trace_reader trace_reader;
+
+// NULL if path is not a trace.
+trace_reader *trace_reader_open(const char *path);
+void trace_reader_free(trace_reader *r);
+// Returns 1 and the next record, 0 at the end, -1 if it is damaged.
+int trace_next(trace_reader *r, trace_event *e);
+
+typedef struct trace_stats {
+	char peer[256];
+	long recorded_us;	// the session as recorded
+	long replayed_us;
+	long in, out;		// octets sent to and received from the client
+} trace_stats;
+
+// 1 if r has another session to play.
+int trace_has_session(trace_reader *r);
+// Plays the next session of r to the client on fd. scale multiplies
+// the recorded server delays, 0 replies at once. Returns 1 when the
+// session was played, 0 when r has no more sessions, -1 when the client
+// hung up or stalled (TRACE_STALL_MS).
+int trace_replay(trace_reader *r, int fd, double scale, trace_stats *st);
+
+#endif
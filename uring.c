@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "uring.h"
+
+#ifndef SMTP_WITH_URING
+
+uring *uring_new(unsigned entries) { return NULL; }
+void uring_free(uring *u) { }
+char *uring_buffer(uring *u, int idx, int *len) { return NULL; }
+int uring_send(uring *u, int fd, const void *buf, int len, int link) { return -1; }
+int uring_recv(uring *u, int fd, void *buf, int len, int link) { return -1; }
+int uring_link_timeout(uring *u, int ms) { return -1; }
+int uring_submit_wait(uring *u, int *res, int n) { return 0; }
+
+#else
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+	unsigned entries;
+
+	unsigned queued;
+	struct __kernel_timespec ts[URING_ENTRIES];
+	struct iovec bufs[URING_BUFFERS];
+};
+
+static int uring__setup(unsigned entries, struct io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring__enter(int fd, unsigned submit, unsigned wait,
+		unsigned flags) {
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int uring__register(int fd, unsigned op, void *arg, unsigned n) {
+	return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+uring *uring_new(unsigned entries) {
+	struct io_uring_params p;
+	uring *u = (uring *)malloc(sizeof(uring));
+	memset(u, 0, sizeof(uring));
+	memset(&p, 0, sizeof(p));
+
+	if(entries > URING_ENTRIES)
+		entries = URING_ENTRIES;
+	if((u->fd = uring__setup(entries, &p)) < 0) {
+		free(u);
+		return NULL;
+	}
+	u->entries = p.sq_entries;
+
+	u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(u->cq_len > u->sq_len) u->sq_len = u->cq_len;
+		u->cq_len = u->sq_len;
+	}
+	u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_ptr = u->sq_ptr;
+	else
+		u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_len,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			u->fd, IORING_OFF_SQES);
+	if(u->sq_ptr == MAP_FAILED || u->cq_ptr == MAP_FAILED ||
+			u->sqes == MAP_FAILED) {
+		uring_free(u);
+		return NULL;
+	}
+
+	char *sq = (char *)u->sq_ptr, *cq = (char *)u->cq_ptr;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	int i;
+	for(i = 0; i < URING_BUFFERS; i++) {
+		u->bufs[i].iov_base = mmap(NULL, URING_BUFFER_SIZE,
+				PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		u->bufs[i].iov_len = URING_BUFFER_SIZE;
+		if(u->bufs[i].iov_base == MAP_FAILED) {
+			u->bufs[i].iov_base = NULL;
+			uring_free(u);
+			return NULL;
+		}
+	}
+	// fixed writes are an optimization, plain sends still work without
+	if(uring__register(u->fd, IORING_REGISTER_BUFFERS,
+				u->bufs, URING_BUFFERS) < 0)
+		memset(u->bufs, 0, sizeof(u->bufs));
+
+	return u;
+}
+
+void uring_free(uring *u) {
+	int i;
+	for(i = 0; i < URING_BUFFERS; i++)
+		if(u->bufs[i].iov_base)
+			munmap(u->bufs[i].iov_base, u->bufs[i].iov_len);
+	if(u->sqes && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_len);
+	if(u->cq_ptr && u->cq_ptr != MAP_FAILED && u->cq_ptr != u->sq_ptr)
+		munmap(u->cq_ptr, u->cq_len);
+	if(u->sq_ptr && u->sq_ptr != MAP_FAILED)
+		munmap(u->sq_ptr, u->sq_len);
+	close(u->fd);
+	free(u);
+}
+
+char *uring_buffer(uring *u, int idx, int *len) {
+	if(idx < 0 || idx >= URING_BUFFERS || !u->bufs[idx].iov_base)
+		return NULL;
+	*len = u->bufs[idx].iov_len;
+	return (char *)u->bufs[idx].iov_base;
+}
+
+static struct io_uring_sqe *uring__get_sqe(uring *u, int link) {
+	if(u->queued >= u->entries)
+		return NULL;
+
+	unsigned tail = *u->sq_tail;
+	unsigned idx = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = u->queued++;
+	if(link)
+		sqe->flags |= IOSQE_IO_LINK;
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+// Index of the registered buffer holding buf..buf+len, or -1.
+static int uring__fixed_index(uring *u, const void *buf, int len) {
+	int i;
+	for(i = 0; i < URING_BUFFERS; i++) {
+		const char *base = (const char *)u->bufs[i].iov_base;
+		if(base && (const char *)buf >= base &&
+				(const char *)buf + len <= base + u->bufs[i].iov_len)
+			return i;
+	}
+	return -1;
+}
+
+int uring_send(uring *u, int fd, const void *buf, int len, int link) {
+	struct io_uring_sqe *sqe = uring__get_sqe(u, link);
+	if(!sqe) return -1;
+
+	int fixed = uring__fixed_index(u, buf, len);
+	if(fixed >= 0) {
+		sqe->opcode = IORING_OP_WRITE_FIXED;
+		sqe->buf_index = fixed;
+	} else {
+		sqe->opcode = IORING_OP_SEND;
+		sqe->msg_flags = MSG_NOSIGNAL;
+	}
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	return (int)sqe->user_data;
+}
+
+int uring_recv(uring *u, int fd, void *buf, int len, int link) {
+	struct io_uring_sqe *sqe = uring__get_sqe(u, link);
+	if(!sqe) return -1;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	return (int)sqe->user_data;
+}
+
+int uring_link_timeout(uring *u, int ms) {
+	struct io_uring_sqe *sqe = uring__get_sqe(u, 0);
+	if(!sqe) return -1;
+	struct __kernel_timespec *ts = &u->ts[sqe->user_data];
+	ts->tv_sec = ms / 1000;
+	ts->tv_nsec = (ms % 1000) * 1000000L;
+	sqe->opcode = IORING_OP_LINK_TIMEOUT;
+	sqe->addr = (unsigned long)ts;
+	sqe->len = 1;
+	return (int)sqe->user_data;
+}
+
+int uring_submit_wait(uring *u, int *res, int n) {
+	unsigned submit = u->queued, done = 0;
+	int ok = 1;
+
+	while(done < u->queued) {
+		int r = uring__enter(u->fd, submit, u->queued - done,
+				IORING_ENTER_GETEVENTS);
+		if(r < 0) {
+			if(errno == EINTR) continue;
+			ok = 0;
+			break;
+		}
+		submit -= r < submit ? r : submit;
+
+		unsigned head = *u->cq_head;
+		unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		for(; head != tail; head++) {
+			struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+			if(cqe->user_data < (unsigned)n)
+				res[cqe->user_data] = cqe->res;
+			done++;
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	u->queued = 0;
+	return ok;
+}
+
+#endif
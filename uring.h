@@ -0,0 +1,36 @@
+#ifndef _URING_H
+#	define _URING_H
+
+// Minimal io_uring wrapper for the smtp transport. Operations are queued
+// and reach the kernel together in one io_uring_enter() call.
+//
+// Only compiled in with -DSMTP_WITH_URING; otherwise, or when the kernel
+// refuses io_uring, uring_new() returns NULL and callers keep using
+// poll() and plain read/write. Only session I/O goes through it;
+// attachment files are still read with read(2).
+
+#define URING_ENTRIES		(64)
+#define URING_BUFFERS		(2)
+#define URING_BUFFER_SIZE	(64 * 1024)
+
+typedef struct uring uring;
+
+uring *uring_new(unsigned entries);
+void uring_free(uring *u);
+
+// Buffers registered with the kernel; writes from them avoid the page
+// pinning done for every ordinary send.
+char *uring_buffer(uring *u, int idx, int *len);
+
+// Queue one operation, link != 0 chains the next queued operation to it.
+// Return value: <0 error (queue full), otherwise its slot in the results.
+int uring_send(uring *u, int fd, const void *buf, int len, int link);
+int uring_recv(uring *u, int fd, void *buf, int len, int link);
+// Cancels the previous (linked) operation after ms milliseconds.
+int uring_link_timeout(uring *u, int ms);
+
+// Submits all queued operations and waits for all of them. res[slot]
+// receives each result (bytes or -errno). Returns 1, or 0 on error.
+int uring_submit_wait(uring *u, int *res, int n);
+
+#endif